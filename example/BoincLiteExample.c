@@ -78,17 +78,23 @@ int main(int argc, char *argv[])
         }
 
         BoincScheduler * scheduler = boincSchedulerCreate(conf, compute, NULL);
+
+        // Record the session, it can be replayed with BoincLiteReplay
+        if (argc > 2) {
+                err = boincSchedulerSetTraceFile(scheduler, argv[2]);
+                if (err) {
+                        boincLogError(err);
+                        boincErrorDestroy(err);
+                }
+        }
   
         while(1) {
 
-                if (boincSchedulerHasEvents(scheduler)) {
-                        err = boincSchedulerHandleEvents(scheduler);
-                        if (err) {
-                                boincLogError(err);
-                                boincErrorDestroy(err);
-                        }
-                } else {
-                        sleep(1);
+                err = boincSchedulerRun(scheduler, 5);
+                if (err) {
+                        boincLogError(err);
+                        boincErrorDestroy(err);
+                        break;
                 }
         }
   
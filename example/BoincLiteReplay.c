@@ -0,0 +1,90 @@
+/*
+  BoincLite, a light-weight library for BOINC clients.
+
+  Copyright (C) 2008 Sony Computer Science Laboratory Paris 
+  Authors: Peter Hanappe, Anthony Beurive, Tangui Morlier
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; version 2 of the License.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+  02110-1301, USA.
+
+*/ 
+#include "BoincLite.h"
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#define REPLAY_DIR "/tmp/boincLiteReplay"
+
+/*
+  Replays a trace recorded by BoincLiteExample (or any application
+  calling boincSchedulerSetTraceFile):
+
+    BoincLiteReplay <trace> [<output trace>] [<log level>]
+
+  The output trace of a faithful replay has the same calls, at the
+  same times, as the input.
+*/
+
+int compute(BoincScheduler * scheduler, BoincWorkUnit * wu, void* userData) 
+{
+        // Never called: the replay answers with the recorded status changes
+        return 0;
+}
+
+int main(int argc, char *argv[])
+{
+        BoincLogger log = { boincDefaultLogFunction, (void*) kBoincInfo};
+        if (argc > 3) {
+                log.userData = (void*)(intptr_t)atoi(argv[3]);
+        }
+
+        boincLogInit(&log);
+
+        if (argc < 2) {
+                fprintf(stderr, "Usage: %s <trace> [<output trace>] [<log level>]\n", argv[0]);
+                exit(1);
+        }
+
+        BoincError err = NULL;
+        mkdir(REPLAY_DIR, S_IRWXU);
+
+        BoincConfiguration * conf = boincConfigurationCreate(REPLAY_DIR);
+        BoincScheduler * scheduler = boincSchedulerCreate(conf, compute, NULL);
+
+        if (argc > 2) {
+                err = boincSchedulerSetTraceFile(scheduler, argv[2]);
+        }
+
+        clock_t start = clock();
+
+        if (!err) {
+                err = boincSchedulerReplay(scheduler, argv[1]);
+        }
+
+        printf("Replay took %.3f s of CPU time\n", (double) (clock() - start) / CLOCKS_PER_SEC);
+
+        boincSchedulerDestroy(scheduler);
+        boincConfigurationDestroy(conf);
+
+        if (err) {
+                boincLogError(err);
+                boincErrorDestroy(err);
+                exit(1);
+        }
+
+        return 0;
+}
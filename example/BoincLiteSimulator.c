@@ -0,0 +1,171 @@
+/*
+  BoincLite, a light-weight library for BOINC clients.
+
+  Copyright (C) 2008 Sony Computer Science Laboratory Paris 
+  Authors: Peter Hanappe, Anthony Beurive, Tangui Morlier
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; version 2 of the License.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+  02110-1301, USA.
+
+*/ 
+#include "BoincLite.h"
+#include "BoincLite.h"
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define SIMULATION_DIR "/tmp/boincLiteSimulation"
+
+/*
+  Runs the scheduler against a simulated server, to tune the slot
+  counts and the retry policy:
+
+    BoincLiteSimulator [name=value ...]
+
+  For example:
+
+    BoincLiteSimulator hours=48 slots=3 cores=2 compute=3600 fail=0.05
+*/
+
+static void usage(const char* name)
+{
+        fprintf(stderr, "Usage: %s [name=value ...]\n"
+                "  hours       simulated time (24)\n"
+                "  seed        random seed (1)\n"
+                "  slots       workunits kept locally (2)\n"
+                "  prefetch    most workunits fetched ahead (slots - cores)\n"
+                "  cores       workunits computed at once (1)\n"
+                "  backoff     first retry delay in seconds (10)\n"
+                "  step        seconds added per retry (10)\n"
+                "  maxdelay    longest retry delay, 0 for none (0)\n"
+                "  slack       seconds a retry may wait to share a wakeup (5)\n"
+                "  compute     mean computation time in seconds (3600)\n"
+                "  spread      computation time variation, 0..1 (0.2)\n"
+                "  deadline    report deadline in seconds (86400)\n"
+                "  latency     server round trip in seconds (1)\n"
+                "  down, up    workunit input and output sizes in bytes (10e6, 1e6)\n"
+                "  downbw      download bandwidth in bytes/s (1e6)\n"
+                "  upbw        upload bandwidth in bytes/s (1e5)\n"
+                "  fail        failure rate of every request, 0..1 (0)\n"
+                "  delay       delay asked by the server on failures (0)\n"
+                "  cancel      fraction of the results aborted by the server, 0..1 (0)\n", name);
+}
+
+int compute(BoincScheduler * scheduler, BoincWorkUnit * wu, void* userData) 
+{
+        // Never called: the simulator computes
+        return 0;
+}
+
+int main(int argc, char *argv[])
+{
+        BoincLogger log = { boincDefaultLogFunction, (void*) kBoincError};
+        boincLogInit(&log);
+
+        BoincSimulationParameters parameters;
+        memset(&parameters, 0, sizeof(BoincSimulationParameters));
+        parameters.duration = 24 * 3600;
+        parameters.seed = 1;
+        parameters.computeTime = 3600;
+        parameters.computeSpread = 0.2;
+        parameters.deadline = 86400;
+        parameters.latency = 1;
+        parameters.downloadBytes = 10e6;
+        parameters.uploadBytes = 1e6;
+        parameters.downBandwidth = 1e6;
+        parameters.upBandwidth = 1e5;
+
+        double slots = 2, cores = 1, prefetch = 0, backoff = 10, step = 10, maxdelay = 0, slack = 5;
+
+        for (int i = 1; i < argc; i++) {
+                char name[32];
+                double value;
+                if (sscanf(argv[i], "%31[^=]=%lf", name, &value) != 2) {
+                        usage(argv[0]);
+                        exit(1);
+                }
+                if (!strcmp(name, "hours")) parameters.duration = (unsigned int) (value * 3600);
+                else if (!strcmp(name, "seed")) parameters.seed = (unsigned int) value;
+                else if (!strcmp(name, "slots")) slots = value;
+                else if (!strcmp(name, "cores")) cores = value;
+                else if (!strcmp(name, "prefetch")) prefetch = value;
+                else if (!strcmp(name, "backoff")) backoff = value;
+                else if (!strcmp(name, "step")) step = value;
+                else if (!strcmp(name, "maxdelay")) maxdelay = value;
+                else if (!strcmp(name, "slack")) slack = value;
+                else if (!strcmp(name, "compute")) parameters.computeTime = (unsigned int) value;
+                else if (!strcmp(name, "spread")) parameters.computeSpread = value;
+                else if (!strcmp(name, "deadline")) parameters.deadline = (unsigned int) value;
+                else if (!strcmp(name, "latency")) parameters.latency = (unsigned int) value;
+                else if (!strcmp(name, "down")) parameters.downloadBytes = value;
+                else if (!strcmp(name, "up")) parameters.uploadBytes = value;
+                else if (!strcmp(name, "downbw")) parameters.downBandwidth = value;
+                else if (!strcmp(name, "upbw")) parameters.upBandwidth = value;
+                else if (!strcmp(name, "fail")) {
+                        parameters.requestFailureRate = value;
+                        parameters.downloadFailureRate = value;
+                        parameters.uploadFailureRate = value;
+                }
+                else if (!strcmp(name, "delay")) parameters.serverDelay = (int) value;
+                else if (!strcmp(name, "cancel")) parameters.cancelRate = value;
+                else {
+                        usage(argv[0]);
+                        exit(1);
+                }
+        }
+
+        mkdir(SIMULATION_DIR, S_IRWXU);
+
+        BoincConfiguration * conf = boincConfigurationCreate(SIMULATION_DIR);
+        boincConfigurationSetNumber(conf, kBoincSchedulerSlots, slots);
+        boincConfigurationSetNumber(conf, kBoincSchedulerComputeSlots, cores);
+        if (prefetch > 0) {
+                boincConfigurationSetNumber(conf, kBoincSchedulerPrefetchMax, prefetch);
+        }
+        boincConfigurationSetNumber(conf, kBoincSchedulerBackoffBase, backoff);
+        boincConfigurationSetNumber(conf, kBoincSchedulerBackoffStep, step);
+        boincConfigurationSetNumber(conf, kBoincSchedulerBackoffMax, maxdelay);
+        boincConfigurationSetNumber(conf, kBoincSchedulerTimerSlack, slack);
+
+        BoincScheduler * scheduler = boincSchedulerCreate(conf, compute, NULL);
+
+        BoincSimulationReport report;
+        clock_t start = clock();
+        BoincError err = boincSchedulerSimulate(scheduler, &parameters, &report);
+        double cpu = (double) (clock() - start) / CLOCKS_PER_SEC;
+
+        boincSchedulerDestroy(scheduler);
+        boincConfigurationDestroy(conf);
+
+        if (err) {
+                boincLogError(err);
+                boincErrorDestroy(err);
+                exit(1);
+        }
+
+        printf("Simulated time:   %.1f h (%.3f s of CPU time)\n", report.virtualTime / 3600.0, cpu);
+        printf("Completed:        %d workunits, %.2f per hour\n", report.completed, report.throughput);
+        printf("Idle core time:   %.0f s (%.1f%%)\n", report.idleCoreTime, 100 * report.idleCoreRatio);
+        printf("Deadline misses:  %d (%d aborted)\n", report.deadlineMisses, report.aborted);
+        printf("Server aborts:    %d\n", report.cancelled);
+        printf("Server requests:  %d (%d failed)\n", report.requests, report.failures);
+        printf("Scheduler events: %d\n", report.events);
+        printf("Wakeups:          %d, %.2f per minute\n", report.wakeups, 60.0 * report.wakeups / report.virtualTime);
+        printf("Prefetch depth:   %d\n", report.prefetchDepth);
+
+        return 0;
+}
@@ -115,6 +115,7 @@
 #ifndef __BoincLite_H__
 #define __BoincLite_H__
 
+#include <stddef.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -137,7 +138,9 @@ typedef struct _BoincFileInfo BoincFileInfo;
 struct _BoincFileInfo {
 	char* name;
 	char* openname;
-	char* url;
+	char* url;              // the first of the urls
+	char** urls;            // the mirrors of the file, in the order of the project
+	int nbUrls;
 	char* checksum;
 	char* signature;
 	char* xmlSignature;
@@ -217,7 +220,11 @@ typedef int (*BoincComputeWorkUnitCallback)(BoincScheduler* scheduler, BoincWork
 
 /** \brief Create a new scheduler
  *
- *  Create a new scheduler.
+ *  Create a new scheduler. The slots are loaded by the first call to
+ *  boincSchedulerHandleEvents. If the project configuration of a
+ *  previous run is found in the project directory, the slots resume
+ *  right away and the configuration is refreshed from the server in
+ *  the background, so a restart does not wait for the network.
  *
  *  \return a pointer to the scheduler or NULL in case of a failure.
  */ 
@@ -227,6 +234,11 @@ BoincScheduler* boincSchedulerCreate(BoincConfiguration* configuration,
 
 
 /** \brief Release all the resources of the scheduler. 
+ *
+ *  The connections to the project servers are kept open for the next
+ *  scheduler of the process, and closed at its exit. The TLS sessions
+ *  are saved in the project directory to be resumed after a restart,
+ *  with libcurl 8.12 or later.
  *
  *  \return zero if no error occured.
  */
@@ -236,6 +248,12 @@ void boincSchedulerDestroy(BoincScheduler* scheduler);
 
 typedef void (*BoincStatusChangedCallback)(void *userData, int index);
 
+/** \brief Be told when the status of a workunit changes.
+ *
+ *  The callback is called by the thread handling the events, by the
+ *  I/O threads of the scheduler for the transfers, and by the threads
+ *  of the application that report progress.
+ */
 BoincError boincSchedulerSetStatusChangedCallback(BoincScheduler * scheduler, 
 						  BoincStatusChangedCallback callback, 
 						  void *userData);
@@ -251,10 +269,50 @@ int boincSchedulerHasEvents(BoincScheduler* scheduler);
  *  boincSchedulerHandleEvents() at regular intervals so it can handle
  *  events and update its state the asynchrounous tasks.
  *
+ *  The transfers with the project server and the deletion of the
+ *  finished workunits are handed to I/O threads, which post an event
+ *  when they are done, so a call never waits for the network. A single
+ *  network thread keeps the downloads of several workunits, the
+ *  uploads and the scheduler requests in flight together, within
+ *  kBoincNetworkMaxTransfers connections.
+ *
+ *  Several threads may call boincSchedulerHandleEvents() or
+ *  boincSchedulerRun() at once: the events of different workunits are
+ *  handled in parallel, the events of a workunit one at a time.
+ *
+ *  Among the events that are due, the status changes of the workunits
+ *  come first, then the transfers, the retries of failed attempts and
+ *  the cleanup. An event waiting longer than
+ *  kBoincSchedulerPriorityAging seconds moves up a class.
+ *
  *  \return zero if no error occured.
  */
 BoincError boincSchedulerHandleEvents(BoincScheduler* scheduler);
 
+/** \brief Handle all the events that are due, waiting for them if needed.
+ *
+ *  Waits at most timeout seconds for an event to become due (or to be
+ *  posted by a compute thread), then handles the due events one after
+ *  the other, including the ones their transitions post on the way,
+ *  so that a workunit goes from Created to Computing in a single
+ *  call. A call handles a bounded number of events and returns after
+ *  timeout seconds even if more are due. Errors that are not fatal
+ *  are logged and the workunit retries later.
+ *
+ *  \return NULL unless a fatal error occured.
+ */
+BoincError boincSchedulerRun(BoincScheduler* scheduler, int timeout);
+
+
+/** \brief How often boincSchedulerRun woke up to handle events.
+ *
+ *  The retry timers are coalesced within kBoincSchedulerTimerSlack
+ *  seconds, so an idle scheduler wakes up rarely.
+ *
+ *  \return the average number of wakeups per minute since the scheduler was created
+ */
+double boincSchedulerGetWakeupsPerMinute(BoincScheduler* scheduler);
+
 
 /** \brief How many work units are available locally.
  *
@@ -288,6 +346,24 @@ BoincError boincSchedulerChangeWorkUnitStatus(BoincScheduler* scheduler,
 					      int status);
   
 
+/** \brief Signal the scheduler the progress of the computation, in percents.
+ *
+ *  The scheduler projects the end of the computation from the
+ *  progress rate. When the result cannot be reported before its
+ *  deadline, an error is returned: the application should stop the
+ *  computation and post the kBoincWorkUnitFailed status. The result
+ *  is then reported as aborted and the slot gets fresh work.
+ *  Workunits that are already late are aborted before they compute.
+ *  The same error is returned when the project server asks to abort
+ *  the result.
+ *
+ *  The deadline is checked by the scheduler thread once this call has
+ *  returned, so that the computation never waits for it: a missed
+ *  deadline is returned by the next progress report. An abort of the
+ *  project server is returned by the first report that follows it.
+ *
+ *  \return NULL if the computation should go on.
+ */
 BoincError boincSchedulerSetWorkUnitProgress(BoincScheduler* scheduler, 
 					     BoincWorkUnit* workunit, 
 					     float progress);
@@ -309,6 +385,81 @@ BoincError boincSchedulerChangeAuthentication(BoincScheduler* scheduler,
  */
 BoincConfiguration* boincSchedulerGetConfiguration(BoincScheduler* scheduler);
 
+/** \brief Record the activity of the scheduler in a trace file.
+ *
+ *  Every dequeued event, the outcome and duration of every server
+ *  transfer, the statuses found on disk at start-up, and the status
+ *  changes posted by the application are written to the file. Pass
+ *  NULL to stop recording.
+ */
+BoincError boincSchedulerSetTraceFile(BoincScheduler* scheduler,
+				      const char* traceFile);
+
+/** \brief Replay a trace file recorded with boincSchedulerSetTraceFile.
+ *
+ *  The scheduler runs on a virtual clock and the server and the
+ *  application are replaced by the recorded outcomes, so the replay
+ *  is deterministic and takes no real time. The scheduler should be
+ *  freshly created, with a scratch project directory and configuration
+ *  file since the state machine still writes its status files. A
+ *  trace file set on the scheduler records the replayed run.
+ */
+BoincError boincSchedulerReplay(BoincScheduler* scheduler,
+				const char* traceFile);
+
+/** \brief Parameters of the simulated project server and application.
+ *
+ *  Durations are in seconds, sizes in bytes, bandwidths in bytes per
+ *  second and rates between 0 and 1.
+ */
+typedef struct _BoincSimulationParameters {
+	unsigned int duration;          // virtual time to simulate
+	unsigned int seed;              // same seed, same run
+	unsigned int computeTime;       // mean computation time of a workunit
+	double computeSpread;           // computation times vary by +/- this fraction
+	unsigned int deadline;          // report deadline, counted from the request
+	unsigned int latency;           // round trip of every server request
+	double downloadBytes;           // input files of a workunit
+	double uploadBytes;             // output files of a workunit
+	double downBandwidth;
+	double upBandwidth;
+	double requestFailureRate;
+	double downloadFailureRate;
+	double uploadFailureRate;
+	int serverDelay;                // delay asked by the server on failures, 0 to let the scheduler back off
+	double cancelRate;              // fraction of the results the server aborts before their end
+} BoincSimulationParameters;
+
+typedef struct _BoincSimulationReport {
+	unsigned int virtualTime;       // simulated seconds
+	int completed;                  // workunits reported
+	double throughput;              // workunits reported per hour
+	double idleCoreTime;            // seconds a compute slot had nothing to do
+	double idleCoreRatio;           // idle core time over the available core time
+	int deadlineMisses;             // workunits reported after their deadline
+	int requests;                   // server requests, failed ones included
+	int failures;                   // failed server requests
+	int events;                     // events handled by the scheduler
+	int prefetchDepth;              // prefetch depth reached at the end
+	int aborted;                    // workunits aborted because they would be late
+	int cancelled;                  // results aborted on request of the server
+	int wakeups;                    // times the scheduler woke up for an event
+} BoincSimulationReport;
+
+/** \brief Run the scheduler against a simulated server.
+ *
+ *  The state machine runs for real on a virtual clock that jumps to
+ *  the next event, so hours of scheduling take a fraction of a second.
+ *  The slot counts and the retry policy are read from the
+ *  configuration of the scheduler (kBoincSchedulerSlots,
+ *  kBoincSchedulerComputeSlots, kBoincSchedulerBackoff...). As for
+ *  the replay, the scheduler should be freshly created with a scratch
+ *  project directory.
+ */
+BoincError boincSchedulerSimulate(BoincScheduler* scheduler,
+				  const BoincSimulationParameters* parameters,
+				  BoincSimulationReport* report);
+
 
 
 
@@ -361,6 +512,30 @@ enum BoincConfigurationIndex {
 	kBoincWorkUnitDirectory,       // string
 	kBoincUserTotalWorkunits,      // number
 	kBoincLanguage,                // string
+	kBoincSchedulerSlots,          // number, workunits kept locally (default 2)
+	kBoincSchedulerComputeSlots,   // number, workunits computed at once (default 1)
+	kBoincSchedulerBackoffBase,    // number, seconds before the first retry (default 10)
+	kBoincSchedulerBackoffStep,    // number, seconds added per retry (default 10)
+	kBoincSchedulerBackoffMax,     // number, longest retry delay, 0 for none
+	kBoincSchedulerPrefetchMin,    // number, fewest workunits fetched ahead (default 1)
+	kBoincSchedulerPrefetchMax,    // number, most workunits fetched ahead (default: the free slots)
+	kBoincSchedulerWorkRequest,    // number, seconds of work requested, set by the scheduler
+	kBoincSchedulerLoadThreads,    // number, threads loading the slots at startup (default 4)
+	kBoincSchedulerTimerSlack,     // number, seconds a retry may be delayed to share a wakeup (default 5)
+	kBoincSchedulerDiskThreads,    // number, threads deleting the finished workunits (default 2)
+	kBoincSchedulerPriorityAging,  // number, seconds a due event waits before moving up a class (default 30)
+	kBoincNetworkMaxTransfers,     // number, connections open at once for the transfers (default 16)
+	kBoincNetworkMaxTransfersPerHost, // number, connections open at once to a single host (default 8)
+	kBoincNetworkMaxIdleConnections, // number, connections kept open between the queries (default 8)
+	kBoincNetworkIdleTimeout,      // number, seconds an unused connection is kept open (default 118)
+	kBoincNetworkMaxDownRate,      // number, bytes per second of all the downloads, 0 for no limit (default 0)
+	kBoincNetworkMaxUpRate,        // number, bytes per second of all the uploads, 0 for no limit (default 0)
+	kBoincNetworkMaxDownRatePerTransfer, // number, bytes per second of a single download (default 0)
+	kBoincNetworkMaxUpRatePerTransfer, // number, bytes per second of a single upload (default 0)
+	kBoincNetworkCompressRequests, // number, 1 to gzip the scheduler requests (default 0)
+	kBoincNetworkRangeCount,       // number, ranges fetched at once for a large file, 1 for none (default 4)
+	kBoincNetworkRangeMinSize,     // number, bytes from which a file is fetched in ranges (default 16777216)
+	kBoincNetworkStallTimeout,     // number, seconds without data before a transfer moves to an other mirror, 0 for never (default 60)
 	kBoincLastIndexEnum,           //DO NOT USE : internal use only
 };
 
@@ -400,6 +575,15 @@ BoincError boincConfigurationStore(BoincConfiguration* configuration);
 int boincConfigurationHasParameter(BoincConfiguration* configuration, int parameter);
 
 
+/** \brief Remove the value of a parameter.
+ *
+ *  \param[in] paramater index of the parameter to unset (cf. BoincConfigurationIndex)
+ *
+ *  \returns zero on success, non-zero otherwise.
+ */
+BoincError boincConfigurationUnset(BoincConfiguration* configuration, int parameter);
+
+
 /** \brief Set a parameter value.
  *
  *  The following functions are used to set the value of a
@@ -433,6 +617,15 @@ BoincError boincConfigurationSetNumber(BoincConfiguration* configuration, int pa
  */
 BoincError boincConfigurationUpdateFromFile(BoincConfiguration * configuration, const char * xmlFileName);
 
+/** \brief Update a configuration struture from xml held in memory
+ *
+ *  As boincConfigurationUpdateFromFile, for a reply that is not stored
+ *
+ *  \param[in] xml the xml text
+ *  \param[in] size its length in bytes
+ */
+BoincError boincConfigurationUpdateFromBuffer(BoincConfiguration * configuration, const char * xml, size_t size);
+
 
 /** \brief returns true if the parameter is a string
  */
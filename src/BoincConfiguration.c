@@ -41,6 +41,7 @@ struct _BoincConfigurationParameter {
 struct _BoincConfiguration {
         BoincConfigurationParameter parameter[kBoincLastIndexEnum];
         BoincMutex mutex;
+        BoincMutex storeMutex;          // one thread at a time writes the file
 };
 
 
@@ -113,6 +114,30 @@ static BoincConfigurationParameterDefinition parameterDefinitions[]  = {
         { kBoincWorkUnitDirectory, BoincConfigurationString, "kBoincWorkUnitDirectory", NULL},
         { kBoincUserTotalWorkunits, BoincConfigurationNumber, "kBoincUserTotalWorkunits", NULL},
         { kBoincLanguage, BoincConfigurationString, "kBoincLanguage", NULL},
+        { kBoincSchedulerSlots, BoincConfigurationNumber, "kBoincSchedulerSlots", NULL},
+        { kBoincSchedulerComputeSlots, BoincConfigurationNumber, "kBoincSchedulerComputeSlots", NULL},
+        { kBoincSchedulerBackoffBase, BoincConfigurationNumber, "kBoincSchedulerBackoffBase", NULL},
+        { kBoincSchedulerBackoffStep, BoincConfigurationNumber, "kBoincSchedulerBackoffStep", NULL},
+        { kBoincSchedulerBackoffMax, BoincConfigurationNumber, "kBoincSchedulerBackoffMax", NULL},
+        { kBoincSchedulerPrefetchMin, BoincConfigurationNumber, "kBoincSchedulerPrefetchMin", NULL},
+        { kBoincSchedulerPrefetchMax, BoincConfigurationNumber, "kBoincSchedulerPrefetchMax", NULL},
+        { kBoincSchedulerWorkRequest, BoincConfigurationNumber | BoincConfigurationDontStore, "kBoincSchedulerWorkRequest", NULL},
+        { kBoincSchedulerLoadThreads, BoincConfigurationNumber, "kBoincSchedulerLoadThreads", NULL},
+        { kBoincSchedulerTimerSlack, BoincConfigurationNumber, "kBoincSchedulerTimerSlack", NULL},
+        { kBoincSchedulerDiskThreads, BoincConfigurationNumber, "kBoincSchedulerDiskThreads", NULL},
+        { kBoincSchedulerPriorityAging, BoincConfigurationNumber, "kBoincSchedulerPriorityAging", NULL},
+        { kBoincNetworkMaxTransfers, BoincConfigurationNumber, "kBoincNetworkMaxTransfers", NULL},
+        { kBoincNetworkMaxTransfersPerHost, BoincConfigurationNumber, "kBoincNetworkMaxTransfersPerHost", NULL},
+        { kBoincNetworkMaxIdleConnections, BoincConfigurationNumber, "kBoincNetworkMaxIdleConnections", NULL},
+        { kBoincNetworkIdleTimeout, BoincConfigurationNumber, "kBoincNetworkIdleTimeout", NULL},
+        { kBoincNetworkMaxDownRate, BoincConfigurationNumber, "kBoincNetworkMaxDownRate", NULL},
+        { kBoincNetworkMaxUpRate, BoincConfigurationNumber, "kBoincNetworkMaxUpRate", NULL},
+        { kBoincNetworkMaxDownRatePerTransfer, BoincConfigurationNumber, "kBoincNetworkMaxDownRatePerTransfer", NULL},
+        { kBoincNetworkMaxUpRatePerTransfer, BoincConfigurationNumber, "kBoincNetworkMaxUpRatePerTransfer", NULL},
+        { kBoincNetworkCompressRequests, BoincConfigurationNumber, "kBoincNetworkCompressRequests", NULL},
+        { kBoincNetworkRangeCount, BoincConfigurationNumber, "kBoincNetworkRangeCount", NULL},
+        { kBoincNetworkRangeMinSize, BoincConfigurationNumber, "kBoincNetworkRangeMinSize", NULL},
+        { kBoincNetworkStallTimeout, BoincConfigurationNumber, "kBoincNetworkStallTimeout", NULL},
 };
 
 static int boincConfigurationGetParameterFromName(const char * name) 
@@ -206,6 +231,13 @@ BoincConfiguration* boincConfigurationCreate(const char* dir)
                 return NULL;
         }
 
+        conf->storeMutex = boincMutexCreate("confstore");
+        if (conf->storeMutex == NULL) {
+                boincMutexDestroy(conf->mutex);
+                boincFree(conf);
+                return NULL;
+        }
+
         // Copy dir name
         if (boincErrorOccured(boincConfigurationSetInternalString(conf, kBoincProjectDirectory, dir)) ) {
                 boincConfigurationDestroy(conf);
@@ -252,6 +284,7 @@ BoincError boincConfigurationDestroy(BoincConfiguration* configuration)
         boincMutexUnlock(configuration->mutex);
         //printf("Mutex destroyed\n");
         boincMutexDestroy(configuration->mutex);
+        boincMutexDestroy(configuration->storeMutex);
 
         // Free each allocated string
         for (int i = 0 ; i < kBoincLastIndexEnum ; i++) {
@@ -290,6 +323,15 @@ BoincError boincConfigurationUpdateFromFile(BoincConfiguration * configuration,
         return boincConfigurationStore(configuration);
 }
 
+BoincError boincConfigurationUpdateFromBuffer(BoincConfiguration * configuration, const char * xml, size_t size) 
+{  
+        BoincError err = boincXMLParseBuffer(xml, size, boincConfigurationXMLBegin, boincConfigurationXMLEnd, configuration);
+        if (err) {
+                return err;
+        }
+        return boincConfigurationStore(configuration);
+}
+
 BoincError boincConfigurationCreateDefault(BoincConfiguration * configuration) 
 {
         boincErrorDestroy(boincConfigurationSetInternalString(configuration, kBoincHostID, "0"));
@@ -317,9 +359,14 @@ BoincError boincConfigurationStore(BoincConfiguration* configuration)
         char confarg[MAX_STRING_BUFF_SIZE];
         boincConfigurationGetString(configuration, kBoincProjectConfigurationTmpFile, confbuff, MAX_STRING_BUFF_SIZE -1);
 
+        // The threads of the scheduler share the temporary file
+        boincMutexLock(configuration->storeMutex);
+
         FILE * fh = boincFopen(confbuff, "w+");
-        if (fh == NULL)
+        if (fh == NULL) {
+                boincMutexUnlock(configuration->storeMutex);
                 return boincErrorCreatef(kBoincError, -1, "Cannot open %s in write mode", confbuff);
+        }
 
         fprintf(fh, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
         fprintf(fh, "<BoincLiteConfiguration>\n");
@@ -338,7 +385,9 @@ BoincError boincConfigurationStore(BoincConfiguration* configuration)
         char newconf[MAX_STRING_BUFF_SIZE];
         boincConfigurationGetString(configuration, kBoincProjectConfigurationFile, newconf, MAX_STRING_BUFF_SIZE - 1);
 
-        return boincRenameFile(confbuff, newconf);
+        BoincError err = boincRenameFile(confbuff, newconf);
+        boincMutexUnlock(configuration->storeMutex);
+        return err;
 }
 
 int boincConfigurationHasParameter(BoincConfiguration* configuration, int parameter) 
@@ -349,6 +398,22 @@ int boincConfigurationHasParameter(BoincConfiguration* configuration, int parame
         return r;
 }
 
+BoincError boincConfigurationUnset(BoincConfiguration* configuration, int parameter) 
+{
+        if (boincConfigurationIsReadOnly(parameter))
+                return boincErrorCreatef(kBoincError, -1, "boincConfigurationUnset(%s) cannot be modified",  
+                                         parameterDefinitions[parameter].name);
+
+        boincMutexLock(configuration->mutex);
+        if (configuration->parameter[parameter].value != NULL) {
+                boincFree(configuration->parameter[parameter].value);
+                configuration->parameter[parameter].value = NULL;
+        }
+        boincMutexUnlock(configuration->mutex);
+
+        return NULL;
+}
+
 BoincError boincConfigurationSetString(BoincConfiguration* configuration, int parameter, const char* value) 
 {
         if (boincConfigurationIsReadOnly(parameter))
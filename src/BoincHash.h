@@ -38,4 +38,25 @@ BoincError boincHashMd5String(const char * src, char * hash) ;
  */
 BoincError boincHashMd5File(const char * fileName, char * hash) ;
 
+/** \brief md5 of a content that comes piece by piece
+ */
+typedef struct _BoincHashMd5 BoincHashMd5;
+
+/** \brief start an md5, NULL if out of memory
+ */
+BoincHashMd5 * boincHashMd5Create() ;
+
+/** \brief add the next piece of the content
+ */
+void boincHashMd5Update(BoincHashMd5 * md5, const void * data, unsigned int len) ;
+
+/** \brief end the md5 and free it
+ * \param[out] hash  the md5 result (must have space for 32 bytes)
+ */
+void boincHashMd5Final(BoincHashMd5 * md5, char * hash) ;
+
+/** \brief free an md5 without ending it
+ */
+void boincHashMd5Destroy(BoincHashMd5 * md5) ;
+
 #endif // __BoincHash_H__
@@ -78,18 +78,89 @@ BoincError boincHttpInit();
 /**
  * Destroy the HTTP engine
  *
- * MUST BE CALLED after the last HttpGet or HttpPost use
+ * MUST BE CALLED after the last HttpGet or HttpPost use, and after the
+ * concurrent transfers are destroyed. The open connections, the DNS
+ * answers and the TLS sessions are kept until then, to be reused by
+ * the next queries to the same hosts.
  */
 BoincError boincHttpCleanup();
 
+/**
+ * Limit the connections kept open between the queries
+ *
+ * maxIdle: most connections kept open (default 8)
+ * idleTimeout: seconds an unused connection is kept open (default 118)
+ * Zero leaves a limit unchanged.
+ */
+BoincError boincHttpSetConnectionLimits(int maxIdle, int idleTimeout);
+
+/**
+ * Fail the transfers that receive or send nothing for stallTimeout
+ * seconds, so that they can be tried on an other server. Zero, the
+ * default, waits for ever.
+ */
+BoincError boincHttpSetStallTimeout(int stallTimeout);
+
+/**
+ * Limit the bandwidth, in bytes per second, zero for no limit
+ *
+ * maxDown, maxUp: total of all the transfers in each direction
+ * maxDownPerTransfer, maxUpPerTransfer: a single transfer
+ * The total limits are shared between the transfers of an engine,
+ * those running included, an even share each unless a transfer
+ * cannot use it, held back by its server: the others then get what
+ * it leaves. A query outside the engine gets the limits when it
+ * starts.
+ */
+BoincError boincHttpSetRateLimits(int maxDown, int maxUp, int maxDownPerTransfer, int maxUpPerTransfer);
+
+/**
+ * Save the TLS sessions to a file, readable by the user only, to
+ * resume them after a restart without a full handshake. Does nothing
+ * before libcurl 8.12, which cannot export its sessions.
+ */
+BoincError boincHttpStoreSessions(const char* sessionFile);
+
+/**
+ * Load the TLS sessions saved by boincHttpStoreSessions. A missing
+ * or truncated file is not an error, and the sessions no longer valid
+ * are dropped.
+ */
+BoincError boincHttpLoadSessions(const char* sessionFile);
+
 /**
  * Retrieve the content of an url via an HTTP GET
  *
  * url: the url to download
  * localFile: the file the downloaded content will be stored in 
+ *
+ * The content is written to localFile.tmp and only moved to localFile
+ * once complete. If a previous GET was interrupted, and the server
+ * gave an ETag for the file, only the rest of it is asked for, with a
+ * Range request the server honours if the file did not change.
  */
 BoincError boincHttpGet(const char* url, const char* localFile);
 
+/**
+ * Retrieve a file of a known size and checksum via an HTTP GET
+ *
+ * As boincHttpGet, but the file must have expectedSize bytes and the
+ * MD5 checksum expectedMd5 to be moved in place; a file that does not
+ * is deleted. With a checksum, the download is resumed even without
+ * an ETag. Zero or NULL skip a check.
+ */
+BoincError boincHttpGetFile(const char* url, const char* localFile, unsigned int expectedSize, const char* expectedMd5);
+
+/**
+ * GET an url into memory, for the small answers that are parsed at
+ * once and need not be kept
+ *
+ * reply: the answer, NUL terminated, to be freed with boincFree; NULL
+ * if the query failed
+ * replySize: its size, without the NUL
+ */
+BoincError boincHttpGetMemory(const char* url, char** reply, size_t* replySize);
+
 /**
  * POST a content to an url
  *
@@ -98,9 +169,27 @@ BoincError boincHttpGet(const char* url, const char* localFile);
  * contentLength: size in OCTETs (byte) of the uploaded content
  * readFunc: callback allowing to retrieve the uploaded content
  * userData: callback user arg
+ * The answer is decoded as it arrives if the server compressed it.
  */
 BoincError boincHttpPost(const char* url, const char* localFile, unsigned int contentLength, BoincHttpReadFun readFunc, void* userData);
 
+/**
+ * POST a content already encoded, as by boincHttpPost
+ *
+ * contentEncoding: the encoding of the content, e.g. "gzip", sent in
+ * the Content-Encoding header. The server answers with an HTTP error,
+ * typically 415, if it cannot decode it.
+ */
+BoincError boincHttpPostEncoded(const char* url, const char* localFile, unsigned int contentLength,
+                                BoincHttpReadFun readFunc, void* userData, const char* contentEncoding);
+
+/**
+ * POST a content as by boincHttpPostEncoded, the answer being kept in
+ * memory as by boincHttpGetMemory
+ */
+BoincError boincHttpPostMemory(const char* url, unsigned int contentLength, BoincHttpReadFun readFunc, void* userData,
+                               const char* contentEncoding, char** reply, size_t* replySize);
+
 /**
  * Set a progress callback
  * must be set before every http calls : the callback attachement is reset after each call
@@ -108,4 +197,128 @@ BoincError boincHttpPost(const char* url, const char* localFile, unsigned int co
 typedef void (*BoincHttpProgressCallback) (void * userdata, float progress);
 BoincError boincHttpSetProgressCallback(BoincHttpProgressCallback progressFunc, void * progressData, int fileNum, int fileTotal);
 
+/**
+ * Concurrent transfers
+ *
+ * The transfers are queued in an engine that runs them all at once,
+ * within a limit of connections in total and to a single host. The
+ * engine is driven by a single thread, which calls
+ * boincHttpTransfersPerform until no transfer is left, and
+ * boincHttpTransfersWait in between to sleep until there is network
+ * activity. The done callback of a transfer is called from
+ * boincHttpTransfersPerform, and owns the error it is given.
+ */
+typedef struct _BoincHttpTransfers BoincHttpTransfers;
+
+typedef void (*BoincHttpDoneCallback) (void * userData, BoincError err);
+
+/**
+ * Done callback of a query whose answer is kept in memory. The answer,
+ * NUL terminated, is only given if the query succeeded, and is then
+ * owned by the callback, as is the error.
+ */
+typedef void (*BoincHttpReplyCallback) (void * userData, BoincError err, char * reply, size_t replySize);
+
+/**
+ * Told of the bytes a GET into a file received since the last call,
+ * with the userData of the GET
+ */
+typedef void (*BoincHttpReceivedCallback) (void * userData, double bytes);
+
+typedef struct _BoincHttpStats {
+  double latency;       // seconds until the first byte of the answer
+  double rate;          // bytes per second once the answer started
+} BoincHttpStats;
+
+/**
+ * Figures of the last query outside the engine, to rank the servers
+ */
+void boincHttpStats(BoincHttpStats * stats);
+
+/**
+ * maxTransfers: most connections open at once, zero for no limit
+ * maxPerHost: most connections open to a single host, zero for no limit
+ */
+BoincHttpTransfers * boincHttpTransfersCreate(int maxTransfers, int maxPerHost);
+
+/**
+ * Cancel the transfers left, whose done callback is called with an error.
+ * What the GETs received is kept, to be resumed.
+ */
+void boincHttpTransfersDestroy(BoincHttpTransfers * transfers);
+
+/**
+ * Queue an HTTP GET of url into localFile, checked and resumed as by
+ * boincHttpGetFile
+ *
+ * A file of at least the size set by boincHttpTransfersSetRanges is
+ * fetched in byte ranges over several connections at once, unless a
+ * previous attempt over a single connection left a part of it, or the
+ * server does not do ranges. It is then fetched whole.
+ *
+ * The spans a ranged attempt received are kept in localFile.part and
+ * listed in localFile.ranges, so that the next attempt, from the same
+ * url or a mirror, only fetches the spans missing. The part is
+ * dropped when the complete file fails the checksum.
+ */
+BoincError boincHttpTransfersGet(BoincHttpTransfers * transfers, const char* url, const char* localFile,
+                                 unsigned int expectedSize, const char* expectedMd5,
+                                 BoincHttpDoneCallback done, void * userData);
+
+/**
+ * Queue an HTTP POST of the content read by readFunc, as by
+ * boincHttpPostMemory. The answer is handed to the callback.
+ */
+BoincError boincHttpTransfersPost(BoincHttpTransfers * transfers, const char* url, unsigned int contentLength,
+                                  BoincHttpReadFun readFunc, void* readData, const char* contentEncoding,
+                                  BoincHttpReplyCallback replied, void * userData);
+
+/**
+ * Queue an HTTP GET whose answer is kept in memory, as by
+ * boincHttpGetMemory. The answer is handed to the callback.
+ */
+BoincError boincHttpTransfersGetMemory(BoincHttpTransfers * transfers, const char* url,
+                                       BoincHttpReplyCallback replied, void * userData);
+
+/**
+ * Follow the bytes received by each GET into a file, to show the
+ * progress of the downloads of several owners at once. Called from
+ * boincHttpTransfersPerform.
+ */
+void boincHttpTransfersSetReceivedCallback(BoincHttpTransfers * transfers, BoincHttpReceivedCallback received);
+
+/**
+ * Figures of the transfer whose done callback is running, to rank the
+ * servers. Those of a file fetched in ranges are for the whole file.
+ */
+void boincHttpTransfersStats(BoincHttpTransfers * transfers, BoincHttpStats * stats);
+
+/**
+ * Split the large files into ranges fetched at once
+ *
+ * rangeCount: number of ranges, 1 or less to fetch every file whole
+ * minSize: smallest size in bytes of a file split into ranges
+ * A file of fewer bytes than ranges is fetched whole.
+ */
+void boincHttpTransfersSetRanges(BoincHttpTransfers * transfers, int rangeCount, unsigned int minSize);
+
+/**
+ * Bytes received by all the transfers since the engine was created,
+ * to follow the progress of a set of files
+ */
+double boincHttpTransfersReceived(BoincHttpTransfers * transfers);
+
+/**
+ * Move the transfers forward without blocking and call the done
+ * callbacks of the finished ones
+ *
+ * returns the number of transfers left
+ */
+int boincHttpTransfersPerform(BoincHttpTransfers * transfers);
+
+/**
+ * Wait for network activity on the transfers, for at most timeout milliseconds
+ */
+void boincHttpTransfersWait(BoincHttpTransfers * transfers, int timeout);
+
 #endif // __BoincHttp_H__
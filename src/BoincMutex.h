@@ -47,14 +47,83 @@ int boincMutexLock(BoincMutex mutex);
  */
 int boincMutexUnlock(BoincMutex mutex);
 
+typedef struct _BoincConditionImpl* BoincCondition; 
+
+/* Initialise a condition variable.
+ * Returns NULL if an error occured.
+ */
+BoincCondition boincConditionCreate();
+
+void boincConditionDestroy(BoincCondition cond);
+
+/* Wait until the condition is signalled or until timeout seconds
+ * have passed. The mutex must be locked by the caller.
+ * Returns 0 if the condition was signalled, non-zero otherwise.
+ */
+int boincConditionWait(BoincCondition cond, BoincMutex mutex, unsigned int timeout);
+
+/* Wake up all the threads waiting on the condition.
+ */
+int boincConditionBroadcast(BoincCondition cond);
+
+typedef struct _BoincThreadImpl* BoincThread; 
+typedef void (*BoincThreadFunction)(void* data);
+
+/* Start a thread that runs function(data).
+ * Returns NULL if an error occured.
+ */
+BoincThread boincThreadCreate(BoincThreadFunction function, void* data);
+
+/* Wait for the end of the thread and free it.
+ */
+void boincThreadJoin(BoincThread thread);
+
+/* Let the other threads run, before trying again something that an
+ * other thread has to make possible.
+ */
+void boincThreadYield();
+
+/* Atomic operations on a word shared between threads without a
+ * mutex. They are sequentially consistent.
+ */
+unsigned int boincAtomicLoad(volatile unsigned int* value);
+
+void boincAtomicStore(volatile unsigned int* value, unsigned int newValue);
+
+/* Set the value to desired if it equals expected.
+ * Returns non-zero if the value was changed.
+ */
+int boincAtomicCompareAndSwap(volatile unsigned int* value, unsigned int expected, unsigned int desired);
+
 #else
 
+#include <unistd.h>
+
 typedef int BoincMutex; 
 #define boincMutexCreate(_n) (0)
 #define boincMutexDestroy(_m)
 #define boincMutexLock(_m) (0)
 #define boincMutexUnlock(_m) (0)
 
+// Nobody else can signal: just let the time pass
+typedef int BoincCondition; 
+#define boincConditionCreate() (0)
+#define boincConditionDestroy(_c)
+#define boincConditionWait(_c, _m, _t) (sleep(_t), 1)
+#define boincConditionBroadcast(_c) (0)
+
+// No threads: run the function right away
+typedef int BoincThread; 
+typedef void (*BoincThreadFunction)(void* data);
+#define boincThreadCreate(_f, _d) ((_f)(_d), 1)
+#define boincThreadJoin(_t)
+#define boincThreadYield()
+
+// Nobody else can see the word in the middle of a change
+#define boincAtomicLoad(_v) (*(_v))
+#define boincAtomicStore(_v, _x) (*(_v) = (_x))
+#define boincAtomicCompareAndSwap(_v, _e, _d) ((*(_v) == (_e))? (*(_v) = (_d), 1) : 0)
+
 #endif
 
 typedef void (*boincTermHandler)(int);
@@ -23,10 +23,14 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <time.h>
 #include <stdlib.h>
 #include "config.h"
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
 #include "BoincProxy.h"
 #include "BoincHttp.h"
 #include "BoincXMLParser.h"
@@ -35,11 +39,35 @@
 #include "BoincHash.h"
 #include "BoincUtil.h"
 #include "BoincWorkUnit.h"
+#include "BoincMutex.h"
+
+#define BUFF_SIZE 255
+
+/*
+  The data servers a file can be fetched from are ranked by the time
+  they should take to send it, from the latency and the rate measured
+  on the previous downloads. A server never measured comes first, in
+  the order of the project, so that each one gets measured. A server
+  that failed comes last until its retry time. The figures are kept by
+  the proxy, for the downloads of all the slots.
+*/
+typedef struct _BoincProxyMirror {
+        char host[BUFF_SIZE];           // scheme and host of the urls
+        double latency;                 // smoothed seconds to the first byte
+        double rate;                    // smoothed bytes per second, zero until measured
+        int failures;                   // failures in a row
+        time_t retry;                   // tried last until then
+        struct _BoincProxyMirror * next;
+} BoincProxyMirror;
 
 struct _BoincProxy {
         BoincConfiguration * conf;
         BoincStatusChangedCallback statusCallback;
         void * statusData;	
+        BoincProxyAbort * aborts;
+        BoincHttpTransfers * transfers;
+        int plainRequests;      // the scheduler refused a compressed request
+        BoincProxyMirror * mirrors;
 };
 
 enum BoincProxyUrlPath {
@@ -50,7 +78,21 @@ enum BoincProxyUrlPath {
 static char* projectConfigPath = "get_project_config.php";
 static char* accountPath = "lookup_account.php";
 
-#define BUFF_SIZE 255
+// Smaller result files are uploaded whole, without asking the data
+// server for the part it already has
+#define UPLOAD_RESUME_SIZE 65536
+
+// A mirror that failed is tried last for this many seconds, doubled
+// at each failure in a row up to MIRROR_MAX_DELAY
+#define MIRROR_RETRY_DELAY 60
+#define MIRROR_MAX_DELAY 3600
+
+// The authenticator and the scheduler URL kept across restarts
+#define CREDENTIALS_FILE "credentials.xml"
+
+// How the project tells of an authenticator it does not know
+#define REJECTED_AUTHENTICATOR "Invalid or missing account key"
+#define ERR_DB_NOT_FOUND -136
 
 
 typedef struct _BoincProxyUrl {
@@ -68,6 +110,7 @@ typedef struct _BoincProxyPostData {
         FILE * fh;
         unsigned int bytesRead;
         unsigned int contentLength;
+        unsigned int lastFileOffset;    // bytes of the last file not sent
 } BoincProxyPostData;
 
 
@@ -117,6 +160,7 @@ static void boincProxySetPostContentLength(BoincProxyPostData * data)
                 stat(data->files[i], &bStat);
                 data->contentLength +=  bStat.st_size;
         }
+        data->contentLength -= data->lastFileOffset;
 }
 
 static size_t boincProxyPostCallback(void *uploadData, size_t size, size_t nmemb, void* userdata) 
@@ -130,6 +174,12 @@ static size_t boincProxyPostCallback(void *uploadData, size_t size, size_t nmemb
                 data->fh = boincFopen(data->files[data->fileOffset++], "r");
                 if (data->fh == NULL)
                         return 0;
+                if ((data->fileOffset == data->nbFiles) && (data->lastFileOffset > 0)
+                    && fseek(data->fh, data->lastFileOffset, SEEK_SET)) {
+                        boincFclose(data->fh);
+                        data->fh = NULL;
+                        return 0;
+                }
         }
         size_t read = fread(uploadData, size, nmemb, data->fh);
         if (!read || feof(data->fh)) {
@@ -149,14 +199,187 @@ static size_t boincProxyPostCallback(void *uploadData, size_t size, size_t nmemb
         return read;
 }
 
-static BoincError boincProxyPost(BoincProxy * proxy, BoincProxyUrl * s_url, BoincProxyPostData * data, const char * path)
+static int boincProxyGetSetting(BoincProxy * proxy, int parameter, int defaultValue)
+{
+        if (!boincConfigurationHasParameter(proxy->conf, parameter)) {
+                return defaultValue;
+        }
+        return (int) boincConfigurationGetNumber(proxy->conf, parameter);
+}
+
+/**
+ * Hand the bandwidth limits of the configuration to the HTTP layer.
+ * Called before each transfer, so a change of the limits applies to
+ * the next one.
+ */
+static void boincProxyApplyRateLimits(BoincProxy * proxy)
+{
+        boincHttpSetRateLimits(boincProxyGetSetting(proxy, kBoincNetworkMaxDownRate, 0),
+                               boincProxyGetSetting(proxy, kBoincNetworkMaxUpRate, 0),
+                               boincProxyGetSetting(proxy, kBoincNetworkMaxDownRatePerTransfer, 0),
+                               boincProxyGetSetting(proxy, kBoincNetworkMaxUpRatePerTransfer, 0));
+}
+
+// A reply of a server, parsed from memory
+typedef struct _BoincProxyReply {
+        char * data;
+        size_t size;
+} BoincProxyReply;
+
+/*
+  The files of a workunit are downloaded on the transfer engine of the
+  proxy, all at once. The engine keeps the downloads of several
+  workunits in flight, along with the requests to the servers and the
+  uploads.
+*/
+typedef struct _BoincProxyFetch BoincProxyFetch;
+
+typedef struct _BoincProxyDownload {
+        BoincProxyFetch * fetch;
+        BoincFileInfo * file;
+        char fullpath[BUFF_SIZE];
+        char ** urls;           // the mirrors, the best first
+        int current;            // the mirror being tried
+} BoincProxyDownload;
+
+struct _BoincProxyFetch {
+        BoincProxyWorkUnit pwu;
+        BoincProxyDownload * downloads;
+        int count;
+        int pending;            // downloads not over yet
+        int filesBefore;        // files of the workunit already there
+        int filesDone;
+        int filesTotal;
+        double expected;        // bytes of the downloads
+        double received;
+        BoincError err;         // of the first download that failed
+        BoincHttpDoneCallback done;
+        void * userData;
+};
+
+/**
+ * The progress of a workunit follows the bytes received for all its
+ * files, as a large file moves forward in several ranges at once
+ */
+static void boincProxyFetchProgress(BoincProxyFetch * fetch)
+{
+        float part = (float) (fetch->filesDone - fetch->filesBefore) / fetch->count;
+        if (fetch->expected > 0) {
+                part = fetch->received / fetch->expected;
+        }
+        if (part > 1) {
+                part = 1;
+        }
+        boincProxyChangeWorkUnitProgress(&fetch->pwu, 100.0f * (fetch->filesBefore + part * fetch->count) / fetch->filesTotal);
+}
+
+static void boincProxyDownloadReceived(void * userData, double bytes)
+{
+        BoincProxyDownload * download = (BoincProxyDownload *) userData;
+        download->fetch->received += bytes;
+        boincProxyFetchProgress(download->fetch);
+}
+
+/**
+ * The transfer engine, created on first use. It is driven by a single
+ * thread: the network thread of the scheduler, which runs it through
+ * boincProxyPerform between the requests, and during them.
+ */
+static BoincHttpTransfers * boincProxyGetTransfers(BoincProxy * proxy)
+{
+        if (proxy->transfers == NULL) {
+                proxy->transfers = boincHttpTransfersCreate(boincProxyGetSetting(proxy, kBoincNetworkMaxTransfers, 16),
+                                                            boincProxyGetSetting(proxy, kBoincNetworkMaxTransfersPerHost, 8));
+                if (proxy->transfers == NULL) {
+                        return NULL;
+                }
+                boincHttpTransfersSetReceivedCallback(proxy->transfers, boincProxyDownloadReceived);
+        }
+
+        boincProxyApplyRateLimits(proxy);
+        boincHttpTransfersSetRanges(proxy->transfers, boincProxyGetSetting(proxy, kBoincNetworkRangeCount, 4),
+                                    boincProxyGetSetting(proxy, kBoincNetworkRangeMinSize, 16777216));
+        return proxy->transfers;
+}
+
+int boincProxyPerform(BoincProxy * proxy, int timeout)
+{
+        if (proxy->transfers == NULL) {
+                return 0;
+        }
+        int left = boincHttpTransfersPerform(proxy->transfers);
+        if ((left > 0) && (timeout > 0)) {
+                boincHttpTransfersWait(proxy->transfers, timeout);
+        }
+        return left;
+}
+
+void boincProxyCancelTransfers(BoincProxy * proxy)
+{
+        // The downloads cancelled do not move on to their next mirror
+        BoincHttpTransfers * transfers = proxy->transfers;
+        proxy->transfers = NULL;
+        boincHttpTransfersDestroy(transfers);
+}
+
+// A request to a server, run on the engine until it is over
+typedef struct _BoincProxyWait {
+        int done;
+        BoincError err;
+        BoincProxyReply * reply;
+} BoincProxyWait;
+
+static void boincProxyWaitDone(void * userData, BoincError err)
+{
+        BoincProxyWait * wait = (BoincProxyWait *) userData;
+        wait->err = err;
+        wait->done = 1;
+}
+
+static void boincProxyWaitReplied(void * userData, BoincError err, char * reply, size_t replySize)
+{
+        BoincProxyWait * wait = (BoincProxyWait *) userData;
+        wait->reply->data = reply;
+        wait->reply->size = replySize;
+        boincProxyWaitDone(wait, err);
+}
+
+/**
+ * Run the engine until the request is over. The other transfers go on
+ * meanwhile, and their done callbacks are called.
+ */
+static BoincError boincProxyWaitFor(BoincProxy * proxy, BoincProxyWait * wait)
+{
+        while (!wait->done) {
+                if (boincProxyPerform(proxy, 1000) == 0) {
+                        break;
+                }
+        }
+        if (!wait->done) {
+                return boincErrorCreate(kBoincError, kBoincInternal, "HTTP transfer lost");
+        }
+        return wait->err;
+}
+
+static BoincError boincProxyPost(BoincProxy * proxy, BoincProxyUrl * s_url, BoincProxyPostData * data,
+                                 const char * contentEncoding, BoincProxyReply * reply)
 {
         char theurl[BUFF_SIZE];
         if (boincProxyConstructUrl(s_url, theurl, BUFF_SIZE) == NULL) {
                 return boincErrorCreate(kBoincError, kBoincInternal, "URL too long");
         }
+        BoincHttpTransfers * transfers = boincProxyGetTransfers(proxy);
+        if (transfers == NULL) {
+                return boincErrorCreate(kBoincFatal, 0, "Cannot initialise HTTP layer");
+        }
         boincProxySetPostContentLength(data); 
-        BoincError err = boincHttpPost(theurl, path, data->contentLength, boincProxyPostCallback, data);
+
+        BoincProxyWait wait = { 0, NULL, reply };
+        BoincError err = boincHttpTransfersPost(transfers, theurl, data->contentLength, boincProxyPostCallback, data, 
+                                                contentEncoding, boincProxyWaitReplied, &wait);
+        if (err == NULL) {
+                err = boincProxyWaitFor(proxy, &wait);
+        }
         if (data->fh != NULL) {
                 boincDebug("boincProxPostCallback closes the opened file");
                 boincFclose(data->fh);
@@ -165,7 +388,86 @@ static BoincError boincProxyPost(BoincProxy * proxy, BoincProxyUrl * s_url, Boin
         return err;
 }
 
-static BoincError boincProxyGet(BoincProxy * proxy , BoincProxyUrl * s_url , const char * path) 
+#ifdef HAVE_LIBZ
+BoincError boincProxyCompressFile(const char * file, const char * compressedFile)
+{
+        char buffer[4096];
+        size_t n;
+        int failed = 0;
+
+        FILE * in = boincFopen(file, "rb");
+        if (in == NULL) {
+                return boincErrorCreatef(kBoincError, kBoincFileSystem, "Cannot open %s", file);
+        }
+        gzFile out = gzopen(compressedFile, "wb");
+        if (out == NULL) {
+                boincFclose(in);
+                return boincErrorCreatef(kBoincError, kBoincFileSystem, "Cannot open %s", compressedFile);
+        }
+        while (!failed && ((n = fread(buffer, 1, sizeof(buffer), in)) > 0)) {
+                failed = (gzwrite(out, buffer, n) != (int) n);
+        }
+        boincFclose(in);
+        if ((gzclose(out) != Z_OK) || failed) {
+                unlink(compressedFile);
+                return boincErrorCreatef(kBoincError, kBoincFileSystem, "Cannot compress %s", file);
+        }
+        return NULL;
+}
+#endif
+
+/**
+ * Whether the next scheduler request is gzipped
+ */
+int boincProxyCompressesRequests(BoincProxy * proxy)
+{
+        return !proxy->plainRequests && boincProxyGetSetting(proxy, kBoincNetworkCompressRequests, 0);
+}
+
+/**
+ * Whether the scheduler refused a compressed request, which is then
+ * sent as is. The requests are plain for the rest of the run.
+ */
+int boincProxyRefusesCompression(BoincProxy * proxy, BoincError err)
+{
+        if ((boincErrorCode(err) != 400) && (boincErrorCode(err) != 415)) {
+                return 0;
+        }
+        boincLogf(kBoincInfo, 0, "The scheduler refuses compressed requests (HTTP %d)", boincErrorCode(err));
+        proxy->plainRequests = 1;
+        return 1;
+}
+
+/**
+ * POST a scheduler request. The request is gzipped if the
+ * configuration asks for it, until the scheduler refuses a compressed
+ * request: the requests are then sent as is for the rest of the run.
+ */
+static BoincError boincProxyPostRequest(BoincProxy * proxy, BoincProxyUrl * s_url, char * requestFile, BoincProxyReply * reply)
+{
+#ifdef HAVE_LIBZ
+        if (boincProxyCompressesRequests(proxy)) {
+                char compressedFile[BUFF_SIZE];
+                snprintf(compressedFile, BUFF_SIZE, "%s.gz", requestFile);
+                BoincError err = boincProxyCompressFile(requestFile, compressedFile);
+                if (err == NULL) {
+                        char * files[] = {compressedFile};
+                        BoincProxyPostData post = { NULL, 1,  files, 0, NULL, 0, 0 };
+                        err = boincProxyPost(proxy, s_url, &post, "gzip", reply);
+                        unlink(compressedFile);
+                        if (!boincProxyRefusesCompression(proxy, err)) {
+                                return err;
+                        }
+                }
+                boincErrorDestroy(err);
+        }
+#endif
+        char * files[] = {requestFile};
+        BoincProxyPostData post = { NULL, 1,  files, 0, NULL, 0, 0 };
+        return boincProxyPost(proxy, s_url, &post, NULL, reply);
+}
+
+static BoincError boincProxyGet(BoincProxy * proxy , BoincProxyUrl * s_url , BoincProxyReply * reply) 
 {
         boincDebugf("boincProxyGet urlpath %s", s_url->urlpath);
 
@@ -173,10 +475,61 @@ static BoincError boincProxyGet(BoincProxy * proxy , BoincProxyUrl * s_url , con
         if (boincProxyConstructUrl(s_url, theurl, BUFF_SIZE) == NULL) {
                 return boincErrorCreate(kBoincError, kBoincInternal, "URL too long");    
         }
-        return boincHttpGet(theurl, path);
+        BoincHttpTransfers * transfers = boincProxyGetTransfers(proxy);
+        if (transfers == NULL) {
+                return boincErrorCreate(kBoincFatal, 0, "Cannot initialise HTTP layer");
+        }
+
+        BoincProxyWait wait = { 0, NULL, reply };
+        BoincError err = boincHttpTransfersGetMemory(transfers, theurl, boincProxyWaitReplied, &wait);
+        if (err == NULL) {
+                err = boincProxyWaitFor(proxy, &wait);
+        }
+        return err;
+}
+
+/**
+ * Keep a reply that is needed after a restart. The previous copy
+ * stays in place until the new one is complete.
+ */
+static BoincError boincProxyStoreReply(const char * path, BoincProxyReply * reply)
+{
+        char tmpFile[BUFF_SIZE];
+        snprintf(tmpFile, BUFF_SIZE, "%s.tmp", path);
+
+        FILE * file = boincFopen(tmpFile, "w");
+        if (file == NULL) {
+                return boincErrorCreatef(kBoincError, kBoincFileSystem, "Cannot create %s", tmpFile);
+        }
+        size_t written = fwrite(reply->data, 1, reply->size, file);
+        if (boincFclose(file) || (written != reply->size)) {
+                unlink(tmpFile);
+                return boincErrorCreatef(kBoincError, kBoincFileSystem, "Cannot write %s", tmpFile);
+        }
+        return boincRenameFile(tmpFile, (char *) path);
 }
 
 
+// The proxies alive, which share the HTTP layer. The layer outlives
+// them, so that its connections and TLS sessions serve the next
+// scheduler of the process: it is released at the exit of the
+// process, if no proxy is left then.
+static volatile unsigned int boincProxyCount = 0;
+static volatile unsigned int boincProxyExitHook = 0;
+
+static void boincProxyCleanupAtExit(void)
+{
+        if (boincAtomicLoad(&boincProxyCount) == 0) {
+                boincErrorDestroy(boincHttpCleanup());
+        }
+}
+
+// The TLS sessions of the last run, resumed without a full handshake
+static void boincProxyGetSessionFile(BoincProxy * proxy, char * sessionFile)
+{
+        boincProxyGetAbsolutePathFromProxy(proxy, "tls_sessions.dat", sessionFile, BUFF_SIZE);
+}
+
 BoincProxy* boincProxyCreate(BoincConfiguration* configuration) 
 {
         boincDebugf("boincProxyCreate");
@@ -187,9 +540,257 @@ BoincProxy* boincProxyCreate(BoincConfiguration* configuration)
                 return NULL;
         }
         proxy->conf = configuration;
+
+        // Also for a proxy started from the cached configuration,
+        // which skips boincProxyInit
+        boincHttpSetConnectionLimits(boincProxyGetSetting(proxy, kBoincNetworkMaxIdleConnections, 8),
+                                     boincProxyGetSetting(proxy, kBoincNetworkIdleTimeout, 118));
+        boincHttpSetStallTimeout(boincProxyGetSetting(proxy, kBoincNetworkStallTimeout, 60));
+
+        unsigned int proxies;
+        do {
+                proxies = boincAtomicLoad(&boincProxyCount);
+        } while (!boincAtomicCompareAndSwap(&boincProxyCount, proxies, proxies + 1));
+        if (boincAtomicCompareAndSwap(&boincProxyExitHook, 0, 1)) {
+                atexit(boincProxyCleanupAtExit);
+        }
+
+        char sessionFile[BUFF_SIZE];
+        boincProxyGetSessionFile(proxy, sessionFile);
+        BoincError err = boincHttpLoadSessions(sessionFile);
+        if (err) {
+                boincLogError(err);
+                boincErrorDestroy(err);
+        }
+
         return proxy;
 }
 
+enum BoincCredentialsXML {
+        kBoincCredentialsProjectURL = 0,
+        kBoincCredentialsEmail,
+        kBoincCredentialsAuthenticator,
+        kBoincCredentialsScheduler,
+        kBoincCredentialsLast,
+};
+
+static char* credentialNames[] = { "project_url", "email", "authenticator", "scheduler" };
+static int credentialParameters[] = { kBoincProjectURL, kBoincUserEmail, kBoincUserAuthenticator, kBoincCGIURL };
+
+/**
+ * Keep the authenticator and the scheduler URL in the project
+ * directory, so a restart needs neither lookup_account.php nor
+ * get_project_config.php. The authenticator gives access to the
+ * account: only the user may read the file.
+ */
+BoincError boincProxyStoreCredentials(BoincProxy * proxy)
+{
+        char tmpFile[BUFF_SIZE];
+        char credentialsFile[BUFF_SIZE];
+        char value[BUFF_SIZE];
+        char escaped[6 * BUFF_SIZE];
+        char content[kBoincCredentialsLast * 7 * BUFF_SIZE];
+        int len = 0;
+
+        boincProxyGetAbsolutePathFromProxy(proxy, CREDENTIALS_FILE ".tmp", tmpFile, BUFF_SIZE);
+        boincProxyGetAbsolutePathFromProxy(proxy, CREDENTIALS_FILE, credentialsFile, BUFF_SIZE);
+
+        len += snprintf(content + len, sizeof(content) - len, "<credentials>\n");
+        for (int i = 0; i < kBoincCredentialsLast; i++) {
+                if (boincConfigurationHasParameter(proxy->conf, credentialParameters[i])) {
+                        // A URL may hold a '&'
+                        boincConfigurationGetString(proxy->conf, credentialParameters[i], value, BUFF_SIZE);
+                        if (boincXMLEscape(value, escaped, sizeof(escaped)) == NULL) {
+                                return boincErrorCreatef(kBoincError, kBoincInternal, "The %s is too long", credentialNames[i]);
+                        }
+                        len += snprintf(content + len, sizeof(content) - len, "<%s>%s</%s>\n", credentialNames[i], 
+                                        escaped, credentialNames[i]);
+                }
+        }
+        len += snprintf(content + len, sizeof(content) - len, "</credentials>\n");
+
+        // A file left over keeps its mode: start from a new one
+        unlink(tmpFile);
+        int fd = open(tmpFile, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+        if (fd < 0) {
+                return boincErrorCreatef(kBoincError, kBoincFileSystem, "Cannot open %s", tmpFile);
+        }
+        int written = write(fd, content, len);
+        close(fd);
+        if (written != len) {
+                return boincErrorCreatef(kBoincError, kBoincFileSystem, "Failed to write %s", tmpFile);
+        }
+
+        return boincRenameFile(tmpFile, credentialsFile);
+}
+
+typedef struct _BoincCredentials {
+        char * values[kBoincCredentialsLast];
+} BoincCredentials;
+
+static int boincProxyCredentialsXMLBegin(const char* elementName, const char** attr, void* userData)
+{
+        for (int i = 0; i < kBoincCredentialsLast; i++) {
+                if (!strcmp(elementName, credentialNames[i])) {
+                        return i;
+                }
+        }
+        return -1;
+}
+
+static BoincError boincProxyCredentialsXMLEnd(int index, const char* elementValue, void* userData)
+{
+        BoincCredentials * credentials = (BoincCredentials*) userData;
+
+        if (credentials->values[index] != NULL) {
+                boincFree(credentials->values[index]);
+        }
+        credentials->values[index] = boincArray(char, strlen(elementValue) + 1);
+        if (credentials->values[index] == NULL) {
+                return boincErrorCreate(kBoincFatal, kBoincSystem, "Out of memory");
+        }
+        strcpy(credentials->values[index], elementValue);
+        return NULL;
+}
+
+BoincError boincProxyLoadCredentials(BoincProxy * proxy)
+{
+        char credentialsFile[BUFF_SIZE];
+        char value[BUFF_SIZE];
+        BoincCredentials credentials;
+        BoincError err = NULL;
+
+        boincProxyGetAbsolutePathFromProxy(proxy, CREDENTIALS_FILE, credentialsFile, BUFF_SIZE);
+
+        struct stat buffer;
+        if (stat(credentialsFile, &buffer)) {
+                return boincErrorCreatef(kBoincError, kBoincFileSystem, "No credentials in %s", credentialsFile);
+        }
+
+        memset(&credentials, 0, sizeof(BoincCredentials));
+        err = boincXMLParse(credentialsFile, boincProxyCredentialsXMLBegin, boincProxyCredentialsXMLEnd, &credentials);
+
+        // Only trust them for the same project and account
+        for (int i = kBoincCredentialsProjectURL; (err == NULL) && (i <= kBoincCredentialsEmail); i++) {
+                if ((credentials.values[i] == NULL)
+                    || !boincConfigurationHasParameter(proxy->conf, credentialParameters[i])
+                    || strcmp(credentials.values[i], 
+                              boincConfigurationGetString(proxy->conf, credentialParameters[i], value, BUFF_SIZE))) {
+                        err = boincErrorCreate(kBoincError, kBoincAuthentication, "The credentials are for another account");
+                }
+        }
+        for (int i = kBoincCredentialsAuthenticator; (err == NULL) && (i < kBoincCredentialsLast); i++) {
+                if (credentials.values[i] == NULL) {
+                        err = boincErrorCreatef(kBoincError, kBoincAuthentication, "No %s in the credentials", credentialNames[i]);
+                }
+        }
+        for (int i = kBoincCredentialsAuthenticator; (err == NULL) && (i < kBoincCredentialsLast); i++) {
+                if (!boincConfigurationHasParameter(proxy->conf, credentialParameters[i])) {
+                        err = boincConfigurationSetString(proxy->conf, credentialParameters[i], credentials.values[i]);
+                }
+        }
+
+        for (int i = 0; i < kBoincCredentialsLast; i++) {
+                if (credentials.values[i] != NULL) {
+                        boincFree(credentials.values[i]);
+                }
+        }
+
+        return err;
+}
+
+/**
+ * Forget a credential the server rejected. The next request fetches
+ * it again.
+ */
+static void boincProxyForgetCredential(BoincProxy * proxy, int parameter)
+{
+        boincConfigurationUnset(proxy->conf, parameter);
+        BoincError err = boincProxyStoreCredentials(proxy);
+        if (err) {
+                boincLogError(err);
+                boincErrorDestroy(err);
+        }
+}
+
+/**
+ * Fetch the credentials that are missing, because they were never
+ * known or because the server rejected them.
+ */
+static BoincError boincProxyCheckCredentials(BoincProxy * proxy)
+{
+        BoincError err = NULL;
+
+        if (!boincConfigurationHasParameter(proxy->conf, kBoincCGIURL)) {
+                err = boincProxyInit(proxy);
+                if (err) {
+                        return err;
+                }
+        }
+        if (!boincConfigurationHasParameter(proxy->conf, kBoincUserAuthenticator)) {
+                err = boincProxyAuthenticate(proxy);
+        }
+        return err;
+}
+
+enum BoincRejectXML {
+        kBoincRejectMessage = 0,
+        kBoincRejectErrorNum,
+};
+
+static int boincProxyRejectXMLBegin(const char* elementName, const char** attr, void* userData)
+{
+        if (!strcmp(elementName, "message")) {
+                return kBoincRejectMessage;
+        }
+        if (!strcmp(elementName, "error_num")) {
+                return kBoincRejectErrorNum;
+        }
+        return -1;
+}
+
+static BoincError boincProxyRejectXMLEnd(int index, const char* elementValue, void* userData)
+{
+        // The scheduler only tells of an unknown authenticator by its
+        // message. The other RPCs of the project give ERR_DB_NOT_FOUND.
+        if ((index == kBoincRejectMessage) && !strncmp(elementValue, REJECTED_AUTHENTICATOR, strlen(REJECTED_AUTHENTICATOR))) {
+                *((int*) userData) = 1;
+        }
+        if ((index == kBoincRejectErrorNum) && (atoi(elementValue) == ERR_DB_NOT_FOUND)) {
+                *((int*) userData) = 1;
+        }
+        return NULL;
+}
+
+/**
+ * Check the reply of the scheduler for a rejected authenticator
+ */
+BoincError boincProxyCheckReply(BoincProxy * proxy, const char * data, size_t size)
+{
+        int rejected = 0;
+
+        BoincError err = boincXMLParseBuffer(data, size, boincProxyRejectXMLBegin, boincProxyRejectXMLEnd, &rejected);
+        if (err) {
+                return err;
+        }
+        if (rejected) {
+                boincProxyForgetCredential(proxy, kBoincUserAuthenticator);
+                return boincErrorCreate(kBoincError, kBoincAuthentication, "The project rejected the authenticator");
+        }
+        return NULL;
+}
+
+/**
+ * Check a failed scheduler request for a scheduler URL that moved
+ */
+static BoincError boincProxyCheckPostError(BoincProxy * proxy, BoincError err)
+{
+        if ((boincErrorCode(err) == 404) || (boincErrorCode(err) == 410)) {
+                boincProxyForgetCredential(proxy, kBoincCGIURL);
+        }
+        return err;
+}
+
 BoincError boincProxyInit(BoincProxy * proxy) 
 {
         BoincError err = boincHttpInit();
@@ -205,24 +806,63 @@ BoincError boincProxyInit(BoincProxy * proxy)
 
         boincDebugf("boincProxyCreate path: %s/%s", s_url.urlbase, s_url.urlpath);
 
-        char projectFile[BUFF_SIZE];
-        boincProxyGetAbsolutePathFromProxy(proxy, "project.xml", projectFile, BUFF_SIZE);
-
-        err = boincProxyGet(proxy, &s_url, projectFile);
+        // Keep the last good configuration until the new one is read
+        BoincProxyReply reply = { NULL, 0 };
+        err = boincProxyGet(proxy, &s_url, &reply);
         if (err) {
                 return err;
         }
 
-        err = boincConfigurationUpdateFromFile(proxy->conf, projectFile);
+        err = boincConfigurationUpdateFromBuffer(proxy->conf, reply.data, reply.size);
+        if (err == NULL) {
+                char projectFile[BUFF_SIZE];
+                boincProxyGetAbsolutePathFromProxy(proxy, "project.xml", projectFile, BUFF_SIZE);
+                err = boincProxyStoreReply(projectFile, &reply);
+        }
+        boincFree(reply.data);
         if (err) {
                 return err;
         }
-        return NULL;
+
+        return boincProxyStoreCredentials(proxy);
+}
+
+BoincError boincProxyLoadProjectConfig(BoincProxy * proxy)
+{
+        char projectFile[BUFF_SIZE];
+        boincProxyGetAbsolutePathFromProxy(proxy, "project.xml", projectFile, BUFF_SIZE);
+
+        struct stat buffer;
+        if (stat(projectFile, &buffer)) {
+                return boincErrorCreatef(kBoincError, kBoincFileSystem, "No project configuration in %s", projectFile);
+        }
+
+        return boincConfigurationUpdateFromFile(proxy->conf, projectFile);
 }
 
 void boincProxyDestroy(BoincProxy* proxy) 
 {  
-        boincHttpCleanup();
+        boincProxyCancelTransfers(proxy);
+
+        // The connections stay open for the next proxy, and the TLS
+        // sessions are kept for the next run
+        char sessionFile[BUFF_SIZE];
+        boincProxyGetSessionFile(proxy, sessionFile);
+        BoincError err = boincHttpStoreSessions(sessionFile);
+        if (err) {
+                boincLogError(err);
+                boincErrorDestroy(err);
+        }
+        unsigned int proxies;
+        do {
+                proxies = boincAtomicLoad(&boincProxyCount);
+        } while (!boincAtomicCompareAndSwap(&boincProxyCount, proxies, proxies - 1));
+        boincProxyDestroyAborts(proxy->aborts);
+        while (proxy->mirrors) {
+                BoincProxyMirror * next = proxy->mirrors->next;
+                boincFree(proxy->mirrors);
+                proxy->mirrors = next;
+        }
         boincFree(proxy);
         proxy = NULL;
 }
@@ -280,10 +920,8 @@ BoincError boincProxyAuthenticate(BoincProxy* proxy)
 
         BoincProxyUrl url = { projectURL, accountPath, 4, args };
 
-        char xmlFile[BUFF_SIZE];
-        boincProxyGetAbsolutePathFromProxy(proxy, "auth.xml", xmlFile, BUFF_SIZE);
-
-        BoincError err = boincProxyGet(proxy, &url, xmlFile);
+        BoincProxyReply reply = { NULL, 0 };
+        BoincError err = boincProxyGet(proxy, &url, &reply);
         if (err) {
                 return err;
         }
@@ -291,7 +929,8 @@ BoincError boincProxyAuthenticate(BoincProxy* proxy)
         // Check for the authenticator in response
         char* authenticator = NULL;
         
-        err = boincXMLParse(xmlFile, boincProxyAuthXMLBegin, boincProxyAuthXMLEnd, &authenticator);
+        err = boincXMLParseBuffer(reply.data, reply.size, boincProxyAuthXMLBegin, boincProxyAuthXMLEnd, &authenticator);
+        boincFree(reply.data);
         if (err) {
                 return err;
         }
@@ -304,6 +943,11 @@ BoincError boincProxyAuthenticate(BoincProxy* proxy)
         }
         free(authenticator);
 
+        err = boincProxyStoreCredentials(proxy);
+        if (err) {
+                return err;
+        }
+
         // Store the configuration
         return boincConfigurationStore(proxy->conf);
 }
@@ -321,10 +965,8 @@ BoincError boincProxyChangeAuthentication(BoincProxy* proxy,
 
         BoincProxyUrl url = { projectURL, accountPath, 4, args };
 
-        char xmlFile[BUFF_SIZE];
-        boincProxyGetAbsolutePathFromProxy(proxy, "auth.xml", xmlFile, BUFF_SIZE);
-
-        BoincError err = boincProxyGet(proxy, &url, xmlFile);
+        BoincProxyReply reply = { NULL, 0 };
+        BoincError err = boincProxyGet(proxy, &url, &reply);
         if (err) {
                 return err;
         }
@@ -332,7 +974,8 @@ BoincError boincProxyChangeAuthentication(BoincProxy* proxy,
         // Check for the authenticator in response
         char* authenticator = NULL;
         
-        err = boincXMLParse(xmlFile, boincProxyAuthXMLBegin, boincProxyAuthXMLEnd, &authenticator);
+        err = boincXMLParseBuffer(reply.data, reply.size, boincProxyAuthXMLBegin, boincProxyAuthXMLEnd, &authenticator);
+        boincFree(reply.data);
         if (err) {
                 return err;
         }
@@ -349,6 +992,9 @@ BoincError boincProxyChangeAuthentication(BoincProxy* proxy,
         err = boincConfigurationSetString(proxy->conf, kBoincUserPassword, passwordHash);
         if (err) return err;
 
+        err = boincProxyStoreCredentials(proxy);
+        if (err) return err;
+
         // Store the configuration
         return boincConfigurationStore(proxy->conf);
 }
@@ -580,11 +1226,26 @@ static BoincError boincProxyWUXMLEnd(int index, const char* elementValue, void*
                 break ;
         case kBoincWUFileinfoUrl:
                 boincDebugf("Url for %s: %s", wu->globalFileInfo->name, elementValue);
-                wu->globalFileInfo->url = boincArray(char, strlen(elementValue)+1);
-                if (wu->globalFileInfo->url == NULL) {
-                        return boincErrorCreate(kBoincFatal, kBoincSystem, "Out of memory");
+                {
+                        BoincFileInfo * fi = wu->globalFileInfo;
+                        char ** urls = boincArray(char*, fi->nbUrls + 1);
+                        if (urls == NULL) {
+                                return boincErrorCreate(kBoincFatal, kBoincSystem, "Out of memory");
+                        }
+                        urls[fi->nbUrls] = boincArray(char, strlen(elementValue)+1);
+                        if (urls[fi->nbUrls] == NULL) {
+                                boincFree(urls);
+                                return boincErrorCreate(kBoincFatal, kBoincSystem, "Out of memory");
+                        }
+                        strcpy(urls[fi->nbUrls], elementValue);
+                        if (fi->nbUrls > 0) {
+                                memcpy(urls, fi->urls, fi->nbUrls * sizeof(char*));
+                        }
+                        boincFree(fi->urls);
+                        fi->urls = urls;
+                        fi->nbUrls++;
+                        fi->url = urls[0];
                 }
-                strcpy(wu->globalFileInfo->url, elementValue);
                 break ;
         case kBoincWUFileinfoFilsignature:
                 boincDebugf("Signature for %s", wu->globalFileInfo->name);
@@ -659,16 +1320,81 @@ static BoincError boincProxyWUXMLEnd(int index, const char* elementValue, void*
 }
 
 
+enum BoincAbortXML {
+        kBoincAbortXMLName = 1,
+        kBoincAbortXMLNameIfNotStarted,
+};
+
+static int boincProxyAbortXMLBegin(const char* elementName, const char** attr, void* userData)
+{
+        if (!strcmp(elementName, "result_abort>name")) {
+                return kBoincAbortXMLName;
+        }
+        if (!strcmp(elementName, "result_abort_if_not_started>name")) {
+                return kBoincAbortXMLNameIfNotStarted;
+        }
+        return -1;
+}
+
+static BoincError boincProxyAbortXMLEnd(int index, const char* elementValue, void* userData)
+{
+        BoincProxy * proxy = (BoincProxy*) userData;
+
+        BoincProxyAbort * abort = boincNew(BoincProxyAbort);
+        if (abort == NULL) {
+                return boincErrorCreate(kBoincFatal, kBoincSystem, "Out of memory");
+        }
+        abort->resultName = boincArray(char, strlen(elementValue) + 1);
+        if (abort->resultName == NULL) {
+                boincFree(abort);
+                return boincErrorCreate(kBoincFatal, kBoincSystem, "Out of memory");
+        }
+        strcpy(abort->resultName, elementValue);
+        abort->ifNotStarted = (index == kBoincAbortXMLNameIfNotStarted);
+
+        boincDebugf("Result abort from the server: %s%s", elementValue, 
+                    abort->ifNotStarted ? " (if not started)" : "");
+
+        abort->next = proxy->aborts;
+        proxy->aborts = abort;
+        return NULL;
+}
+
+/**
+ * Collect the result aborts of a scheduler reply
+ */
+static BoincError boincProxyParseAborts(BoincProxy * proxy, BoincProxyReply * reply)
+{
+        return boincXMLParseBuffer(reply->data, reply->size, boincProxyAbortXMLBegin, boincProxyAbortXMLEnd, (void*) proxy);
+}
+
+BoincProxyAbort* boincProxyTakeAborts(BoincProxy * proxy)
+{
+        BoincProxyAbort * aborts = proxy->aborts;
+        proxy->aborts = NULL;
+        return aborts;
+}
+
+void boincProxyDestroyAborts(BoincProxyAbort * aborts)
+{
+        while (aborts != NULL) {
+                BoincProxyAbort * next = aborts->next;
+                boincFree(aborts->resultName);
+                boincFree(aborts);
+                aborts = next;
+        }
+}
+
 static char * boincGetRequestWorkFile(BoincWorkUnit * wu, char* xmlFileRes)
 {
         return boincGetAbsolutePath(wu->workingDir, "workResponse.xml", xmlFileRes, BUFF_SIZE);
 }
 
-BoincError boincProxyLoadWorkUnit(BoincWorkUnit* wu)
+/**
+ * A reply without files asks to come back later
+ */
+static BoincError boincProxyCheckWorkUnit(BoincWorkUnit* wu, BoincError err)
 {
-        char xmlFileres[BUFF_SIZE];
-
-        BoincError err = boincXMLParse(boincGetRequestWorkFile(wu, xmlFileres), boincProxyWUXMLBegin, boincProxyWUXMLEnd, (void*) wu);
         if (!err && !wu->globalFileInfo && wu->delay) {
                 return boincErrorCreateWithDelay(kBoincServer, "Empty work unit", wu->delay);
         }
@@ -676,13 +1402,26 @@ BoincError boincProxyLoadWorkUnit(BoincWorkUnit* wu)
         return err;
 }
 
+BoincError boincProxyLoadWorkUnit(BoincWorkUnit* wu)
+{
+        char xmlFileres[BUFF_SIZE];
 
-BoincError boinProxyWorkUnitExecuted(BoincProxyWorkUnit * pwu, unsigned int error)
+        BoincError err = boincXMLParse(boincGetRequestWorkFile(wu, xmlFileres), boincProxyWUXMLBegin, boincProxyWUXMLEnd, (void*) wu);
+        return boincProxyCheckWorkUnit(wu, err);
+}
+
+
+BoincError boincProxyReportResults(BoincProxy * proxy, BoincWorkUnit ** wus, int count, unsigned int error)
 {
         char* createFile = "resultRequest.xml";
         char filepath[BUFF_SIZE];
 
-        initFilename(filepath, BUFF_SIZE, pwu->wu->workingDir);
+        BoincError err = boincProxyCheckCredentials(proxy);
+        if (err) {
+                return err;
+        }
+
+        initFilename(filepath, BUFF_SIZE, wus[0]->workingDir);
         if (appendFilename(filepath, BUFF_SIZE, createFile) == NULL) {
                 return boincErrorCreate(kBoincError, kBoincFileSystem, "File path too long");
         }
@@ -692,8 +1431,6 @@ BoincError boinProxyWorkUnitExecuted(BoincProxyWorkUnit * pwu, unsigned int erro
                 return boincErrorCreatef(kBoincError, kBoincFileSystem, "Cannot open file %s", filepath);
         }
 
-        BoincProxy * proxy = pwu->proxy;
-
         char strBuff[BUFF_SIZE];
         fprintf(file, "<scheduler_request>\n");
         fprintf(file, "<authenticator>%s</authenticator>\n", 
@@ -711,18 +1448,27 @@ BoincError boinProxyWorkUnitExecuted(BoincProxyWorkUnit * pwu, unsigned int erro
         fprintf(file, "<duration_correction_factor>1.000000</duration_correction_factor>\n");
         fprintf(file, "<client_cap_plan_class>1</client_cap_plan_class>\n");
         fprintf(file, "<platform_name>%s</platform_name>\n", boincConfigurationGetString(proxy->conf, kBoincPlatformName, strBuff, BUFF_SIZE));
-        printf("%s %s\n", pwu->wu->name, pwu->wu->result->name);
-        fprintf(file, "<result>\n");
-        fprintf(file, "    <name>%s</name>\n", pwu->wu->result->name);
-        fprintf(file, "    <final_cpu_time>%u.000000</final_cpu_time>\n", pwu->wu->result->cpu_time);
-        fprintf(file, "    <exit_status>%u</exit_status>\n", error);
-        fprintf(file, "    <state>%u</state>\n", (error) ? 3 : 5);
-        fprintf(file, "    <platform>%s</platform>\n",boincConfigurationGetString(proxy->conf, kBoincPlatformName, strBuff, BUFF_SIZE));
-        fprintf(file, "    <version_num>%s</version_num>\n", pwu->wu->app->version);
-        fprintf(file, "    <app_version_num>%s</app_version_num>\n", pwu->wu->app->version);
-        fprintf(file, "    <stderr_out>\n");
-        fprintf(file, "    </stderr_out>\n");
-        fprintf(file, "</result>\n");  
+        for (int i = 0; i < count; i++) {
+                BoincWorkUnit * wu = wus[i];
+                unsigned int state = 5;
+                if ((error == kBoincExitAborted) || (error == kBoincExitAbortedByProject)) {
+                        state = 6;
+                } else if (error) {
+                        state = 3;
+                }
+                printf("%s %s\n", wu->name, wu->result->name);
+                fprintf(file, "<result>\n");
+                fprintf(file, "    <name>%s</name>\n", wu->result->name);
+                fprintf(file, "    <final_cpu_time>%u.000000</final_cpu_time>\n", wu->result->cpu_time);
+                fprintf(file, "    <exit_status>%u</exit_status>\n", error);
+                fprintf(file, "    <state>%u</state>\n", state);
+                fprintf(file, "    <platform>%s</platform>\n",boincConfigurationGetString(proxy->conf, kBoincPlatformName, strBuff, BUFF_SIZE));
+                fprintf(file, "    <version_num>%s</version_num>\n", wu->app->version);
+                fprintf(file, "    <app_version_num>%s</app_version_num>\n", wu->app->version);
+                fprintf(file, "    <stderr_out>\n");
+                fprintf(file, "    </stderr_out>\n");
+                fprintf(file, "</result>\n");  
+        }
         fprintf(file, "<other_results>\n");
         fprintf(file, "</other_results>\n");
         fprintf(file, "<in_progress_results>\n");
@@ -730,34 +1476,54 @@ BoincError boinProxyWorkUnitExecuted(BoincProxyWorkUnit * pwu, unsigned int erro
         fprintf(file, "</scheduler_request>\n");
         boincFclose(file);
 
-        boincDebugf("boinProxyWorkUnitExecuted: data writen in %s", filepath);
+        boincDebugf("boincProxyReportResults: %d result(s) writen in %s", count, filepath);
 
         BoincProxyUrl url = {boincConfigurationGetString(proxy->conf, kBoincCGIURL, strBuff, BUFF_SIZE),
                              "", 0, NULL};
-        char * files[] = {filepath};
-        BoincProxyPostData post = { NULL, 1,  files, 0, NULL, 0, 0 };
-
-        char xmlFileres[BUFF_SIZE];
-        BoincError err = boincProxyPost(proxy, &url, &post, boincGetAbsolutePath(pwu->wu->workingDir, "resultResponse.xml", xmlFileres, BUFF_SIZE));
+        BoincProxyReply reply = { NULL, 0 };
+        err = boincProxyPostRequest(proxy, &url, filepath, &reply);
 
         if (err) {
                 boincLogError(err);
+                return boincProxyCheckPostError(proxy, err);
+        }
+
+        err = boincProxyCheckReply(proxy, reply.data, reply.size);
+        if (err) {
+                boincFree(reply.data);
                 return err;
         }
   
-        err = boincConfigurationUpdateFromFile(proxy->conf, xmlFileres);
+        err = boincConfigurationUpdateFromBuffer(proxy->conf, reply.data, reply.size);
         if (err) {
                 boincErrorDestroy(err); // if the update failed, don't stop
                 err = NULL;
         }
+
+        err = boincProxyParseAborts(proxy, &reply);
+        if (err) {
+                boincLogError(err);
+                boincErrorDestroy(err);
+        }
+        boincFree(reply.data);
         return NULL;
 }
 
+BoincError boinProxyWorkUnitExecuted(BoincProxyWorkUnit * pwu, unsigned int error)
+{
+        return boincProxyReportResults(pwu->proxy, &pwu->wu, 1, error);
+}
+
 BoincError boincProxyRequestWork(BoincProxyWorkUnit * pwu) 
 {
         char* createFile = "workRequest.xml";
         char filepath[BUFF_SIZE];
 
+        BoincError err = boincProxyCheckCredentials(pwu->proxy);
+        if (err) {
+                return err;
+        }
+
         initFilename(filepath, BUFF_SIZE, pwu->wu->workingDir);
         if (appendFilename(filepath, BUFF_SIZE, createFile) == NULL) {
                 return boincErrorCreate(kBoincError, kBoincFileSystem, "File path too long");
@@ -779,7 +1545,12 @@ BoincError boincProxyRequestWork(BoincProxyWorkUnit * pwu)
         fprintf(file, "<core_client_major_version>6</core_client_major_version>\n"); //1
         fprintf(file, "<core_client_minor_version>2</core_client_minor_version>\n"); //1
         fprintf(file, "<core_client_release>19</core_client_release>\n");            //1
-        fprintf(file, "<work_req_seconds>1.000000</work_req_seconds>\n");
+        // Sized by the scheduler to fill its prefetch buffer
+        double workRequest = 1.0;
+        if (boincConfigurationHasParameter(proxy->conf, kBoincSchedulerWorkRequest)) {
+                workRequest = boincConfigurationGetNumber(proxy->conf, kBoincSchedulerWorkRequest);
+        }
+        fprintf(file, "<work_req_seconds>%f</work_req_seconds>\n", workRequest);
         fprintf(file, "<resource_share_fraction>1.000000</resource_share_fraction>\n");
         fprintf(file, "<rrs_fraction>1.000000</rrs_fraction>\n");
         fprintf(file, "<prrs_fraction>1.000000</prrs_fraction>\n");
@@ -810,8 +1581,10 @@ BoincError boincProxyRequestWork(BoincProxyWorkUnit * pwu)
         fprintf(file, "<ram_max_used_busy_pct>50.000000</ram_max_used_busy_pct>\n");
         fprintf(file, "<ram_max_used_idle_pct>90.000000</ram_max_used_idle_pct>\n");
         fprintf(file, "<idle_time_to_run>3.000000</idle_time_to_run>\n");
-        fprintf(file, "<max_bytes_sec_up>0.000000</max_bytes_sec_up>\n");
-        fprintf(file, "<max_bytes_sec_down>0.000000</max_bytes_sec_down>\n");
+        fprintf(file, "<max_bytes_sec_up>%d.000000</max_bytes_sec_up>\n",
+                boincProxyGetSetting(proxy, kBoincNetworkMaxUpRate, 0));
+        fprintf(file, "<max_bytes_sec_down>%d.000000</max_bytes_sec_down>\n",
+                boincProxyGetSetting(proxy, kBoincNetworkMaxDownRate, 0));
         fprintf(file, "<cpu_usage_limit>100.000000</cpu_usage_limit>\n");
         fprintf(file, "</global_preferences>\n");
         fprintf(file, "</working_global_preferences>\n");
@@ -869,25 +1642,42 @@ BoincError boincProxyRequestWork(BoincProxyWorkUnit * pwu)
 
         BoincProxyUrl url = {boincConfigurationGetString(proxy->conf, kBoincCGIURL, strBuff, BUFF_SIZE),
                              "", 0, NULL};
-        char * files[] = {filepath};
-        BoincProxyPostData post = { NULL, 1,  files, 0, NULL, 0, 0 };
-
-        char xmlFileres[BUFF_SIZE];
-        BoincError err = boincProxyPost(proxy, &url, &post, boincGetRequestWorkFile(pwu->wu, xmlFileres));
+        BoincProxyReply reply = { NULL, 0 };
+        err = boincProxyPostRequest(proxy, &url, filepath, &reply);
 
         if (err) {
                 boincLogError(err);
+                return boincProxyCheckPostError(proxy, err);
+        }
+
+        // The workunit is loaded again from this reply after a restart
+        char xmlFileres[BUFF_SIZE];
+        err = boincProxyStoreReply(boincGetRequestWorkFile(pwu->wu, xmlFileres), &reply);
+        if (err == NULL) {
+                err = boincProxyCheckReply(proxy, reply.data, reply.size);
+        }
+        if (err) {
+                boincFree(reply.data);
                 return err;
         }
   
-        err = boincConfigurationUpdateFromFile(proxy->conf, xmlFileres);
+        err = boincConfigurationUpdateFromBuffer(proxy->conf, reply.data, reply.size);
         if (err) {
                 boincLogError(err);
                 boincErrorDestroy(err); // if the update failed, don't stop
                 err = NULL;
         }
 
-        err = boincProxyLoadWorkUnit(pwu->wu);
+        err = boincProxyParseAborts(proxy, &reply);
+        if (err) {
+                boincLogError(err);
+                boincErrorDestroy(err);
+                err = NULL;
+        }
+
+        err = boincXMLParseBuffer(reply.data, reply.size, boincProxyWUXMLBegin, boincProxyWUXMLEnd, (void*) pwu->wu);
+        boincFree(reply.data);
+        err = boincProxyCheckWorkUnit(pwu->wu, err);
         if (err) {
                 return err;
         }
@@ -895,38 +1685,97 @@ BoincError boincProxyRequestWork(BoincProxyWorkUnit * pwu)
         return NULL;
 }
 
+typedef struct _BoincProxyUploadReply {
+        int status;
+        double fileSize;        // -1 if the reply has none
+} BoincProxyUploadReply;
+
 static int boincProxyUploadXMLBegin(const char* elementName, const char** attr, void* userData) 
 {
         if (!strcmp(elementName, "status"))
                 return 2;
         if (!strcmp(elementName, "message"))
                 return 3;
+        if (!strcmp(elementName, "file_size"))
+                return 4;
         return -1;
 }
 
 static BoincError boincProxyUploadXMLEnd(int index, const char* elementValue, void* userData)
 {
-        int * status = (int*) userData;
+        BoincProxyUploadReply * reply = (BoincProxyUploadReply*) userData;
         if (index == 2) {
                 boincDebugf("Upload set status: %s", elementValue);
-                *status = atoi(elementValue);
+                reply->status = atoi(elementValue);
         }
-        if (index == 3 && *status != 0) {
+        if (index == 3 && reply->status != 0) {
                 boincDebugf("Upload set message: %s", elementValue);
-                return boincErrorCreate(kBoincError, *status, elementValue);
+                return boincErrorCreate(kBoincError, reply->status, elementValue);
+        }
+        if (index == 4) {
+                boincDebugf("Upload set file size: %s", elementValue);
+                char * end;
+                double size = strtod(elementValue, &end);
+                // A garbled size is left out: the file is sent again
+                if ((end != elementValue) && (*end == '\0') && (size >= 0)) {
+                        reply->fileSize = size;
+                }
         }
         return NULL;
 }
 
-BoincError boincProxyUploadFile(BoincProxyWorkUnit * pwu, BoincFileInfo* fileinfo, int filenum, int filetotal)
+/**
+ * Whether the data server is asked for the part of a file it has
+ * before the upload. A small file is sent again rather than asking,
+ * which costs a round trip as well.
+ */
+int boincProxyResumesUpload(unsigned int nBytes)
+{
+        return (nBytes >= UPLOAD_RESUME_SIZE);
+}
+
+/**
+ * Read the offset to resume an upload of nBytes from, in the reply of
+ * the data server to get_file_size
+ */
+BoincError boincProxyParseUploadOffset(const char * data, size_t size, unsigned int nBytes, unsigned int * offset)
+{
+        BoincProxyUploadReply reply = { 0, -1 };
+
+        *offset = 0;
+
+        BoincError err = boincXMLParseBuffer(data, size, boincProxyUploadXMLBegin, boincProxyUploadXMLEnd, &reply);
+        if (err)
+                return err;
+
+        // A copy longer than the file is not ours: send it all again
+        if ((reply.fileSize > 0) && (reply.fileSize <= nBytes)) {
+                *offset = (unsigned int) reply.fileSize;
+        }
+
+        return NULL;
+}
+
+/**
+ * Ask the data server how much of a file it already has
+ *
+ * \return the offset to resume the upload from, zero to send it all
+ */
+static BoincError boincProxyGetUploadOffset(BoincProxyWorkUnit * pwu, BoincProxyUrl * url, 
+                                            BoincFileInfo* fileinfo, unsigned int * offset)
 {
         BoincWorkUnit * wu = pwu->wu;
 
-        BoincProxyUrl url = {fileinfo->url, "", 0, NULL};
+        *offset = 0;
 
         char preuploadHeaderFile[BUFF_SIZE];
         boincGetAbsolutePath(wu->workingDir, "preuploadHeader.xml", preuploadHeaderFile, BUFF_SIZE);
         FILE * file = boincFopen(preuploadHeaderFile, "w+");
+        if (file == NULL) {
+                return boincErrorCreatef(kBoincError, kBoincFileSystem, 
+                                         "cannot create/open xml data file %s", 
+                                         preuploadHeaderFile);
+        }
         fprintf(file, "<data_server_request>\n");
         fprintf(file, "    <core_client_major_version>6</core_client_major_version>\n");
         fprintf(file, "    <core_client_minor_version>2</core_client_minor_version>\n");
@@ -936,14 +1785,29 @@ BoincError boincProxyUploadFile(BoincProxyWorkUnit * pwu, BoincFileInfo* fileinf
         boincFclose(file);
 
         char * prefiles[] = {preuploadHeaderFile};
-        BoincProxyPostData prepost = { pwu, 1,  prefiles, 0, NULL, 0, 0 };
-        char preuploadResult[BUFF_SIZE];
-        boincGetAbsolutePath(wu->workingDir, "preuploadResponse.xml", preuploadResult, BUFF_SIZE);
-        BoincError err = boincProxyPost(pwu->proxy, &url, &prepost, preuploadResult);
+        BoincProxyPostData prepost = { NULL, 1,  prefiles, 0, NULL, 0, 0 };
+        BoincProxyReply preuploadResult = { NULL, 0 };
+        BoincError err = boincProxyPost(pwu->proxy, url, &prepost, NULL, &preuploadResult);
 
         if (err)
                 return err;
 
+        err = boincProxyParseUploadOffset(preuploadResult.data, preuploadResult.size, fileinfo->nBytes, offset);
+        boincFree(preuploadResult.data);
+        if ((err == NULL) && (*offset > 0)) {
+                boincDebugf("Upload of %s resumes at byte %u", fileinfo->name, *offset);
+        }
+
+        return err;
+}
+
+BoincError boincProxyUploadFile(BoincProxyWorkUnit * pwu, BoincFileInfo* fileinfo, int filenum, int filetotal)
+{
+        BoincWorkUnit * wu = pwu->wu;
+
+        BoincProxyUrl url = {fileinfo->url, "", 0, NULL};
+        BoincError err;
+
         char uploadData[BUFF_SIZE];
         boincWorkUnitGetPath(wu, fileinfo, uploadData, BUFF_SIZE);
 
@@ -961,10 +1825,17 @@ BoincError boincProxyUploadFile(BoincProxyWorkUnit * pwu, BoincFileInfo* fileinf
         }
         boincHashMd5File(uploadData, fileinfo->checksum);
 
+        unsigned int offset = 0;
+        if (boincProxyResumesUpload(fileinfo->nBytes)) {
+                err = boincProxyGetUploadOffset(pwu, &url, fileinfo, &offset);
+                if (err)
+                        return err;
+        }
+
         char uploadHeaderFile[BUFF_SIZE];
         boincGetAbsolutePath(wu->workingDir, "uploadHeader.xml", 
                              uploadHeaderFile, BUFF_SIZE);
-        file = boincFopen(uploadHeaderFile, "w+");
+        FILE * file = boincFopen(uploadHeaderFile, "w+");
 
         if (file == NULL) {
                 return boincErrorCreatef(kBoincError, kBoincFileSystem, 
@@ -988,23 +1859,22 @@ BoincError boincProxyUploadFile(BoincProxyWorkUnit * pwu, BoincFileInfo* fileinf
         fprintf(file, "</file_info>\n");
         fprintf(file, "<nbytes>%d</nbytes>\n", fileinfo->nBytes);
         fprintf(file, "<md5_cksum>%s</md5_cksum>\n", fileinfo->checksum);
-        fprintf(file, "<offset>0</offset>\n");
+        fprintf(file, "<offset>%u</offset>\n", offset);
         fprintf(file, "<data>\n");
         boincFclose(file);
 
         char * files[] = {uploadHeaderFile, uploadData};
-        BoincProxyPostData post = { pwu, 2,  files, 0, NULL, 0, 0 };
-
-        char uploadResult[BUFF_SIZE];
-        boincGetAbsolutePath(wu->workingDir, "uploadResponse.xml", uploadResult, BUFF_SIZE);
+        BoincProxyPostData post = { pwu, 2,  files, 0, NULL, 0, 0, offset };
 
-        err = boincProxyPost(pwu->proxy, &url, &post, uploadResult);
+        BoincProxyReply uploadResult = { NULL, 0 };
+        err = boincProxyPost(pwu->proxy, &url, &post, NULL, &uploadResult);
 
         if (err)
                 return err;
 
-        int status = 0;
-        err = boincXMLParse(uploadResult, boincProxyUploadXMLBegin, boincProxyUploadXMLEnd, &status);
+        BoincProxyUploadReply reply = { 0, -1 };
+        err = boincXMLParseBuffer(uploadResult.data, uploadResult.size, boincProxyUploadXMLBegin, boincProxyUploadXMLEnd, &reply);
+        boincFree(uploadResult.data);
         return err;
 }
 
@@ -1020,10 +1890,142 @@ BoincError boincProxyChangeWorkUnitProgress(BoincProxyWorkUnit* pwu, float progr
         return NULL;
 }
 
-BoincError boincProxyDownloadFile(BoincProxyWorkUnit* pwu, BoincFileInfo* file, int filenum, int filetotal) 
+static BoincProxyMirror * boincProxyGetMirror(BoincProxy * proxy, const char * url)
+{
+        char host[BUFF_SIZE];
+        const char * start = strstr(url, "://");
+        start = start? start + 3 : url;
+        size_t len = start - url + strcspn(start, "/");
+        if (len >= BUFF_SIZE) {
+                len = BUFF_SIZE - 1;
+        }
+        memcpy(host, url, len);
+        host[len] = 0;
+
+        BoincProxyMirror * mirror;
+        for (mirror = proxy->mirrors; mirror; mirror = mirror->next) {
+                if (!strcmp(mirror->host, host)) {
+                        return mirror;
+                }
+        }
+        mirror = boincNew(BoincProxyMirror);
+        if (mirror == NULL) {
+                return NULL;
+        }
+        strcpy(mirror->host, host);
+        mirror->next = proxy->mirrors;
+        proxy->mirrors = mirror;
+        return mirror;
+}
+
+void boincProxyMirrorSucceeded(BoincProxy * proxy, const char * url, const BoincHttpStats * stats)
+{
+        BoincProxyMirror * mirror = boincProxyGetMirror(proxy, url);
+        if (mirror == NULL) {
+                return;
+        }
+        mirror->failures = 0;
+        mirror->retry = 0;
+        if ((stats == NULL) || (stats->rate <= 0)) {
+                return;
+        }
+        if (mirror->rate <= 0) {
+                mirror->latency = stats->latency;
+                mirror->rate = stats->rate;
+        } else {
+                mirror->latency = 0.7 * mirror->latency + 0.3 * stats->latency;
+                mirror->rate = 0.7 * mirror->rate + 0.3 * stats->rate;
+        }
+}
+
+/**
+ * Put a mirror last for a while, returns the delay in seconds
+ */
+int boincProxyMirrorFailed(BoincProxy * proxy, const char * url)
+{
+        BoincProxyMirror * mirror = boincProxyGetMirror(proxy, url);
+        if (mirror == NULL) {
+                return 0;
+        }
+        int delay = MIRROR_RETRY_DELAY;
+        for (int i = 0; (i < mirror->failures) && (delay < MIRROR_MAX_DELAY); i++) {
+                delay *= 2;
+        }
+        if (delay > MIRROR_MAX_DELAY) {
+                delay = MIRROR_MAX_DELAY;
+        }
+        mirror->failures++;
+        mirror->retry = time(NULL) + delay;
+        boincLogf(kBoincInfo, kBoincNetwork, "Data server %s failed, tried last for %d seconds", mirror->host, delay);
+        return delay;
+}
+
+static int boincProxyCompareCosts(const void * a, const void * b)
+{
+        double x = *(const double *) a, y = *(const double *) b;
+        return (x > y) - (x < y);
+}
+
+/**
+ * Sort the urls of a file, the best first, in an array to be freed
+ * with boincFree. A mirror not measured yet costs as much as the
+ * median of the measured ones, so it is neither always tried first
+ * nor never tried.
+ */
+BoincError boincProxyRankUrls(BoincProxy * proxy, BoincFileInfo * file, char *** ranked)
+{
+        time_t now = time(NULL);
+        char ** urls = boincArray(char*, file->nbUrls);
+        double * costs = boincArray(double, file->nbUrls);
+        double * measured = boincArray(double, file->nbUrls);
+        if ((urls == NULL) || (costs == NULL) || (measured == NULL)) {
+                boincFree(urls);
+                boincFree(costs);
+                boincFree(measured);
+                return boincErrorCreate(kBoincFatal, kBoincSystem, "Out of memory");
+        }
+
+        // The cost of each mirror, -1 if not measured
+        int nbMeasured = 0;
+        for (int i = 0; i < file->nbUrls; i++) {
+                BoincProxyMirror * mirror = boincProxyGetMirror(proxy, file->urls[i]);
+                costs[i] = -1;
+                if ((mirror != NULL) && (mirror->retry > now)) {
+                        costs[i] = 1e12 + (mirror->retry - now);
+                } else if ((mirror != NULL) && (mirror->rate > 0)) {
+                        costs[i] = mirror->latency + file->nBytes / mirror->rate;
+                        measured[nbMeasured++] = costs[i];
+                }
+        }
+        double median = 0;
+        if (nbMeasured > 0) {
+                qsort(measured, nbMeasured, sizeof(double), boincProxyCompareCosts);
+                median = (nbMeasured % 2)? measured[nbMeasured / 2]
+                        : (measured[nbMeasured / 2 - 1] + measured[nbMeasured / 2]) / 2;
+        }
+        boincFree(measured);
+
+        for (int i = 0; i < file->nbUrls; i++) {
+                double cost = (costs[i] < 0)? median : costs[i];
+                // Insertion sort, stable to keep the order of the project
+                int j = i;
+                for (; (j > 0) && (costs[j - 1] > cost); j--) {
+                        urls[j] = urls[j - 1];
+                        costs[j] = costs[j - 1];
+                }
+                urls[j] = file->urls[i];
+                costs[j] = cost;
+        }
+
+        boincFree(costs);
+        *ranked = urls;
+        return NULL;
+}
+
+static BoincError boincProxyGetDownloadPath(BoincProxyWorkUnit* pwu, BoincFileInfo* file, char * fullpath)
 {
         char * filename;
-        if (!file->url || !strlen(file->url))
+        if ((file->nbUrls == 0) || !strlen(file->urls[0]))
                 return boincErrorCreate(kBoincError, kBoincInternal, "no url provided");
 
         if (file->openname && strlen(file->openname) ) {
@@ -1032,27 +2034,170 @@ BoincError boincProxyDownloadFile(BoincProxyWorkUnit* pwu, BoincFileInfo* file,
                 filename = file->name;
         }
 
-        char fullpath[BUFF_SIZE];
         boincGetAbsolutePath(pwu->wu->workingDir, filename, fullpath, BUFF_SIZE);
   
         boincDebugf("wd: %s ; fn: %s => %s", pwu->wu->workingDir, filename, fullpath);
 
-        BoincProxyUrl url = {file->url, "", 0, NULL};
-		
-        if (filetotal < 1) {
-                filetotal = 1;
-        }
-        boincHttpSetProgressCallback((BoincHttpProgressCallback) boincProxyChangeWorkUnitProgress, pwu, filenum, filetotal);
-
-        BoincError err = boincProxyGet(pwu->proxy, &url, fullpath);
+        return NULL;
+}
 
+static void boincProxySetDownloadMode(BoincFileInfo* file, const char * fullpath)
+{
         mode_t mode = S_IWUSR | S_IRUSR;
         if ((file->flags & kBoincFileExecutable) || (file->flags & kBoincFileMainProgram)) {
                 boincDebugf("boincProxyDownloadFile: File executable !");
                 mode |= S_IXUSR;
         }
         chmod(fullpath, mode);
+}
+
+BoincError boincProxyDownloadFile(BoincProxyWorkUnit* pwu, BoincFileInfo* file, int filenum, int filetotal) 
+{
+        return boincProxyDownloadFiles(pwu, &file, 1, filenum, filetotal);
+}
+
+/**
+ * Called once the downloads of a workunit are all over
+ */
+static void boincProxyFetchEnd(BoincProxyFetch * fetch)
+{
+        for (int i = 0; i < fetch->count; i++) {
+                boincFree(fetch->downloads[i].urls);
+        }
+        boincFree(fetch->downloads);
+
+        if (fetch->done) {
+                fetch->done(fetch->userData, fetch->err);
+        } else {
+                boincErrorDestroy(fetch->err);
+        }
+        boincFree(fetch);
+}
+
+static void boincProxyDownloadDone(void * userData, BoincError err)
+{
+        BoincProxyDownload * download = (BoincProxyDownload *) userData;
+        BoincProxyFetch * fetch = download->fetch;
+        BoincProxy * proxy = fetch->pwu.proxy;
+        BoincFileInfo * file = download->file;
+
+        // A download cancelled says nothing of its mirror
+        if (proxy->transfers == NULL) {
+        } else if (err == NULL) {
+                BoincHttpStats stats;
+                boincHttpTransfersStats(proxy->transfers, &stats);
+                boincProxyMirrorSucceeded(proxy, download->urls[download->current], &stats);
+        } else {
+                boincProxyMirrorFailed(proxy, download->urls[download->current]);
+        }
+
+        // Move on to the next mirror, the other files go on meanwhile
+        while (err && (proxy->transfers != NULL) && (boincErrorType(err) != kBoincFatal) 
+               && (download->current + 1 < file->nbUrls)) {
+                boincLogError(err);
+                boincErrorDestroy(err);
+                download->current++;
+                err = boincHttpTransfersGet(proxy->transfers, download->urls[download->current], download->fullpath,
+                                            file->nBytes, file->checksum, boincProxyDownloadDone, download);
+                if (err == NULL) {
+                        return;
+                }
+        }
 
+        boincProxySetDownloadMode(download->file, download->fullpath);
+
+        // Keep the first error, the other files are still useful
+        if (err) {
+                if (fetch->err == NULL) 
+                        fetch->err = err;
+                else
+                        boincErrorDestroy(err);
+        } else {
+                // The checksum was checked as the file was written
+                if (download->file->checksum && strlen(download->file->checksum)) {
+                        download->file->flags |= kBoincFileVerified;
+                }
+                fetch->filesDone++;
+                boincProxyFetchProgress(fetch);
+        }
+
+        if (--fetch->pending == 0) {
+                boincProxyFetchEnd(fetch);
+        }
+}
+
+BoincError boincProxyStartDownloads(BoincProxyWorkUnit* pwu, BoincFileInfo** files, int count, int filesDone, int filesTotal,
+                                    BoincHttpDoneCallback done, void * userData)
+{
+        BoincProxy * proxy = pwu->proxy;
+
+        BoincHttpTransfers * transfers = boincProxyGetTransfers(proxy);
+        if (transfers == NULL) {
+                return boincErrorCreate(kBoincFatal, 0, "Cannot initialise HTTP layer");
+        }
+
+        BoincProxyFetch * fetch = boincNew(BoincProxyFetch);
+        BoincProxyDownload * downloads = boincArray(BoincProxyDownload, (count > 0)? count : 1);
+        if ((fetch == NULL) || (downloads == NULL)) {
+                boincFree(fetch);
+                boincFree(downloads);
+                return boincErrorCreate(kBoincFatal, kBoincSystem, "Out of memory");
+        }
+        fetch->pwu = *pwu;
+        fetch->downloads = downloads;
+        fetch->count = count;
+        fetch->filesBefore = filesDone;
+        fetch->filesDone = filesDone;
+        fetch->filesTotal = (filesTotal < 1)? 1 : filesTotal;
+        fetch->done = done;
+        fetch->userData = userData;
+        for (int i = 0; i < count; i++) {
+                fetch->expected += files[i]->nBytes;
+        }
+
+        // Held until all the downloads are queued, as the done
+        // callback of a file already there is called at once
+        fetch->pending = 1;
+        for (int i = 0; (i < count) && (fetch->err == NULL); i++) {
+                BoincProxyDownload * download = &downloads[i];
+                download->fetch = fetch;
+                download->file = files[i];
+
+                BoincError e = boincProxyGetDownloadPath(pwu, files[i], download->fullpath);
+                if (e == NULL) {
+                        e = boincProxyRankUrls(proxy, files[i], &download->urls);
+                }
+                if (e == NULL) {
+                        fetch->pending++;
+                        e = boincHttpTransfersGet(transfers, download->urls[0], download->fullpath, 
+                                                  files[i]->nBytes, files[i]->checksum,
+                                                  boincProxyDownloadDone, download);
+                        if (e != NULL) {
+                                fetch->pending--;
+                        }
+                }
+                if (e != NULL) {
+                        fetch->err = e;
+                }
+        }
+        if (--fetch->pending == 0) {
+                boincProxyFetchEnd(fetch);
+        }
+
+        return NULL;
+}
+
+BoincError boincProxyDownloadFiles(BoincProxyWorkUnit* pwu, BoincFileInfo** files, int count, int filesDone, int filesTotal)
+{
+        if (count == 0) {
+                return NULL;
+        }
+
+        BoincProxyWait wait = { 0, NULL, NULL };
+        BoincError err = boincProxyStartDownloads(pwu, files, count, filesDone, filesTotal, boincProxyWaitDone, &wait);
+        if (err == NULL) {
+                err = boincProxyWaitFor(pwu->proxy, &wait);
+        }
         return err;
 }
 
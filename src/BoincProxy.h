@@ -28,6 +28,7 @@
 #define __BoincProxy_H__
 
 #include "BoincLite.h"
+#include "BoincHttp.h"
 
 /* Forward declarations. */
 
@@ -39,6 +40,19 @@ typedef struct _BoincProxy BoincProxy;
 #define kBoincFileGenerated  2
 #define kBoincFileUpload     4
 #define kBoincFileMainProgram 8
+#define kBoincFileVerified   16  // found valid on disk or downloaded with a matching checksum
+
+/** Exit status of the results aborted by the client */
+#define kBoincExitAborted 194
+/** Exit status of the results aborted on request of the project */
+#define kBoincExitAbortedByProject 202
+
+/** A result the server asked to abort in a scheduler reply */
+typedef struct _BoincProxyAbort {
+  char* resultName;
+  int ifNotStarted;               // <result_abort_if_not_started>
+  struct _BoincProxyAbort* next;
+} BoincProxyAbort;
 
 
 
@@ -63,6 +77,21 @@ BoincProxy* boincProxyCreate(BoincConfiguration* configuration);
  */
 BoincError boincProxyInit(BoincProxy * proxy) ;
 
+/** \brief Apply the project configuration kept by the last successful boincProxyInit
+ *
+ * Lets a restart work without the server. Fails if there is none.
+ */
+BoincError boincProxyLoadProjectConfig(BoincProxy * proxy);
+
+/** \brief Apply the authenticator and the scheduler URL kept by a previous run
+ *
+ * They are kept in the project directory, readable by the user only,
+ * and only apply to the same project and email. A credential the
+ * server rejects is forgotten and fetched again by the next request.
+ * Fails if there are none.
+ */
+BoincError boincProxyLoadCredentials(BoincProxy * proxy);
+
 /** \brief Destroy a proxy
  */
 void boincProxyDestroy(BoincProxy* proxy);
@@ -112,11 +141,74 @@ BoincError boincProxyUploadFile(BoincProxyWorkUnit * pwu, BoincFileInfo* file, i
  */
 BoincError boinProxyWorkUnitExecuted(BoincProxyWorkUnit * pwu, unsigned int error);
 
+/** \brief inform the server that several work units ended with the same exit status
+ *
+ *  The results are sent in a single scheduler request. An error equal
+ *  to kBoincExitAborted reports them as aborted.
+ */
+BoincError boincProxyReportResults(BoincProxy * proxy, BoincWorkUnit ** wus, int count, unsigned int error);
+
+/** \brief take the result aborts found in the scheduler replies so far
+ *
+ *  \return a list to be freed with boincProxyDestroyAborts, NULL if none.
+ */
+BoincProxyAbort* boincProxyTakeAborts(BoincProxy * proxy);
+
+void boincProxyDestroyAborts(BoincProxyAbort * aborts);
+
 /** \brief Download a fileinfo
  *
+ *  The mirrors of the file are tried in turn, the fastest so far first,
+ *  until one of them sends it.
  */
 BoincError boincProxyDownloadFile(BoincProxyWorkUnit* pwu, BoincFileInfo* file, int filenum, int filetotal);
 
+/** \brief Download several fileinfos at once
+ *
+ *  The transfers run concurrently, within kBoincNetworkMaxTransfers
+ *  connections and kBoincNetworkMaxTransfersPerHost per host, and
+ *  the call returns when all of them are over. A file that fails, or
+ *  gets nothing for kBoincNetworkStallTimeout seconds, is fetched again
+ *  from its next mirror.
+ *
+ *  The transfer engine of the proxy keeps running the other downloads
+ *  and requests in flight while it waits.
+ *
+ *  \param filesDone the files of the workunit already there, for the progress
+ *  \param filesTotal all the files of the workunit
+ *  \returns the error of the first transfer that failed, NULL if none
+ */
+BoincError boincProxyDownloadFiles(BoincProxyWorkUnit* pwu, BoincFileInfo** files, int count, int filesDone, int filesTotal);
+
+/** \brief Start downloading several fileinfos, without waiting
+ *
+ *  As boincProxyDownloadFiles, but the transfers are only queued on the
+ *  engine of the proxy, which boincProxyPerform then runs. Several
+ *  workunits download at once this way.
+ *
+ *  \param done called once all the transfers are over, with the error of
+ *  the first one that failed. It may be called before the function returns.
+ *  \returns an error, and done is not called, if nothing could be started
+ */
+BoincError boincProxyStartDownloads(BoincProxyWorkUnit* pwu, BoincFileInfo** files, int count, int filesDone, int filesTotal,
+                                    BoincHttpDoneCallback done, void * userData);
+
+/** \brief Run the transfers of the proxy
+ *
+ *  The done callbacks of the transfers over are called from here. Every
+ *  call to the proxy must come from the thread running this.
+ *
+ *  \param timeout the milliseconds to wait for activity, 0 not to wait
+ *  \returns the number of transfers still running
+ */
+int boincProxyPerform(BoincProxy * proxy, int timeout);
+
+/** \brief Stop all the transfers of the proxy
+ *
+ *  Their done callbacks are called with an error.
+ */
+void boincProxyCancelTransfers(BoincProxy * proxy);
+
 
 /** \brief change the status of a work unit
  *
@@ -0,0 +1,341 @@
+/*
+  BoincLite, a light-weight library for BOINC clients.
+
+  Copyright (C) 2008 Sony Computer Science Laboratory Paris 
+  Authors: Peter Hanappe, Anthony Beurive, Tangui Morlier
+
+  This library is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation; version 2.1 of the
+  License.
+
+  This library is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+  02110-1301 USA
+
+*/ 
+#include "BoincLite.h"
+#include "BoincMem.h"
+#include "BoincError.h"
+#include "BoincUtil.h"
+#include "BoincSchedulerInternal.h"
+#include "BoincTrace.h"
+#include <string.h>
+#include <stdio.h>
+
+/*
+  The replay feeds the scheduler with the outcomes found in a trace.
+
+  The state machine itself is not replayed: it runs for real on a
+  virtual clock, and every call it makes to the backend pops the next
+  recorded outcome of the same call for the same slot. The status
+  changes posted by the application and the result aborts of the
+  project server are re-posted at their recorded time. As long as the scheduler makes the same decisions as in the
+  recorded run, the trace it produces is identical to the input.
+*/
+
+typedef struct _BoincReplay {
+	BoincTraceRecord * records;
+	int count;
+	unsigned int now;
+	unsigned int end;
+	int nbslots;
+	int * cursor;       // next record to examine, per slot and per call
+	int nextStatus;     // next 'S' or 'A' record
+	int finished;       // the trace has no outcome for a call
+	int workunits;      // counter used to name the replayed workunits
+} BoincReplay;
+
+static unsigned int boincReplayClock(void* data)
+{
+	BoincReplay * replay = (BoincReplay*) data;
+	return replay->now;
+}
+
+/**
+ * Find the next record of the given kind and call for a slot.
+ *
+ * The slot of the initialization is -1, hence the shift of the rows.
+ * The 'L' records use the extra column kBoincTraceLastCall.
+ */
+static BoincTraceRecord* boincReplayNext(BoincReplay* replay, int index, char kind, int call)
+{
+	int * cursor = &replay->cursor[(index + 1) * (kBoincTraceLastCall + 1) + call];
+
+	for (; *cursor < replay->count; (*cursor)++) {
+		BoincTraceRecord * r = &replay->records[*cursor];
+		if ((r->kind == kind) && (r->index == index)
+		    && ((kind != 'C') || (r->value == call))) {
+			(*cursor)++;
+			return r;
+		}
+	}
+	return NULL;
+}
+
+static BoincError boincReplayCall(BoincReplay* replay, int index, int call)
+{
+	if ((index < -1) || (index >= replay->nbslots)) {
+		return boincErrorCreatef(kBoincFatal, kBoincInternal, "Replay: slot %d out of bounds", index);
+	}
+
+	BoincTraceRecord * r = boincReplayNext(replay, index, 'C', call);
+	if (r == NULL) {
+		replay->finished = 1;
+		return boincErrorCreate(kBoincFatal, kBoincInternal, "Replay: end of the trace");
+	}
+
+	replay->now += r->duration;
+
+	if (r->errorType == kBoincNone) {
+		return NULL;
+	}
+	const char * message = (r->message[0] != 0)? r->message : NULL;
+	if (r->errorType == kBoincDelay) {
+		return boincErrorCreateWithDelay(r->errorCode, message, r->errorDelay);
+	}
+	return boincErrorCreate(r->errorType, r->errorCode, message);
+}
+
+/**
+ * Give a recorded workunit the fields the scheduler relies on. The
+ * files are not known from the trace, so the workunit has none.
+ */
+static BoincError boincReplayDefineWorkUnit(BoincReplay* replay, BoincWorkUnit* wu)
+{
+	char name[64];
+
+	snprintf(name, 64, "replay_%d_%d", wu->index, replay->workunits++);
+
+	if (wu->name == NULL) {
+		wu->name = boincArray(char, strlen(name) + 1);
+		if (wu->name == NULL) {
+			return boincErrorCreate(kBoincFatal, kBoincSystem, "Out of memory");
+		}
+		strcpy(wu->name, name);
+	}
+
+	if (wu->result == NULL) {
+		wu->result = boincNew(BoincResult);
+		if (wu->result == NULL) {
+			return boincErrorCreate(kBoincFatal, kBoincSystem, "Out of memory");
+		}
+		wu->result->name = boincArray(char, strlen(name) + 1);
+		if (wu->result->name == NULL) {
+			return boincErrorCreate(kBoincFatal, kBoincSystem, "Out of memory");
+		}
+		strcpy(wu->result->name, name);
+	}
+
+	return NULL;
+}
+
+static BoincError boincReplayInit(BoincScheduler* scheduler, void* data)
+{
+	return boincReplayCall((BoincReplay*) data, -1, kBoincTraceInit);
+}
+
+static BoincError boincReplayLoadWorkUnit(BoincScheduler* scheduler, BoincWorkUnit* wu, void* data)
+{
+	BoincReplay * replay = (BoincReplay*) data;
+
+	BoincError err = boincReplayCall(replay, wu->index, kBoincTraceLoadWorkUnit);
+	if (err != NULL) {
+		return err;
+	}
+
+	BoincTraceRecord * r = boincReplayNext(replay, wu->index, 'L', kBoincTraceLastCall);
+	if (r == NULL) {
+		replay->finished = 1;
+		return boincErrorCreate(kBoincFatal, kBoincInternal, "Replay: end of the trace");
+	}
+
+	wu->status = r->value;
+	if (wu->status >= kBoincWorkUnitDownloading) {
+		return boincReplayDefineWorkUnit(replay, wu);
+	}
+
+	return NULL;
+}
+
+static BoincError boincReplayRequestWork(BoincScheduler* scheduler, BoincWorkUnit* wu, void* data)
+{
+	BoincReplay * replay = (BoincReplay*) data;
+
+	BoincError err = boincReplayCall(replay, wu->index, kBoincTraceRequestWork);
+	if (err != NULL) {
+		return err;
+	}
+
+	return boincReplayDefineWorkUnit(replay, wu);
+}
+
+static BoincError boincReplayDownload(BoincScheduler* scheduler, BoincWorkUnit* wu, void* data)
+{
+	return boincReplayCall((BoincReplay*) data, wu->index, kBoincTraceDownload);
+}
+
+static BoincError boincReplayCompute(BoincScheduler* scheduler, BoincWorkUnit* wu, void* data)
+{
+	// The application answers through the recorded 'S' records
+	return NULL;
+}
+
+static BoincError boincReplayUpload(BoincScheduler* scheduler, BoincWorkUnit* wu, void* data)
+{
+	return boincReplayCall((BoincReplay*) data, wu->index, kBoincTraceUpload);
+}
+
+static BoincError boincReplayReport(BoincScheduler* scheduler, BoincWorkUnit* wu, unsigned int failed, void* data)
+{
+	return boincReplayCall((BoincReplay*) data, wu->index, kBoincTraceReport);
+}
+
+static BoincSchedulerBackend boincReplayBackend = {
+	boincReplayInit,
+	boincReplayLoadWorkUnit,
+	boincReplayRequestWork,
+	boincReplayDownload,
+	boincReplayCompute,
+	boincReplayUpload,
+	boincReplayReport,
+};
+
+static int boincReplayIsPosted(BoincTraceRecord* r)
+{
+	return (r->kind == 'S') || (r->kind == 'A');
+}
+
+/**
+ * Re-post the status changes of the application and the result aborts
+ * that are due.
+ */
+static BoincError boincReplayPostStatus(BoincReplay* replay, BoincScheduler* scheduler)
+{
+	for (; replay->nextStatus < replay->count; replay->nextStatus++) {
+		BoincTraceRecord * r = &replay->records[replay->nextStatus];
+		if (!boincReplayIsPosted(r)) {
+			continue;
+		}
+		if (r->time > replay->now) {
+			break;
+		}
+		BoincWorkUnit * wu = boincSchedulerGetWorkUnit(scheduler, r->index);
+		if (wu == NULL) {
+			return boincErrorCreatef(kBoincFatal, kBoincInternal, "Replay: slot %d out of bounds", r->index);
+		}
+		BoincError err;
+		if (r->kind == 'A') {
+			err = (wu->result != NULL)? boincSchedulerAbortResult(scheduler, wu->result->name, r->value) : NULL;
+		} else {
+			err = boincSchedulerChangeWorkUnitStatus(scheduler, wu, r->value);
+		}
+		if (err != NULL) {
+			return err;
+		}
+	}
+	return NULL;
+}
+
+static BoincError boincReplayRun(BoincReplay* replay, BoincScheduler* scheduler)
+{
+	BoincError err = NULL;
+
+	while (1) {
+
+		err = boincReplayPostStatus(replay, scheduler);
+		if (err != NULL) {
+			return err;
+		}
+
+		if (boincSchedulerHasEvents(scheduler)) {
+			err = boincSchedulerHandleEvents(scheduler);
+			if (replay->finished) {
+				boincErrorDestroy(err);
+				return NULL;
+			}
+			if (err != NULL) {
+				if (boincErrorType(err) == kBoincFatal) {
+					return err;
+				}
+				boincLogError(err);
+				boincErrorDestroy(err);
+			}
+			continue;
+		}
+
+		// Nothing to do now: jump to the next event or status change
+		unsigned int next = 0;
+		int found = boincQueueNextEventTime(boincSchedulerGetQueue(scheduler), &next);
+
+		if ((replay->nextStatus < replay->count)
+		    && (!found || (replay->records[replay->nextStatus].time < next))) {
+			next = replay->records[replay->nextStatus].time;
+			found = 1;
+		}
+
+		if (!found || (next > replay->end)) {
+			return NULL;
+		}
+
+		if (next > replay->now) {
+			replay->now = next;
+		}
+	}
+}
+
+BoincError boincSchedulerReplay(BoincScheduler* scheduler, const char* traceFile)
+{
+	BoincReplay replay;
+	BoincError err;
+
+	memset(&replay, 0, sizeof(BoincReplay));
+
+	err = boincTraceRead(traceFile, &replay.records, &replay.count);
+	if (err != NULL) {
+		return err;
+	}
+	if (replay.count == 0) {
+		boincFree(replay.records);
+		return boincErrorCreatef(kBoincError, kBoincFileSystem, "Empty trace file %s", traceFile);
+	}
+
+	replay.nbslots = boincSchedulerCountWorkUnits(scheduler);
+	replay.cursor = boincArray(int, (replay.nbslots + 1) * (kBoincTraceLastCall + 1));
+	if (replay.cursor == NULL) {
+		boincFree(replay.records);
+		return boincErrorCreate(kBoincFatal, kBoincSystem, "Out of memory");
+	}
+
+	replay.now = replay.records[0].time;
+	replay.end = replay.records[replay.count - 1].time;
+
+	// Skip to the first status change of the application
+	while ((replay.nextStatus < replay.count) && !boincReplayIsPosted(&replay.records[replay.nextStatus])) {
+		replay.nextStatus++;
+	}
+
+	boincSchedulerSetBackend(scheduler, &boincReplayBackend, &replay);
+	boincSchedulerSetInline(scheduler, 1);
+	boincSchedulerSetClock(scheduler, boincReplayClock, &replay);
+
+	err = boincReplayRun(&replay, scheduler);
+
+	boincSchedulerSetClock(scheduler, NULL, NULL);
+	boincSchedulerSetInline(scheduler, 0);
+	boincSchedulerSetBackend(scheduler, NULL, NULL);
+
+	boincLogf(kBoincInfo, 0, "Replayed %d trace records, %u virtual seconds",
+		  replay.count, replay.now - replay.records[0].time);
+
+	boincFree(replay.cursor);
+	boincFree(replay.records);
+
+	return err;
+}
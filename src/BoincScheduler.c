@@ -28,6 +28,9 @@
 #include "BoincMutex.h"
 #include "BoincHash.h"
 #include "BoincWorkUnit.h"
+#include "BoincSchedulerInternal.h"
+#include "BoincTrace.h"
+#include "BoincTuner.h"
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <string.h>
@@ -38,6 +41,51 @@
 #define WORKUNIT_SUBDIR "%d"
 #define STATUS_FILENAME "workunit.status"
 
+// Most events boincSchedulerRun handles in one call
+#define RUN_BUDGET 64
+
+// The wait lists of the workunits blocked on a busy download, compute
+// or upload slot.
+enum {
+	kBoincWaitDownload = 0,
+	kBoincWaitCompute,
+	kBoincWaitUpload,
+	kBoincWaitLists
+};
+
+// The workunits given up before their end, either because they cannot
+// meet their deadline or on request of the project server
+enum {
+	kBoincAbortNone = 0,
+	kBoincAbortPending,             // failed, not reported yet
+	kBoincAbortReported,            // reported with an other one
+};
+
+// The I/O threads. The network pool has a single thread: it runs the
+// transfer engine of the proxy, which keeps the state of each transfer
+// and the downloads of several workunits in flight, along with the
+// requests and the uploads the thread sends meanwhile.
+enum {
+	kBoincPoolNetwork = 0,
+	kBoincPoolDisk,
+	kBoincPools
+};
+
+typedef struct _BoincSchedulerPool {
+	BoincScheduler * scheduler;
+	BoincQueue * jobs;              // the events handed to the pool
+	BoincThread * threads;
+	int nbthreads;
+	int started;
+	volatile unsigned int stop;
+} BoincSchedulerPool;
+
+// The notifications posted by the compute threads of the application
+enum {
+	kBoincInboxStatus = 0,          // value is the new status of the slot
+	kBoincInboxProgress,            // the slot made progress
+};
+
 
 struct _BoincScheduler {
 	BoincConfiguration * configuration;
@@ -50,8 +98,49 @@ struct _BoincScheduler {
 	BoincStatusChangedCallback statusCallback;
 	void *statusData;
 	BoincMutex mutex;
+	BoincSchedulerBackend * backend;
+	void * backendData;
+	BoincTrace * trace;
+	int nbcompute;
+	int backoffBase;
+	int backoffStep;
+	int backoffMax;
+	BoincQueue * waiting[kBoincWaitLists];
+	BoincTuner tuner;
+	unsigned int coreFreed;
+	int * aborted;
+	unsigned int * exitStatus;      // of the aborted workunits
+	BoincThread * loaders;
+	int nbloaders;
+	int nextLoad;                   // next slot for the loader threads
+	int loaded;                     // slots loaded so far
+	int initPending;                // started from the cached project configuration
+	unsigned int created;           // real time, for the wakeup rate
+	BoincInbox * inbox;             // from the compute threads
+	volatile unsigned int * progressPosted; // a progress notification is in the inbox
+	volatile unsigned int * stop;   // exit status the application must stop with
+	BoincSchedulerPool pools[kBoincPools];
+	int downloading;                // in flight, only seen by the network thread
+	int ioThreads;                  // the pools handle the transfers and the deletes
+	int inlineRun;                  // everything on the thread handling the events
+	BoincQueueClock clock;          // virtual time of the replay and the simulator
+	void * clockData;
+	BoincError ioError;             // fatal error of an I/O thread
+	BoincMutex * slotLocks;         // held while an event of the slot is handled
+	BoincMutex admission;           // checks the room left in a stage
+	volatile unsigned int readingInbox;
 };
 
+// The time of the scheduler: the real one, unless the replay or the
+// simulator play it on their virtual clock
+static unsigned int boincSchedulerNow(BoincScheduler* scheduler)
+{
+	if (scheduler->clock != NULL) {
+		return scheduler->clock(scheduler->clockData);
+	}
+	return boincQueueNow();
+}
+
 //////////////////////////////////////////////////////////////
 
 /*     BoincStatusInfo   */
@@ -78,6 +167,14 @@ static BoincStatusInfo BoincStatusInfos[] = {
 
 /*     BoincEvent   */
 
+// The events that are not about a slot. The others carry the status
+// the slot moves to.
+enum {
+	kBoincEventErase = -3,          // delete the files of a slot and free it
+	kBoincEventInit = -2,           // refresh the project configuration
+	kBoincEventLoad = -1,           // load the slots from disk
+};
+
 typedef struct _BoincEvent {
 	int eventType;
 	int index;
@@ -92,10 +189,296 @@ static BoincEvent * boincEventCreate(int eventType, int index)
 	return event;
 }
 
+// The classes of the events, served in this order among the due ones
+enum {
+	kBoincPriorityStateChange = 0,  // the progress of a workunit through its stages
+	kBoincPriorityTransfer,         // a first attempt at a network exchange
+	kBoincPriorityRetry,            // an attempt that failed before
+	kBoincPriorityMaintenance,      // the cleanup of the finished slots
+};
+
+static int boincEventPriority(void* data)
+{
+	BoincEvent * event = (BoincEvent*) data;
+
+	if (event->eventType == kBoincEventErase) {
+		return kBoincPriorityMaintenance;
+	}
+	if (event->nbtries > 0) {
+		return kBoincPriorityRetry;
+	}
+	switch (event->eventType) {
+	case kBoincEventInit:
+	case kBoincWorkUnitCreated:
+	case kBoincWorkUnitInitializing:
+	case kBoincWorkUnitDownloading:
+	case kBoincWorkUnitUploading:
+		return kBoincPriorityTransfer;
+	}
+	return kBoincPriorityStateChange;
+}
+
+//////////////////////////////////////////////////////////////
+
+/* Default backend: the project server and the application */
+
+static BoincError boincSchedulerReadWorkUnitStatus(BoincScheduler* scheduler, BoincWorkUnit * wu);
+
+static BoincError boincSchedulerProxyInit(BoincScheduler* scheduler, void* data)
+{
+	BoincError err = boincProxyInit(scheduler->proxy);
+	if (err) {
+		return err;
+	}
+
+	// Authenticate for the current session, if necessary
+	if (!boincConfigurationHasParameter(scheduler->configuration, kBoincUserAuthenticator)) {
+		return boincProxyAuthenticate(scheduler->proxy);
+	}
+
+	return NULL;
+}
+
+static BoincError boincSchedulerProxyLoadWorkUnit(BoincScheduler* scheduler, BoincWorkUnit* wu, void* data)
+{
+	// Try loading the status from disk
+	BoincError err = boincSchedulerReadWorkUnitStatus(scheduler, wu);
+		
+	if ((err == NULL) && (wu->status >= kBoincWorkUnitDownloading)) {
+		err = boincProxyLoadWorkUnit(wu);
+	}
+
+	// Check the input files already there while the other slots
+	// load, so the download does not hash them again
+	if ((err == NULL) && (wu->status == kBoincWorkUnitDownloading)) {
+		for (BoincFileInfo * fi = wu->fileInfo ; fi ; fi = fi->next) {
+			if (!(fi->flags & kBoincFileGenerated) && !boincWorkUnitFileNeedsDownload(wu, fi)) {
+				fi->flags |= kBoincFileVerified;
+			}
+		}
+	}
+
+	return err;
+}
+
+/**
+ * Apply the result aborts found in the last reply of the server
+ */
+static void boincSchedulerProxyApplyAborts(BoincScheduler* scheduler)
+{
+	BoincProxyAbort * aborts = boincProxyTakeAborts(scheduler->proxy);
+
+	for (BoincProxyAbort * a = aborts; a != NULL; a = a->next) {
+		BoincError err = boincSchedulerAbortResult(scheduler, a->resultName, a->ifNotStarted);
+		if (err != NULL) {
+			boincLogError(err);
+			boincErrorDestroy(err);
+		}
+	}
+
+	boincProxyDestroyAborts(aborts);
+}
+
+static BoincError boincSchedulerProxyRequestWork(BoincScheduler* scheduler, BoincWorkUnit* wu, void* data)
+{
+	BoincProxyWorkUnit pwu = {scheduler->proxy, wu};
+	BoincError err = boincProxyRequestWork(&pwu);
+	boincSchedulerProxyApplyAborts(scheduler);
+	return err;
+}
+
+/**
+ * The files of the workunit left to download. The application files
+ * must be provided by the parent application.
+ */
+static BoincError boincSchedulerProxyMissing(BoincWorkUnit* wu, BoincFileInfo*** missing, int* filesMissing, 
+					     int* filesDownloaded, int* filesTotal)
+{
+	BoincFileInfo * fi;
+
+	*filesMissing = 0;
+	*filesDownloaded = 0;
+	*filesTotal = 0;
+	for (fi = wu->fileInfo ; fi ; fi = fi->next) {
+		if (fi->flags & kBoincFileGenerated)
+			continue;
+		(*filesTotal)++;
+	}
+
+	*missing = boincArray(BoincFileInfo*, *filesTotal + 1);
+	if (*missing == NULL) {
+		return boincErrorCreate(kBoincFatal, kBoincSystem, "Out of memory");
+	}
+
+	for (fi = wu->fileInfo ; fi ; fi = fi->next) {
+
+		if (fi->flags & kBoincFileGenerated) {
+			continue;
+		}
+		if ((fi->flags & kBoincFileVerified) || !boincWorkUnitFileNeedsDownload(wu, fi)) {
+			(*filesDownloaded)++;
+			continue;
+		}
+		(*missing)[(*filesMissing)++] = fi;
+	}
+
+	return NULL;
+}
+
+static BoincError boincSchedulerProxyDownload(BoincScheduler* scheduler, BoincWorkUnit* wu, void* data)
+{
+	BoincFileInfo ** missing;
+	int filesMissing, filesDownloaded, filesTotal;
+
+	BoincError err = boincSchedulerProxyMissing(wu, &missing, &filesMissing, &filesDownloaded, &filesTotal);
+	if (err) {
+		return err;
+	}
+
+	// All the files at once: the workunit waits for the slowest
+	// rather than for the sum
+	BoincProxyWorkUnit pwu = {scheduler->proxy, wu};
+	err = boincProxyDownloadFiles(&pwu, missing, filesMissing, filesDownloaded, filesTotal);
+	boincFree(missing);
+	if (err) {
+		return err;
+	} 
+
+	boincLogf(6, 1, "%d files downloaded", filesTotal);
+
+	return NULL;
+}
+
+static BoincError boincSchedulerProxyDownloadStart(BoincScheduler* scheduler, BoincWorkUnit* wu, 
+						   BoincSchedulerDone done, void* doneData, void* data)
+{
+	BoincFileInfo ** missing;
+	int filesMissing, filesDownloaded, filesTotal;
+
+	BoincError err = boincSchedulerProxyMissing(wu, &missing, &filesMissing, &filesDownloaded, &filesTotal);
+	if (err) {
+		return err;
+	}
+
+	// The transfers keep the files, not the list
+	BoincProxyWorkUnit pwu = {scheduler->proxy, wu};
+	err = boincProxyStartDownloads(&pwu, missing, filesMissing, filesDownloaded, filesTotal, done, doneData);
+	boincFree(missing);
+	return err;
+}
+
+static void boincSchedulerProxyPerform(BoincScheduler* scheduler, int timeout, void* data)
+{
+	boincProxyPerform(scheduler->proxy, timeout);
+}
+
+static void boincSchedulerProxyCancel(BoincScheduler* scheduler, void* data)
+{
+	boincProxyCancelTransfers(scheduler->proxy);
+}
+
+static BoincError boincSchedulerProxyCompute(BoincScheduler* scheduler, BoincWorkUnit* wu, void* data)
+{
+	// Send the workunit to the parent application. Good luck.
+
+	BoincComputeWorkUnitCallback compute_callback = (BoincComputeWorkUnitCallback) scheduler->callback;
+	compute_callback(scheduler, wu, scheduler->userData);
+
+	return NULL;
+}
+
+static BoincError boincSchedulerProxyUpload(BoincScheduler* scheduler, BoincWorkUnit* wu, void* data)
+{
+	BoincFileInfo * fi;
+	BoincError err;
+	int fileNum = 0;
+	int filesTotal = 0;
+
+	for (fi = wu->result->fileInfo ; fi ; fi = fi->next) {
+		if (! (fi->flags & kBoincFileGenerated) || ! (fi->flags & kBoincFileUpload)) {
+			continue;
+		}
+		filesTotal++;
+	}
+
+	for (fi = wu->result->fileInfo ; fi ; fi = fi->next) {
+		if (! (fi->flags & kBoincFileGenerated) || ! (fi->flags & kBoincFileUpload))
+			continue;
+
+		BoincProxyWorkUnit pwu = { scheduler->proxy, wu };
+
+		err = boincProxyUploadFile(&pwu, fi, fileNum, filesTotal);
+		if (err) {
+			return err;
+		}
+		
+		fileNum++;
+	}
+
+	boincLogf(6, 1, "%d file(s) uploaded", fileNum);
+
+	return NULL;
+}
+
+static BoincError boincSchedulerProxyReport(BoincScheduler* scheduler, BoincWorkUnit* wu, unsigned int failed, void* data)
+{
+	BoincProxyWorkUnit pwu = {scheduler->proxy, wu};
+	BoincError err = boinProxyWorkUnitExecuted(&pwu, failed);
+	boincSchedulerProxyApplyAborts(scheduler);
+	return err;
+}
+
+static BoincError boincSchedulerProxyReportBatch(BoincScheduler* scheduler, BoincWorkUnit** wus, int count, 
+						 unsigned int failed, void* data)
+{
+	BoincError err = boincProxyReportResults(scheduler->proxy, wus, count, failed);
+	boincSchedulerProxyApplyAborts(scheduler);
+	return err;
+}
+
+static BoincSchedulerBackend boincSchedulerProxyBackend = {
+	boincSchedulerProxyInit,
+	boincSchedulerProxyLoadWorkUnit,
+	boincSchedulerProxyRequestWork,
+	boincSchedulerProxyDownload,
+	boincSchedulerProxyCompute,
+	boincSchedulerProxyUpload,
+	boincSchedulerProxyReport,
+	boincSchedulerProxyReportBatch,
+	boincSchedulerProxyDownloadStart,
+	boincSchedulerProxyPerform,
+	boincSchedulerProxyCancel,
+};
+
+/**
+ * Record the outcome of a backend call in the trace, if any.
+ *
+ * The call is evaluated before this function is entered so the
+ * duration includes the call itself.
+ */
+static BoincError boincSchedulerTraceCall(BoincScheduler* scheduler, int call, int index, unsigned int start, BoincError err)
+{
+	if (scheduler->trace != NULL) {
+		boincTraceWriteCall(scheduler->trace, start, index, call, boincSchedulerNow(scheduler) - start, err);
+	}
+	return err;
+}
+
 //////////////////////////////////////////////////////////////
 
 /* BoincScheduler */
 
+static int boincSchedulerGetSetting(BoincConfiguration* config, int parameter, int defaultValue)
+{
+	if (!boincConfigurationHasParameter(config, parameter)) {
+		return defaultValue;
+	}
+	return (int) boincConfigurationGetNumber(config, parameter);
+}
+
+static void boincSchedulerJoinLoaders(BoincScheduler* scheduler);
+static void boincSchedulerStopPools(BoincScheduler* scheduler);
+
 BoincScheduler* boincSchedulerCreate(BoincConfiguration* config, BoincComputeWorkUnitCallback callback, void* userData)
 {
 	boincDebug("scheduler create");
@@ -107,9 +490,29 @@ BoincScheduler* boincSchedulerCreate(BoincConfiguration* config, BoincComputeWor
 	scheduler->configuration = config;
 	scheduler->callback = callback;
 	scheduler->userData = userData;
-	scheduler->nbworkunits = 2;
+	scheduler->nbworkunits = boincSchedulerGetSetting(config, kBoincSchedulerSlots, 2);
+	if (scheduler->nbworkunits < 1) {
+		scheduler->nbworkunits = 1;
+	}
+	scheduler->nbcompute = boincSchedulerGetSetting(config, kBoincSchedulerComputeSlots, 1);
+	if (scheduler->nbcompute < 1) {
+		scheduler->nbcompute = 1;
+	}
+	scheduler->backoffBase = boincSchedulerGetSetting(config, kBoincSchedulerBackoffBase, 10);
+	scheduler->backoffStep = boincSchedulerGetSetting(config, kBoincSchedulerBackoffStep, 10);
+	scheduler->backoffMax = boincSchedulerGetSetting(config, kBoincSchedulerBackoffMax, 0);
+
+	// By default, every slot that doesn't compute may prefetch
+	int freeSlots = scheduler->nbworkunits - scheduler->nbcompute;
+	boincTunerInit(&scheduler->tuner,
+		       boincSchedulerGetSetting(config, kBoincSchedulerPrefetchMin, 1),
+		       boincSchedulerGetSetting(config, kBoincSchedulerPrefetchMax, (freeSlots > 1)? freeSlots : 1));
 	scheduler->queue = boincQueueCreate();
 	scheduler->mutex = boincMutexCreate("sched");
+	scheduler->admission = boincMutexCreate("admission");
+	scheduler->backend = &boincSchedulerProxyBackend;
+	scheduler->ioThreads = 1;
+	scheduler->created = boincQueueNow();
 
 	if (scheduler->queue == NULL) {
 		boincFree(scheduler);
@@ -117,16 +520,57 @@ BoincScheduler* boincSchedulerCreate(BoincConfiguration* config, BoincComputeWor
 		return NULL;
 	}
 
-	scheduler->workunits = (BoincWorkUnit**) boincArray(BoincWorkUnit, scheduler->nbworkunits);
+	// Let the retries of the slots share their wakeups
+	boincQueueSetSlack(scheduler->queue, boincSchedulerGetSetting(config, kBoincSchedulerTimerSlack, 5));
+
+	// The completions and the promotions to compute are not delayed
+	// by a burst of retries, which in turn are not starved
+	boincQueueSetPriority(scheduler->queue, boincEventPriority,
+			      boincSchedulerGetSetting(config, kBoincSchedulerPriorityAging, 30));
+
+	for (int i = 0; i < kBoincWaitLists; i++) {
+		scheduler->waiting[i] = boincQueueCreate();
+		if (scheduler->waiting[i] == NULL) {
+			boincSchedulerDestroy(scheduler);
+			boincLog(kBoincError, -1, "Out of memory");
+			return NULL;
+		}
+	}
+
+	scheduler->workunits = boincArray(BoincWorkUnit*, scheduler->nbworkunits);
+	scheduler->aborted = boincArray(int, scheduler->nbworkunits);
+	scheduler->exitStatus = boincArray(unsigned int, scheduler->nbworkunits);
+	scheduler->progressPosted = boincArray(unsigned int, scheduler->nbworkunits);
+	scheduler->stop = boincArray(unsigned int, scheduler->nbworkunits);
+
+	// Each slot has at most one progress and a few status changes
+	// in flight
+	scheduler->inbox = boincInboxCreate(4 * scheduler->nbworkunits + 16);
+
+	scheduler->slotLocks = boincArray(BoincMutex, scheduler->nbworkunits);
+	for (int i = 0; (scheduler->slotLocks != NULL) && (i < scheduler->nbworkunits); i++) {
+		scheduler->slotLocks[i] = boincMutexCreate("slot");
+	}
+
+	if ((scheduler->workunits == NULL) || (scheduler->aborted == NULL) || (scheduler->exitStatus == NULL)
+	    || (scheduler->progressPosted == NULL) || (scheduler->stop == NULL) || (scheduler->inbox == NULL)
+	    || (scheduler->slotLocks == NULL)) {
+		boincSchedulerDestroy(scheduler);
+		boincLog(kBoincError, -1, "Out of memory");
+		return NULL;
+	}
 
-	boincDebug("create -> event -1");
-	boincQueuePut(scheduler->queue, 0, boincEventCreate(-1, 0));
+	boincDebug("create -> load event");
+	boincQueuePut(scheduler->queue, 0, boincEventCreate(kBoincEventLoad, 0));
 
 	return scheduler;
 }
 
 void boincSchedulerDestroy(BoincScheduler* scheduler)
 {
+	boincSchedulerJoinLoaders(scheduler);
+	boincSchedulerStopPools(scheduler);
+
 	if (scheduler->mutex != NULL) {
 		boincMutexLock(scheduler->mutex);
 		boincMutexUnlock(scheduler->mutex);
@@ -151,8 +595,62 @@ void boincSchedulerDestroy(BoincScheduler* scheduler)
 		scheduler->workunits = NULL;
 	}
 
+	if (scheduler->aborted) {
+		boincFree(scheduler->aborted);
+		scheduler->aborted = NULL;
+	}
+
+	if (scheduler->exitStatus) {
+		boincFree(scheduler->exitStatus);
+		scheduler->exitStatus = NULL;
+	}
+
+	if (scheduler->progressPosted) {
+		boincFree((void*) scheduler->progressPosted);
+		scheduler->progressPosted = NULL;
+	}
+
+	if (scheduler->stop) {
+		boincFree((void*) scheduler->stop);
+		scheduler->stop = NULL;
+	}
+
+	boincInboxDestroy(scheduler->inbox);
+	scheduler->inbox = NULL;
+
+	if (scheduler->slotLocks) {
+		for (int i = 0; i < scheduler->nbworkunits; i++) {
+			boincMutexDestroy(scheduler->slotLocks[i]);
+		}
+		boincFree(scheduler->slotLocks);
+		scheduler->slotLocks = NULL;
+	}
+
+	if (scheduler->admission != NULL) {
+		boincMutexDestroy(scheduler->admission);
+		scheduler->admission = NULL;
+	}
+
 	boincQueueDestroy(scheduler->queue);
 
+	for (int i = 0; i < kBoincWaitLists; i++) {
+		if (scheduler->waiting[i] != NULL) {
+			BoincEvent * event;
+			while ((event = (BoincEvent*) boincQueueGet(scheduler->waiting[i])) != NULL) {
+				boincFree(event);
+			}
+			boincQueueDestroy(scheduler->waiting[i]);
+			scheduler->waiting[i] = NULL;
+		}
+	}
+
+	if (scheduler->trace != NULL) {
+		boincTraceDestroy(scheduler->trace);
+		scheduler->trace = NULL;
+	}
+
+	boincErrorDestroy(scheduler->ioError);
+
 	boincFree(scheduler);
 }
 
@@ -197,14 +695,15 @@ static BoincError boincSchedulerInitializeWorkUnit(BoincScheduler* scheduler, Bo
 
 	// Get the data from the server
 
-	BoincProxyWorkUnit pwu = {scheduler->proxy, wu};
-	BoincError err = boincProxyRequestWork(&pwu);
+	unsigned int start = boincSchedulerNow(scheduler);
+	BoincError err = boincSchedulerTraceCall(scheduler, kBoincTraceRequestWork, wu->index, start,
+						 scheduler->backend->requestWork(scheduler, wu, scheduler->backendData));
 	if (err != NULL) {
 		return err;
 	}
 
 	// Tell the scheduler the workunit is ready for the download
-	err = boincQueuePut(scheduler->queue, boincQueueNow(), boincEventCreate(kBoincWorkUnitDownloading, 
+	err = boincQueuePut(scheduler->queue, boincSchedulerNow(scheduler), boincEventCreate(kBoincWorkUnitDownloading, 
 										boincSchedulerGetWorkUnitIndex(scheduler, wu)));
 	if (err != NULL) {
 		return err;
@@ -223,43 +722,16 @@ static BoincError boincSchedulerDownload(BoincScheduler* scheduler, BoincWorkUni
 
 	// Do the thing
 
-	BoincFileInfo * fi;
-	BoincError err = NULL;
-	int filesDownloaded = 0;
-	int filesTotal = 0;
-
-	// Only download the workunit files. The application files
-	// must be provided by the parent application
-	for (fi = wu->fileInfo ; fi ; fi = fi->next) {
-		if (fi->flags & kBoincFileGenerated)
-			continue;
-		filesTotal++;
-	}
-
-	for (fi = wu->fileInfo ; fi ; fi = fi->next) {
-
-		if (fi->flags & kBoincFileGenerated) {
-			continue;
-		}
-		if (!boincWorkUnitFileNeedsDownload(wu, fi)) {
-			filesDownloaded++;
-			continue;
-		}
-
-		BoincProxyWorkUnit pwu = {scheduler->proxy, wu};
-		err = boincProxyDownloadFile(&pwu, fi, filesDownloaded, filesTotal);
-		if (err) {
-			return err;
-		} 
-
-		filesDownloaded++;
+	unsigned int start = boincSchedulerNow(scheduler);
+	BoincError err = boincSchedulerTraceCall(scheduler, kBoincTraceDownload, wu->index, start,
+						 scheduler->backend->download(scheduler, wu, scheduler->backendData));
+	if (err) {
+		return err;
 	}
 
-	boincLogf(6, 1, "%d files downloaded", filesDownloaded);
-	
 	// Inform the scheduler that the download is finished
 
-	err = boincQueuePut(scheduler->queue, boincQueueNow(), boincEventCreate(kBoincWorkUnitWaiting, 
+	err = boincQueuePut(scheduler->queue, boincSchedulerNow(scheduler), boincEventCreate(kBoincWorkUnitWaiting, 
 										boincSchedulerGetWorkUnitIndex(scheduler, wu)));
 	if (err != NULL) {
 		return err;
@@ -268,56 +740,125 @@ static BoincError boincSchedulerDownload(BoincScheduler* scheduler, BoincWorkUni
 	return NULL;
 }
 
-static BoincError boincSchedulerCompute(BoincScheduler* scheduler, BoincWorkUnit* wu)
-{
-	boincDebug("scheduler compute");
-
-	// Send the workunit to the parent application. Good luck.
+static BoincError boincSchedulerRegenerate(BoincScheduler * sched, int delay, BoincEvent * event, int maxtries, BoincError error);
 
-	BoincComputeWorkUnitCallback compute_callback = (BoincComputeWorkUnitCallback) scheduler->callback;
-	wu->result->cpu_time = time(NULL);
-	compute_callback(scheduler, wu, scheduler->userData);
-
-	return NULL;
+/**
+ * Hand the fatal error of an I/O thread to the next call to
+ * boincSchedulerHandleEvents, log the others
+ */
+static void boincSchedulerIOFailed(BoincScheduler* scheduler, BoincError err)
+{
+	if ((err != NULL) && (boincErrorType(err) == kBoincFatal)) {
+		boincMutexLock(scheduler->mutex);
+		if (scheduler->ioError == NULL) {
+			scheduler->ioError = err;
+			err = NULL;
+		}
+		boincMutexUnlock(scheduler->mutex);
+		boincQueueWake(scheduler->queue);
+	}
+	if (err != NULL) {
+		boincLogError(err);
+		boincErrorDestroy(err);
+	}
 }
 
-static BoincError boincSchedulerUpload(BoincScheduler* scheduler, BoincWorkUnit* wu)
+// A download the network thread runs on the engine of the backend
+typedef struct _BoincSchedulerTransfer {
+	BoincScheduler * scheduler;
+	BoincEvent * event;             // kept until the download is over
+	unsigned int start;
+} BoincSchedulerTransfer;
+
+/**
+ * Called on the network thread once the files of the workunit are
+ * there, or the download failed
+ */
+static void boincSchedulerDownloaded(void* doneData, BoincError err)
 {
-	boincDebug("scheduler upload");
+	BoincSchedulerTransfer * transfer = (BoincSchedulerTransfer*) doneData;
+	BoincScheduler * scheduler = transfer->scheduler;
+	BoincEvent * event = transfer->event;
+	unsigned int start = transfer->start;
+	boincFree(transfer);
+	scheduler->downloading--;
+
+	// Cancelled as the scheduler stops: the files are fetched again
+	// by the next run
+	if (boincAtomicLoad(&scheduler->pools[kBoincPoolNetwork].stop)) {
+		boincErrorDestroy(err);
+		boincFree(event);
+		return;
+	}
 
-	// Transfer the bits
+	int index = event->index;
+	BoincWorkUnit * wu = scheduler->workunits[index];
+	err = boincSchedulerTraceCall(scheduler, kBoincTraceDownload, index, start, err);
+	if (err) {
+		boincSchedulerSetWorkUnitError(scheduler, wu, err);
+		err = boincSchedulerRegenerate(scheduler, boincErrorDelay(err), event, 0, NULL);
+	} else {
+		boincLogf(6, 1, "Workunit %s downloaded", wu->name);
+		boincFree(event);
+		err = boincQueuePut(scheduler->queue, boincSchedulerNow(scheduler), 
+				    boincEventCreate(kBoincWorkUnitWaiting, index));
+	}
+	boincSchedulerIOFailed(scheduler, err);
+}
 
-	BoincFileInfo * fi;
-	BoincError err;
-	int fileNum = 0;
-	int filesTotal = 0;
+/**
+ * Start the download of a workunit on the network thread, without
+ * waiting for it. The event is kept until boincSchedulerDownloaded,
+ * unless an error is returned.
+ */
+static BoincError boincSchedulerDownloadStart(BoincScheduler* scheduler, BoincWorkUnit* wu, BoincEvent* event)
+{
+	boincDebug("scheduler download start");
 
-	for (fi = wu->result->fileInfo ; fi ; fi = fi->next) {
-		if (! (fi->flags & kBoincFileGenerated) || ! (fi->flags & kBoincFileUpload)) {
-			continue;
-		}
-		filesTotal++;
+	BoincSchedulerTransfer * transfer = boincNew(BoincSchedulerTransfer);
+	if (transfer == NULL) {
+		return boincErrorCreate(kBoincFatal, kBoincSystem, "Out of memory");
 	}
+	transfer->scheduler = scheduler;
+	transfer->event = event;
+	transfer->start = boincSchedulerNow(scheduler);
 
-	for (fi = wu->result->fileInfo ; fi ; fi = fi->next) {
-		if (! (fi->flags & kBoincFileGenerated) || ! (fi->flags & kBoincFileUpload))
-			continue;
+	scheduler->downloading++;
+	BoincError err = scheduler->backend->downloadStart(scheduler, wu, boincSchedulerDownloaded, transfer, 
+							   scheduler->backendData);
+	if (err) {
+		scheduler->downloading--;
+		err = boincSchedulerTraceCall(scheduler, kBoincTraceDownload, wu->index, transfer->start, err);
+		boincFree(transfer);
+	}
+	return err;
+}
 
-		BoincProxyWorkUnit pwu = { scheduler->proxy, wu };
+static BoincError boincSchedulerCompute(BoincScheduler* scheduler, BoincWorkUnit* wu)
+{
+	boincDebug("scheduler compute");
 
-		err = boincProxyUploadFile(&pwu, fi, fileNum, filesTotal);
-		if (err) {
-			return err;
-		}
-		
-		fileNum++;
-	}
+	wu->result->cpu_time = boincSchedulerNow(scheduler);
 
-	boincLogf(6, 1, "%d file(s) uploaded", fileNum);
+	return scheduler->backend->compute(scheduler, wu, scheduler->backendData);
+}
+
+static BoincError boincSchedulerUpload(BoincScheduler* scheduler, BoincWorkUnit* wu)
+{
+	boincDebug("scheduler upload");
+
+	// Transfer the bits
+
+	unsigned int start = boincSchedulerNow(scheduler);
+	BoincError err = boincSchedulerTraceCall(scheduler, kBoincTraceUpload, wu->index, start,
+						 scheduler->backend->upload(scheduler, wu, scheduler->backendData));
+	if (err) {
+		return err;
+	}
 
 	// Tell the scheduler that he can erase our friend.
 
-	err = boincQueuePut(scheduler->queue, boincQueueNow(), boincEventCreate(kBoincWorkUnitCompleted, 
+	err = boincQueuePut(scheduler->queue, boincSchedulerNow(scheduler), boincEventCreate(kBoincWorkUnitCompleted, 
 										boincSchedulerGetWorkUnitIndex(scheduler, wu)));
 	if (err != NULL) {
 		return err;
@@ -326,7 +867,7 @@ static BoincError boincSchedulerUpload(BoincScheduler* scheduler, BoincWorkUnit*
 	return NULL;
 }
 
-static BoincError boincSchedulerErase(BoincScheduler* scheduler, int index)
+static BoincError boincSchedulerEraseSlot(BoincScheduler* scheduler, int index)
 {
 	boincDebug("scheduler erase");
 	BoincError err = NULL;
@@ -348,13 +889,15 @@ static BoincError boincSchedulerErase(BoincScheduler* scheduler, int index)
 	// Store the workunit pointer
 	boincMutexLock(scheduler->mutex);	
 	scheduler->workunits[index] = newwu;
+	scheduler->aborted[index] = kBoincAbortNone;
+	boincAtomicStore(&scheduler->stop[index], 0);
 	boincMutexUnlock(scheduler->mutex);
 
 	// Destroy the old workunit
 	boincWorkUnitDestroy(oldwu);
 
 	// Tell the scheduler
-	err = boincQueuePut(scheduler->queue, boincQueueNow(), boincEventCreate(kBoincWorkUnitCreated, index));
+	err = boincQueuePut(scheduler->queue, boincSchedulerNow(scheduler), boincEventCreate(kBoincWorkUnitCreated, index));
 	if (err != NULL) {
 		return err;
 	}
@@ -362,6 +905,18 @@ static BoincError boincSchedulerErase(BoincScheduler* scheduler, int index)
 	return NULL;
 }
 
+/**
+ * Free a slot, on a disk thread if there are some
+ */
+static BoincError boincSchedulerErase(BoincScheduler* scheduler, int index)
+{
+	if (scheduler->pools[kBoincPoolDisk].nbthreads == 0) {
+		return boincSchedulerEraseSlot(scheduler, index);
+	}
+	BoincEvent * event = boincEventCreate(kBoincEventErase, index);
+	return boincQueuePut(scheduler->pools[kBoincPoolDisk].jobs, boincSchedulerNow(scheduler), event);
+}
+
 static BoincError boincSchedulerReadWorkUnitStatus(BoincScheduler* scheduler, BoincWorkUnit * wu)
 {
 	int statusfile_len = strlen(wu->workingDir) + 1 + strlen(STATUS_FILENAME) + 1;
@@ -408,6 +963,134 @@ static BoincError boincSchedulerReadWorkUnitStatus(BoincScheduler* scheduler, Bo
 	return NULL;
 }
 
+/**
+ * Load a slot from disk and publish it: the slot gets its event as soon
+ * as it is ready, while the other slots are still loading.
+ */
+static void boincSchedulerLoadSlot(BoincScheduler* scheduler, int index)
+{
+	// Try to load the single, pre-defined workunit  
+	char wu_path[255];
+	char subdir[50];
+
+	boincConfigurationGetString(scheduler->configuration, kBoincProjectDirectory, wu_path, 255);
+	sprintf(subdir, WORKUNIT_SUBDIR, index);
+	appendFilename(wu_path, 255, subdir);
+
+	// Create a new workunit.
+	BoincWorkUnit * wu = boincWorkUnitCreate(wu_path);
+	if (wu == NULL) {
+		boincLogf(kBoincError, kBoincSystem, "Out of memory: slot %d not loaded", index);
+		return;
+	}
+	wu->index = index;
+
+	int erase = 0;
+	unsigned int start = boincSchedulerNow(scheduler);
+	BoincError err = boincSchedulerTraceCall(scheduler, kBoincTraceLoadWorkUnit, index, start,
+						 scheduler->backend->loadWorkUnit(scheduler, wu, scheduler->backendData));
+
+	if (err) {
+		// Because there is no a recovery scheme, the
+		// workunit and its directory is
+		// erased . This avoids falling in the same error situation
+		// the next time the application starts.
+		// FIXME: there should be a way to inform the server about
+		// these errors.
+		boincLogError(err);
+		boincErrorDestroy(err);
+		err = boincRemoveDirectory(wu_path);
+
+		boincWorkUnitDestroy(wu);
+
+		wu = boincWorkUnitCreate(wu_path);
+		if (wu == NULL) {
+			boincErrorDestroy(err);
+			boincLogf(kBoincError, kBoincSystem, "Out of memory: slot %d not loaded", index);
+			return;
+		}
+		wu->index = index;
+
+		if (err) {
+			// The erase event is retried until the directory is
+			// gone, and only then the slot gets a new workunit
+			boincLogf(kBoincError, kBoincFileSystem, "Slot %d could not be erased, it is tried again: %s",
+				  index, boincErrorMessage(err));
+			boincErrorDestroy(err);
+			erase = 1;
+		}
+
+	} else {
+		boincDebugf("Workunit %d is now loaded", index);
+	}
+
+	if (scheduler->trace != NULL) {
+		boincTraceWriteStatus(scheduler->trace, 'L', boincSchedulerNow(scheduler), index, wu->status);
+	}
+
+	boincMutexLock(scheduler->mutex);
+	scheduler->workunits[index] = wu;
+	boincMutexUnlock(scheduler->mutex);
+
+	// Communicate the status to the parent application.
+	// (This has to be done with the mutex unlocked.)
+	if (scheduler->statusCallback != NULL) {
+		scheduler->statusCallback(scheduler->statusData, index);
+	}
+		
+	int t = (wu->status == kBoincWorkUnitComputing)? 0 : boincSchedulerNow(scheduler); // FIXME: a hack to put computing workunits first in queue
+		
+	// Post an event to get the workunit started.
+	boincQueuePut(scheduler->queue, t, boincEventCreate(erase? kBoincEventErase : wu->status, index));
+}
+
+static void boincSchedulerLoader(void* data)
+{
+	BoincScheduler * scheduler = (BoincScheduler*) data;
+
+	while (1) {
+		boincMutexLock(scheduler->mutex);
+		int index = scheduler->nextLoad++;
+		boincMutexUnlock(scheduler->mutex);
+
+		if (index >= scheduler->nbworkunits) {
+			return;
+		}
+		boincSchedulerLoadSlot(scheduler, index);
+
+		boincMutexLock(scheduler->mutex);
+		int last = (++scheduler->loaded == scheduler->nbworkunits);
+		int refresh = scheduler->initPending;
+		boincMutexUnlock(scheduler->mutex);
+
+		// Talk to the server once every slot got its first
+		// event, so the computations that resume go first
+		if (last && refresh) {
+			boincQueuePut(scheduler->queue, boincSchedulerNow(scheduler) + 1, boincEventCreate(kBoincEventInit, 0));
+		}
+	}
+}
+
+static void boincSchedulerJoinLoaders(BoincScheduler* scheduler)
+{
+	for (int i = 0; i < scheduler->nbloaders; i++) {
+		boincThreadJoin(scheduler->loaders[i]);
+	}
+	scheduler->nbloaders = 0;
+
+	if (scheduler->loaders) {
+		boincFree(scheduler->loaders);
+		scheduler->loaders = NULL;
+	}
+}
+
+static BoincError boincSchedulerInit(BoincScheduler* scheduler)
+{
+	unsigned int start = boincSchedulerNow(scheduler);
+	return boincSchedulerTraceCall(scheduler, kBoincTraceInit, -1, start,
+				       scheduler->backend->init(scheduler, scheduler->backendData));
+}
+
 static BoincError boincSchedulerLoad(BoincScheduler* scheduler)
 {
 	boincDebug("load");
@@ -426,106 +1109,182 @@ static BoincError boincSchedulerLoad(BoincScheduler* scheduler)
 		goto unlock_and_return;
 	}
   
-	err = boincProxyInit(scheduler->proxy);
-	if (err) {
-		goto unlock_and_return;
+	// Restart from the project configuration of the last run, if
+	// any: the slots resume without waiting for the server, which is
+	// asked for a fresh one in the background. With the credentials
+	// of the last run too, the refresh does not authenticate again:
+	// they are fetched again when the server rejects them. The replay
+	// and the simulator run inline and play their own calls.
+	int cached = 0;
+	scheduler->initPending = 0;
+	if (!scheduler->inlineRun) {
+		BoincError cacheErr = boincProxyLoadProjectConfig(scheduler->proxy);
+		if (cacheErr == NULL) {
+			cached = 1;
+			cacheErr = boincProxyLoadCredentials(scheduler->proxy);
+			if (cacheErr == NULL) {
+				cached = 2;
+			}
+		}
+		if (cacheErr != NULL) {
+			boincDebugf("Startup cache: %s", boincErrorMessage(cacheErr));
+			boincErrorDestroy(cacheErr);
+		}
 	}
+	scheduler->initPending = (cached > 0);
 
-	// Authenticate for the current session, if necessary
-	if (!boincConfigurationHasParameter(scheduler->configuration, kBoincUserAuthenticator)) {
-		err = boincProxyAuthenticate(scheduler->proxy);
+	if (cached == 0) {
+		err = boincSchedulerInit(scheduler);
 		if (err) {
 			goto unlock_and_return;
 		}
 	}
 
-	for (int index = 0; index < scheduler->nbworkunits; index++) {
+	scheduler->nextLoad = 0;
+	scheduler->loaded = 0;
 
-		// Try to load the single, pre-defined workunit  
-		char wu_path[255];
-		char subdir[50];
+unlock_and_return:
 
-		boincConfigurationGetString(scheduler->configuration, kBoincProjectDirectory, wu_path, 255);
-		sprintf(subdir, WORKUNIT_SUBDIR, index);
-		appendFilename(wu_path, 255, subdir);
+	boincMutexUnlock(scheduler->mutex);
 
-		// Create a new workunit.
-		BoincWorkUnit * wu = boincWorkUnitCreate(wu_path);
-		if (wu == NULL) {
-			err = boincErrorCreate(kBoincFatal, -1, "Out of memory");
-			goto unlock_and_return;
-		}
-		scheduler->workunits[index] = wu;
-		wu->index = index;
+	if (err) {
+		return err;
+	}
 
-		// Try loading the status from disk
-		err = boincSchedulerReadWorkUnitStatus(scheduler, wu);
-		
-		if ((err == NULL) && (wu->status >= kBoincWorkUnitDownloading)) {
-			err = boincProxyLoadWorkUnit(wu);
-		}
+	// Reading the status files and hashing the input files is
+	// spread over a few threads. The replay and the simulator run
+	// inline, so they load the slots in order.
+	int threads = boincSchedulerGetSetting(scheduler->configuration, kBoincSchedulerLoadThreads, 4);
+	if (scheduler->inlineRun) {
+		threads = 1;
+	}
+	if (threads > scheduler->nbworkunits) {
+		threads = scheduler->nbworkunits;
+	}
 
-		if (err) {
-			// Because there is no a recovery scheme, the
-			// workunit and its directory is
-			// erased . This avoids falling in the same error situation
-			// the next time the application starts.
-			// FIXME: there should be a way to inform the server about
-			// these errors.
-			err = boincRemoveDirectory(wu_path);
-			if (err)
-				goto unlock_and_return; // If the directory could not removed, the application is in a bad situation
-
-			boincWorkUnitDestroy(wu);
-
-			wu = boincWorkUnitCreate(wu_path);
-			if (wu == NULL) {
-				err = boincErrorCreate(kBoincFatal, -1, "Out of memory");
-				goto unlock_and_return;
+	if (threads > 1) {
+		scheduler->loaders = boincArray(BoincThread, threads);
+	}
+	if (scheduler->loaders != NULL) {
+		for (int i = 0; i < threads; i++) {
+			BoincThread thread = boincThreadCreate(boincSchedulerLoader, scheduler);
+			if (!thread) {
+				break;
 			}
-			scheduler->workunits[index] = wu;
-			wu->index = index;
-
-		} else {
-			boincDebugf("Workunit %d is now loaded", index);
+			scheduler->loaders[scheduler->nbloaders++] = thread;
 		}
-		
-		int t = (wu->status == kBoincWorkUnitComputing)? 0 : boincQueueNow(); // FIXME: a hack to put computing workunits first in queue
-		
-		// Post an event to get the workunit started.
-		boincQueuePut(scheduler->queue, t, boincEventCreate(wu->status, index));
 	}
 
-unlock_and_return:
-
-	boincMutexUnlock(scheduler->mutex);
-
-	
-	// Communicate the status to the parent application.
-	// (This has to be done with the mutex unlocked.)
-	if (!err) {
-		for (int index = 0; index < scheduler->nbworkunits; index++) {
-			if (scheduler->statusCallback != NULL) {
-				scheduler->statusCallback(scheduler->statusData, index);
-			}
-		}
+	// Without threads, load everything now
+	if (scheduler->nbloaders == 0) {
+		boincSchedulerLoader(scheduler);
 	}
 
-	return err;
+	return NULL;
 }
 
+static BoincError boincSchedulerReadInbox(BoincScheduler* scheduler);
+
 BoincError boincSchedulerChangeWorkUnitStatus(BoincScheduler* scheduler, BoincWorkUnit* workunit, int status)
 {
 	int index = boincSchedulerGetWorkUnitIndex(scheduler, workunit);
 	boincDebugf("boincSchedulerChangeWorkUnitStatus: index %d, status %d", index, status);
-	return boincQueuePut(scheduler->queue, boincQueueNow(), boincEventCreate(status, index));
+	if (scheduler->trace != NULL) {
+		boincTraceWriteStatus(scheduler->trace, 'S', boincSchedulerNow(scheduler), index, status);
+	}
+
+	BoincInboxMessage message = {kBoincInboxStatus, index, status};
+	int posted;
+	while ((posted = boincInboxPut(scheduler->inbox, &message)) < 0) {
+		// The inbox is full: move its messages to the queue, or
+		// wait for the thread reading them to do so, so that the
+		// status change still comes after the messages posted before
+		BoincError err = boincSchedulerReadInbox(scheduler);
+		if (err != NULL) {
+			return err;
+		}
+		boincThreadYield();
+	}
+	if (posted > 0) {
+		boincQueueWake(scheduler->queue);
+	}
+	return NULL;
+}
+
+/**
+ * Whether a workunit will be reported after its deadline. The end of
+ * the computation is projected from its progress rate once the
+ * application reports one. Otherwise, a workunit that waited for a
+ * compute slot is only given up if even the fastest computation seen
+ * so far would end too late. Called with the mutex locked.
+ */
+static int boincSchedulerMissesDeadline(BoincScheduler * scheduler, BoincWorkUnit * wu)
+{
+	if ((wu->result == NULL) || (wu->result->deadline == 0)) {
+		return 0;
+	}
+
+	unsigned int now = boincSchedulerNow(scheduler);
+	if (now >= wu->result->deadline) {
+		return 1;
+	}
+
+	double left = boincTunerShortestStage(&scheduler->tuner, kBoincWorkUnitComputing);
+
+	if (wu->status == kBoincWorkUnitComputing) {
+		double elapsed = (wu->dateStatusChange > 0)? (double) (now - wu->dateStatusChange) : 0;
+		if ((wu->progress > 0) && (wu->progress < 100) && (elapsed > 0)) {
+			left = elapsed * (100 - wu->progress) / wu->progress;
+		} else {
+			left = (left > elapsed)? left - elapsed : 0;
+		}
+	} else if (wu->status != kBoincWorkUnitWaiting) {
+		// A fresh workunit computes anyway, so the computation
+		// time keeps being learned
+		return 0;
+	}
+
+	left += boincTunerShortestStage(&scheduler->tuner, kBoincWorkUnitUploading);
+
+	return (now + left > wu->result->deadline);
 }
 
 BoincError boincSchedulerSetWorkUnitProgress(BoincScheduler * scheduler, BoincWorkUnit* workunit, float progress)
 {
 	BoincProxyWorkUnit pwu = {scheduler->proxy, workunit};
 	BoincError err = boincProxyChangeWorkUnitProgress(&pwu, progress);
-	return err;
+	if (err != NULL) {
+		return err;
+	}
+
+	// Let the scheduler thread check the deadline. A slot has a
+	// single progress notification in the inbox at a time.
+	int index = workunit->index;
+	if (boincAtomicCompareAndSwap(&scheduler->progressPosted[index], 0, 1)) {
+		BoincInboxMessage message = {kBoincInboxProgress, index, 0};
+		int posted = boincInboxPut(scheduler->inbox, &message);
+		if (posted > 0) {
+			boincQueueWake(scheduler->queue);
+		} else if (posted < 0) {
+			boincAtomicStore(&scheduler->progressPosted[index], 0);
+		}
+	}
+
+	// Tell the application to give up a computation that is too late
+	// or that the project server does not want anymore. The deadline
+	// of this report is checked later by the scheduler thread, so it
+	// stops the computation at the next report.
+	unsigned int abort = boincAtomicLoad(&scheduler->stop[index]);
+
+	if (abort == kBoincExitAbortedByProject) {
+		return boincErrorCreatef(kBoincError, kBoincServer, "Workunit %s aborted by the project", 
+					 workunit->name);
+	} else if (abort) {
+		return boincErrorCreatef(kBoincError, kBoincServer, "Workunit %s aborted: it cannot meet its deadline", 
+					 workunit->name);
+	}
+
+	return NULL;
 }
 
 /**
@@ -538,7 +1297,14 @@ static BoincError boincSchedulerRegenerate(BoincScheduler * sched, int delay, Bo
 	event->nbtries++;
   
 	if (delay <= 0) {
-		delay = 10 + event->nbtries * 10; // make sure there's a minimum delay
+		// make sure there's a minimum delay
+		delay = sched->backoffBase + event->nbtries * sched->backoffStep;
+		if ((sched->backoffMax > 0) && (delay > sched->backoffMax)) {
+			delay = sched->backoffMax;
+		}
+		if (delay <= 0) {
+			delay = 1;
+		}
 	}
 
 	if ((maxtries > 0) && (event->nbtries == maxtries)) {
@@ -553,7 +1319,37 @@ static BoincError boincSchedulerRegenerate(BoincScheduler * sched, int delay, Bo
                         return boincErrorCreate(kBoincFatal, 0, "Maximum number of tries exceeded");
                 }
 	}
-	return boincQueuePut(sched->queue, boincQueueNow() + delay, event);
+	return boincQueuePut(sched->queue, boincSchedulerNow(sched) + delay, event);
+}
+
+static void boincSchedulerWake(BoincScheduler * scheduler);
+
+/**
+ * Feed the tuner with a status change. Called with the mutex locked.
+ */
+static void boincSchedulerLearn(BoincScheduler * scheduler, int oldStatus, int oldDate, int status)
+{
+	unsigned int now = boincSchedulerNow(scheduler);
+
+	// The date is unknown for the statuses loaded from disk
+	if (oldDate > 0) {
+		boincTunerStatusLeft(&scheduler->tuner, oldStatus, now - oldDate);
+	}
+
+	if (oldStatus == kBoincWorkUnitComputing) {
+		if (scheduler->coreFreed == 0) {
+			scheduler->coreFreed = now;
+		}
+		int depth = boincTunerUpdate(&scheduler->tuner, scheduler->nbcompute);
+		boincConfigurationSetNumber(scheduler->configuration, kBoincSchedulerWorkRequest, 
+					    boincTunerWorkRequestSeconds(&scheduler->tuner, scheduler->nbcompute));
+		boincDebugf("Prefetch depth %d", depth);
+	}
+
+	if ((status == kBoincWorkUnitComputing) && (scheduler->coreFreed > 0)) {
+		boincTunerCoreIdle(&scheduler->tuner, now - scheduler->coreFreed);
+		scheduler->coreFreed = 0;
+	}
 }
 
 static BoincError boincSchedulerSetWorkUnitStatus(BoincScheduler * scheduler, int index, int status)
@@ -570,7 +1366,14 @@ static BoincError boincSchedulerSetWorkUnitStatus(BoincScheduler * scheduler, in
 
 	wu = scheduler->workunits[index];
 
-	storeStatus = boincWorkUnitSetStatus(wu, status);
+	int oldStatus = wu->status;
+	int oldDate = wu->dateStatusChange;
+
+	storeStatus = boincWorkUnitSetStatus(wu, status, boincSchedulerNow(scheduler));
+
+	if (storeStatus) {
+		boincSchedulerLearn(scheduler, oldStatus, oldDate, status);
+	}
 
 	if (storeStatus && BoincStatusInfos[status].storable) {
 		
@@ -615,6 +1418,9 @@ static BoincError boincSchedulerSetWorkUnitStatus(BoincScheduler * scheduler, in
 		scheduler->statusCallback(scheduler->statusData, wu->index);
 	}
 
+	// The change may have freed a slot
+	boincSchedulerWake(scheduler);
+
 	return NULL;
 }
 
@@ -677,6 +1483,78 @@ static int boincSchedulerCountUploading(BoincScheduler * scheduler)
 	return num;
 }
 
+/**
+ * Park an event until a slot frees up
+ */
+static BoincError boincSchedulerPark(BoincScheduler * scheduler, int list, BoincEvent * event)
+{
+	boincDebugf("Park event %d (i:%d) on wait list %d", event->eventType, event->index, list);
+	BoincError err = boincQueuePut(scheduler->waiting[list], boincSchedulerNow(scheduler), event);
+
+	// A slot freed by an other thread since the check did not see
+	// the event on the wait list
+	boincSchedulerWake(scheduler);
+
+	return err;
+}
+
+static int boincSchedulerHasFreeSlot(BoincScheduler * scheduler, int list)
+{
+	switch (list) {
+	case kBoincWaitDownload:
+		return boincSchedulerCountDownloading(scheduler) < boincSchedulerGetPrefetchDepth(scheduler);
+	case kBoincWaitCompute:
+		return boincSchedulerCountComputing(scheduler) < scheduler->nbcompute;
+	case kBoincWaitUpload:
+		return boincSchedulerCountUploading(scheduler) == 0;
+	}
+	return 0;
+}
+
+/**
+ * Move a workunit to the status of a stage if the stage has room for
+ * it. The check and the change are made at once, so the threads
+ * handling the events never admit more workunits than allowed.
+ *
+ * \return non-zero if the workunit was admitted
+ */
+static int boincSchedulerAdmit(BoincScheduler * scheduler, int list, int index, int status, BoincError * err)
+{
+	*err = NULL;
+
+	boincMutexLock(scheduler->admission);
+	int admitted = boincSchedulerHasFreeSlot(scheduler, list);
+	if (admitted) {
+		*err = boincSchedulerSetWorkUnitStatus(scheduler, index, status);
+	}
+	boincMutexUnlock(scheduler->admission);
+
+	return admitted;
+}
+
+/**
+ * Hand the first parked event of each list back to the scheduler if
+ * its slot is free. The event checks the slot again when it is
+ * handled, and goes back to the wait list if it lost the race.
+ */
+static void boincSchedulerWake(BoincScheduler * scheduler)
+{
+	for (int list = 0; list < kBoincWaitLists; list++) {
+		if (!boincQueueHasEvent(scheduler->waiting[list]) 
+		    || !boincSchedulerHasFreeSlot(scheduler, list)) {
+			continue;
+		}
+		BoincEvent * event = (BoincEvent*) boincQueueGet(scheduler->waiting[list]);
+		if (event != NULL) {
+			BoincError err = boincQueuePut(scheduler->queue, boincSchedulerNow(scheduler), event);
+			if (err != NULL) {
+				boincLogError(err);
+				boincErrorDestroy(err);
+			}
+		}
+	}
+}
+
 BoincError boincSchedulerCompleted(BoincScheduler * scheduler, 
                                    BoincWorkUnit* workunit, 
                                    unsigned int failed)
@@ -688,8 +1566,10 @@ BoincError boincSchedulerCompleted(BoincScheduler * scheduler,
                 return err;
         }
         
-        BoincProxyWorkUnit pwu = {scheduler->proxy, workunit};
-        err = boinProxyWorkUnitExecuted(&pwu, failed);
+        unsigned int start = boincSchedulerNow(scheduler);
+        err = boincSchedulerTraceCall(scheduler, kBoincTraceReport, workunit->index, start,
+                                      scheduler->backend->report(scheduler, workunit, failed,
+                                                                 scheduler->backendData));
         
         if (err != NULL) {
                 return err;
@@ -699,213 +1579,806 @@ BoincError boincSchedulerCompleted(BoincScheduler * scheduler,
         return err;
 }
 
-int boincSchedulerHasEvents(BoincScheduler* scheduler)
+static int boincSchedulerShouldAbort(BoincScheduler * scheduler, BoincWorkUnit * wu)
 {
-	return boincQueueHasEvent(scheduler->queue);
+	boincMutexLock(scheduler->mutex);
+	int abort = boincSchedulerMissesDeadline(scheduler, wu);
+	boincMutexUnlock(scheduler->mutex);
+	return abort;
 }
 
-BoincError boincSchedulerHandleEvents(BoincScheduler* scheduler)
+static int boincSchedulerIsAborted(BoincScheduler * scheduler, int index)
 {
-	boincDebug("handle events");
+	boincMutexLock(scheduler->mutex);
+	int aborted = (scheduler->aborted[index] != kBoincAbortNone);
+	boincMutexUnlock(scheduler->mutex);
+	return aborted;
+}
+
+/**
+ * Give up a workunit in place of handling its event. The exit status
+ * is kept if the workunit was already aborted by the project server.
+ */
+static BoincError boincSchedulerAbort(BoincScheduler * scheduler, BoincWorkUnit * wu, BoincEvent * event, 
+				      unsigned int exitStatus)
+{
+	boincMutexLock(scheduler->mutex);
+	if (scheduler->aborted[wu->index] == kBoincAbortNone) {
+		scheduler->aborted[wu->index] = kBoincAbortPending;
+		scheduler->exitStatus[wu->index] = exitStatus;
+	}
+	exitStatus = scheduler->exitStatus[wu->index];
+	boincMutexUnlock(scheduler->mutex);
+
+	if (exitStatus == kBoincExitAbortedByProject) {
+		boincLogf(kBoincInfo, 0, "Aborting workunit %s on request of the project", wu->name);
+	} else {
+		boincLogf(kBoincInfo, 0, "Aborting workunit %s: it cannot meet its deadline", wu->name);
+	}
 
+	if (wu->status == kBoincWorkUnitComputing) {
+		// The application finished anyway
+		wu->result->cpu_time = boincSchedulerNow(scheduler) - wu->result->cpu_time;
+	}
+
+	BoincError err = boincSchedulerSetWorkUnitStatus(scheduler, wu->index, kBoincWorkUnitFailed);
+	if (err != NULL) {
+		boincSchedulerSetWorkUnitError(scheduler, wu, err);
+		return boincSchedulerRegenerate(scheduler, 0, event, 0, NULL);
+	}
+
+	boincFree(event);
+	return boincQueuePut(scheduler->queue, boincSchedulerNow(scheduler), boincEventCreate(kBoincWorkUnitFailed, wu->index));
+}
+
+/**
+ * Report an aborted workunit, together with the other aborted ones
+ * that wait for their report, then free its slot.
+ */
+static BoincError boincSchedulerReportAborted(BoincScheduler * scheduler, BoincWorkUnit * workunit)
+{
 	BoincError err = NULL;
-	BoincEvent * event = (BoincEvent*) boincQueueGet(scheduler->queue);
-  
+
+	if (workunit->status == kBoincWorkUnitComputing) {
+		// Given up by the application in the middle of the computation
+		workunit->result->cpu_time = boincSchedulerNow(scheduler) - workunit->result->cpu_time;
+	}
+	err = boincSchedulerSetWorkUnitStatus(scheduler, workunit->index, kBoincWorkUnitFailed);
+	if (err != NULL) {
+		return err;
+	}
+
+	BoincWorkUnit ** batch = boincArray(BoincWorkUnit*, scheduler->nbworkunits);
+	if (batch == NULL) {
+		return boincErrorCreate(kBoincFatal, kBoincSystem, "Out of memory");
+	}
+
+	// Only the workunits aborted for the same reason share a report
+	int count = 0;
+	boincMutexLock(scheduler->mutex);
+	unsigned int exitStatus = scheduler->exitStatus[workunit->index];
+	for (int i = 0; i < scheduler->nbworkunits; i++) {
+		if ((scheduler->aborted[i] == kBoincAbortPending) 
+		    && (scheduler->exitStatus[i] == exitStatus)
+		    && (scheduler->workunits[i]->status == kBoincWorkUnitFailed)) {
+			batch[count++] = scheduler->workunits[i];
+		}
+	}
+	boincMutexUnlock(scheduler->mutex);
+
+	int reported = 0;
+	unsigned int start = boincSchedulerNow(scheduler);
+
+	if ((count > 0) && (scheduler->backend->reportBatch != NULL)) {
+		err = scheduler->backend->reportBatch(scheduler, batch, count, exitStatus, 
+						      scheduler->backendData);
+		for (int i = 0; i < count; i++) {
+			boincSchedulerTraceCall(scheduler, kBoincTraceReport, batch[i]->index, start, err);
+		}
+		reported = (err == NULL)? count : 0;
+	} else {
+		for (; reported < count; reported++) {
+			start = boincSchedulerNow(scheduler);
+			err = boincSchedulerTraceCall(scheduler, kBoincTraceReport, batch[reported]->index, start,
+						      scheduler->backend->report(scheduler, batch[reported], exitStatus,
+										 scheduler->backendData));
+			if (err != NULL) {
+				break;
+			}
+		}
+	}
+
+	boincMutexLock(scheduler->mutex);
+	for (int i = 0; i < reported; i++) {
+		scheduler->aborted[batch[i]->index] = kBoincAbortReported;
+	}
+	boincMutexUnlock(scheduler->mutex);
+
+	boincFree(batch);
+
+	if (err != NULL) {
+		return err;
+	}
+
+	return boincSchedulerErase(scheduler, workunit->index);
+}
+
+static int boincSchedulerEventOfSlot(void* data, void* matchData)
+{
+	BoincEvent * event = (BoincEvent*) data;
+	return (event->eventType >= 0) && (event->index == *((int*) matchData));
+}
+
+BoincError boincSchedulerAbortResult(BoincScheduler* scheduler, const char* resultName, int ifNotStarted)
+{
 	BoincWorkUnit * wu = NULL;
-	int index = -1;
+	int index;
 
-	if (event->eventType != -1) {
-		index = event->index;
+	boincMutexLock(scheduler->mutex);
+	for (index = 0; index < scheduler->nbworkunits; index++) {
 		wu = scheduler->workunits[index];
+		if ((wu != NULL) && (wu->result != NULL) && (wu->result->name != NULL)
+		    && (strcmp(wu->result->name, resultName) == 0)) {
+			break;
+		}
+	}
+	if (index == scheduler->nbworkunits) {
+		boincMutexUnlock(scheduler->mutex);
+		boincDebugf("Abort of unknown result %s ignored", resultName);
+		return NULL;
 	}
 
-	if (event) {
-    
-		boincDebugf("Deal event %d (i:%d)", event->eventType, event->index);
-		//boincDebugSchedulerStates(scheduler);
+	int status = wu->status;
+	int started = ((status == kBoincWorkUnitComputing) || (status == kBoincWorkUnitFinished)
+		       || (status == kBoincWorkUnitUploading) || (status == kBoincWorkUnitCompleted));
+
+	if ((scheduler->aborted[index] != kBoincAbortNone) || (status == kBoincWorkUnitCompleted)
+	    || (status == kBoincWorkUnitFailed) || (ifNotStarted && started)) {
+		boincMutexUnlock(scheduler->mutex);
+		return NULL;
+	}
+	scheduler->aborted[index] = kBoincAbortPending;
+	scheduler->exitStatus[index] = kBoincExitAbortedByProject;
+	if (status == kBoincWorkUnitComputing) {
+		boincAtomicStore(&scheduler->stop[index], kBoincExitAbortedByProject);
+	}
+	boincMutexUnlock(scheduler->mutex);
+
+	if (scheduler->trace != NULL) {
+		boincTraceWriteStatus(scheduler->trace, 'A', boincSchedulerNow(scheduler), index, ifNotStarted);
+	}
+
+	boincLogf(kBoincInfo, 0, "Result %s aborted by the project", resultName);
+
+	if (status == kBoincWorkUnitComputing) {
+		// The application learns it from boincSchedulerSetWorkUnitProgress
+		return NULL;
+	}
+
+	// Bring the event of the slot forward so the slot is freed now.
+	// Without one, the event is being handled and the next one fails.
+	BoincEvent * event = (BoincEvent*) boincQueueRemove(scheduler->queue, boincSchedulerEventOfSlot, &index);
+	for (int list = 0; (event == NULL) && (list < kBoincWaitLists); list++) {
+		event = (BoincEvent*) boincQueueRemove(scheduler->waiting[list], boincSchedulerEventOfSlot, &index);
+	}
+	if (event == NULL) {
+		return NULL;
+	}
+
+	return boincQueuePut(scheduler->queue, boincSchedulerNow(scheduler), event);
+}
+
+/**
+ * Check the deadline of a computation that made progress, so the next
+ * progress report of the application tells it to stop if need be.
+ */
+static void boincSchedulerCheckProgress(BoincScheduler* scheduler, int index)
+{
+	// A later progress report posts a new notification
+	boincAtomicStore(&scheduler->progressPosted[index], 0);
+
+	boincMutexLock(scheduler->mutex);
+	BoincWorkUnit * wu = scheduler->workunits[index];
+	if ((wu != NULL) && (wu->status == kBoincWorkUnitComputing)) {
+		if ((scheduler->aborted[index] == kBoincAbortNone)
+		    && boincSchedulerMissesDeadline(scheduler, wu)) {
+			scheduler->aborted[index] = kBoincAbortPending;
+			scheduler->exitStatus[index] = kBoincExitAborted;
+		}
+		if (scheduler->aborted[index] != kBoincAbortNone) {
+			boincAtomicStore(&scheduler->stop[index], scheduler->exitStatus[index]);
+		}
+	}
+	boincMutexUnlock(scheduler->mutex);
+}
+
+/**
+ * Move the notifications of the compute threads to the event queue.
+ * The status changes become events due now, in the order they were
+ * posted.
+ */
+static BoincError boincSchedulerReadInbox(BoincScheduler* scheduler)
+{
+	BoincInboxMessage message;
+	BoincError err = NULL;
+
+	// The inbox has a single reader: a thread that finds an other
+	// one reading leaves the messages to it
+	if (!boincAtomicCompareAndSwap(&scheduler->readingInbox, 0, 1)) {
+		return NULL;
+	}
 
-		switch (event->eventType) {
+	while ((err == NULL) && boincInboxGet(scheduler->inbox, &message)) {
+		if (message.kind == kBoincInboxProgress) {
+			boincSchedulerCheckProgress(scheduler, message.index);
+			continue;
+		}
+		err = boincQueuePut(scheduler->queue, boincSchedulerNow(scheduler), 
+				    boincEventCreate(message.value, message.index));
+	}
+
+	boincAtomicStore(&scheduler->readingInbox, 0);
+
+	return err;
+}
+
+int boincSchedulerHasEvents(BoincScheduler* scheduler)
+{
+	BoincError err = boincSchedulerReadInbox(scheduler);
+	if (err != NULL) {
+		boincLogError(err);
+		boincErrorDestroy(err);
+	}
+	return boincQueueHasEvent(scheduler->queue);
+}
+
+/**
+ * Carry out the transition of an event. Called by the thread handling
+ * the events or by an I/O thread for the events handed to it.
+ */
+static BoincError boincSchedulerHandleEvent(BoincScheduler* scheduler, BoincEvent* event)
+{
+	BoincError err = NULL;
+	BoincWorkUnit * wu = NULL;
+	int index = event->index;
+
+	if (event->eventType >= 0) {
+		wu = scheduler->workunits[index];
+	}
+
+	switch (event->eventType) {
       
-		case -1:
-			err = boincSchedulerLoad(scheduler);
-			if (err) {
-				// If it's fatal, don't battle with destiny. 
-				if (boincErrorType(err) == kBoincFatal) {
-					boincFree(event);
-					return err;
-				}
-	
-				// If it's not a fatal error, try again
-				boincLogError(err);
-	
-				boincDebug("loading regenerate");
-				return boincSchedulerRegenerate(scheduler, 15, event, 4, err);
+	case kBoincEventLoad:
+		err = boincSchedulerLoad(scheduler);
+		if (err) {
+			// If it's fatal, don't battle with destiny. 
+			if (boincErrorType(err) == kBoincFatal) {
+				boincFree(event);
+				return err;
+			}
+
+			// If it's not a fatal error, try again
+			boincLogError(err);
 
-			} else {
+			boincDebug("loading regenerate");
+			return boincSchedulerRegenerate(scheduler, 15, event, 4, err);
+
+		} else {
+			boincFree(event);
+		}
+		break;
+
+	case kBoincEventErase:
+		err = boincSchedulerEraseSlot(scheduler, index);
+		if (err) {
+			if (boincErrorType(err) == kBoincFatal) {
 				boincFree(event);
+				return err;
 			}
-			break;
+			boincLogError(err);
+			boincErrorDestroy(err);
+			return boincSchedulerRegenerate(scheduler, 0, event, 0, NULL);
+		}
+		boincFree(event);
+		break;
+
+	case kBoincEventInit:
+		err = boincSchedulerInit(scheduler);
+		if (err) {
+			// The slots go on with the cached configuration
+			boincLogError(err);
+			int delay = boincErrorDelay(err);
+			boincErrorDestroy(err);
+			return boincSchedulerRegenerate(scheduler, delay, event, 0, NULL);
+		}
+		boincLog(kBoincInfo, 0, "Project configuration refreshed");
+		boincFree(event);
+		break;
       
-		case kBoincWorkUnitCreated:
+	case kBoincWorkUnitCreated:
       
-			// Set the state to created
-			err = boincSchedulerSetWorkUnitStatus(scheduler, index, kBoincWorkUnitCreated);
+		// Set the state to created
+		err = boincSchedulerSetWorkUnitStatus(scheduler, index, kBoincWorkUnitCreated);
+		if (err != NULL) {
+			boincSchedulerSetWorkUnitError(scheduler, wu, err);
+			return boincSchedulerRegenerate(scheduler, 0, event, 0, NULL);
+		}
+
+		if (boincSchedulerAdmit(scheduler, kBoincWaitDownload, index, kBoincWorkUnitInitializing, &err)) {
+
 			if (err != NULL) {
 				boincSchedulerSetWorkUnitError(scheduler, wu, err);
+				// The status could probably not be written : retry unfinitely
 				return boincSchedulerRegenerate(scheduler, 0, event, 0, NULL);
 			}
+			
+			boincFree(event);
+			return boincQueuePut(scheduler->queue, boincSchedulerNow(scheduler), boincEventCreate(kBoincWorkUnitInitializing, index));
 
-			if (boincSchedulerCountDownloading(scheduler) == 0) {
+		} else {
+			return boincSchedulerPark(scheduler, kBoincWaitDownload, event);
+		}
+		break;
+      
+	case kBoincWorkUnitInitializing:
+    
+		err = boincSchedulerInitializeWorkUnit(scheduler, wu);
+		if (err != NULL) {
+			boincSchedulerSetWorkUnitError(scheduler, wu, err);
+			return boincSchedulerRegenerate(scheduler, boincErrorDelay(err), event, 0, NULL);
 
-				err = boincSchedulerSetWorkUnitStatus(scheduler, index, kBoincWorkUnitInitializing);
-				if (err != NULL) {
-					boincSchedulerSetWorkUnitError(scheduler, wu, err);
-					// The status could probably not be written : retry unfinitely
-					return boincSchedulerRegenerate(scheduler, 0, event, 0, NULL);
-				}
-				
-				boincFree(event);
-				return boincQueuePut(scheduler->queue, boincQueueNow(), boincEventCreate(kBoincWorkUnitInitializing, index));
+		} 
+		boincFree(event);
+		break;
+      
+	case kBoincWorkUnitDownloading:
 
-			} else {
-				return boincSchedulerRegenerate(scheduler, 5, event, 0, NULL);
-			}
-			break;
+		if (boincSchedulerShouldAbort(scheduler, wu)) {
+			return boincSchedulerAbort(scheduler, wu, event, kBoincExitAborted);
+		}
+
+		// Set the state to downloading
+		err = boincSchedulerSetWorkUnitStatus(scheduler, index, kBoincWorkUnitDownloading);
+		if (err != NULL) {
+			boincSchedulerSetWorkUnitError(scheduler, wu, err);
+			return boincSchedulerRegenerate(scheduler, 0, event, 0, NULL);
+		}
       
-		case kBoincWorkUnitInitializing:
-            
-			err = boincSchedulerInitializeWorkUnit(scheduler, wu);
-			if (err != NULL) {
+		// On the network thread, the downloads of several
+		// workunits run at once on the engine of the backend
+		if ((scheduler->pools[kBoincPoolNetwork].nbthreads > 0) && (scheduler->backend->downloadStart != NULL)) {
+			err = boincSchedulerDownloadStart(scheduler, wu, event);
+			if (err) {
 				boincSchedulerSetWorkUnitError(scheduler, wu, err);
 				return boincSchedulerRegenerate(scheduler, boincErrorDelay(err), event, 0, NULL);
-
-			} 
-			boincFree(event);
+			}
 			break;
+		}
+
+		err = boincSchedulerDownload(scheduler, scheduler->workunits[index]);
+		if (err) {
+			boincSchedulerSetWorkUnitError(scheduler, wu, err);
+			return boincSchedulerRegenerate(scheduler, boincErrorDelay(err), event, 0, NULL);
+
+		} 
+		boincFree(event);
+		break;
+      
+	case kBoincWorkUnitWaiting:
       
-		case kBoincWorkUnitDownloading:
+		// Don't compute what will be late anyway
+		if (boincSchedulerShouldAbort(scheduler, wu)) {
+			return boincSchedulerAbort(scheduler, wu, event, kBoincExitAborted);
+		}
 
-			// Set the state to downloading
-			err = boincSchedulerSetWorkUnitStatus(scheduler, index, kBoincWorkUnitDownloading);
+		// Set the state to waiting
+		err = boincSchedulerSetWorkUnitStatus(scheduler, index, kBoincWorkUnitWaiting);
+		if (err != NULL) {
+			boincSchedulerSetWorkUnitError(scheduler, wu, err);
+			return boincSchedulerRegenerate(scheduler, 0, event, 0, NULL);
+		}
+      
+		// If a compute slot is free, promote this one
+		if (boincSchedulerAdmit(scheduler, kBoincWaitCompute, index, kBoincWorkUnitComputing, &err)) {
 			if (err != NULL) {
 				boincSchedulerSetWorkUnitError(scheduler, wu, err);
 				return boincSchedulerRegenerate(scheduler, 0, event, 0, NULL);
 			}
+			boincFree(event);
+			return boincQueuePut(scheduler->queue, boincSchedulerNow(scheduler), boincEventCreate(kBoincWorkUnitComputing, index));
+		} else {
+			// Otherwise, wait for a compute slot
+			return boincSchedulerPark(scheduler, kBoincWaitCompute, event);
+		}
+		break;
       
-			err = boincSchedulerDownload(scheduler, scheduler->workunits[index]);
-			if (err) {
-				boincSchedulerSetWorkUnitError(scheduler, wu, err);
-				return boincSchedulerRegenerate(scheduler, boincErrorDelay(err), event, 0, NULL);
+	case kBoincWorkUnitComputing:
+    
+		err = boincSchedulerCompute(scheduler, scheduler->workunits[index]);
+		if (err) {
+			boincSchedulerSetWorkUnitError(scheduler, wu, err);
+			return boincSchedulerRegenerate(scheduler, boincErrorDelay(err), event, 0, NULL);
 
-			} 
-			boincFree(event);
-			break;
+		} 
+		boincFree(event);
+		break;
       
-		case kBoincWorkUnitWaiting:
+	case kBoincWorkUnitFinished:
       
-			// Set the state to waiting
-			err = boincSchedulerSetWorkUnitStatus(scheduler, index, kBoincWorkUnitWaiting);
+		err = boincSchedulerSetWorkUnitStatus(scheduler, index, kBoincWorkUnitFinished);
+		wu->result->cpu_time = boincSchedulerNow(scheduler) - wu->result->cpu_time;
+		if (err != NULL) {
+			boincSchedulerSetWorkUnitError(scheduler, wu, err);
+			return boincSchedulerRegenerate(scheduler, 0, event, 0, NULL);
+		}
+      
+		// If no workunit is uploading, start this one
+		if (boincSchedulerAdmit(scheduler, kBoincWaitUpload, index, kBoincWorkUnitUploading, &err)) {
+
 			if (err != NULL) {
 				boincSchedulerSetWorkUnitError(scheduler, wu, err);
 				return boincSchedulerRegenerate(scheduler, 0, event, 0, NULL);
 			}
-      
-			// If no workunit is computing, promote this one
-			if (boincSchedulerCountComputing(scheduler) == 0) {
-				// Set the state to computing
-				err = boincSchedulerSetWorkUnitStatus(scheduler, index, kBoincWorkUnitComputing);
+			boincFree(event);
+			return boincQueuePut(scheduler->queue, boincSchedulerNow(scheduler), boincEventCreate(kBoincWorkUnitUploading, index));
+
+		} else {
+			// Sorry, wait for the upload slot
+			return boincSchedulerPark(scheduler, kBoincWaitUpload, event);
+		}
+		break;
+
+	case kBoincWorkUnitUploading:
+    
+		err = boincSchedulerUpload(scheduler, scheduler->workunits[index]);
+		if (err) {
+			if ((boincErrorCode(err) == kBoincFileSystem) 
+			    && (event->nbtries >= 10)) {
+				err = boincSchedulerSetWorkUnitStatus(scheduler, index, kBoincWorkUnitFailed);
 				if (err != NULL) {
 					boincSchedulerSetWorkUnitError(scheduler, wu, err);
 					return boincSchedulerRegenerate(scheduler, 0, event, 0, NULL);
 				}
-				boincFree(event);
-				return boincQueuePut(scheduler->queue, boincQueueNow(), boincEventCreate(kBoincWorkUnitComputing, index));
-			} else {
-				// Otherwise, resend an event
-				return boincSchedulerRegenerate(scheduler, 5, event, 0, NULL);
-			}
-			break;
-      
-		case kBoincWorkUnitComputing:
-            
-			err = boincSchedulerCompute(scheduler, scheduler->workunits[index]);
-			if (err) {
-				boincSchedulerSetWorkUnitError(scheduler, wu, err);
-				return boincSchedulerRegenerate(scheduler, boincErrorDelay(err), event, 0, NULL);
-
+				return boincQueuePut(scheduler->queue, boincSchedulerNow(scheduler), boincEventCreate(kBoincWorkUnitFailed, index));
 			} 
-			boincFree(event);
-			break;
+			boincSchedulerSetWorkUnitError(scheduler, wu, err);
+			return boincSchedulerRegenerate(scheduler, boincErrorDelay(err), event, 0, NULL);
+		} 
+		boincFree(event);
+		break;
       
-		case kBoincWorkUnitFinished:
+	case kBoincWorkUnitFailed:
+	case kBoincWorkUnitCompleted:
       
-			err = boincSchedulerSetWorkUnitStatus(scheduler, index, kBoincWorkUnitFinished);
-			wu->result->cpu_time = time(NULL) - wu->result->cpu_time;
+		if ((event->eventType == kBoincWorkUnitFailed) && boincSchedulerIsAborted(scheduler, index)) {
+			err = boincSchedulerReportAborted(scheduler, wu);
 			if (err != NULL) {
 				boincSchedulerSetWorkUnitError(scheduler, wu, err);
 				return boincSchedulerRegenerate(scheduler, 0, event, 0, NULL);
 			}
-      
-			// If no workunit is uploading, start this one
-			if (boincSchedulerCountUploading(scheduler) == 0) {
+			boincFree(event);
+			break;
+		}
 
-				err = boincSchedulerSetWorkUnitStatus(scheduler, index, kBoincWorkUnitUploading);
-				if (err != NULL) {
-					boincSchedulerSetWorkUnitError(scheduler, wu, err);
-					return boincSchedulerRegenerate(scheduler, 0, event, 0, NULL);
+                err = boincSchedulerCompleted(scheduler, wu, (event->eventType == kBoincWorkUnitFailed));
+                if (err != NULL) {
+                        boincSchedulerSetWorkUnitError(scheduler, wu, err);
+                        return boincSchedulerRegenerate(scheduler, 0, event, 0, NULL);
+                }
+                
+                if (event->eventType == kBoincWorkUnitCompleted) {
+                        boincFree(event);
+                        boincMutexLock(scheduler->mutex);
+                        int totalWorkunits = 1 + boincConfigurationGetNumber(scheduler->configuration, 
+                                                                             kBoincUserTotalWorkunits); 
+                        boincConfigurationSetNumber(scheduler->configuration, 
+                                                    kBoincUserTotalWorkunits, 
+                                                    totalWorkunits);
+                        boincMutexUnlock(scheduler->mutex);
+                        return boincConfigurationStore(scheduler->configuration);
+                }
+                
+                boincFree(event);
+                break;    
+	}
+	return err;
+}
+
+/**
+ * The slot an event is about, -1 for the events of the scheduler
+ */
+static int boincSchedulerSlotOf(BoincEvent* event)
+{
+	return ((event->eventType >= 0) || (event->eventType == kBoincEventErase))? event->index : -1;
+}
+
+/**
+ * Loop of an I/O thread: handle the events given to the pool until the
+ * scheduler is destroyed.
+ *
+ * The network thread also runs the downloads in flight between the
+ * events, and waits on them rather than on the queue while there are
+ * some. The downloads left are cancelled when it stops.
+ */
+static void boincSchedulerWorker(void* data)
+{
+	BoincSchedulerPool * pool = (BoincSchedulerPool*) data;
+	BoincScheduler * scheduler = pool->scheduler;
+	int network = (pool == &scheduler->pools[kBoincPoolNetwork]);
+
+	while (!boincAtomicLoad(&pool->stop)) {
+		BoincEvent * event = (BoincEvent*) boincQueueGet(pool->jobs);
+		if (network && (scheduler->downloading > 0)) {
+			// A new event waits 100 ms at most
+			scheduler->backend->perform(scheduler, (event == NULL)? 100 : 0, scheduler->backendData);
+		}
+		if (event == NULL) {
+			if (!network || (scheduler->downloading == 0)) {
+				boincQueueWait(pool->jobs, 3600);
+			}
+			continue;
+		}
+
+		int slot = boincSchedulerSlotOf(event);
+		if (slot >= 0) {
+			boincMutexLock(scheduler->slotLocks[slot]);
+		}
+		BoincError err = boincSchedulerHandleEvent(scheduler, event);
+		if (slot >= 0) {
+			boincMutexUnlock(scheduler->slotLocks[slot]);
+		}
+
+		boincSchedulerIOFailed(scheduler, err);
+	}
+
+	if (network && (scheduler->downloading > 0)) {
+		scheduler->backend->cancel(scheduler, scheduler->backendData);
+	}
+
+	// Pass the wakeup on to the next thread of the pool
+	boincQueueWake(pool->jobs);
+}
+
+/**
+ * Start the I/O threads, the first time the events are handled. The
+ * replay and the simulator run on a virtual clock and have none: their
+ * transfers take no real time anyway.
+ *
+ * The transfers share the HTTP handles of the proxy, which only the
+ * network thread may use: without it, the events are not handled.
+ */
+static BoincError boincSchedulerStartPools(BoincScheduler* scheduler)
+{
+	boincMutexLock(scheduler->mutex);
+	if (scheduler->pools[kBoincPoolNetwork].started) {
+		boincMutexUnlock(scheduler->mutex);
+		return NULL;
+	}
+
+	// A single network thread runs all the transfers on the engine
+	int sizes[kBoincPools] = {
+		1, boincSchedulerGetSetting(scheduler->configuration, kBoincSchedulerDiskThreads, 2)
+	};
+
+	for (int p = 0; p < kBoincPools; p++) {
+		BoincSchedulerPool * pool = &scheduler->pools[p];
+		pool->started = 1;
+		pool->scheduler = scheduler;
+
+#if !defined(BOINCLITE_SINGLE_THREADED)
+		if (!scheduler->ioThreads || scheduler->inlineRun || (sizes[p] < 1)) {
+			continue;
+		}
+		pool->jobs = boincQueueCreate();
+		pool->threads = boincArray(BoincThread, sizes[p]);
+		if ((pool->jobs != NULL) && (pool->threads != NULL)) {
+			// The jobs waiting for a thread are served by class too
+			boincQueueSetPriority(pool->jobs, boincEventPriority,
+					      boincSchedulerGetSetting(scheduler->configuration, kBoincSchedulerPriorityAging, 30));
+			boincQueueSetClock(pool->jobs, scheduler->clock, scheduler->clockData);
+			for (int i = 0; i < sizes[p]; i++) {
+				BoincThread thread = boincThreadCreate(boincSchedulerWorker, pool);
+				if (!thread) {
+					break;
 				}
+				pool->threads[pool->nbthreads++] = thread;
+			}
+		}
+		if (pool->nbthreads > 0) {
+			continue;
+		}
+
+		if (pool->jobs != NULL) {
+			boincQueueDestroy(pool->jobs);
+			pool->jobs = NULL;
+		}
+		if (pool->threads != NULL) {
+			boincFree(pool->threads);
+			pool->threads = NULL;
+		}
+
+		if (p == kBoincPoolNetwork) {
+			// Tried again by the next call
+			pool->started = 0;
+			boincMutexUnlock(scheduler->mutex);
+			return boincErrorCreate(kBoincFatal, kBoincSystem, "Could not start the network thread");
+		}
+		boincLog(kBoincError, kBoincSystem, "Could not start the disk threads");
+#endif
+	}
+	boincMutexUnlock(scheduler->mutex);
+
+	return NULL;
+}
+
+static void boincSchedulerStopPools(BoincScheduler* scheduler)
+{
+	for (int p = 0; p < kBoincPools; p++) {
+		BoincSchedulerPool * pool = &scheduler->pools[p];
+
+		// A request in progress is finished first, the downloads in
+		// flight are cancelled
+		boincAtomicStore(&pool->stop, 1);
+		if (pool->jobs != NULL) {
+			boincQueueWake(pool->jobs);
+		}
+		for (int i = 0; i < pool->nbthreads; i++) {
+			boincThreadJoin(pool->threads[i]);
+		}
+		pool->nbthreads = 0;
+
+		if (pool->threads != NULL) {
+			boincFree(pool->threads);
+			pool->threads = NULL;
+		}
+		if (pool->jobs != NULL) {
+			BoincEvent * event;
+			while ((event = (BoincEvent*) boincQueueGet(pool->jobs)) != NULL) {
 				boincFree(event);
-				return boincQueuePut(scheduler->queue, boincQueueNow(), boincEventCreate(kBoincWorkUnitUploading, index));
+			}
+			boincQueueDestroy(pool->jobs);
+			pool->jobs = NULL;
+		}
+	}
+}
 
-			} else {
-				// Sorry
-				return boincSchedulerRegenerate(scheduler, 5, event, 0, NULL);
+/**
+ * The pool that handles an event, -1 if it is handled right away
+ */
+static int boincSchedulerPoolOf(BoincScheduler* scheduler, BoincEvent* event)
+{
+	int pool = -1;
+
+	switch (event->eventType) {
+	case kBoincEventInit:
+	case kBoincWorkUnitInitializing:
+	case kBoincWorkUnitDownloading:
+	case kBoincWorkUnitUploading:
+	case kBoincWorkUnitFailed:
+	case kBoincWorkUnitCompleted:
+		pool = kBoincPoolNetwork;
+		break;
+	case kBoincEventErase:
+		pool = kBoincPoolDisk;
+		break;
+	}
+
+	if ((pool < 0) || (scheduler->pools[pool].nbthreads == 0)) {
+		return -1;
+	}
+	return pool;
+}
+
+BoincError boincSchedulerHandleEvents(BoincScheduler* scheduler)
+{
+	boincDebug("handle events");
+
+	BoincError err = boincSchedulerStartPools(scheduler);
+	if (err != NULL) {
+		return err;
+	}
+
+	// A fatal error of an I/O thread
+	boincMutexLock(scheduler->mutex);
+	err = scheduler->ioError;
+	scheduler->ioError = NULL;
+	boincMutexUnlock(scheduler->mutex);
+	if (err != NULL) {
+		return err;
+	}
+
+	err = boincSchedulerReadInbox(scheduler);
+	if (err != NULL) {
+		return err;
+	}
+
+	BoincEvent * event = (BoincEvent*) boincQueueGet(scheduler->queue);
+  
+	BoincWorkUnit * wu = NULL;
+	int index = -1;
+
+	if (event) {
+
+		// The other threads handle the events of the other slots
+		int slot = boincSchedulerSlotOf(event);
+		if (slot >= 0) {
+			boincMutexLock(scheduler->slotLocks[slot]);
+		}
+
+		if (event->eventType >= 0) {
+			index = event->index;
+			wu = scheduler->workunits[index];
+		}
+
+		if (scheduler->trace != NULL) {
+			boincTraceWriteEvent(scheduler->trace, boincSchedulerNow(scheduler), 
+					     (event->eventType < 0)? -1 : index, 
+					     event->eventType, event->nbtries);
+		}
+    
+		boincDebugf("Deal event %d (i:%d)", event->eventType, event->index);
+		//boincDebugSchedulerStates(scheduler);
+
+		// Whatever happened to a workunit aborted meanwhile, fail it.
+		// The transfers and the deletes run on the I/O threads,
+		// which post the follow-up events.
+		int pool = -1;
+		if ((wu != NULL) && (event->eventType != kBoincWorkUnitFailed)
+		    && (event->eventType != kBoincWorkUnitCreated)
+		    && boincSchedulerIsAborted(scheduler, index)) {
+			err = boincSchedulerAbort(scheduler, wu, event, kBoincExitAborted);
+		} else if ((pool = boincSchedulerPoolOf(scheduler, event)) >= 0) {
+			// Due now, so that a completion does not wait behind
+			// the retries already handed to the pool
+			err = boincQueuePut(scheduler->pools[pool].jobs, boincSchedulerNow(scheduler), event);
+		} else {
+			err = boincSchedulerHandleEvent(scheduler, event);
+		}
+
+		if (slot >= 0) {
+			boincMutexUnlock(scheduler->slotLocks[slot]);
+		}
+	}
+
+	return err;
+}
+
+BoincError boincSchedulerRun(BoincScheduler* scheduler, int timeout)
+{
+	unsigned int start = boincSchedulerNow(scheduler);
+
+	if (!boincQueueWait(scheduler->queue, (timeout > 0)? timeout : 0)) {
+		return NULL;
+	}
+
+	// Drain the due events. A transition that needs no transfer posts
+	// its follow-up event for now, so it is chained in the same call.
+	for (int budget = RUN_BUDGET; (budget > 0) && boincSchedulerHasEvents(scheduler); budget--) {
+
+		BoincError err = boincSchedulerHandleEvents(scheduler);
+		if (err != NULL) {
+			if (boincErrorType(err) == kBoincFatal) {
+				return err;
 			}
-			break;
+			boincLogError(err);
+			boincErrorDestroy(err);
+		}
 
-		case kBoincWorkUnitUploading:
-            
-			err = boincSchedulerUpload(scheduler, scheduler->workunits[index]);
-			if (err) {
-				if ((boincErrorCode(err) == kBoincFileSystem) 
-				    && (event->nbtries >= 10)) {
-					err = boincSchedulerSetWorkUnitStatus(scheduler, index, kBoincWorkUnitFailed);
-					if (err != NULL) {
-						boincSchedulerSetWorkUnitError(scheduler, wu, err);
-						return boincSchedulerRegenerate(scheduler, 0, event, 0, NULL);
-					}
-					return boincQueuePut(scheduler->queue, boincQueueNow(), boincEventCreate(kBoincWorkUnitFailed, index));
-				} 
-				boincSchedulerSetWorkUnitError(scheduler, wu, err);
-				return boincSchedulerRegenerate(scheduler, boincErrorDelay(err), event, 0, NULL);
-			} 
-			boincFree(event);
+		if ((timeout > 0) && (boincSchedulerNow(scheduler) - start >= (unsigned int) timeout)) {
 			break;
-      
-		case kBoincWorkUnitFailed:
-		case kBoincWorkUnitCompleted:
-      
-                        err = boincSchedulerCompleted(scheduler, wu, (event->eventType == kBoincWorkUnitFailed));
-                        if (err != NULL) {
-                                boincSchedulerSetWorkUnitError(scheduler, wu, err);
-                                return boincSchedulerRegenerate(scheduler, 0, event, 0, NULL);
-                        }
-                        
-                        if (event->eventType == kBoincWorkUnitCompleted) {
-                                int totalWorkunits = 1 + boincConfigurationGetNumber(scheduler->configuration, 
-                                                                                     kBoincUserTotalWorkunits); 
-                                boincConfigurationSetNumber(scheduler->configuration, 
-                                                            kBoincUserTotalWorkunits, 
-                                                            totalWorkunits);
-                                return boincConfigurationStore(scheduler->configuration);
-                        }
-                        
-                        boincFree(event);
-                        break;    
 		}
 	}
 
-	return err;
+	return NULL;
+}
+
+double boincSchedulerGetWakeupsPerMinute(BoincScheduler* scheduler)
+{
+	unsigned int elapsed = boincQueueNow() - scheduler->created;
+	if (elapsed < 60) {
+		elapsed = 60;
+	}
+	return 60.0 * boincQueueCountWakeups(scheduler->queue) / elapsed;
 }
 
 int boincSchedulerCountWorkUnits(BoincScheduler* scheduler)
@@ -913,7 +2386,7 @@ int boincSchedulerCountWorkUnits(BoincScheduler* scheduler)
 	return scheduler->nbworkunits;
 }
 
-// Only used in BoincSchedulerTest.c
+// Used in BoincSchedulerTest.c and by the trace replay
 BoincWorkUnit* boincSchedulerGetWorkUnit(BoincScheduler* scheduler, int index)
 {
 	if ((index < 0) || (index >= boincSchedulerCountWorkUnits(scheduler)))
@@ -935,11 +2408,87 @@ void boincSchedulerGetWorkUnitStatus(BoincScheduler* scheduler, BoincWorkUnitSta
 
 	boincMutexLock(scheduler->mutex);
 
-	boincWorkUnitGetStatus(scheduler->workunits[index], status);
+	if (scheduler->workunits[index] != NULL) {
+		boincWorkUnitGetStatus(scheduler->workunits[index], status);
+	} else {
+		// Not loaded yet
+		status->status = kBoincWorkUnitLoading;
+	}
+
+	boincMutexUnlock(scheduler->mutex);
+}
+
+
+BoincQueue* boincSchedulerGetQueue(BoincScheduler* scheduler)
+{
+	return scheduler->queue;
+}
+
+int boincSchedulerGetPrefetchDepth(BoincScheduler* scheduler)
+{
+	boincMutexLock(scheduler->mutex);
+	int depth = scheduler->tuner.depth;
+	boincMutexUnlock(scheduler->mutex);
+	return depth;
+}
+
+int boincSchedulerCountComputeSlots(BoincScheduler* scheduler)
+{
+	return scheduler->nbcompute;
+}
 
+void boincSchedulerSetBackend(BoincScheduler* scheduler, BoincSchedulerBackend* backend, void* data)
+{
+	scheduler->backend = (backend != NULL)? backend : &boincSchedulerProxyBackend;
+	scheduler->backendData = (backend != NULL)? data : NULL;
+	scheduler->ioThreads = (backend == NULL);
+}
+
+void boincSchedulerSetIOThreads(BoincScheduler* scheduler, int ioThreads)
+{
+	scheduler->ioThreads = ioThreads;
+}
+
+void boincSchedulerSetInline(BoincScheduler* scheduler, int inlineRun)
+{
+	scheduler->inlineRun = inlineRun;
+}
+
+void boincSchedulerSetClock(BoincScheduler* scheduler, BoincQueueClock clock, void* clockData)
+{
+	boincMutexLock(scheduler->mutex);
+	scheduler->clock = clock;
+	scheduler->clockData = clockData;
+	boincQueueSetClock(scheduler->queue, clock, clockData);
+	for (int i = 0; i < kBoincWaitLists; i++) {
+		boincQueueSetClock(scheduler->waiting[i], clock, clockData);
+	}
+	for (int p = 0; p < kBoincPools; p++) {
+		if (scheduler->pools[p].jobs != NULL) {
+			boincQueueSetClock(scheduler->pools[p].jobs, clock, clockData);
+		}
+	}
 	boincMutexUnlock(scheduler->mutex);
 }
 
+BoincError boincSchedulerSetTraceFile(BoincScheduler* scheduler, const char* traceFile)
+{
+	if (scheduler->trace != NULL) {
+		boincTraceDestroy(scheduler->trace);
+		scheduler->trace = NULL;
+	}
+
+	if (traceFile == NULL) {
+		return NULL;
+	}
+
+	scheduler->trace = boincTraceCreate(traceFile);
+	if (scheduler->trace == NULL) {
+		return boincErrorCreatef(kBoincError, kBoincFileSystem, "Cannot create trace file %s", traceFile);
+	}
+
+	return NULL;
+}
 
 BoincError boincSchedulerChangeAuthentication(BoincScheduler* scheduler, const char* email, const char* password)
 {
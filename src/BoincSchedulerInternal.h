@@ -0,0 +1,115 @@
+/*
+  BoincLite, a light-weight library for BOINC clients.
+
+  Copyright (C) 2008 Sony Computer Science Laboratory Paris 
+  Authors: Peter Hanappe, Anthony Beurive, Tangui Morlier
+
+  This library is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation; version 2.1 of the
+  License.
+
+  This library is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+  02110-1301 USA
+
+*/ 
+#ifndef __BoincSchedulerInternal_H__
+#define __BoincSchedulerInternal_H__
+
+#include "BoincLite.h"
+#include "BoincUtil.h"
+
+/** \brief Called once a transfer started by the backend is over
+ */
+typedef void (*BoincSchedulerDone)(void* doneData, BoincError err);
+
+/** \brief Everything the scheduler state machine does not decide itself.
+ *
+ *  The default backend talks to the project server through BoincProxy
+ *  and hands the work units to the compute callback of the
+ *  application. The trace replay and the simulator swap it for stubs
+ *  that return recorded or simulated outcomes.
+ */
+typedef struct _BoincSchedulerBackend {
+	BoincError (*init)(BoincScheduler* scheduler, void* data);
+	BoincError (*loadWorkUnit)(BoincScheduler* scheduler, BoincWorkUnit* wu, void* data);
+	BoincError (*requestWork)(BoincScheduler* scheduler, BoincWorkUnit* wu, void* data);
+	BoincError (*download)(BoincScheduler* scheduler, BoincWorkUnit* wu, void* data);
+	BoincError (*compute)(BoincScheduler* scheduler, BoincWorkUnit* wu, void* data);
+	BoincError (*upload)(BoincScheduler* scheduler, BoincWorkUnit* wu, void* data);
+	BoincError (*report)(BoincScheduler* scheduler, BoincWorkUnit* wu, unsigned int failed, void* data);
+	// Optional: report several workunits in a single request. Without
+	// it, the scheduler calls report for each of them.
+	BoincError (*reportBatch)(BoincScheduler* scheduler, BoincWorkUnit** wus, int count, 
+				  unsigned int failed, void* data);
+	// Optional: start a download without waiting for it, then call
+	// done, possibly before returning, unless an error is returned.
+	// The network thread runs the transfers with perform while some
+	// are in flight, and stops them with cancel. Without them, the
+	// scheduler calls download.
+	BoincError (*downloadStart)(BoincScheduler* scheduler, BoincWorkUnit* wu, 
+				    BoincSchedulerDone done, void* doneData, void* data);
+	void (*perform)(BoincScheduler* scheduler, int timeout, void* data);
+	void (*cancel)(BoincScheduler* scheduler, void* data);
+} BoincSchedulerBackend;
+
+/** \brief Replace the backend (NULL restores the default one)
+ */
+void boincSchedulerSetBackend(BoincScheduler* scheduler, BoincSchedulerBackend* backend, void* data);
+
+/** \brief Whether the transfers and the deletes run on I/O threads
+ *
+ *  The default backend uses them, the others are called by the thread
+ *  handling the events. Set it after the backend and before the
+ *  events are handled.
+ */
+void boincSchedulerSetIOThreads(BoincScheduler* scheduler, int ioThreads);
+
+/** \brief Whether everything runs on the thread handling the events
+ *
+ *  Inline, the slots are loaded without loader threads, the transfers
+ *  and the deletes without I/O threads, and the project configuration
+ *  of the last run is not used: the backend plays every call. The
+ *  replay and the simulator run inline. Set it before the events are
+ *  handled.
+ */
+void boincSchedulerSetInline(BoincScheduler* scheduler, int inlineRun);
+
+/** \brief Replace the clock of the scheduler and its queues (NULL
+ *  restores the real time)
+ *
+ *  The replay and the simulator play the scheduling on their virtual
+ *  clock, faster than real time. The other schedulers of the process
+ *  keep their own clock.
+ */
+void boincSchedulerSetClock(BoincScheduler* scheduler, BoincQueueClock clock, void* clockData);
+
+BoincWorkUnit* boincSchedulerGetWorkUnit(BoincScheduler* scheduler, int index);
+
+BoincQueue* boincSchedulerGetQueue(BoincScheduler* scheduler);
+
+/** \brief How many workunits may compute at once
+ */
+int boincSchedulerCountComputeSlots(BoincScheduler* scheduler);
+
+/** \brief How many workunits are fetched ahead of the computation
+ */
+int boincSchedulerGetPrefetchDepth(BoincScheduler* scheduler);
+
+/** \brief Abort a result on request of the project server
+ *
+ *  The workunit is failed and reported with kBoincExitAbortedByProject
+ *  unless it is finished already. With ifNotStarted, the workunit is
+ *  only aborted if it did not start computing. Unknown results are
+ *  ignored.
+ */
+BoincError boincSchedulerAbortResult(BoincScheduler* scheduler, const char* resultName, int ifNotStarted);
+
+#endif // __BoincSchedulerInternal_H__
@@ -0,0 +1,416 @@
+/*
+  BoincLite, a light-weight library for BOINC clients.
+
+  Copyright (C) 2008 Sony Computer Science Laboratory Paris 
+  Authors: Peter Hanappe, Anthony Beurive, Tangui Morlier
+
+  This library is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation; version 2.1 of the
+  License.
+
+  This library is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+  02110-1301 USA
+
+*/ 
+#include "BoincLite.h"
+#include "BoincMem.h"
+#include "BoincError.h"
+#include "BoincUtil.h"
+#include "BoincSchedulerInternal.h"
+#include "BoincProxy.h"
+#include "BoincTrace.h"
+#include <string.h>
+#include <stdio.h>
+
+
+/*
+  The simulator runs the scheduler against a made-up project server.
+
+  Like the replay, it swaps the backend for stubs and drives the queue
+  with a virtual clock. Every server request takes the configured
+  latency plus the transfer time, and fails at random with the
+  configured rate. The application computes each workunit for a
+  random time around the mean and then posts the Finished status.
+  The server may abort a result at a random time before its end.
+*/
+
+typedef struct _BoincSimulator {
+	const BoincSimulationParameters * parameters;
+	BoincSimulationReport * report;
+	unsigned int now;
+	unsigned int end;
+	unsigned int random;
+	int nbslots;
+	int nbcompute;
+	unsigned int * finish;    // end of the computation per slot, 0 if none
+	unsigned int * cancel;    // time the server aborts the result per slot, 0 if never
+	int workunits;            // counter used to name the simulated workunits
+} BoincSimulator;
+
+static unsigned int boincSimulatorClock(void* data)
+{
+	BoincSimulator * sim = (BoincSimulator*) data;
+	return sim->now;
+}
+
+// A small linear congruential generator: the runs must not depend on
+// the C library or on whoever else calls rand().
+static double boincSimulatorRandom(BoincSimulator* sim)
+{
+	sim->random = sim->random * 1664525 + 1013904223;
+	return (sim->random >> 8) / 16777216.0;
+}
+
+static int boincSimulatorCountBusy(BoincSimulator* sim, unsigned int t)
+{
+	int busy = 0;
+	for (int i = 0; i < sim->nbslots; i++) {
+		if (sim->finish[i] > t) {
+			busy++;
+		}
+	}
+	return busy;
+}
+
+/**
+ * Move the clock forward, accounting for the compute slots left idle
+ * on the way. Computations may end in the middle of the interval.
+ */
+static void boincSimulatorAdvance(BoincSimulator* sim, unsigned int to)
+{
+	while (sim->now < to) {
+		unsigned int next = to;
+		for (int i = 0; i < sim->nbslots; i++) {
+			if ((sim->finish[i] > sim->now) && (sim->finish[i] < next)) {
+				next = sim->finish[i];
+			}
+		}
+
+		int idle = sim->nbcompute - boincSimulatorCountBusy(sim, sim->now);
+		if (idle > 0) {
+			sim->report->idleCoreTime += (double) idle * (next - sim->now);
+		}
+		sim->now = next;
+	}
+}
+
+static BoincError boincSimulatorRequest(BoincSimulator* sim, double bytes, double bandwidth, double failureRate, const char* what)
+{
+	unsigned int duration = sim->parameters->latency;
+	if ((bytes > 0) && (bandwidth > 0)) {
+		duration += (unsigned int) (bytes / bandwidth);
+	}
+
+	sim->report->requests++;
+
+	if (boincSimulatorRandom(sim) < failureRate) {
+		// Fail somewhere in the middle of the transfer
+		boincSimulatorAdvance(sim, sim->now + duration / 2);
+		sim->report->failures++;
+		if (sim->parameters->serverDelay > 0) {
+			return boincErrorCreateWithDelay(kBoincNetwork, what, sim->parameters->serverDelay);
+		}
+		return boincErrorCreate(kBoincError, kBoincNetwork, what);
+	}
+
+	boincSimulatorAdvance(sim, sim->now + duration);
+
+	return NULL;
+}
+
+static BoincError boincSimulatorInit(BoincScheduler* scheduler, void* data)
+{
+	BoincSimulator * sim = (BoincSimulator*) data;
+	return boincSimulatorRequest(sim, 0, 0, 0, "Simulated initialization failure");
+}
+
+static BoincError boincSimulatorLoadWorkUnit(BoincScheduler* scheduler, BoincWorkUnit* wu, void* data)
+{
+	// Nothing on disk: every slot starts empty
+	return NULL;
+}
+
+static BoincError boincSimulatorRequestWork(BoincScheduler* scheduler, BoincWorkUnit* wu, void* data)
+{
+	BoincSimulator * sim = (BoincSimulator*) data;
+	char name[64];
+
+	BoincError err = boincSimulatorRequest(sim, 0, 0, sim->parameters->requestFailureRate,
+					       "Simulated scheduler request failure");
+	if (err != NULL) {
+		return err;
+	}
+
+	snprintf(name, 64, "sim_%d", sim->workunits++);
+
+	if (wu->name == NULL) {
+		wu->name = boincArray(char, strlen(name) + 1);
+		if (wu->name == NULL) {
+			return boincErrorCreate(kBoincFatal, kBoincSystem, "Out of memory");
+		}
+		strcpy(wu->name, name);
+	}
+
+	if (wu->result == NULL) {
+		wu->result = boincNew(BoincResult);
+		if (wu->result == NULL) {
+			return boincErrorCreate(kBoincFatal, kBoincSystem, "Out of memory");
+		}
+		wu->result->name = boincArray(char, strlen(name) + 1);
+		if (wu->result->name == NULL) {
+			return boincErrorCreate(kBoincFatal, kBoincSystem, "Out of memory");
+		}
+		strcpy(wu->result->name, name);
+	}
+	wu->result->deadline = (sim->parameters->deadline > 0)? sim->now + sim->parameters->deadline : 0;
+
+	sim->cancel[wu->index] = 0;
+	if (boincSimulatorRandom(sim) < sim->parameters->cancelRate) {
+		sim->cancel[wu->index] = sim->now + 1 + (unsigned int) (boincSimulatorRandom(sim) * sim->parameters->computeTime);
+	}
+
+	return NULL;
+}
+
+static BoincError boincSimulatorDownload(BoincScheduler* scheduler, BoincWorkUnit* wu, void* data)
+{
+	BoincSimulator * sim = (BoincSimulator*) data;
+	return boincSimulatorRequest(sim, sim->parameters->downloadBytes, sim->parameters->downBandwidth,
+				     sim->parameters->downloadFailureRate, "Simulated download failure");
+}
+
+static BoincError boincSimulatorCompute(BoincScheduler* scheduler, BoincWorkUnit* wu, void* data)
+{
+	BoincSimulator * sim = (BoincSimulator*) data;
+
+	double spread = sim->parameters->computeSpread * (2 * boincSimulatorRandom(sim) - 1);
+	unsigned int duration = (unsigned int) (sim->parameters->computeTime * (1 + spread));
+	if (duration == 0) {
+		duration = 1;
+	}
+
+	sim->finish[wu->index] = sim->now + duration;
+
+	return NULL;
+}
+
+static BoincError boincSimulatorUpload(BoincScheduler* scheduler, BoincWorkUnit* wu, void* data)
+{
+	BoincSimulator * sim = (BoincSimulator*) data;
+	return boincSimulatorRequest(sim, sim->parameters->uploadBytes, sim->parameters->upBandwidth,
+				     sim->parameters->uploadFailureRate, "Simulated upload failure");
+}
+
+static BoincError boincSimulatorReport(BoincScheduler* scheduler, BoincWorkUnit* wu, unsigned int failed, void* data)
+{
+	BoincSimulator * sim = (BoincSimulator*) data;
+
+	BoincError err = boincSimulatorRequest(sim, 0, 0, sim->parameters->requestFailureRate,
+					       "Simulated report failure");
+	if (err != NULL) {
+		return err;
+	}
+
+	sim->cancel[wu->index] = 0;
+
+	if (failed == kBoincExitAbortedByProject) {
+		sim->report->cancelled++;
+		return NULL;
+	} else if (failed) {
+		sim->report->aborted++;
+		return NULL;
+	}
+
+	sim->report->completed++;
+	if ((wu->result != NULL) && (wu->result->deadline > 0) && (sim->now > wu->result->deadline)) {
+		sim->report->deadlineMisses++;
+	}
+
+	return NULL;
+}
+
+static BoincSchedulerBackend boincSimulatorBackend = {
+	boincSimulatorInit,
+	boincSimulatorLoadWorkUnit,
+	boincSimulatorRequestWork,
+	boincSimulatorDownload,
+	boincSimulatorCompute,
+	boincSimulatorUpload,
+	boincSimulatorReport,
+};
+
+/**
+ * Post the Finished status of the computations that are over.
+ */
+static BoincError boincSimulatorPostFinished(BoincSimulator* sim, BoincScheduler* scheduler)
+{
+	for (int i = 0; i < sim->nbslots; i++) {
+		if ((sim->finish[i] == 0) || (sim->finish[i] > sim->now)) {
+			continue;
+		}
+		sim->finish[i] = 0;
+		BoincError err = boincSchedulerChangeWorkUnitStatus(scheduler, boincSchedulerGetWorkUnit(scheduler, i),
+								    kBoincWorkUnitFinished);
+		if (err != NULL) {
+			return err;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Abort the results the server gave up. A computation in progress
+ * stops as soon as the application is told.
+ */
+static BoincError boincSimulatorPostCancels(BoincSimulator* sim, BoincScheduler* scheduler)
+{
+	for (int i = 0; i < sim->nbslots; i++) {
+		if ((sim->cancel[i] == 0) || (sim->cancel[i] > sim->now)) {
+			continue;
+		}
+		sim->cancel[i] = 0;
+
+		BoincWorkUnit * wu = boincSchedulerGetWorkUnit(scheduler, i);
+		if ((wu->result == NULL) || (wu->result->name == NULL)) {
+			continue;
+		}
+		BoincError err = boincSchedulerAbortResult(scheduler, wu->result->name, 0);
+		if (err != NULL) {
+			return err;
+		}
+
+		if (sim->finish[i] > sim->now) {
+			err = boincSchedulerSetWorkUnitProgress(scheduler, wu, 50);
+			if (err == NULL) {
+				continue;
+			}
+			boincErrorDestroy(err);
+			sim->finish[i] = 0;
+			err = boincSchedulerChangeWorkUnitStatus(scheduler, wu, kBoincWorkUnitFailed);
+			if (err != NULL) {
+				return err;
+			}
+		}
+	}
+	return NULL;
+}
+
+static BoincError boincSimulatorRun(BoincSimulator* sim, BoincScheduler* scheduler)
+{
+	BoincError err = NULL;
+	BoincQueue* queue = boincSchedulerGetQueue(scheduler);
+	int asleep = 0;
+
+	while (1) {
+
+		err = boincSimulatorPostFinished(sim, scheduler);
+		if (err != NULL) {
+			return err;
+		}
+
+		err = boincSimulatorPostCancels(sim, scheduler);
+		if (err != NULL) {
+			return err;
+		}
+
+		if (sim->now >= sim->end) {
+			return NULL;
+		}
+
+		if (boincSchedulerHasEvents(scheduler)) {
+			// The clock moved while the scheduler was idle: this is
+			// where its wait returns, so the queue counts the wakeup
+			if (asleep) {
+				boincQueueWait(queue, 0);
+				asleep = 0;
+			}
+			sim->report->events++;
+			err = boincSchedulerHandleEvents(scheduler);
+			if (err != NULL) {
+				if (boincErrorType(err) == kBoincFatal) {
+					return err;
+				}
+				boincLogError(err);
+				boincErrorDestroy(err);
+			}
+			continue;
+		}
+
+		// Nothing to do now: jump to the next event or the next
+		// end of a computation
+		unsigned int next = sim->end;
+		unsigned int eventTime;
+
+		if (boincQueueNextEventTime(boincSchedulerGetQueue(scheduler), &eventTime) && (eventTime < next)) {
+			next = eventTime;
+		}
+		for (int i = 0; i < sim->nbslots; i++) {
+			if ((sim->finish[i] > sim->now) && (sim->finish[i] < next)) {
+				next = sim->finish[i];
+			}
+			if ((sim->cancel[i] > sim->now) && (sim->cancel[i] < next)) {
+				next = sim->cancel[i];
+			}
+		}
+
+		boincSimulatorAdvance(sim, (next > sim->now)? next : sim->now + 1);
+		asleep = 1;
+	}
+}
+
+BoincError boincSchedulerSimulate(BoincScheduler* scheduler, const BoincSimulationParameters* parameters, 
+				  BoincSimulationReport* report)
+{
+	BoincSimulator sim;
+	BoincError err;
+
+	memset(&sim, 0, sizeof(BoincSimulator));
+	memset(report, 0, sizeof(BoincSimulationReport));
+
+	sim.parameters = parameters;
+	sim.report = report;
+	sim.random = parameters->seed;
+	sim.now = 0;
+	sim.end = parameters->duration;
+	sim.nbslots = boincSchedulerCountWorkUnits(scheduler);
+	sim.nbcompute = boincSchedulerCountComputeSlots(scheduler);
+	sim.finish = boincArray(unsigned int, sim.nbslots);
+	sim.cancel = boincArray(unsigned int, sim.nbslots);
+	if ((sim.finish == NULL) || (sim.cancel == NULL)) {
+		boincFree(sim.finish);
+		boincFree(sim.cancel);
+		return boincErrorCreate(kBoincFatal, kBoincSystem, "Out of memory");
+	}
+
+	boincSchedulerSetBackend(scheduler, &boincSimulatorBackend, &sim);
+	boincSchedulerSetInline(scheduler, 1);
+	boincSchedulerSetClock(scheduler, boincSimulatorClock, &sim);
+
+	int wakeups = boincQueueCountWakeups(boincSchedulerGetQueue(scheduler));
+	err = boincSimulatorRun(&sim, scheduler);
+	report->wakeups = boincQueueCountWakeups(boincSchedulerGetQueue(scheduler)) - wakeups;
+
+	boincSchedulerSetClock(scheduler, NULL, NULL);
+	boincSchedulerSetInline(scheduler, 0);
+	boincSchedulerSetBackend(scheduler, NULL, NULL);
+
+	report->virtualTime = sim.now;
+	report->prefetchDepth = boincSchedulerGetPrefetchDepth(scheduler);
+	if (sim.now > 0) {
+		report->throughput = 3600.0 * report->completed / sim.now;
+		report->idleCoreRatio = report->idleCoreTime / ((double) sim.nbcompute * sim.now);
+	}
+
+	boincFree(sim.finish);
+	boincFree(sim.cancel);
+
+	return err;
+}
@@ -0,0 +1,197 @@
+/*
+  BoincLite, a light-weight library for BOINC clients.
+
+  Copyright (C) 2008 Sony Computer Science Laboratory Paris 
+  Authors: Peter Hanappe, Anthony Beurive, Tangui Morlier
+
+  This library is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation; version 2.1 of the
+  License.
+
+  This library is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+  02110-1301 USA
+
+*/ 
+#include "BoincTrace.h"
+#include "BoincMem.h"
+#include "BoincMutex.h"
+#include "BoincUtil.h"
+#include <string.h>
+#include <stdio.h>
+
+#define TRACE_LINE_SIZE 512
+
+struct _BoincTrace {
+	FILE * fh;
+	BoincMutex mutex;
+};
+
+BoincTrace* boincTraceCreate(const char* file)
+{
+	BoincTrace * trace = boincNew(BoincTrace);
+	if (trace == NULL) {
+		boincLog(kBoincError, kBoincSystem, "Out of memory");
+		return NULL;
+	}
+
+	trace->fh = boincFopen(file, "w");
+	if (trace->fh == NULL) {
+		boincLogf(kBoincError, kBoincFileSystem, "Cannot open trace file %s", file);
+		boincFree(trace);
+		return NULL;
+	}
+
+	trace->mutex = boincMutexCreate("trace");
+	fprintf(trace->fh, "# BoincLite scheduler trace\n");
+
+	return trace;
+}
+
+void boincTraceDestroy(BoincTrace* trace)
+{
+	if (trace == NULL) {
+		return;
+	}
+	boincMutexLock(trace->mutex);
+	boincFclose(trace->fh);
+	trace->fh = NULL;
+	boincMutexUnlock(trace->mutex);
+	boincMutexDestroy(trace->mutex);
+	boincFree(trace);
+}
+
+static void boincTraceWriteLine(BoincTrace* trace, const char* line)
+{
+	// The records come from the scheduler thread and from the
+	// compute threads of the application.
+	boincMutexLock(trace->mutex);
+	if (trace->fh != NULL) {
+		fputs(line, trace->fh);
+		fflush(trace->fh);
+	}
+	boincMutexUnlock(trace->mutex);
+}
+
+void boincTraceWriteEvent(BoincTrace* trace, unsigned int time, int index, int eventType, unsigned int nbtries)
+{
+	char line[TRACE_LINE_SIZE];
+	snprintf(line, TRACE_LINE_SIZE, "E %u %d %d %u\n", time, index, eventType, nbtries);
+	boincTraceWriteLine(trace, line);
+}
+
+void boincTraceWriteCall(BoincTrace* trace, unsigned int time, int index, int call, unsigned int duration, BoincError err)
+{
+	char message[BOINC_TRACE_MESSAGE_SIZE];
+	char line[TRACE_LINE_SIZE];
+
+	message[0] = 0;
+	if (boincErrorMessage(err) != NULL) {
+		snprintf(message, BOINC_TRACE_MESSAGE_SIZE, "%s", boincErrorMessage(err));
+		for (char * c = message; *c; c++) {
+			if ((*c == '\n') || (*c == '\r')) {
+				*c = ' ';
+			}
+		}
+	}
+
+	snprintf(line, TRACE_LINE_SIZE, "C %u %d %d %u %d %d %d %s\n", time, index, call, duration,
+		 boincErrorType(err), boincErrorCode(err), boincErrorDelay(err), message);
+	boincTraceWriteLine(trace, line);
+}
+
+void boincTraceWriteStatus(BoincTrace* trace, char kind, unsigned int time, int index, int status)
+{
+	char line[TRACE_LINE_SIZE];
+	snprintf(line, TRACE_LINE_SIZE, "%c %u %d %d\n", kind, time, index, status);
+	boincTraceWriteLine(trace, line);
+}
+
+static int boincTraceParseLine(const char* line, BoincTraceRecord* record)
+{
+	int offset = 0;
+
+	memset(record, 0, sizeof(BoincTraceRecord));
+	record->kind = line[0];
+
+	switch (record->kind) {
+	case 'E':
+		return (sscanf(line + 1, "%u %d %d %u", &record->time, &record->index,
+			       &record->value, &record->nbtries) == 4);
+	case 'C':
+		if (sscanf(line + 1, "%u %d %d %u %d %d %d %n", &record->time, &record->index, &record->value,
+			   &record->duration, &record->errorType, &record->errorCode, &record->errorDelay, &offset) < 7) {
+			return 0;
+		}
+		snprintf(record->message, BOINC_TRACE_MESSAGE_SIZE, "%s", line + 1 + offset);
+		record->message[strcspn(record->message, "\r\n")] = 0;
+		return 1;
+	case 'L':
+	case 'S':
+	case 'A':
+		return (sscanf(line + 1, "%u %d %d", &record->time, &record->index, &record->value) == 3);
+	default:
+		return 0;
+	}
+}
+
+BoincError boincTraceRead(const char* file, BoincTraceRecord** records, int* count)
+{
+	char line[TRACE_LINE_SIZE];
+	int size = 256;
+	int n = 0;
+	int lineNum = 0;
+
+	*records = NULL;
+	*count = 0;
+
+	FILE * fh = boincFopen(file, "r");
+	if (fh == NULL) {
+		return boincErrorCreatef(kBoincError, kBoincFileSystem, "Cannot open trace file %s", file);
+	}
+
+	BoincTraceRecord * r = boincArray(BoincTraceRecord, size);
+	if (r == NULL) {
+		boincFclose(fh);
+		return boincErrorCreate(kBoincFatal, kBoincSystem, "Out of memory");
+	}
+
+	while (fgets(line, TRACE_LINE_SIZE, fh) != NULL) {
+		lineNum++;
+		if ((line[0] == '#') || (line[0] == '\n') || (line[0] == 0)) {
+			continue;
+		}
+		if (n == size) {
+			BoincTraceRecord * bigger = boincArray(BoincTraceRecord, 2 * size);
+			if (bigger == NULL) {
+				boincFree(r);
+				boincFclose(fh);
+				return boincErrorCreate(kBoincFatal, kBoincSystem, "Out of memory");
+			}
+			memcpy(bigger, r, size * sizeof(BoincTraceRecord));
+			boincFree(r);
+			r = bigger;
+			size *= 2;
+		}
+		if (!boincTraceParseLine(line, &r[n])) {
+			boincFree(r);
+			boincFclose(fh);
+			return boincErrorCreatef(kBoincError, kBoincFileSystem, "Malformed trace record line %d in %s", lineNum, file);
+		}
+		n++;
+	}
+
+	boincFclose(fh);
+
+	*records = r;
+	*count = n;
+
+	return NULL;
+}
@@ -0,0 +1,89 @@
+/*
+  BoincLite, a light-weight library for BOINC clients.
+
+  Copyright (C) 2008 Sony Computer Science Laboratory Paris 
+  Authors: Peter Hanappe, Anthony Beurive, Tangui Morlier
+
+  This library is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation; version 2.1 of the
+  License.
+
+  This library is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+  02110-1301 USA
+
+*/ 
+/*
+  BoincTrace, a recorder for the events of the scheduler.
+
+  A trace is a text file with one record per line:
+
+    E <time> <slot> <event> <nbtries>          event dequeued by the scheduler
+    C <time> <slot> <call> <duration> <type> <code> <delay> <message>
+                                               outcome of a backend call
+    L <time> <slot> <status>                   status of a slot found on disk
+    S <time> <slot> <status>                   status posted by the application
+    A <time> <slot> <ifNotStarted>             result aborted by the project server
+
+  Lines starting with '#' are comments. The slot of the load event is -1.
+*/
+
+#ifndef __BoincTrace_H__
+#define __BoincTrace_H__
+
+#include "BoincError.h"
+
+typedef struct _BoincTrace BoincTrace;
+
+enum BoincTraceCall {
+	kBoincTraceInit = 0,
+	kBoincTraceLoadWorkUnit,
+	kBoincTraceRequestWork,
+	kBoincTraceDownload,
+	kBoincTraceUpload,
+	kBoincTraceReport,
+	kBoincTraceLastCall,
+};
+
+#define BOINC_TRACE_MESSAGE_SIZE 128
+
+typedef struct _BoincTraceRecord {
+	char kind;                // 'E', 'C', 'L', 'S' or 'A'
+	unsigned int time;
+	int index;
+	int value;                // event type, call, status or ifNotStarted
+	unsigned int nbtries;     // 'E' only
+	unsigned int duration;    // 'C' only
+	int errorType;            // 'C' only, kBoincNone if the call succeeded
+	int errorCode;
+	int errorDelay;
+	char message[BOINC_TRACE_MESSAGE_SIZE];
+} BoincTraceRecord;
+
+/** \brief open a trace file for writing (the file is truncated)
+ */
+BoincTrace* boincTraceCreate(const char* file);
+
+void boincTraceDestroy(BoincTrace* trace);
+
+void boincTraceWriteEvent(BoincTrace* trace, unsigned int time, int index, int eventType, unsigned int nbtries);
+
+void boincTraceWriteCall(BoincTrace* trace, unsigned int time, int index, int call, unsigned int duration, BoincError err);
+
+void boincTraceWriteStatus(BoincTrace* trace, char kind, unsigned int time, int index, int status);
+
+/** \brief read a whole trace file
+ *
+ *  \param[out] records array of records, to be freed with boincFree
+ *  \param[out] count number of records
+ */
+BoincError boincTraceRead(const char* file, BoincTraceRecord** records, int* count);
+
+#endif // __BoincTrace_H__
@@ -0,0 +1,119 @@
+/*
+  BoincLite, a light-weight library for BOINC clients.
+
+  Copyright (C) 2008 Sony Computer Science Laboratory Paris 
+  Authors: Peter Hanappe, Anthony Beurive, Tangui Morlier
+
+  This library is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation; version 2.1 of the
+  License.
+
+  This library is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+  02110-1301 USA
+
+*/ 
+#include "BoincTuner.h"
+#include <string.h>
+
+// Weight of a new sample in the running averages
+#define TUNER_WEIGHT 0.25
+
+// Idle gaps shorter than this are the cost of the transition itself
+#define TUNER_IDLE_THRESHOLD 1.0
+
+static void boincTunerAverage(double* average, int* samples, double value)
+{
+	if (*samples == 0) {
+		*average = value;
+	} else {
+		*average += TUNER_WEIGHT * (value - *average);
+	}
+	(*samples)++;
+}
+
+void boincTunerInit(BoincTuner* tuner, int minDepth, int maxDepth)
+{
+	memset(tuner, 0, sizeof(BoincTuner));
+	tuner->minDepth = (minDepth < 1)? 1 : minDepth;
+	tuner->maxDepth = (maxDepth < tuner->minDepth)? tuner->minDepth : maxDepth;
+	tuner->depth = tuner->minDepth;
+}
+
+void boincTunerStatusLeft(BoincTuner* tuner, int status, unsigned int duration)
+{
+	if ((status < 0) || (status >= kBoincWorkUnitLastStatus)) {
+		return;
+	}
+	if ((tuner->samples[status] == 0) || (duration < tuner->shortest[status])) {
+		tuner->shortest[status] = duration;
+	}
+	boincTunerAverage(&tuner->stage[status], &tuner->samples[status], duration);
+}
+
+void boincTunerCoreIdle(BoincTuner* tuner, unsigned int duration)
+{
+	boincTunerAverage(&tuner->idle, &tuner->idleSamples, duration);
+}
+
+int boincTunerUpdate(BoincTuner* tuner, int ncompute)
+{
+	double compute = tuner->stage[kBoincWorkUnitComputing];
+	double lead = tuner->stage[kBoincWorkUnitInitializing] + tuner->stage[kBoincWorkUnitDownloading];
+
+	if ((tuner->samples[kBoincWorkUnitComputing] == 0) || (compute <= 0)) {
+		return tuner->depth;
+	}
+
+	// Enough workunits in flight to cover the time it takes to get
+	// one, while the compute slots eat through theirs.
+	double needed = ncompute * lead / compute;
+	int depth = (int) needed;
+	if (depth < needed) {
+		depth++;
+	}
+
+	if ((tuner->idleSamples > 0) && (tuner->idle > TUNER_IDLE_THRESHOLD)) {
+		// The cores still starve: the averages are too optimistic
+		if (depth <= tuner->depth) {
+			depth = tuner->depth + 1;
+		}
+	} else if (depth < tuner->depth) {
+		// Shrink one step at a time
+		depth = tuner->depth - 1;
+	}
+
+	if (depth < tuner->minDepth) {
+		depth = tuner->minDepth;
+	}
+	if (depth > tuner->maxDepth) {
+		depth = tuner->maxDepth;
+	}
+
+	tuner->depth = depth;
+
+	return depth;
+}
+
+double boincTunerWorkRequestSeconds(BoincTuner* tuner, int ncompute)
+{
+	if (tuner->samples[kBoincWorkUnitComputing] == 0) {
+		return 1.0;
+	}
+	return tuner->depth * tuner->stage[kBoincWorkUnitComputing] / ncompute;
+}
+
+double boincTunerShortestStage(BoincTuner* tuner, int status)
+{
+	if ((status < 0) || (status >= kBoincWorkUnitLastStatus) || (tuner->samples[status] == 0)) {
+		return 0;
+	}
+	return tuner->shortest[status];
+}
@@ -0,0 +1,75 @@
+/*
+  BoincLite, a light-weight library for BOINC clients.
+
+  Copyright (C) 2008 Sony Computer Science Laboratory Paris 
+  Authors: Peter Hanappe, Anthony Beurive, Tangui Morlier
+
+  This library is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation; version 2.1 of the
+  License.
+
+  This library is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+  02110-1301 USA
+
+*/ 
+/*
+  BoincTuner, the prefetch depth of the scheduler.
+
+  The tuner learns how long the workunits stay in each status and how
+  long the compute slots stay idle between two workunits. From that it
+  derives how many workunits the scheduler should fetch ahead of the
+  computation, and how many seconds of work to ask the server for.
+*/
+
+#ifndef __BoincTuner_H__
+#define __BoincTuner_H__
+
+#include "BoincLite.h"
+
+typedef struct _BoincTuner {
+	double stage[kBoincWorkUnitLastStatus];    // average seconds spent in each status
+	int samples[kBoincWorkUnitLastStatus];
+	double shortest[kBoincWorkUnitLastStatus]; // shortest stay seen in each status
+	double idle;                               // average idle gap of a compute slot
+	int idleSamples;
+	int depth;
+	int minDepth;
+	int maxDepth;
+} BoincTuner;
+
+void boincTunerInit(BoincTuner* tuner, int minDepth, int maxDepth);
+
+/** \brief A workunit spent duration seconds in the given status
+ */
+void boincTunerStatusLeft(BoincTuner* tuner, int status, unsigned int duration);
+
+/** \brief A compute slot stayed idle for duration seconds
+ */
+void boincTunerCoreIdle(BoincTuner* tuner, unsigned int duration);
+
+/** \brief Update the prefetch depth from what was learned so far
+ *
+ *  \return the number of workunits to keep fetched or fetching
+ *  ahead of the ncompute compute slots.
+ */
+int boincTunerUpdate(BoincTuner* tuner, int ncompute);
+
+/** \brief Seconds of work to request from the server to fill the buffer
+ */
+double boincTunerWorkRequestSeconds(BoincTuner* tuner, int ncompute);
+
+/** \brief Shortest seconds a workunit stayed in the given status
+ *
+ *  \return zero as long as nothing was learned about the status.
+ */
+double boincTunerShortestStage(BoincTuner* tuner, int status);
+
+#endif // __BoincTuner_H__
@@ -193,6 +193,7 @@ typedef struct _QueueEntry QueueEntry;
 struct _QueueEntry
 {
 	unsigned int time;
+	int priority;
 	void* data;
 	QueueEntry* next;
 };
@@ -201,6 +202,15 @@ struct _BoincQueue
 {
   QueueEntry * first;
   BoincMutex mutex;
+  BoincCondition cond;
+  unsigned int slack;
+  BoincQueuePriority priority;
+  unsigned int aging;
+  int woken;
+  int waited;         // boincQueueWait found an event due
+  int wakeups;        // waits ended by an event, counted by boincQueueGet
+  BoincQueueClock clock;
+  void * clockData;
 };
 
 
@@ -215,6 +225,12 @@ BoincQueue* boincQueueCreate()
     boincFree(queue);
     return NULL;
   }
+  queue->cond = boincConditionCreate();
+  if (queue->cond == NULL) {
+    boincMutexDestroy(queue->mutex);
+    boincFree(queue);
+    return NULL;
+  }
   return queue;
 }
 
@@ -228,6 +244,16 @@ void boincQueueDestroy(BoincQueue* queue)
   boincMutexLock(queue->mutex);
   boincMutexUnlock(queue->mutex);
   boincMutexDestroy(queue->mutex);
+  boincConditionDestroy(queue->cond);
+  boincFree(queue);
+}
+
+void boincQueueSetClock(BoincQueue* queue, BoincQueueClock clock, void* clockData)
+{
+  boincMutexLock(queue->mutex);
+  queue->clock = clock;
+  queue->clockData = clockData;
+  boincMutexUnlock(queue->mutex);
 }
 
 unsigned int boincQueueNow()
@@ -235,6 +261,63 @@ unsigned int boincQueueNow()
   return (unsigned int) time(NULL);
 }
 
+/* Called with the mutex locked */
+static inline unsigned int boincQueueTimeLocked(BoincQueue* queue)
+{
+  if (queue->clock != NULL) {
+    return queue->clock(queue->clockData);
+  }
+  return boincQueueNow();
+}
+
+unsigned int boincQueueTime(BoincQueue* queue)
+{
+  boincMutexLock(queue->mutex);
+  unsigned int now = boincQueueTimeLocked(queue);
+  boincMutexUnlock(queue->mutex);
+  return now;
+}
+
+void boincQueueSetSlack(BoincQueue* queue, unsigned int slack)
+{
+  boincMutexLock(queue->mutex);
+  queue->slack = slack;
+  boincMutexUnlock(queue->mutex);
+}
+
+void boincQueueSetPriority(BoincQueue* queue, BoincQueuePriority priority, unsigned int aging)
+{
+  boincMutexLock(queue->mutex);
+  queue->priority = priority;
+  queue->aging = aging;
+  boincMutexUnlock(queue->mutex);
+}
+
+/**
+ * Move a timer to a wakeup already planned within the slack after it,
+ * or else to the next multiple of the slack, so that the timers set at
+ * slightly different times fire together. A timer never fires early.
+ * Called with the mutex locked.
+ */
+static unsigned int boincQueueCoalesce(BoincQueue* queue, unsigned int eventTime)
+{
+  if ((queue->slack == 0) || (eventTime <= boincQueueTimeLocked(queue))) {
+    return eventTime;
+  }
+
+  for (QueueEntry * qe = queue->first; qe; qe = qe->next) {
+    if (qe->time >= eventTime) {
+      if (qe->time - eventTime <= queue->slack) {
+        return qe->time;
+      }
+      break;
+    }
+  }
+
+  unsigned int late = eventTime % queue->slack;
+  return (late == 0)? eventTime : eventTime + queue->slack - late;
+}
+
 BoincError boincQueuePut(BoincQueue* queue, unsigned int eventTime, void* data)
 {
   boincDebug("boincQueuePut");
@@ -244,10 +327,13 @@ BoincError boincQueuePut(BoincQueue* queue, unsigned int eventTime, void* data)
     return boincErrorCreate(kBoincFatal, kBoincSystem, "Out of memory");
   }
   qe->data = data;
-  qe->time = eventTime;
 
   boincMutexLock(queue->mutex);
 
+  eventTime = boincQueueCoalesce(queue, eventTime);
+  qe->time = eventTime;
+  qe->priority = (queue->priority != NULL)? queue->priority(data) : 0;
+
   QueueEntry ** pqe = &(queue->first);
   while (*pqe) {
     if ((*pqe)->time > eventTime) {
@@ -258,6 +344,8 @@ BoincError boincQueuePut(BoincQueue* queue, unsigned int eventTime, void* data)
   qe->next = *pqe;
   *pqe = qe;
 
+  boincConditionBroadcast(queue->cond);
+
   boincMutexUnlock(queue->mutex);
 
   return NULL;
@@ -266,7 +354,7 @@ BoincError boincQueuePut(BoincQueue* queue, unsigned int eventTime, void* data)
 
 static inline int boincQueueHasEventLocked(BoincQueue* queue)
 {
-  return (queue->first && queue->first->time <= boincQueueNow());
+  return (queue->first && queue->first->time <= boincQueueTimeLocked(queue));
 }
 
 int boincQueueHasEvent(BoincQueue* queue)
@@ -278,6 +366,96 @@ int boincQueueHasEvent(BoincQueue* queue)
   return r;
 }
 
+int boincQueueNextEventTime(BoincQueue* queue, unsigned int* eventTime)
+{
+  int r = 0;
+
+  boincMutexLock(queue->mutex);
+  if (queue->first) {
+    *eventTime = queue->first->time;
+    r = 1;
+  }
+  boincMutexUnlock(queue->mutex);
+
+  return r;
+}
+
+int boincQueueWait(BoincQueue* queue, unsigned int timeout)
+{
+  // A virtual clock only moves when its owner moves it
+  boincMutexLock(queue->mutex);
+  if (queue->clock != NULL) {
+    int r = boincQueueHasEventLocked(queue);
+    queue->waited |= r;
+    boincMutexUnlock(queue->mutex);
+    return r;
+  }
+
+  unsigned int deadline = boincQueueNow() + timeout;
+
+  int r = boincQueueHasEventLocked(queue);
+  while (!r && !queue->woken) {
+    unsigned int now = boincQueueNow();
+    if (now >= deadline) {
+      break;
+    }
+    unsigned int wait = deadline - now;
+    if (queue->first && (queue->first->time - now < wait)) {
+      wait = queue->first->time - now;
+    }
+    boincConditionWait(queue->cond, queue->mutex, wait);
+    r = boincQueueHasEventLocked(queue);
+  }
+
+  queue->waited |= r;
+  r = r || queue->woken;
+  queue->woken = 0;
+
+  boincMutexUnlock(queue->mutex);
+
+  return r;
+}
+
+void boincQueueWake(BoincQueue* queue)
+{
+  boincMutexLock(queue->mutex);
+  queue->woken = 1;
+  boincConditionBroadcast(queue->cond);
+  boincMutexUnlock(queue->mutex);
+}
+
+/**
+ * Find the due event of the most urgent class, taking the time it has
+ * been waiting into account. The due events are at the head of the
+ * list, oldest first, so the first of a class wins the ties.
+ * Called with the mutex locked.
+ */
+static QueueEntry ** boincQueueFindUrgent(BoincQueue* queue)
+{
+  QueueEntry ** best = NULL;
+  int bestPriority = 0;
+  unsigned int now = boincQueueTimeLocked(queue);
+
+  for (QueueEntry ** pqe = &(queue->first); *pqe && ((*pqe)->time <= now); pqe = &((*pqe)->next)) {
+    int priority = (*pqe)->priority;
+    if (queue->aging > 0) {
+      priority -= (now - (*pqe)->time) / queue->aging;
+      if (priority < 0) {
+        priority = 0;
+      }
+    }
+    if ((best == NULL) || (priority < bestPriority)) {
+      best = pqe;
+      bestPriority = priority;
+    }
+    if (priority <= 0) {
+      break;
+    }
+  }
+
+  return best;
+}
+
 void* boincQueueGet(BoincQueue* queue)
 {
   QueueEntry * qe = NULL;
@@ -285,9 +463,15 @@ void* boincQueueGet(BoincQueue* queue)
 
   boincMutexLock(queue->mutex);
 
-  if (boincQueueHasEventLocked(queue)) {
-    qe = queue->first;
-    queue->first = qe->next;
+  QueueEntry ** pqe = boincQueueFindUrgent(queue);
+  if (pqe != NULL) {
+    qe = *pqe;
+    *pqe = qe->next;
+    // The first event taken after a wait is the one that woke it up
+    if (queue->waited) {
+      queue->waited = 0;
+      queue->wakeups++;
+    }
   }
 
   boincMutexUnlock(queue->mutex);
@@ -300,6 +484,142 @@ void* boincQueueGet(BoincQueue* queue)
   return data;
 }
 
+int boincQueueCountWakeups(BoincQueue* queue)
+{
+  boincMutexLock(queue->mutex);
+  int wakeups = queue->wakeups;
+  boincMutexUnlock(queue->mutex);
+
+  return wakeups;
+}
+
+void* boincQueueRemove(BoincQueue* queue, BoincQueueMatch match, void* matchData)
+{
+  QueueEntry * qe = NULL;
+  void * data = NULL;
+
+  boincMutexLock(queue->mutex);
+
+  QueueEntry ** pqe = &(queue->first);
+  while (*pqe) {
+    if (match((*pqe)->data, matchData)) {
+      qe = *pqe;
+      *pqe = qe->next;
+      break;
+    }
+    pqe = &((*pqe)->next);
+  }
+
+  boincMutexUnlock(queue->mutex);
+
+  if (qe) {
+    data = qe->data;
+    boincFree(qe);
+  }
+
+  return data;
+}
+
+/*
+  The inbox is a ring of slots with a sequence number each. A writer
+  claims a position by moving the tail forward, copies its message and
+  publishes it by setting the sequence of the slot to the position plus
+  one. The reader frees the slot for the next round by setting its
+  sequence to the position plus the capacity.
+*/
+
+typedef struct _BoincInboxSlot {
+  volatile unsigned int sequence;
+  BoincInboxMessage message;
+} BoincInboxSlot;
+
+struct _BoincInbox {
+  BoincInboxSlot * slots;
+  unsigned int mask;
+  volatile unsigned int tail;     // next position for the writers
+  unsigned int head;              // next position for the reader
+  volatile unsigned int pending;  // a wakeup is due or being handled
+};
+
+BoincInbox* boincInboxCreate(unsigned int capacity)
+{
+  unsigned int size = 1;
+  while (size < capacity) {
+    size <<= 1;
+  }
+
+  BoincInbox * inbox = boincNew(BoincInbox);
+  if (inbox == NULL) {
+    return NULL;
+  }
+  inbox->slots = boincArray(BoincInboxSlot, size);
+  if (inbox->slots == NULL) {
+    boincFree(inbox);
+    return NULL;
+  }
+  for (unsigned int i = 0; i < size; i++) {
+    inbox->slots[i].sequence = i;
+  }
+  inbox->mask = size - 1;
+
+  return inbox;
+}
+
+void boincInboxDestroy(BoincInbox* inbox)
+{
+  if (inbox) {
+    boincFree(inbox->slots);
+    boincFree(inbox);
+  }
+}
+
+int boincInboxPut(BoincInbox* inbox, const BoincInboxMessage* message)
+{
+  BoincInboxSlot * slot;
+  unsigned int pos = boincAtomicLoad(&inbox->tail);
+
+  while (1) {
+    slot = &inbox->slots[pos & inbox->mask];
+    unsigned int sequence = boincAtomicLoad(&slot->sequence);
+    if (sequence == pos) {
+      if (boincAtomicCompareAndSwap(&inbox->tail, pos, pos + 1)) {
+        break;
+      }
+    } else if (sequence == pos - inbox->mask) {
+      // Not read yet since the last round: the inbox is full
+      return -1;
+    }
+    // An other writer took the position
+    pos = boincAtomicLoad(&inbox->tail);
+  }
+
+  slot->message = *message;
+  boincAtomicStore(&slot->sequence, pos + 1);
+
+  // Only the first message since the reader went idle wakes it up
+  return boincAtomicCompareAndSwap(&inbox->pending, 0, 1);
+}
+
+int boincInboxGet(BoincInbox* inbox, BoincInboxMessage* message)
+{
+  BoincInboxSlot * slot = &inbox->slots[inbox->head & inbox->mask];
+
+  if (boincAtomicLoad(&slot->sequence) != inbox->head + 1) {
+    // Re-arm the wakeup, then look again for a message posted while
+    // the wakeup was still pending
+    boincAtomicStore(&inbox->pending, 0);
+    if (boincAtomicLoad(&slot->sequence) != inbox->head + 1) {
+      return 0;
+    }
+  }
+
+  *message = slot->message;
+  boincAtomicStore(&slot->sequence, inbox->head + inbox->mask + 1);
+  inbox->head++;
+
+  return 1;
+}
+
 #define DEBUG_FOPEN 0
 
 #if DEBUG_FOPEN
@@ -62,14 +62,120 @@ BoincQueue* boincQueueCreate();
 
 void boincQueueDestroy(BoincQueue* queue);
 
+/** \brief the real time, in seconds
+ */
 unsigned int boincQueueNow();
 
+/** \brief clock of a queue
+ *
+ *  Returns the current time in seconds. The default clock is
+ *  boincQueueNow. The trace replay and the simulator give their
+ *  scheduler a virtual clock, so that scheduling is played back faster
+ *  than real time.
+ */
+typedef unsigned int (*BoincQueueClock)(void* clockData);
+
+/** \brief replace the clock of the queue (NULL restores the real time)
+ *
+ *  On a virtual clock, boincQueueWait does not block: the time only
+ *  moves when the owner of the clock moves it.
+ */
+void boincQueueSetClock(BoincQueue* queue, BoincQueueClock clock, void* clockData);
+
+/** \brief the current time on the clock of the queue
+ */
+unsigned int boincQueueTime(BoincQueue* queue);
+
+/** \brief time of the first event in the queue, due or not
+ *  \returns zero if the queue is empty, non-zero otherwise
+ */
+int boincQueueNextEventTime(BoincQueue* queue, unsigned int* eventTime);
+
+/** \brief let the timers set in the future fire up to slack seconds late
+ *
+ *  The timers that fall within the slack of each other share a
+ *  single wakeup. Zero, the default, keeps every timer exact.
+ */
+void boincQueueSetSlack(BoincQueue* queue, unsigned int slack);
+
+/** \brief class of an event, zero being the most urgent
+ */
+typedef int (*BoincQueuePriority)(void* data);
+
+/** \brief serve the due events by class rather than by time
+ *
+ *  boincQueueGet returns the due event of the most urgent class, the
+ *  oldest first within a class. An event that has been due for aging
+ *  seconds moves up one class, and so on, so that a steady flow of
+ *  urgent events never starves the others. Zero disables the aging.
+ *  Without a priority function, all the events are of class zero.
+ */
+void boincQueueSetPriority(BoincQueue* queue, BoincQueuePriority priority, unsigned int aging);
+
 BoincError boincQueuePut(BoincQueue* queue, unsigned int eventTime, void* data);
 
 int boincQueueHasEvent(BoincQueue* queue);
 
+/** \brief Wait until an event is due, for at most timeout seconds.
+ *
+ *  Returns as soon as an event is put in the queue by another thread
+ *  or the first event becomes due. Returns non-zero if an event is due.
+ */
+int boincQueueWait(BoincQueue* queue, unsigned int timeout);
+
+/** \brief Make boincQueueWait return non-zero, even if no event is due.
+ */
+void boincQueueWake(BoincQueue* queue);
+
 void* boincQueueGet(BoincQueue* queue);
 
+/** \brief number of times boincQueueWait returned for an event that was then taken
+ */
+int boincQueueCountWakeups(BoincQueue* queue);
+
+typedef int (*BoincQueueMatch)(void* data, void* matchData);
+
+/** \brief Take out the first event for which match returns non-zero, due or not.
+ *  \returns the data of the event, NULL if none matched
+ */
+void* boincQueueRemove(BoincQueue* queue, BoincQueueMatch match, void* matchData);
+
+
+/*   Inbox    */
+
+/*
+  A bounded ring of fixed-size messages that any thread can post to
+  without taking a lock or allocating memory, read by a single thread.
+*/
+
+typedef struct _BoincInbox BoincInbox;
+
+typedef struct _BoincInboxMessage {
+  int kind;
+  int index;
+  int value;
+} BoincInboxMessage;
+
+/** \brief create an inbox holding up to capacity messages, rounded
+ *  up to a power of two
+ */
+BoincInbox* boincInboxCreate(unsigned int capacity);
+
+void boincInboxDestroy(BoincInbox* inbox);
+
+/** \brief post a message, from any thread
+ *
+ *  \returns -1 if the inbox is full, 1 if the reader has to be woken
+ *  up because it may have seen the inbox empty, 0 otherwise
+ */
+int boincInboxPut(BoincInbox* inbox, const BoincInboxMessage* message);
+
+/** \brief take the oldest message, from the reader thread only
+ *
+ *  \returns zero if the inbox is empty
+ */
+int boincInboxGet(BoincInbox* inbox, BoincInboxMessage* message);
+
 
 #include <stdio.h>
 FILE* boincFopen(const char* file, const char* mode);
@@ -48,10 +48,13 @@ static void boincFileInfoDestroy(BoincFileInfo * fi)
 		boincFree(fi->openname);
 		fi->openname = NULL;
 	}
-	if (fi->url) {
-		boincFree(fi->url);
-		fi->url = NULL;
+	// The url is the first of the urls
+	for (int i = 0; i < fi->nbUrls; i++) {
+		boincFree(fi->urls[i]);
 	}
+	boincFree(fi->urls);
+	fi->urls = NULL;
+	fi->url = NULL;
 	if (fi->checksum) {
 		boincFree(fi->checksum);
 		fi->checksum = NULL;
@@ -167,13 +170,13 @@ void boincWorkUnitGetStatus(BoincWorkUnit* workunit, BoincWorkUnitStatus* status
 	}
 }
 
-int boincWorkUnitSetStatus(BoincWorkUnit* workunit, int status)
+int boincWorkUnitSetStatus(BoincWorkUnit* workunit, int status, unsigned int now)
 {
 	int changed = 0;
 	if (workunit->status != status) {
 		workunit->status = status;
 		workunit->progress = 0;
-		workunit->dateStatusChange = boincQueueNow();
+		workunit->dateStatusChange = now;
 		changed = 1;
 	}
 	return changed;
@@ -28,7 +28,7 @@
 BoincWorkUnit * boincWorkUnitCreate(const char * workunitDir);
 void boincWorkUnitDestroy(BoincWorkUnit* wu);
 void boincWorkUnitGetStatus(BoincWorkUnit* workunit, BoincWorkUnitStatus* status);
-int boincWorkUnitSetStatus(BoincWorkUnit* workunit, int status);
+int boincWorkUnitSetStatus(BoincWorkUnit* workunit, int status, unsigned int now);
 void boincWorkUnitSetError(BoincWorkUnit* workunit, BoincError error);
 char* boincWorkUnitGetPath(BoincWorkUnit * wu, BoincFileInfo * fi, char * resFile, unsigned int resSize);
 int boincWorkUnitFileExists(BoincWorkUnit * workunit, BoincFileInfo * file);
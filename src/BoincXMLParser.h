@@ -21,6 +21,7 @@
 
 */ 
 #include "BoincError.h"
+#include <stddef.h>
 
 #ifndef __BoincXMLParser_H__
 #define __BoincXMLParser_H__
@@ -45,6 +46,17 @@ typedef BoincError (*boincXMLElementEndCallback) (int index, const char* element
  */
 BoincError boincXMLParse(const char * xmlFile, boincXMLElementBeginCallback begin, boincXMLElementEndCallback end, void* userData);
 
+/** \brief parse xml held in memory, as boincXMLParse does a file
+ *
+ */
+BoincError boincXMLParseBuffer(const char * buffer, size_t size, boincXMLElementBeginCallback begin, boincXMLElementEndCallback end, void* userData);
+
+/** \brief copy a value into out, with the characters special to XML escaped
+ *
+ * \returns out, or NULL if the escaped value does not fit in size bytes
+ */
+char * boincXMLEscape(const char * value, char * out, size_t size);
+
 /** \brief returns the value of a attribute name
  *
  *  cf. second argument of boincXMLElementBeginCallback
@@ -1,4 +1,5 @@
 #include "BoincHash.h"
+#include "BoincMem.h"
 #include <string.h>
 #include <stdio.h>
 
@@ -47,3 +48,31 @@ BoincError boincHashMd5File(const char * fileName, char * hash)
   return NULL;
 }
 
+struct _BoincHashMd5 {
+  MD5_CTX state;
+};
+
+BoincHashMd5 * boincHashMd5Create()
+{
+  BoincHashMd5 * md5 = boincNew(BoincHashMd5);
+  if (md5 != NULL)
+    MD5Init(&md5->state);
+  return md5;
+}
+
+void boincHashMd5Update(BoincHashMd5 * md5, const void * data, unsigned int len)
+{
+  MD5Update(&md5->state, data, len);
+}
+
+void boincHashMd5Final(BoincHashMd5 * md5, char * hash)
+{
+  MD5Final(&md5->state);
+  boincHashConvert2Hex(md5->state.digest, 16, hash);
+  boincFree(md5);
+}
+
+void boincHashMd5Destroy(BoincHashMd5 * md5)
+{
+  boincFree(md5);
+}
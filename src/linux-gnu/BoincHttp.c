@@ -6,18 +6,43 @@
   Authors: Tangui Morlier
  
 */
+#define _POSIX_C_SOURCE 200809L // clock_gettime, pwrite, posix_fallocate
 #include <stdio.h>
+#include <errno.h>
+#include <time.h>
 #include <curl/curl.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include "BoincHttp.h"
 #include "config.h"
 #include "BoincError.h"
 #include "BoincMem.h"
+#include "BoincMutex.h"
+#include "BoincHash.h"
 
 
+enum {
+  kBoincHttpDown = 0,
+  kBoincHttpUp,
+};
+
+/*
+  The bandwidth of each direction is shared between the transfers
+  running at once, each of them kept within its share by libcurl, so
+  a transfer over budget waits without holding up the others of the
+  same thread. The engine shares it again every RATE_SHARE_PERIOD
+  seconds from the rates the transfers reached: one held back by its
+  server gets what it used and a margin to grow, and the others split
+  the rest.
+*/
+#define RATE_SHARE_PERIOD 1.0
+#define RATE_SATURATED 0.9      // of its share, a transfer that used it all
+#define RATE_MARGIN 1.25        // of its rate, for a transfer that did not
+
 typedef struct _BoincHttp {
   CURL *curl;
   BoincHttpProgressCallback progressfunc;
@@ -25,11 +50,57 @@ typedef struct _BoincHttp {
   int progressFileNum;	
   int progressFileTotal;	
   char ua[100];
+  struct curl_slist * headers;
+  CURLSH * share;
+  BoincMutex shareLocks[CURL_LOCK_DATA_LAST];
+  long maxIdle;
+  long idleTimeout;
+  long stallTimeout;
+  BoincMutex rateMutex;
+  long maxRate[2];              // bytes per second of all the transfers, zero for no limit
+  long maxRatePerTransfer[2];
+  unsigned int rateVersion;     // changes with the limits
+  BoincHttpStats stats;         // of the last query
 } BoincHttp;
 
 
 BoincHttp * singleHttp = NULL;
 
+static void boincHttpShareLock(CURL * curl, curl_lock_data data, curl_lock_access access, void * userptr)
+{
+  boincMutexLock(singleHttp->shareLocks[data]);
+}
+
+static void boincHttpShareUnlock(CURL * curl, curl_lock_data data, void * userptr)
+{
+  boincMutexUnlock(singleHttp->shareLocks[data]);
+}
+
+/**
+ * The DNS answers, the TLS sessions and the open connections are kept
+ * in a share used by all the queries, so that a query to a host seen
+ * before skips the lookup and the handshake.
+ */
+static BoincError boincHttpCreateShare(BoincHttp * bHttp)
+{
+  bHttp->share = curl_share_init();
+  if (!bHttp->share)
+    return boincErrorCreate(kBoincFatal, 0, "Cannot initialise HTTP layer");
+
+  for (int i = 0; i < CURL_LOCK_DATA_LAST; i++)
+    bHttp->shareLocks[i] = boincMutexCreate("http");
+
+  curl_share_setopt(bHttp->share, CURLSHOPT_LOCKFUNC, boincHttpShareLock);
+  curl_share_setopt(bHttp->share, CURLSHOPT_UNLOCKFUNC, boincHttpShareUnlock);
+  curl_share_setopt(bHttp->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+  curl_share_setopt(bHttp->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900
+  curl_share_setopt(bHttp->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+
+  return NULL;
+}
+
 BoincError boincHttpInit() 
 {
   if (!singleHttp) {
@@ -40,10 +111,125 @@ BoincError boincHttpInit()
     strcpy(singleHttp->ua, "User-Agent: \"");
     strcat(singleHttp->ua, PACKAGE_STRING);
     strcat(singleHttp->ua, "\"");
+    singleHttp->headers = curl_slist_append(NULL, singleHttp->ua);
+    singleHttp->maxIdle = 8;
+    singleHttp->idleTimeout = 118;
+    singleHttp->rateMutex = boincMutexCreate("bandwidth");
+    BoincError err = boincHttpCreateShare(singleHttp);
+    if (err)
+      return err;
+    curl_easy_setopt(singleHttp->curl, CURLOPT_SHARE, singleHttp->share);
   }
   return NULL;
 }
 
+static double boincHttpClock()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+BoincError boincHttpSetRateLimits(int maxDown, int maxUp, int maxDownPerTransfer, int maxUpPerTransfer)
+{
+  BoincError err = boincHttpInit();
+  if (err)
+    return err;
+
+  boincMutexLock(singleHttp->rateMutex);
+  singleHttp->maxRate[kBoincHttpDown] = (maxDown > 0)? maxDown : 0;
+  singleHttp->maxRate[kBoincHttpUp] = (maxUp > 0)? maxUp : 0;
+  singleHttp->maxRatePerTransfer[kBoincHttpDown] = (maxDownPerTransfer > 0)? maxDownPerTransfer : 0;
+  singleHttp->maxRatePerTransfer[kBoincHttpUp] = (maxUpPerTransfer > 0)? maxUpPerTransfer : 0;
+  singleHttp->rateVersion++;
+  boincMutexUnlock(singleHttp->rateMutex);
+
+  return NULL;
+}
+
+/**
+ * Share the bandwidth of a direction between count transfers running
+ * at once, within the limit of a single transfer, zero for no limit
+ *
+ * demands: the rate each transfer reached with its last share, or a
+ * negative number if not known yet
+ * lastShares: the last share of each transfer, zero if none
+ */
+void boincHttpRateShares(int direction, int count, const double * demands, const long * lastShares, long * shares)
+{
+  boincMutexLock(singleHttp->rateMutex);
+  long total = singleHttp->maxRate[direction];
+  long perTransfer = singleHttp->maxRatePerTransfer[direction];
+  boincMutexUnlock(singleHttp->rateMutex);
+
+  if (total <= 0) {
+    for (int i = 0; i < count; i++)
+      shares[i] = perTransfer;
+    return;
+  }
+
+  // The transfers that cannot use an even share get what they can
+  // use, until the even share of the others is over all of them
+  double left = total;
+  int others = count;
+  for (int i = 0; i < count; i++)
+    shares[i] = -1;
+  for (int changed = 1; changed && (others > 0); ) {
+    changed = 0;
+    double even = left / others;
+    for (int i = 0; i < count; i++) {
+      if (shares[i] >= 0)
+        continue;
+      double limit = -1;
+      if ((demands[i] >= 0) && (lastShares[i] > 0) && (demands[i] < RATE_SATURATED * lastShares[i]))
+        limit = demands[i] * RATE_MARGIN;
+      if ((perTransfer > 0) && ((limit < 0) || (perTransfer < limit)))
+        limit = perTransfer;
+      if ((limit >= 0) && (limit < even)) {
+        shares[i] = (limit < 1)? 1 : (long) limit;
+        left -= shares[i];
+        others--;
+        changed = 1;
+      }
+    }
+  }
+  for (int i = 0; i < count; i++) {
+    if (shares[i] < 0)
+      shares[i] = (left / others < 1)? 1 : (long) (left / others);
+  }
+}
+
+static void boincHttpSetRateShare(CURL * curl)
+{
+  double demand = -1;
+  long last = 0, share;
+  boincHttpRateShares(kBoincHttpDown, 1, &demand, &last, &share);
+  curl_easy_setopt(curl, CURLOPT_MAX_RECV_SPEED_LARGE, (curl_off_t) share);
+  boincHttpRateShares(kBoincHttpUp, 1, &demand, &last, &share);
+  curl_easy_setopt(curl, CURLOPT_MAX_SEND_SPEED_LARGE, (curl_off_t) share);
+}
+
+BoincError boincHttpSetConnectionLimits(int maxIdle, int idleTimeout)
+{
+  BoincError err = boincHttpInit();
+  if (err)
+    return err;
+  if (maxIdle > 0)
+    singleHttp->maxIdle = maxIdle;
+  if (idleTimeout > 0)
+    singleHttp->idleTimeout = idleTimeout;
+  return NULL;
+}
+
+BoincError boincHttpSetStallTimeout(int stallTimeout)
+{
+  BoincError err = boincHttpInit();
+  if (err)
+    return err;
+  singleHttp->stallTimeout = (stallTimeout > 0)? stallTimeout : 0;
+  return NULL;
+}
+
 BoincError boincHttpCleanup() 
 {
   if (!singleHttp)
@@ -51,6 +237,13 @@ BoincError boincHttpCleanup()
   if (singleHttp->curl)
     curl_easy_cleanup(singleHttp->curl);
   singleHttp->curl = NULL;
+  if (singleHttp->share) {
+    curl_share_cleanup(singleHttp->share);
+    for (int i = 0; i < CURL_LOCK_DATA_LAST; i++)
+      boincMutexDestroy(singleHttp->shareLocks[i]);
+  }
+  curl_slist_free_all(singleHttp->headers);
+  boincMutexDestroy(singleHttp->rateMutex);
   boincFree(singleHttp);
   singleHttp = NULL;
   return NULL;
@@ -80,27 +273,435 @@ int boincHttpProgressInternalFunc(BoincHttp * bHttp,
   return 0;
 }
 
-BoincError boincHttpCommon(BoincHttp * bHttp, const char* localFile) 
+/**
+ * The state of a query while the answer is written to a temporary file
+ */
+typedef struct _BoincHttpQuery {
+  CURL * curl;
+  const char * localFile;       // NULL to keep the answer in memory
+  char * reply;                 // the answer kept in memory
+  size_t replySize;
+  size_t replyCapacity;
+  char * tmpfile;
+  FILE * file;
+  struct curl_slist * headers;  // only if the query has its own headers
+  int resumable;
+  curl_off_t offset;            // bytes already there when resuming
+  int checked;                  // the answer to the resume was looked at
+  char etag[128];
+  unsigned int expectedSize;
+  const char * expectedMd5;
+  BoincHashMd5 * md5;           // of the bytes written so far
+  BoincHttpReadFun readFunc;    // the body of a POST
+  void * readData;
+  const char * contentEncoding; // of the body, NULL if sent as is
+} BoincHttpQuery;
+
+static char * boincHttpPathWithSuffix(const char * path, const char * suffix)
 {
-  int res;
+  char * p = boincArray(char, strlen(path) + strlen(suffix) + 1);
+  if (p != NULL) {
+    strcpy(p, path);
+    strcat(p, suffix);
+  }
+  return p;
+}
 
+/**
+ * The validator of a partial download, saved next to it so that the
+ * download can be resumed by an other process
+ */
+static void boincHttpReadETag(BoincHttpQuery * query, char * etag, int size)
+{
+  etag[0] = 0;
+  char * etagfile = boincHttpPathWithSuffix(query->tmpfile, ".etag");
+  if (etagfile == NULL)
+    return;
+  FILE * file = fopen(etagfile, "r");
+  if (file != NULL) {
+    if (fgets(etag, size, file) == NULL)
+      etag[0] = 0;
+    etag[strcspn(etag, "\r\n")] = 0;
+    fclose(file);
+  }
+  boincFree(etagfile);
+}
+
+static void boincHttpWriteETag(BoincHttpQuery * query, const char * etag)
+{
+  char * etagfile = boincHttpPathWithSuffix(query->tmpfile, ".etag");
+  if (etagfile == NULL)
+    return;
+  if (etag == NULL) {
+    unlink(etagfile);
+  } else {
+    FILE * file = fopen(etagfile, "w");
+    if (file != NULL) {
+      fprintf(file, "%s\n", etag);
+      fclose(file);
+    }
+  }
+  boincFree(etagfile);
+}
+
+static size_t boincHttpHeader(char * buffer, size_t size, size_t nitems, void * userdata)
+{
+  BoincHttpQuery * query = (BoincHttpQuery *) userdata;
+  size_t len = size * nitems;
+
+  // Only a strong validator tells that the bytes are the same
+  if ((len > 5) && !strncasecmp(buffer, "ETag:", 5)) {
+    char * value = buffer + 5;
+    size_t n = len - 5;
+    while ((n > 0) && ((*value == ' ') || (*value == '\t'))) {
+      value++;
+      n--;
+    }
+    while ((n > 0) && ((value[n - 1] == '\r') || (value[n - 1] == '\n') || (value[n - 1] == ' ')))
+      n--;
+    if ((n > 0) && (n < sizeof(query->etag)) && strncmp(value, "W/", 2)) {
+      memcpy(query->etag, value, n);
+      query->etag[n] = 0;
+      if (query->resumable)
+        boincHttpWriteETag(query, query->etag);
+    }
+  }
+  return len;
+}
+
+/**
+ * Append a chunk of the answer to the memory buffer, which is kept
+ * NUL terminated
+ */
+static size_t boincHttpWriteMemory(BoincHttpQuery * query, void * data, size_t len)
+{
+  if (query->replySize + len + 1 > query->replyCapacity) {
+    size_t capacity = (query->replyCapacity > 0)? 2 * query->replyCapacity : 4096;
+    while (capacity < query->replySize + len + 1)
+      capacity *= 2;
+    char * reply = boincArray(char, capacity);
+    if (reply == NULL)
+      return 0;
+    if (query->reply) {
+      memcpy(reply, query->reply, query->replySize);
+      boincFree(query->reply);
+    }
+    query->reply = reply;
+    query->replyCapacity = capacity;
+  }
+  memcpy(query->reply + query->replySize, data, len);
+  query->replySize += len;
+  query->reply[query->replySize] = 0;
+  return len;
+}
+
+static size_t boincHttpWrite(void * data, size_t size, size_t nmemb, void * userdata)
+{
+  BoincHttpQuery * query = (BoincHttpQuery *) userdata;
+
+  if (query->localFile == NULL) {
+    return boincHttpWriteMemory(query, data, size * nmemb) / size;
+  }
+
+  // The server may send the whole file instead of the range asked
+  // for, if it changed or if it does not do ranges: start over
+  if ((query->offset > 0) && !query->checked) {
+    long code = 0;
+    curl_easy_getinfo(query->curl, CURLINFO_RESPONSE_CODE, &code);
+    if (code == 200) {
+      boincDebugf("HTTP %ld to a range request: %s starts over", code, query->localFile);
+      query->file = freopen(query->tmpfile, "w+", query->file);
+      if (query->file == NULL)
+        return 0;
+      query->offset = 0;
+      if (query->md5) {
+        boincHashMd5Destroy(query->md5);
+        query->md5 = boincHashMd5Create();
+      }
+    }
+  }
+  query->checked = 1;
+
+  size_t written = fwrite(data, size, nmemb, query->file);
+  if (query->md5)
+    boincHashMd5Update(query->md5, data, written * size);
+
+  return written;
+}
+
+static size_t boincHttpRead(void * data, size_t size, size_t nmemb, void * userdata)
+{
+  BoincHttpQuery * query = (BoincHttpQuery *) userdata;
+
+  return query->readFunc(data, size, nmemb, query->readData);
+}
+
+/**
+ * Start the checksum of a resumed query with the bytes already there
+ */
+static void boincHttpHashPrefix(BoincHttpQuery * query)
+{
+  char buff[4096];
+  size_t read;
+
+  // Without them, the file is hashed again at the end
+  FILE * file = fopen(query->tmpfile, "rb");
+  if (file == NULL) {
+    boincHashMd5Destroy(query->md5);
+    query->md5 = NULL;
+    return;
+  }
+  while ((read = fread(buff, 1, sizeof(buff), file)) > 0)
+    boincHashMd5Update(query->md5, buff, read);
+  fclose(file);
+}
+
+/**
+ * Open the temporary file the answer is written to.
+ *
+ * A resumable query keeps what is left of a previous attempt and asks
+ * for the rest only, if it can tell that the bytes are from the same
+ * file: the server confirms it with the ETag, or the checksum does at
+ * the end.
+ */
+static BoincError boincHttpOpen(BoincHttpQuery * query, char * etag, size_t etagSize)
+{
+  query->tmpfile = boincHttpPathWithSuffix(query->localFile, ".tmp");
+  if (query->tmpfile == NULL) {
+    return boincErrorCreate(kBoincFatal, kBoincSystem, "Out of memory");
+  }
+
+  struct stat tmpStat;
+  if (query->resumable && !stat(query->tmpfile, &tmpStat) && (tmpStat.st_size > 0)) {
+    boincHttpReadETag(query, etag, etagSize);
+    if (etag[0] || query->expectedMd5)
+      query->offset = tmpStat.st_size;
+  }
+
+  query->file = fopen(query->tmpfile, (query->offset > 0)? "a" : "w+");
+  if (query->file == NULL) {
+    boincFree(query->tmpfile);
+    query->tmpfile = NULL;
+    return boincErrorCreatef(kBoincError, 0, "Failed to open file %s", query->localFile);
+  }
+  if (query->offset == 0)
+    boincHttpWriteETag(query, NULL);
+
+  // The checksum is computed as the answer is written, rather than by
+  // reading the whole file again at the end
+  if (query->expectedMd5 && strlen(query->expectedMd5)) {
+    query->md5 = boincHashMd5Create();
+    if (query->md5 && (query->offset > 0))
+      boincHttpHashPrefix(query);
+  }
+
+  return NULL;
+}
+
+/**
+ * Set the options shared by all the queries
+ */
+static void boincHttpSetOptions(CURL * curl)
+{
+  //Connection reuse
+  curl_easy_setopt(curl, CURLOPT_SHARE, singleHttp->share);
+  curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+  curl_easy_setopt(curl, CURLOPT_MAXCONNECTS, singleHttp->maxIdle);
+#if LIBCURL_VERSION_NUM >= 0x074100
+  curl_easy_setopt(curl, CURLOPT_MAXAGE_CONN, singleHttp->idleTimeout);
+#endif
   //Redirection
-  curl_easy_setopt(bHttp->curl, CURLOPT_FOLLOWLOCATION, 1);
+  curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1);
   //Error management
-  curl_easy_setopt(bHttp->curl, CURLOPT_FAILONERROR, 1);
+  curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1);
+  //A transfer that gets nothing for a while fails, to be tried elsewhere
+  curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, singleHttp->stallTimeout? 1L : 0L);
+  curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, singleHttp->stallTimeout);
+
+  //Bandwidth, as the only transfer until the engine shares it
+  boincHttpSetRateShare(curl);
+}
+
+/**
+ * Set the options of a query and open the temporary file of the
+ * answer, if it is not kept in memory
+ */
+static BoincError boincHttpPrepare(CURL * curl, BoincHttpQuery * query)
+{
+  query->curl = curl;
+
+  boincHttpSetOptions(curl);
   //Result file
-  char * tmpfile = boincArray(char, strlen(localFile) + 5);
-  strcpy(tmpfile, localFile);
-  strcat(tmpfile, ".tmp");
-  FILE * file = fopen(tmpfile, "w+");
-  if (file == NULL) {
-    return boincErrorCreatef(kBoincError, 0, "Failed to open file %s", localFile);
+  char etag[sizeof(query->etag)] = "";
+  if (query->localFile) {
+    BoincError err = boincHttpOpen(query, etag, sizeof(etag));
+    if (err)
+      return err;
+  }
+
+  if (query->readFunc) {
+    curl_easy_setopt(curl, CURLOPT_READFUNCTION, boincHttpRead);
+    curl_easy_setopt(curl, CURLOPT_READDATA, query);
   }
-  curl_easy_setopt(bHttp->curl, CURLOPT_WRITEDATA, file);
+
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, boincHttpWrite);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, query);
+  curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, boincHttpHeader);
+  curl_easy_setopt(curl, CURLOPT_HEADERDATA, query);
+
+  // Unlike a resume, a range answered with the whole file is no error
+  char range[32];
+  snprintf(range, sizeof(range), "%ld-", (long) query->offset);
+  curl_easy_setopt(curl, CURLOPT_RANGE, (query->offset > 0)? range : NULL);
+
+  // The answer to a POST is decoded on the fly. A download is not,
+  // as its size, checksum and ranges are those of the encoded file.
+  curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, query->readFunc? "" : NULL);
+
   //User agent
-  struct curl_slist *slist=NULL;
-  slist = curl_slist_append(slist, bHttp->ua);
-  curl_easy_setopt(bHttp->curl, CURLOPT_HTTPHEADER, slist); 
+  if (((query->offset > 0) && etag[0]) || query->contentEncoding) {
+    char line[sizeof(etag) + 32];
+    query->headers = curl_slist_append(NULL, singleHttp->ua);
+    if ((query->offset > 0) && etag[0]) {
+      snprintf(line, sizeof(line), "If-Range: %s", etag);
+      query->headers = curl_slist_append(query->headers, line);
+    }
+    if (query->contentEncoding) {
+      snprintf(line, sizeof(line), "Content-Encoding: %s", query->contentEncoding);
+      query->headers = curl_slist_append(query->headers, line);
+    }
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, query->headers); 
+  } else {
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, singleHttp->headers); 
+  }
+
+  if (query->offset > 0)
+    boincDebugf("HTTP resumes %s at byte %ld", query->localFile, (long) query->offset);
+
+  return NULL;
+}
+
+/**
+ * Check a complete answer against the size and the checksum expected
+ */
+static BoincError boincHttpVerify(BoincHttpQuery * query)
+{
+  struct stat tmpStat;
+  if (stat(query->tmpfile, &tmpStat))
+    return boincErrorCreatef(kBoincError, kBoincFileSystem, "Cannot stat %s", query->tmpfile);
+
+  if ((query->expectedSize > 0) && (tmpStat.st_size != query->expectedSize))
+    return boincErrorCreatef(kBoincError, kBoincFileSystem, "%s has %ld bytes instead of %u",
+                             query->localFile, (long) tmpStat.st_size, query->expectedSize);
+
+  if (query->expectedMd5 && strlen(query->expectedMd5)) {
+    char hash[33];
+    if (query->md5) {
+      boincHashMd5Final(query->md5, hash);
+      query->md5 = NULL;
+    } else {
+      BoincError err = boincHashMd5File(query->tmpfile, hash);
+      if (err)
+        return err;
+    }
+    if (strcmp(hash, query->expectedMd5))
+      return boincErrorCreatef(kBoincError, kBoincFileSystem, "Wrong checksum for %s", query->localFile);
+  }
+
+  return NULL;
+}
+
+/**
+ * Turn a failed transfer into an error, with the HTTP code if there is one
+ */
+static BoincError boincHttpResultError(CURLcode res, CURL * curl, long * code)
+{
+  curl_easy_getinfo(curl, CURLINFO_HTTP_CODE, code);
+  if (*code && (*code != 200) && (*code != 206))
+    return boincErrorCreatef(kBoincError, *code, "HTTP returns %d code", *code);
+  return boincErrorCreate(kBoincError, 2, curl_easy_strerror(res));
+}
+
+/**
+ * Move a complete and verified answer in place and turn the result of
+ * the query into an error. What a resumable query got of the answer
+ * is kept for the next attempt.
+ */
+static BoincError boincHttpFinish(CURLcode res, BoincHttpQuery * query)
+{
+  BoincError err = NULL;
+  long statLong = 0;
+
+  if (query->file)
+    fclose(query->file);
+  query->file = NULL;
+  curl_slist_free_all(query->headers);
+  query->headers = NULL;
+
+  //Error management
+  if (res) {
+    err = boincHttpResultError(res, query->curl, &statLong);
+  } else if (query->localFile) {
+    err = boincHttpVerify(query);
+  } else if (query->reply == NULL) {
+    // An empty answer is an empty string
+    boincHttpWriteMemory(query, "", 0);
+    if (query->reply == NULL)
+      err = boincErrorCreate(kBoincFatal, kBoincSystem, "Out of memory");
+  }
+
+  // An answer in memory is only handed over if complete
+  if (query->localFile == NULL) {
+    if (err) {
+      boincFree(query->reply);
+      query->reply = NULL;
+      query->replySize = 0;
+    }
+    return err;
+  }
+
+  // A range past the end, an answer that fails the checks, or one
+  // that cannot be resumed: the next attempt starts from scratch
+  if (err && (!query->resumable || (statLong == 416) || (res == CURLE_OK))) {
+    unlink(query->tmpfile);
+    boincHttpWriteETag(query, NULL);
+  }
+
+  if (!err) {
+    rename(query->tmpfile, query->localFile);
+    boincHttpWriteETag(query, NULL);
+  }
+
+  boincHashMd5Destroy(query->md5);
+  query->md5 = NULL;
+  boincFree(query->tmpfile);
+  query->tmpfile = NULL;
+
+  return err;
+}
+
+/**
+ * Time to the first byte, which also counts the wait for a connection,
+ * and rate of the answer after it
+ */
+static void boincHttpMeasure(CURL * curl, BoincHttpStats * stats)
+{
+  double latency = 0, total = 0;
+  curl_off_t bytes = 0;
+  curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME, &latency);
+  curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &total);
+  curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &bytes);
+  stats->latency = latency;
+  stats->rate = (total > latency)? bytes / (total - latency) : 0;
+}
+
+static BoincError boincHttpCommon(BoincHttp * bHttp, BoincHttpQuery * query) 
+{
+  int res;
+
+  BoincError err = boincHttpPrepare(bHttp->curl, query);
+  if (err)
+    return err;
 
   //Progress callback
   if (bHttp->progressfunc) {
@@ -111,10 +712,7 @@ BoincError boincHttpCommon(BoincHttp * bHttp, const char* localFile)
 
   //Downloading
   res = curl_easy_perform(bHttp->curl);
-  fclose(file);
-  rename(tmpfile, localFile);
-
-  curl_slist_free_all(slist);
+  boincHttpMeasure(bHttp->curl, &bHttp->stats);
 
   singleHttp->progressfunc = NULL;
   singleHttp->progressdata = NULL;
@@ -123,58 +721,1054 @@ BoincError boincHttpCommon(BoincHttp * bHttp, const char* localFile)
   if (bHttp->progressfunc != NULL)
     bHttp->progressfunc(bHttp->progressdata, 100.0);
 
-  //Error management
-  if (res) {
-    long statLong ;
-    curl_easy_getinfo(bHttp->curl, CURLINFO_HTTP_CODE, &statLong);
-
-    if (statLong != 200) {
-      struct stat resStat;
-      if (!stat(localFile, &resStat)) {
-        if (resStat.st_size == 0) {
-          boincLogf(kBoincError, 0, "unlink %s", localFile);
-          unlink(localFile);
-	}
-      }
-      return boincErrorCreatef(kBoincError, statLong, "HTTP returns %d code", statLong);
-    }
-    return boincErrorCreate(kBoincError, 2, curl_easy_strerror(res));
-  }
-   
-  return NULL;
+  return boincHttpFinish(res, query);
 }
 
-BoincError boincHttpGet(const char* url, const char* localFile) 
+static BoincError boincHttpGetQuery(const char* url, BoincHttpQuery * query) 
 {
   BoincError err = boincHttpInit();
   if (err)
     return err;
 
-  boincDebugf("HTTP GET %s will be saved in %s", url, localFile);
+  boincDebugf("HTTP GET %s will be saved in %s", url, query->localFile? query->localFile : "memory");
   curl_easy_setopt(singleHttp->curl, CURLOPT_URL, url);
   curl_easy_setopt(singleHttp->curl, CURLOPT_READFUNCTION, NULL);
   curl_easy_setopt(singleHttp->curl, CURLOPT_READDATA, NULL);
   curl_easy_setopt(singleHttp->curl, CURLOPT_POST, 0);
   curl_easy_setopt(singleHttp->curl, CURLOPT_POSTFIELDSIZE, 0);
-  return boincHttpCommon(singleHttp, localFile);
-
+  return boincHttpCommon(singleHttp, query);
 }
 
-
-BoincError boincHttpPost(const char* url, const char* localFile, unsigned int contentLength, BoincHttpReadFun readFunc, void* userData) 
+static BoincError boincHttpPostQuery(const char* url, unsigned int contentLength, BoincHttpQuery * query) 
 {
   BoincError err = boincHttpInit();
   if (err)
     return err;
-  
+
   curl_easy_setopt(singleHttp->curl, CURLOPT_URL, url);
-  curl_easy_setopt(singleHttp->curl, CURLOPT_READFUNCTION, readFunc);
-  curl_easy_setopt(singleHttp->curl, CURLOPT_READDATA, userData);
+  curl_easy_setopt(singleHttp->curl, CURLOPT_READFUNCTION, NULL);
+  curl_easy_setopt(singleHttp->curl, CURLOPT_READDATA, NULL);
   curl_easy_setopt(singleHttp->curl, CURLOPT_POST, 1);
   curl_easy_setopt(singleHttp->curl, CURLOPT_POSTFIELDSIZE, contentLength);
 
-  boincDebugf("HTTP POST %s will be save in %s", url, localFile);
+  boincDebugf("HTTP POST %s%s will be save in %s", url, query->contentEncoding? " (encoded)" : "",
+              query->localFile? query->localFile : "memory");
+
+  return boincHttpCommon(singleHttp, query);
+}
+
+void boincHttpStats(BoincHttpStats * stats)
+{
+  if (singleHttp)
+    *stats = singleHttp->stats;
+  else
+    memset(stats, 0, sizeof(BoincHttpStats));
+}
+
+BoincError boincHttpGet(const char* url, const char* localFile) 
+{
+  return boincHttpGetFile(url, localFile, 0, NULL);
+}
+
+BoincError boincHttpGetFile(const char* url, const char* localFile, unsigned int expectedSize, const char* expectedMd5) 
+{
+  BoincHttpQuery query;
+  memset(&query, 0, sizeof(BoincHttpQuery));
+  query.localFile = localFile;
+  query.resumable = 1;
+  query.expectedSize = expectedSize;
+  query.expectedMd5 = expectedMd5;
+
+  return boincHttpGetQuery(url, &query);
+}
+
+BoincError boincHttpGetMemory(const char* url, char** reply, size_t* replySize) 
+{
+  BoincHttpQuery query;
+  memset(&query, 0, sizeof(BoincHttpQuery));
+
+  BoincError err = boincHttpGetQuery(url, &query);
+  *reply = query.reply;
+  *replySize = query.replySize;
+  return err;
+}
+
+BoincError boincHttpPost(const char* url, const char* localFile, unsigned int contentLength, BoincHttpReadFun readFunc, void* userData) 
+{
+  return boincHttpPostEncoded(url, localFile, contentLength, readFunc, userData, NULL);
+}
+
+BoincError boincHttpPostEncoded(const char* url, const char* localFile, unsigned int contentLength,
+                                BoincHttpReadFun readFunc, void* userData, const char* contentEncoding) 
+{
+  // The answer to a POST is never resumed
+  BoincHttpQuery query;
+  memset(&query, 0, sizeof(BoincHttpQuery));
+  query.localFile = localFile;
+  query.readFunc = readFunc;
+  query.readData = userData;
+  query.contentEncoding = contentEncoding;
+
+  return boincHttpPostQuery(url, contentLength, &query);
+}
+
+BoincError boincHttpPostMemory(const char* url, unsigned int contentLength, BoincHttpReadFun readFunc, void* userData,
+                               const char* contentEncoding, char** reply, size_t* replySize) 
+{
+  BoincHttpQuery query;
+  memset(&query, 0, sizeof(BoincHttpQuery));
+  query.readFunc = readFunc;
+  query.readData = userData;
+  query.contentEncoding = contentEncoding;
+
+  BoincError err = boincHttpPostQuery(url, contentLength, &query);
+  *reply = query.reply;
+  *replySize = query.replySize;
+  return err;
+}
+
+
+/*   Concurrent transfers    */
+
+
+typedef struct _BoincHttpJob BoincHttpJob;
+typedef struct _BoincHttpRanges BoincHttpRanges;
+
+struct _BoincHttpJob {
+  CURL * curl;
+  BoincHttpQuery query;
+  char * localFile;
+  char expectedMd5[33];
+  BoincHttpDoneCallback done;
+  BoincHttpReplyCallback replied; // instead of done, for an answer kept in memory
+  void * userData;
+  BoincHttpJob * next;
+  curl_off_t reported;          // bytes received told to the progress callback
+  BoincHttpRanges * ranges;     // the file this job gets a range of, if any
+  curl_off_t rangeStart;        // first byte of the range
+  curl_off_t rangeNext;         // where the next byte of the range goes
+  curl_off_t rangeEnd;          // past the last byte of the range
+  int rangeChecked;             // the server was seen to answer with a range
+  long share[2];                // bytes per second given in each direction
+  curl_off_t sharedBytes[2];    // moved at the last measure of the rates
+  int measured;                 // running at the last measure
+};
+
+/*
+  A large file is fetched in several byte ranges at once, each on its
+  own connection, and every range writes its bytes in place into a
+  file of the final size.
 
-  return boincHttpCommon(singleHttp, localFile);
+  The spans received are listed in a .ranges file next to it, as each
+  range ends: the size of the file on the first line, then a span per
+  line. A new attempt, over the same mirror or another one, only
+  fetches the spans missing.
+*/
+struct _BoincHttpRanges {
+  BoincHttpTransfers * transfers;
+  char * url;
+  char * localFile;
+  char * partfile;
+  char * spanfile;              // the spans of the part received so far
+  unsigned int expectedSize;
+  char expectedMd5[33];
+  int fd;
+  int pending;                  // range jobs still running
+  int whole;                    // the server sent the whole file instead of a range
+  double start;                 // time the ranges were queued
+  double latency;               // shortest wait for the first byte of a range
+  BoincError err;               // the first failure of a range
+  BoincHttpDoneCallback done;
+  void * userData;
+};
+
+struct _BoincHttpTransfers {
+  CURLM * multi;
+  BoincHttpJob * jobs;
+  int rangeCount;               // ranges a large file is split into
+  unsigned int rangeMinSize;    // smallest file split into ranges
+  int closing;
+  double received;              // bytes of the jobs that ended
+  BoincHttpStats stats;         // of the transfer whose done callback runs
+  BoincHttpReceivedCallback onReceived; // told of the bytes each GET into a file receives
+  double sharedAt;              // when the bandwidth was last shared
+  unsigned int rateVersion;     // of the limits it was shared with
+};
+
+BoincHttpTransfers * boincHttpTransfersCreate(int maxTransfers, int maxPerHost)
+{
+  BoincError err = boincHttpInit();
+  if (err) {
+    boincErrorDestroy(err);
+    return NULL;
+  }
 
+  BoincHttpTransfers * transfers = boincNew(BoincHttpTransfers);
+  if (transfers == NULL)
+    return NULL;
+
+  transfers->multi = curl_multi_init();
+  if (transfers->multi == NULL) {
+    boincFree(transfers);
+    return NULL;
+  }
+  curl_multi_setopt(transfers->multi, CURLMOPT_MAXCONNECTS, singleHttp->maxIdle);
+
+  // The transfers over the limits wait in libcurl for a connection
+  if (maxTransfers > 0)
+    curl_multi_setopt(transfers->multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, (long) maxTransfers);
+  if (maxPerHost > 0)
+    curl_multi_setopt(transfers->multi, CURLMOPT_MAX_HOST_CONNECTIONS, (long) maxPerHost);
+
+  return transfers;
+}
+
+static void boincHttpJobDestroy(BoincHttpJob * job)
+{
+  curl_easy_cleanup(job->curl);
+  boincFree(job->localFile);
+  boincFree(job);
 }
+
+/**
+ * Share the bandwidth again between the jobs, as one starts or ends,
+ * or from the rates they reached since the last measure. libcurl
+ * reads the limits of a transfer as it goes.
+ */
+static void boincHttpTransfersShare(BoincHttpTransfers * transfers, int measure)
+{
+  static const CURLoption options[2] = { CURLOPT_MAX_RECV_SPEED_LARGE, CURLOPT_MAX_SEND_SPEED_LARGE };
+  static const CURLINFO moved[2] = { CURLINFO_SIZE_DOWNLOAD_T, CURLINFO_SIZE_UPLOAD_T };
+
+  double now = boincHttpClock();
+  double elapsed = now - transfers->sharedAt;
+  if (measure)
+    transfers->sharedAt = now;
+  boincMutexLock(singleHttp->rateMutex);
+  transfers->rateVersion = singleHttp->rateVersion;
+  boincMutexUnlock(singleHttp->rateMutex);
+
+  int count = 0;
+  for (BoincHttpJob * job = transfers->jobs; job; job = job->next)
+    count++;
+  if (count == 0)
+    return;
+
+  double * demands = boincArray(double, count);
+  long * lastShares = boincArray(long, count);
+  long * shares = boincArray(long, count);
+  if (!demands || !lastShares || !shares) {
+    boincFree(demands);
+    boincFree(lastShares);
+    boincFree(shares);
+    return;
+  }
+
+  for (int d = 0; d < 2; d++) {
+    int i = 0;
+    for (BoincHttpJob * job = transfers->jobs; job; job = job->next, i++) {
+      demands[i] = -1;
+      lastShares[i] = job->share[d];
+      if (measure) {
+        curl_off_t bytes = 0;
+        curl_easy_getinfo(job->curl, moved[d], &bytes);
+        if (job->measured && (elapsed > 0))
+          demands[i] = (bytes - job->sharedBytes[d]) / elapsed;
+        job->sharedBytes[d] = bytes;
+      }
+    }
+    boincHttpRateShares(d, count, demands, lastShares, shares);
+    i = 0;
+    for (BoincHttpJob * job = transfers->jobs; job; job = job->next, i++) {
+      job->share[d] = shares[i];
+      curl_easy_setopt(job->curl, options[d], (curl_off_t) shares[i]);
+    }
+  }
+  for (BoincHttpJob * job = transfers->jobs; job; job = job->next)
+    job->measured |= measure;
+
+  boincFree(demands);
+  boincFree(lastShares);
+  boincFree(shares);
+}
+
+static void boincHttpRangeKeep(BoincHttpJob * job);
+
+/**
+ * Take a finished job out of the list, then tell its owner
+ */
+static void boincHttpTransfersEnd(BoincHttpTransfers * transfers, BoincHttpJob * job, BoincError err)
+{
+  BoincHttpJob ** pjob = &transfers->jobs;
+  while (*pjob != job)
+    pjob = &(*pjob)->next;
+  *pjob = job->next;
+
+  curl_multi_remove_handle(transfers->multi, job->curl);
+  if (!transfers->closing)
+    boincHttpTransfersShare(transfers, 0);
+  if (job->ranges)
+    boincHttpRangeKeep(job);
+
+  boincHttpMeasure(job->curl, &transfers->stats);
+
+  // An answer kept in memory is handed over with the error
+  if (job->replied) {
+    job->replied(job->userData, err, job->query.reply, job->query.replySize);
+    job->query.reply = NULL;
+  } else if (job->done) {
+    job->done(job->userData, err);
+  } else {
+    boincErrorDestroy(err);
+  }
+
+  boincHttpJobDestroy(job);
+}
+
+/**
+ * Stop a query before its end, keeping what a resumable query got
+ */
+static void boincHttpAbandon(BoincHttpQuery * query)
+{
+  if (query->file)
+    fclose(query->file);
+  query->file = NULL;
+  curl_slist_free_all(query->headers);
+  query->headers = NULL;
+  boincHashMd5Destroy(query->md5);
+  query->md5 = NULL;
+  boincFree(query->reply);
+  query->reply = NULL;
+  if (!query->resumable && query->tmpfile)
+    unlink(query->tmpfile);
+  boincFree(query->tmpfile);
+  query->tmpfile = NULL;
+}
+
+void boincHttpTransfersDestroy(BoincHttpTransfers * transfers)
+{
+  if (transfers == NULL)
+    return;
+
+  transfers->closing = 1;
+  while (transfers->jobs) {
+    BoincHttpJob * job = transfers->jobs;
+    boincHttpAbandon(&job->query);
+    boincHttpTransfersEnd(transfers, job, boincErrorCreate(kBoincError, 0, "Transfer cancelled"));
+  }
+
+  curl_multi_cleanup(transfers->multi);
+  boincFree(transfers);
+}
+
+static BoincError boincHttpTransfersAdd(BoincHttpTransfers * transfers, BoincHttpJob * job, 
+                                        const char* url, const char* localFile)
+{
+  curl_easy_setopt(job->curl, CURLOPT_URL, url);
+  curl_easy_setopt(job->curl, CURLOPT_PRIVATE, job);
+
+  if (localFile != NULL) {
+    job->localFile = boincArray(char, strlen(localFile) + 1);
+    if (job->localFile == NULL) {
+      boincHttpJobDestroy(job);
+      return boincErrorCreate(kBoincFatal, kBoincSystem, "Out of memory");
+    }
+    strcpy(job->localFile, localFile);
+    job->query.localFile = job->localFile;
+  }
+
+  BoincError err = boincHttpPrepare(job->curl, &job->query);
+  if (err) {
+    boincHttpJobDestroy(job);
+    return err;
+  }
+
+  if (curl_multi_add_handle(transfers->multi, job->curl) != CURLM_OK) {
+    boincHttpAbandon(&job->query);
+    boincHttpJobDestroy(job);
+    return boincErrorCreate(kBoincError, 0, "Cannot queue the HTTP transfer");
+  }
+
+  job->next = transfers->jobs;
+  transfers->jobs = job;
+  boincHttpTransfersShare(transfers, 0);
+
+  return NULL;
+}
+
+static BoincHttpJob * boincHttpJobCreate(BoincHttpDoneCallback done, void * userData)
+{
+  BoincHttpJob * job = boincNew(BoincHttpJob);
+  if (job == NULL)
+    return NULL;
+  job->curl = curl_easy_init();
+  if (job->curl == NULL) {
+    boincFree(job);
+    return NULL;
+  }
+  job->done = done;
+  job->userData = userData;
+  return job;
+}
+
+/**
+ * Queue the GET of a whole file, resumed if a previous attempt left a part
+ */
+static BoincError boincHttpTransfersGetWhole(BoincHttpTransfers * transfers, const char* url, const char* localFile,
+                                             unsigned int expectedSize, const char* expectedMd5,
+                                             BoincHttpDoneCallback done, void * userData)
+{
+  BoincHttpJob * job = boincHttpJobCreate(done, userData);
+  if (job == NULL)
+    return boincErrorCreate(kBoincFatal, 0, "Cannot initialise HTTP layer");
+
+  job->query.resumable = 1;
+  job->query.expectedSize = expectedSize;
+  if (expectedMd5 && strlen(expectedMd5)) {
+    snprintf(job->expectedMd5, sizeof(job->expectedMd5), "%s", expectedMd5);
+    job->query.expectedMd5 = job->expectedMd5;
+  }
+
+  boincDebugf("HTTP GET %s will be saved in %s", url, localFile);
+  return boincHttpTransfersAdd(transfers, job, url, localFile);
+}
+
+static void boincHttpRangesDestroy(BoincHttpRanges * ranges)
+{
+  if (ranges->fd >= 0)
+    close(ranges->fd);
+  boincFree(ranges->url);
+  boincFree(ranges->localFile);
+  boincFree(ranges->partfile);
+  boincFree(ranges->spanfile);
+  boincFree(ranges);
+}
+
+/**
+ * Drop the part of a file and its spans, to start over
+ */
+static void boincHttpRangesDiscard(BoincHttpRanges * ranges)
+{
+  unlink(ranges->partfile);
+  unlink(ranges->spanfile);
+}
+
+/**
+ * Add the span a range job received to the list of the file, whether
+ * the job ended or failed halfway
+ */
+static void boincHttpRangeKeep(BoincHttpJob * job)
+{
+  if (job->ranges->whole || (job->rangeNext <= job->rangeStart))
+    return;
+
+  int fd = open(job->ranges->spanfile, O_WRONLY | O_APPEND);
+  if (fd < 0)
+    return;
+  char line[64];
+  int len = snprintf(line, sizeof(line), "%lld %lld\n", (long long) job->rangeStart, (long long) job->rangeNext);
+  if (write(fd, line, len) != len)
+    boincDebugf("HTTP cannot list the span %s of %s", line, job->ranges->localFile);
+  close(fd);
+}
+
+static int boincHttpCompareSpans(const void * a, const void * b)
+{
+  curl_off_t sa = ((const curl_off_t *) a)[0];
+  curl_off_t sb = ((const curl_off_t *) b)[0];
+  return (sa < sb)? -1 : (sa > sb);
+}
+
+/**
+ * Read the spans a previous attempt received, as start and end pairs
+ * sorted by start. Returns their count, or -1 if there is no part to
+ * resume: no list, a list of another size, or no part file.
+ */
+static int boincHttpRangesLoad(BoincHttpRanges * ranges, curl_off_t ** spans)
+{
+  struct stat partStat;
+  if (stat(ranges->partfile, &partStat))
+    return -1;
+  FILE * file = fopen(ranges->spanfile, "r");
+  if (file == NULL)
+    return -1;
+
+  unsigned int size = 0;
+  int count = 0, allocated = 0;
+  long long start, end;
+  *spans = NULL;
+  if ((fscanf(file, "%u", &size) != 1) || (size != ranges->expectedSize))
+    count = -1;
+  while ((count >= 0) && (fscanf(file, "%lld %lld", &start, &end) == 2)) {
+    if ((start < 0) || (start >= end) || (end > size)) {
+      count = -1;
+      break;
+    }
+    if (count == allocated) {
+      allocated = allocated? 2 * allocated : 16;
+      curl_off_t * grown = boincArray(curl_off_t, 2 * allocated);
+      if (grown == NULL) {
+        count = -1;
+        break;
+      }
+      if (*spans)
+        memcpy(grown, *spans, 2 * count * sizeof(curl_off_t));
+      boincFree(*spans);
+      *spans = grown;
+    }
+    (*spans)[2 * count] = start;
+    (*spans)[2 * count + 1] = end;
+    count++;
+  }
+  fclose(file);
+
+  if (count < 0) {
+    boincFree(*spans);
+    *spans = NULL;
+    return -1;
+  }
+  qsort(*spans, count, 2 * sizeof(curl_off_t), boincHttpCompareSpans);
+  return count;
+}
+
+static size_t boincHttpWriteRange(void * data, size_t size, size_t nmemb, void * userdata)
+{
+  BoincHttpJob * job = (BoincHttpJob *) userdata;
+  size_t len = size * nmemb;
+
+  // A server that does not do ranges sends the whole file: the file
+  // is then fetched over a single connection
+  if (!job->rangeChecked) {
+    long code = 0;
+    curl_easy_getinfo(job->curl, CURLINFO_RESPONSE_CODE, &code);
+    if (code == 200) {
+      job->ranges->whole = 1;
+      return 0;
+    }
+    job->rangeChecked = 1;
+  }
+
+  if (job->rangeNext + (curl_off_t) len > job->rangeEnd)
+    return 0;
+
+  if (pwrite(job->ranges->fd, data, len, (off_t) job->rangeNext) != (ssize_t) len)
+    return 0;
+  job->rangeNext += len;
+
+  return len;
+}
+
+/**
+ * Called as each range ends. Once they all have, the file is checked
+ * and moved in place, or fetched whole if the server sent no range.
+ */
+static void boincHttpRangeDone(void * userData, BoincError err)
+{
+  BoincHttpRanges * ranges = (BoincHttpRanges *) userData;
+
+  if (err && (ranges->err == NULL))
+    ranges->err = err;
+  else
+    boincErrorDestroy(err);
+
+  if (--ranges->pending > 0)
+    return;
+
+  close(ranges->fd);
+  ranges->fd = -1;
+
+  if (ranges->whole)
+    boincHttpRangesDiscard(ranges);
+  if (ranges->whole && !ranges->transfers->closing) {
+    boincErrorDestroy(ranges->err);
+    boincDebugf("HTTP %s has no ranges, it is fetched whole", ranges->url);
+    err = boincHttpTransfersGetWhole(ranges->transfers, ranges->url, ranges->localFile, ranges->expectedSize,
+                                     ranges->expectedMd5, ranges->done, ranges->userData);
+    if (err && ranges->done)
+      ranges->done(ranges->userData, err);
+    else if (err)
+      boincErrorDestroy(err);
+    boincHttpRangesDestroy(ranges);
+    return;
+  }
+
+  // The ranges arrive out of order, so the checksum is computed once
+  // the file is complete. A range that failed leaves the part and its
+  // spans for the next attempt; a part that fails the checksum is
+  // fetched again from scratch.
+  err = ranges->err;
+  if (err == NULL) {
+    BoincHttpQuery query;
+    memset(&query, 0, sizeof(BoincHttpQuery));
+    query.localFile = ranges->localFile;
+    query.tmpfile = ranges->partfile;
+    query.expectedSize = ranges->expectedSize;
+    query.expectedMd5 = ranges->expectedMd5;
+    err = boincHttpVerify(&query);
+    if (err) {
+      boincHttpRangesDiscard(ranges);
+    } else {
+      rename(ranges->partfile, ranges->localFile);
+      unlink(ranges->spanfile);
+    }
+  }
+
+  // The figures of the file as a whole, rather than of its last range
+  BoincHttpStats * stats = &ranges->transfers->stats;
+  double elapsed = boincHttpClock() - ranges->start - ranges->latency;
+  stats->latency = ranges->latency;
+  stats->rate = (elapsed > 0)? ranges->expectedSize / elapsed : 0;
+
+  if (ranges->done)
+    ranges->done(ranges->userData, err);
+  else
+    boincErrorDestroy(err);
+  boincHttpRangesDestroy(ranges);
+}
+
+static BoincError boincHttpRangeFinish(CURLcode res, BoincHttpJob * job)
+{
+  long code = 0;
+  double latency = 0;
+
+  curl_easy_getinfo(job->curl, CURLINFO_STARTTRANSFER_TIME, &latency);
+  if ((latency > 0) && ((job->ranges->latency == 0) || (latency < job->ranges->latency)))
+    job->ranges->latency = latency;
+
+  if (job->ranges->whole)
+    return NULL;
+  if (res)
+    return boincHttpResultError(res, job->curl, &code);
+  if (job->rangeNext != job->rangeEnd)
+    return boincErrorCreatef(kBoincError, 2, "Incomplete range of %s", job->ranges->localFile);
+  return NULL;
+}
+
+static BoincError boincHttpTransfersAddRange(BoincHttpTransfers * transfers, BoincHttpRanges * ranges,
+                                             curl_off_t start, curl_off_t end)
+{
+  BoincHttpJob * job = boincHttpJobCreate(boincHttpRangeDone, ranges);
+  if (job == NULL)
+    return boincErrorCreate(kBoincFatal, 0, "Cannot initialise HTTP layer");
+
+  job->ranges = ranges;
+  job->rangeStart = start;
+  job->rangeNext = start;
+  job->rangeEnd = end;
+
+  char range[64];
+  snprintf(range, sizeof(range), "%ld-%ld", (long) start, (long) end - 1);
+
+  curl_easy_setopt(job->curl, CURLOPT_URL, ranges->url);
+  curl_easy_setopt(job->curl, CURLOPT_PRIVATE, job);
+  boincHttpSetOptions(job->curl);
+  curl_easy_setopt(job->curl, CURLOPT_HTTPHEADER, singleHttp->headers);
+  curl_easy_setopt(job->curl, CURLOPT_RANGE, range);
+  curl_easy_setopt(job->curl, CURLOPT_WRITEFUNCTION, boincHttpWriteRange);
+  curl_easy_setopt(job->curl, CURLOPT_WRITEDATA, job);
+
+  if (curl_multi_add_handle(transfers->multi, job->curl) != CURLM_OK) {
+    boincHttpJobDestroy(job);
+    return boincErrorCreate(kBoincError, 0, "Cannot queue the HTTP transfer");
+  }
+
+  job->next = transfers->jobs;
+  transfers->jobs = job;
+  boincHttpTransfersShare(transfers, 0);
+  ranges->pending++;
+
+  return NULL;
+}
+
+static char * boincHttpStrdup(const char * str)
+{
+  char * copy = boincArray(char, strlen(str) + 1);
+  if (copy)
+    strcpy(copy, str);
+  return copy;
+}
+
+/**
+ * Reserve the space of a file, so a full disk shows up before the
+ * transfer rather than halfway through the ranges. A file system that
+ * cannot reserve gets a file of the size, with holes.
+ */
+static int boincHttpReserve(int fd, unsigned int size)
+{
+  int res = posix_fallocate(fd, 0, size);
+  if ((res == EINVAL) || (res == EOPNOTSUPP))
+    res = ftruncate(fd, size)? errno : 0;
+  return res;
+}
+
+/**
+ * Queue the GET of a large file in ranges, into a file of its final
+ * size. The part left by a previous attempt is kept, and only the spans
+ * it misses are queued, each as a range.
+ */
+static BoincError boincHttpTransfersGetRanges(BoincHttpTransfers * transfers, const char* url, const char* localFile,
+                                              unsigned int expectedSize, const char* expectedMd5,
+                                              BoincHttpDoneCallback done, void * userData)
+{
+  BoincHttpRanges * ranges = boincNew(BoincHttpRanges);
+  if (ranges == NULL)
+    return boincErrorCreate(kBoincFatal, kBoincSystem, "Out of memory");
+
+  ranges->fd = -1;
+  ranges->transfers = transfers;
+  ranges->url = boincHttpStrdup(url);
+  ranges->localFile = boincHttpStrdup(localFile);
+  ranges->partfile = boincHttpPathWithSuffix(localFile, ".part");
+  ranges->spanfile = boincHttpPathWithSuffix(localFile, ".ranges");
+  if (!ranges->url || !ranges->localFile || !ranges->partfile || !ranges->spanfile) {
+    boincHttpRangesDestroy(ranges);
+    return boincErrorCreate(kBoincFatal, kBoincSystem, "Out of memory");
+  }
+  ranges->expectedSize = expectedSize;
+  if (expectedMd5)
+    snprintf(ranges->expectedMd5, sizeof(ranges->expectedMd5), "%s", expectedMd5);
+  ranges->done = done;
+  ranges->userData = userData;
+  ranges->start = boincHttpClock();
+
+  curl_off_t * spans = NULL;
+  int nbspans = boincHttpRangesLoad(ranges, &spans);
+
+  ranges->fd = open(ranges->partfile, O_RDWR | O_CREAT | ((nbspans < 0)? O_TRUNC : 0), 
+                    S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  if (ranges->fd < 0) {
+    BoincError err = boincErrorCreatef(kBoincError, kBoincFileSystem, "Failed to open file %s", ranges->partfile);
+    boincFree(spans);
+    boincHttpRangesDestroy(ranges);
+    return err;
+  }
+  int reserved = boincHttpReserve(ranges->fd, expectedSize);
+  if ((reserved == 0) && (nbspans < 0)) {
+    FILE * file = fopen(ranges->spanfile, "w");
+    if ((file == NULL) || (fprintf(file, "%u\n", expectedSize) < 0))
+      reserved = errno;
+    if (file && fclose(file) && (reserved == 0))
+      reserved = errno;
+  }
+  if (reserved) {
+    BoincError err = boincErrorCreatef(kBoincError, kBoincFileSystem, "Failed to reserve %u bytes for %s: %s",
+                                       expectedSize, ranges->partfile, strerror(reserved));
+    boincFree(spans);
+    boincHttpRangesDiscard(ranges);
+    boincHttpRangesDestroy(ranges);
+    return err;
+  }
+
+  // The last range also gets what is left of the division, and every
+  // range at least a byte. A part resumed gets a range for each span
+  // it misses. The ranges queued so far end as usual if one cannot be
+  // queued.
+  BoincError err = NULL;
+  ranges->pending = 1;
+  if (nbspans < 0) {
+    int count = ((transfers->rangeCount > 1) && (expectedSize >= (unsigned int) transfers->rangeCount))? 
+      transfers->rangeCount : 1;
+    boincDebugf("HTTP GET %s will be saved in %s, in %d ranges", url, localFile, count);
+    curl_off_t size = expectedSize / count;
+    for (int i = 0; (i < count) && (err == NULL); i++) {
+      curl_off_t end = (i == count - 1)? (curl_off_t) expectedSize : (i + 1) * size;
+      err = boincHttpTransfersAddRange(transfers, ranges, i * size, end);
+    }
+  } else {
+    boincDebugf("HTTP GET %s resumes %s, %d spans received", url, localFile, nbspans);
+    curl_off_t next = 0;
+    for (int i = 0; (i <= nbspans) && (err == NULL); i++) {
+      curl_off_t start = (i < nbspans)? spans[2 * i] : (curl_off_t) expectedSize;
+      if (start > next)
+        err = boincHttpTransfersAddRange(transfers, ranges, next, start);
+      if ((i < nbspans) && (spans[2 * i + 1] > next))
+        next = spans[2 * i + 1];
+    }
+  }
+  boincFree(spans);
+  if (err && (ranges->pending == 1)) {
+    close(ranges->fd);
+    ranges->fd = -1;
+    boincHttpRangesDestroy(ranges);
+    return err;
+  }
+  boincHttpRangeDone(ranges, err);
+
+  return NULL;
+}
+
+BoincError boincHttpTransfersGet(BoincHttpTransfers * transfers, const char* url, const char* localFile,
+                                 unsigned int expectedSize, const char* expectedMd5,
+                                 BoincHttpDoneCallback done, void * userData)
+{
+  // A part left by a previous attempt is resumed the way it was
+  // fetched: over a single connection, or in ranges
+  struct stat partStat;
+  char * tmpfile = boincHttpPathWithSuffix(localFile, ".tmp");
+  int partial = (tmpfile == NULL) || !stat(tmpfile, &partStat);
+  boincFree(tmpfile);
+  char * spanfile = boincHttpPathWithSuffix(localFile, ".ranges");
+  int spans = (spanfile != NULL) && !stat(spanfile, &partStat);
+  boincFree(spanfile);
+
+  if (!partial && (expectedSize > 0) && (spans || ((transfers->rangeCount > 1) && (transfers->rangeMinSize > 0)
+      && (expectedSize >= transfers->rangeMinSize) && (expectedSize >= (unsigned int) transfers->rangeCount))))
+    return boincHttpTransfersGetRanges(transfers, url, localFile, expectedSize, expectedMd5, done, userData);
+
+  return boincHttpTransfersGetWhole(transfers, url, localFile, expectedSize, expectedMd5, done, userData);
+}
+
+/**
+ * Queue a query whose answer is kept in memory: a POST of the content
+ * read by readFunc, or a GET without it
+ */
+static BoincError boincHttpTransfersMemory(BoincHttpTransfers * transfers, const char* url, unsigned int contentLength,
+                                           BoincHttpReadFun readFunc, void* readData, const char* contentEncoding,
+                                           BoincHttpReplyCallback replied, void * userData)
+{
+  BoincHttpJob * job = boincHttpJobCreate(NULL, userData);
+  if (job == NULL)
+    return boincErrorCreate(kBoincFatal, 0, "Cannot initialise HTTP layer");
+
+  job->replied = replied;
+  job->query.readFunc = readFunc;
+  job->query.readData = readData;
+  job->query.contentEncoding = contentEncoding;
+  if (readFunc) {
+    curl_easy_setopt(job->curl, CURLOPT_POST, 1L);
+    curl_easy_setopt(job->curl, CURLOPT_POSTFIELDSIZE, (long) contentLength);
+  }
+
+  boincDebugf("HTTP %s %s%s will be saved in memory", readFunc? "POST" : "GET", url, 
+              contentEncoding? " (encoded)" : "");
+  return boincHttpTransfersAdd(transfers, job, url, NULL);
+}
+
+BoincError boincHttpTransfersPost(BoincHttpTransfers * transfers, const char* url, unsigned int contentLength,
+                                  BoincHttpReadFun readFunc, void* readData, const char* contentEncoding,
+                                  BoincHttpReplyCallback replied, void * userData)
+{
+  return boincHttpTransfersMemory(transfers, url, contentLength, readFunc, readData, contentEncoding, replied, userData);
+}
+
+BoincError boincHttpTransfersGetMemory(BoincHttpTransfers * transfers, const char* url,
+                                       BoincHttpReplyCallback replied, void * userData)
+{
+  return boincHttpTransfersMemory(transfers, url, 0, NULL, NULL, NULL, replied, userData);
+}
+
+void boincHttpTransfersSetReceivedCallback(BoincHttpTransfers * transfers, BoincHttpReceivedCallback received)
+{
+  transfers->onReceived = received;
+}
+
+/**
+ * Tell the owner of each GET into a file of the bytes it received
+ * since the last time. The ranges of a file count for their file.
+ */
+static void boincHttpTransfersReport(BoincHttpTransfers * transfers)
+{
+  for (BoincHttpJob * job = transfers->jobs; job; job = job->next) {
+    if (job->replied)
+      continue;
+    curl_off_t bytes = 0;
+    curl_easy_getinfo(job->curl, CURLINFO_SIZE_DOWNLOAD_T, &bytes);
+    if (bytes > job->reported) {
+      transfers->onReceived(job->ranges? job->ranges->userData : job->userData, (double) (bytes - job->reported));
+      job->reported = bytes;
+    }
+  }
+}
+
+void boincHttpTransfersStats(BoincHttpTransfers * transfers, BoincHttpStats * stats)
+{
+  *stats = transfers->stats;
+}
+
+void boincHttpTransfersSetRanges(BoincHttpTransfers * transfers, int rangeCount, unsigned int minSize)
+{
+  transfers->rangeCount = rangeCount;
+  transfers->rangeMinSize = minSize;
+}
+
+double boincHttpTransfersReceived(BoincHttpTransfers * transfers)
+{
+  double received = transfers->received;
+  for (BoincHttpJob * job = transfers->jobs; job; job = job->next) {
+    curl_off_t bytes = 0;
+    curl_easy_getinfo(job->curl, CURLINFO_SIZE_DOWNLOAD_T, &bytes);
+    received += bytes;
+  }
+  return received;
+}
+
+int boincHttpTransfersPerform(BoincHttpTransfers * transfers)
+{
+  int running = 0;
+  int left = 0;
+  CURLMsg * msg;
+
+  curl_multi_perform(transfers->multi, &running);
+  if (transfers->onReceived)
+    boincHttpTransfersReport(transfers);
+
+  // Share the bandwidth again as the transfers go, or as the limits change
+  boincMutexLock(singleHttp->rateMutex);
+  int changed = (transfers->rateVersion != singleHttp->rateVersion);
+  boincMutexUnlock(singleHttp->rateMutex);
+  int due = (boincHttpClock() - transfers->sharedAt >= RATE_SHARE_PERIOD);
+  if (changed || due)
+    boincHttpTransfersShare(transfers, due);
+
+  while ((msg = curl_multi_info_read(transfers->multi, &left)) != NULL) {
+    if (msg->msg != CURLMSG_DONE)
+      continue;
+
+    BoincHttpJob * job = NULL;
+    CURLcode res = msg->data.result;
+    curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **) &job);
+
+    curl_off_t bytes = 0;
+    curl_easy_getinfo(job->curl, CURLINFO_SIZE_DOWNLOAD_T, &bytes);
+    transfers->received += bytes;
+
+    BoincError err = job->ranges? boincHttpRangeFinish(res, job) : boincHttpFinish(res, &job->query);
+    boincHttpTransfersEnd(transfers, job, err);
+  }
+
+  int count = 0;
+  for (BoincHttpJob * job = transfers->jobs; job; job = job->next)
+    count++;
+
+  return count;
+}
+
+void boincHttpTransfersWait(BoincHttpTransfers * transfers, int timeout)
+{
+  curl_multi_wait(transfers->multi, NULL, 0, timeout, NULL);
+}
+
+
+/*   TLS sessions    */
+
+#if LIBCURL_VERSION_NUM >= 0x080c00
+
+static int boincHttpWriteBlock(FILE * file, const void * data, size_t len)
+{
+  return (fwrite(&len, sizeof(size_t), 1, file) == 1) 
+    && ((len == 0) || (fwrite(data, 1, len, file) == len));
+}
+
+/* A block of the file, terminated by a zero for the keys */
+static unsigned char * boincHttpReadBlock(FILE * file, size_t * len)
+{
+  if (fread(len, sizeof(size_t), 1, file) != 1)
+    return NULL;
+  if (*len > 65536)
+    return NULL;
+  unsigned char * data = boincArray(unsigned char, *len + 1);
+  if (data == NULL)
+    return NULL;
+  if (fread(data, 1, *len, file) != *len) {
+    boincFree(data);
+    return NULL;
+  }
+  data[*len] = 0;
+  return data;
+}
+
+static CURLcode boincHttpExportSession(CURL *handle, void *userptr, const char *session_key,
+                                       const unsigned char *shmac, size_t shmac_len,
+                                       const unsigned char *sdata, size_t sdata_len,
+                                       curl_off_t valid_until, int ietf_tls_id,
+                                       const char *alpn, size_t earlydata_max)
+{
+  FILE * file = (FILE*) userptr;
+  if (!boincHttpWriteBlock(file, session_key, strlen(session_key))
+      || !boincHttpWriteBlock(file, shmac, shmac_len)
+      || !boincHttpWriteBlock(file, sdata, sdata_len))
+    return CURLE_WRITE_ERROR;
+  return CURLE_OK;
+}
+
+BoincError boincHttpStoreSessions(const char* sessionFile)
+{
+  BoincError err = boincHttpInit();
+  if (err)
+    return err;
+
+  // The sessions are secrets: only the user may read them
+  char * tmpfile = boincHttpPathWithSuffix(sessionFile, ".tmp");
+  if (tmpfile == NULL)
+    return boincErrorCreate(kBoincFatal, kBoincSystem, "Out of memory");
+  int fd = open(tmpfile, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+  FILE * file = (fd >= 0)? fdopen(fd, "wb") : NULL;
+  if (file == NULL) {
+    if (fd >= 0)
+      close(fd);
+    err = boincErrorCreatef(kBoincError, kBoincFileSystem, "Failed to open file %s", tmpfile);
+    boincFree(tmpfile);
+    return err;
+  }
+
+  CURLcode res = curl_easy_ssls_export(singleHttp->curl, boincHttpExportSession, file);
+  if (fclose(file) && (res == CURLE_OK))
+    res = CURLE_WRITE_ERROR;
+
+  if (res != CURLE_OK) {
+    unlink(tmpfile);
+    boincFree(tmpfile);
+    return boincErrorCreatef(kBoincError, kBoincFileSystem, "Failed to save the TLS sessions: %s", curl_easy_strerror(res));
+  }
+  rename(tmpfile, sessionFile);
+  boincFree(tmpfile);
+
+  return NULL;
+}
+
+BoincError boincHttpLoadSessions(const char* sessionFile)
+{
+  BoincError err = boincHttpInit();
+  if (err)
+    return err;
+
+  FILE * file = fopen(sessionFile, "rb");
+  if (file == NULL)
+    return NULL;
+
+  while (1) {
+    size_t keyLen, shmacLen, sdataLen;
+    unsigned char * key = boincHttpReadBlock(file, &keyLen);
+    unsigned char * shmac = key? boincHttpReadBlock(file, &shmacLen) : NULL;
+    unsigned char * sdata = shmac? boincHttpReadBlock(file, &sdataLen) : NULL;
+
+    // The sessions that expired or do not match the TLS backend are refused
+    if (sdata != NULL)
+      curl_easy_ssls_import(singleHttp->curl, (const char*) key, shmac, shmacLen, sdata, sdataLen);
+
+    boincFree(key);
+    boincFree(shmac);
+    if (sdata == NULL)
+      break;
+    boincFree(sdata);
+  }
+  fclose(file);
+
+  return NULL;
+}
+
+#else
+
+// This libcurl cannot export its sessions: they only last as long as the process
+
+BoincError boincHttpStoreSessions(const char* sessionFile)
+{
+  return NULL;
+}
+
+BoincError boincHttpLoadSessions(const char* sessionFile)
+{
+  return NULL;
+}
+
+#endif
@@ -6,13 +6,16 @@
   Authors: Peter Hanappe
  
 */
+#define _POSIX_C_SOURCE 200112L // clock_gettime
 #include "BoincMutex.h"
 #include "BoincError.h"
 #include "BoincMem.h"
 #include <pthread.h>
+#include <sched.h>
 #include <stdlib.h>
 #include <signal.h>
 #include <string.h>
+#include <time.h>
 
 #define TRACE_MUTEX_CALLS 0
 #if TRACE_MUTEX_CALLS
@@ -107,6 +110,123 @@ int boincMutexUnlock(BoincMutex mutex)
 	return pthread_mutex_unlock(&mutex->impl);
 }
 
+typedef struct _BoincConditionImpl {
+	pthread_cond_t impl;
+} BoincConditionImpl;
+
+BoincCondition boincConditionCreate()
+{
+	int err;
+	pthread_condattr_t attr;
+	BoincConditionImpl* cond;
+
+	cond = boincNew(BoincConditionImpl);
+	if (cond == NULL) {
+		boincLogf(kBoincError, -1, "boincConditionCreate: Out of memory");
+		return NULL;
+	}
+
+	// Measure the timeouts on a clock that doesn't jump with the date
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	err = pthread_cond_init(&cond->impl, &attr);
+	pthread_condattr_destroy(&attr);
+	if (err) {
+		boincLogf(kBoincError, -1, "boincConditionCreate: pthread_cond_init returned error %d", err);
+		boincFree(cond);
+		return NULL;
+	}
+
+	return cond;
+}
+
+void boincConditionDestroy(BoincCondition cond)
+{
+	if (cond) {
+		pthread_cond_destroy(&cond->impl);
+		boincFree(cond);
+	}
+}
+
+int boincConditionWait(BoincCondition cond, BoincMutex mutex, unsigned int timeout)
+{
+	struct timespec deadline;
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += timeout;
+
+	return pthread_cond_timedwait(&cond->impl, &mutex->impl, &deadline);
+}
+
+int boincConditionBroadcast(BoincCondition cond)
+{
+	return pthread_cond_broadcast(&cond->impl);
+}
+
+typedef struct _BoincThreadImpl {
+	pthread_t impl;
+	BoincThreadFunction function;
+	void* data;
+} BoincThreadImpl;
+
+static void* boincThreadMain(void* arg)
+{
+	BoincThreadImpl* thread = (BoincThreadImpl*) arg;
+	thread->function(thread->data);
+	return NULL;
+}
+
+BoincThread boincThreadCreate(BoincThreadFunction function, void* data)
+{
+	int err;
+	BoincThreadImpl* thread;
+
+	thread = boincNew(BoincThreadImpl);
+	if (thread == NULL) {
+		boincLogf(kBoincError, -1, "boincThreadCreate: Out of memory");
+		return NULL;
+	}
+	thread->function = function;
+	thread->data = data;
+
+	err = pthread_create(&thread->impl, NULL, boincThreadMain, thread);
+	if (err) {
+		boincLogf(kBoincError, -1, "boincThreadCreate: pthread_create returned error %d", err);
+		boincFree(thread);
+		return NULL;
+	}
+
+	return thread;
+}
+
+void boincThreadJoin(BoincThread thread)
+{
+	if (thread) {
+		pthread_join(thread->impl, NULL);
+		boincFree(thread);
+	}
+}
+
+void boincThreadYield()
+{
+	sched_yield();
+}
+
+unsigned int boincAtomicLoad(volatile unsigned int* value)
+{
+	return __atomic_load_n(value, __ATOMIC_SEQ_CST);
+}
+
+void boincAtomicStore(volatile unsigned int* value, unsigned int newValue)
+{
+	__atomic_store_n(value, newValue, __ATOMIC_SEQ_CST);
+}
+
+int boincAtomicCompareAndSwap(volatile unsigned int* value, unsigned int expected, unsigned int desired)
+{
+	return __atomic_compare_exchange_n(value, &expected, desired, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
 void boincCatchSigTerm(boincTermHandler th)
 {
   signal(SIGINT, th);
@@ -80,6 +80,25 @@ static void XMLCALL boincXMLParserEnd(void *data, const char * name)
 }
 
 
+static XML_Parser boincXMLParserCreate(BoincXMLParser * xml, boincXMLElementBeginCallback begin, boincXMLElementEndCallback end, void* userData)
+{
+  XML_Parser p = XML_ParserCreate(NULL);
+  if (!p)
+    return NULL;
+
+  XML_SetElementHandler(p, boincXMLParserStart, boincXMLParserEnd);
+  XML_SetCharacterDataHandler(p, boincXMLParserData);
+  xml->userData = userData;
+  xml->beginCallback = begin;
+  xml->endCallback = end;
+  xml->error = NULL;
+  xml->level = -1;
+  xml->withFullNames = 1;
+  XML_SetUserData(p, xml);
+  xml->fullName[0] = 0;
+  return p;
+}
+
 BoincError boincXMLParse(const char * xmlFile, boincXMLElementBeginCallback begin, boincXMLElementEndCallback end, void* userData)
 {
   FILE * fh = fopen(xmlFile, "r");
@@ -91,23 +110,12 @@ BoincError boincXMLParse(const char * xmlFile, boincXMLElementBeginCallback begi
     return boincErrorCreatef(kBoincError, 1, "Cannot open file %s", xmlFile);
   }
 
-  XML_Parser p = XML_ParserCreate(NULL);
+  BoincXMLParser xml;
+  XML_Parser p = boincXMLParserCreate(&xml, begin, end, userData);
   if (!p) {
     return boincErrorCreate(kBoincFatal, -2, "Cannot create xml parser");
   }
 
-  XML_SetElementHandler(p, boincXMLParserStart, boincXMLParserEnd);
-  XML_SetCharacterDataHandler(p, boincXMLParserData);
-  BoincXMLParser xml;
-  xml.userData = userData;
-  xml.beginCallback = begin;
-  xml.endCallback = end;
-  xml.error = NULL;
-  xml.level = -1;
-  xml.withFullNames = 1;
-  XML_SetUserData(p, &xml);
-  xml.fullName[0] = 0;
-
   for (;;) {
     int done;
     int len;
@@ -132,6 +140,48 @@ BoincError boincXMLParse(const char * xmlFile, boincXMLElementBeginCallback begi
   return xml.error;
 }
 
+BoincError boincXMLParseBuffer(const char * buffer, size_t size, boincXMLElementBeginCallback begin, boincXMLElementEndCallback end, void* userData)
+{
+  BoincXMLParser xml;
+  XML_Parser p = boincXMLParserCreate(&xml, begin, end, userData);
+  if (!p) {
+    return boincErrorCreate(kBoincFatal, -2, "Cannot create xml parser");
+  }
+
+  if (XML_Parse(p, buffer, (int) size, 1) == XML_STATUS_ERROR) {
+    XML_ParserFree(p);
+    boincErrorDestroy(xml.error);
+    return boincErrorCreate(kBoincError, -4, "Error in XML parsing");
+  }
+  XML_ParserFree(p);
+  return xml.error;
+}
+
+char * boincXMLEscape(const char * value, char * out, size_t size)
+{
+  size_t len = 0;
+  for (const char * c = value; *c; c++) {
+    const char * entity = NULL;
+    switch (*c) {
+    case '&': entity = "&amp;"; break;
+    case '<': entity = "&lt;"; break;
+    case '>': entity = "&gt;"; break;
+    case '"': entity = "&quot;"; break;
+    case '\'': entity = "&apos;"; break;
+    }
+    size_t n = entity? strlen(entity) : 1;
+    if (len + n >= size)
+      return NULL;
+    if (entity)
+      memcpy(out + len, entity, n);
+    else
+      out[len] = *c;
+    len += n;
+  }
+  out[len] = 0;
+  return out;
+}
+
 const char * boincXMLGetAttributeValue(const char** attributes, const char* attributeName) 
 {
   for (int i = 0 ; attributes[i] ; i+=2 ) {
@@ -59,11 +59,30 @@ BoincError testBoincHashMd5File(void* data)
   
 }
 
+BoincError testBoincHashMd5Pieces(void* data)
+{
+  char string[] = "bonjours très chers amis adorés ùùùùùù àààà";
+  char wantedmd5[] = "28f4ec9e275883579cf3f51866d71adc";
+  char md5res[33];
+
+  BoincHashMd5 * md5 = boincHashMd5Create();
+  if (md5 == NULL)
+    return boincErrorCreate(kBoincError, 2, "no md5");
+  for (int i = 0; i < strlen(string); i += 7)
+    boincHashMd5Update(md5, string + i, (strlen(string) - i < 7)? strlen(string) - i : 7);
+  boincHashMd5Final(md5, md5res);
+  boincDebugf("md5res %s (%s)", md5res, wantedmd5);
+  if (strcmp(md5res, wantedmd5))
+    return boincErrorCreate(kBoincError, 1, "wrong md5");
+  return NULL;
+}
+
 int testBoincHash(BoincTest * test)
 {
   boincTestInitMajor(test, "BoincHash");
   boincTestRunMinor(test, "BoincHash md5 string", testBoincHashMd5String, NULL);
   boincTestRunMinor(test, "BoincHash md5 file", testBoincHashMd5File, NULL);
+  boincTestRunMinor(test, "BoincHash md5 in pieces", testBoincHashMd5Pieces, NULL);
   boincTestEndMajor(test);
   return 0;
 }
@@ -22,12 +22,18 @@
 */ 
 #include "BoincHttpTest.h"
 #include "BoincHttp.h"
+#include "BoincHash.h"
+#include "BoincMem.h"
 #include "BoincTest.h"
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+#include <curl/curl.h>
+
+void boincHttpRateShares(int direction, int count, const double * demands, const long * lastShares, long * shares);
 
 BoincError TestBoincHttpGet200(void * data)
 {
@@ -173,6 +179,463 @@ BoincError TestBoincHttpPostFormError(void * dada)
   return res;
 }
 
+#define TRANSFERS 20
+
+static void TestBoincHttpTransferDone(void * done, BoincError err)
+{
+  if (err)
+    boincErrorDestroy(err);
+  else
+    (*((int*) done))++;
+}
+
+BoincError TestBoincHttpTransfers(void * data)
+{
+  /**
+   * Copy local files through the concurrent engine, more of them than
+   * the engine opens at once
+   */
+  char source[64], url[96], target[64];
+  int done = 0;
+  BoincError res = NULL;
+
+  BoincHttpTransfers * transfers = boincHttpTransfersCreate(4, 2);
+  if (!transfers)
+    return boincErrorCreate(kBoincError, -1, "cannot create the transfers");
+
+  for (int i = 0; i < TRANSFERS; i++) {
+    sprintf(source, "%s.src%d", TMPFILE, i);
+    FILE * file = fopen(source, "w");
+    fprintf(file, "transfer %d", i);
+    fclose(file);
+    sprintf(url, "file://%s", source);
+    sprintf(target, "%s.%d", TMPFILE, i);
+    if (!res)
+      res = boincHttpTransfersGet(transfers, url, target, 0, NULL, TestBoincHttpTransferDone, &done);
+  }
+
+  while (boincHttpTransfersPerform(transfers) > 0)
+    boincHttpTransfersWait(transfers, 1000);
+  boincHttpTransfersDestroy(transfers);
+
+  if (!res && (done != TRANSFERS))
+    res = boincErrorCreatef(kBoincError, -2, "%d transfers done out of %d", done, TRANSFERS);
+
+  for (int i = 0; i < TRANSFERS; i++) {
+    char content[64] = "", expected[64];
+    sprintf(target, "%s.%d", TMPFILE, i);
+    sprintf(expected, "transfer %d", i);
+    FILE * file = fopen(target, "r");
+    if (file) {
+      fgets(content, 64, file);
+      fclose(file);
+    }
+    if (!res && strcmp(content, expected))
+      res = boincErrorCreatef(kBoincError, -3, "wrong content in %s", target);
+    remove(target);
+    sprintf(source, "%s.src%d", TMPFILE, i);
+    remove(source);
+  }
+  return res;
+}
+
+typedef struct _TestBoincHttpReply {
+  char * reply;
+  size_t size;
+  int replies;
+  int done;
+  double received;
+} TestBoincHttpReply;
+
+static void TestBoincHttpReplied(void * data, BoincError err, char * reply, size_t replySize)
+{
+  TestBoincHttpReply * r = (TestBoincHttpReply*) data;
+  if (err) {
+    boincErrorDestroy(err);
+    return;
+  }
+  r->reply = reply;
+  r->size = replySize;
+  r->replies++;
+}
+
+static void TestBoincHttpReplyDone(void * data, BoincError err)
+{
+  TestBoincHttpTransferDone(&((TestBoincHttpReply*) data)->done, err);
+}
+
+static void TestBoincHttpReceived(void * data, double bytes)
+{
+  ((TestBoincHttpReply*) data)->received += bytes;
+}
+
+BoincError TestBoincHttpTransfersMemory(void * data)
+{
+  /**
+   * A request answered in memory runs on the engine along with a
+   * download, which reports the bytes it receives
+   */
+  char source[64], url[96];
+  TestBoincHttpReply r = { NULL, 0, 0, 0, 0 };
+  BoincError res = NULL;
+
+  sprintf(source, "%s.src", TMPFILE);
+  FILE * file = fopen(source, "w");
+  fputs("in memory", file);
+  fclose(file);
+  sprintf(url, "file://%s", source);
+
+  BoincHttpTransfers * transfers = boincHttpTransfersCreate(4, 2);
+  if (!transfers)
+    return boincErrorCreate(kBoincError, -1, "cannot create the transfers");
+  boincHttpTransfersSetReceivedCallback(transfers, TestBoincHttpReceived);
+
+  res = boincHttpTransfersGetMemory(transfers, url, TestBoincHttpReplied, &r);
+  if (!res)
+    res = boincHttpTransfersGet(transfers, url, TMPFILE, 0, NULL, TestBoincHttpReplyDone, &r);
+  while (boincHttpTransfersPerform(transfers) > 0)
+    boincHttpTransfersWait(transfers, 1000);
+  boincHttpTransfersDestroy(transfers);
+
+  if (!res && ((r.replies != 1) || (r.done != 1)))
+    res = boincErrorCreatef(kBoincError, -2, "%d replies and %d downloads done", r.replies, r.done);
+  if (!res && ((r.size != 9) || memcmp(r.reply, "in memory", 9)))
+    res = boincErrorCreatef(kBoincError, -3, "wrong reply of %d bytes", (int) r.size);
+  if (!res && (r.received != 9))
+    res = boincErrorCreatef(kBoincError, -4, "%.0f bytes received by the download", r.received);
+
+  boincFree(r.reply);
+  remove(source);
+  remove(TMPFILE);
+  return res;
+}
+
+static void TestBoincHttpWritePattern(const char * path, int from, int to, int shift)
+{
+  FILE * file = fopen(path, "w");
+  for (int i = from; i < to; i++)
+    fputc((i + shift) % 251, file);
+  fclose(file);
+}
+
+BoincError TestBoincHttpResume(void * data)
+{
+  /**
+   * Resume a partial download of a local file, then refuse a partial
+   * download that does not match the checksum
+   */
+  char source[64], url[96], partial[64], hash[33];
+  struct stat buffer;
+  BoincError res = NULL;
+
+  sprintf(source, "%s.src", TMPFILE);
+  sprintf(url, "file://%s", source);
+  sprintf(partial, "%s.tmp", TMPFILE);
+  TestBoincHttpWritePattern(source, 0, 65536, 0);
+  boincHashMd5File(source, hash);
+
+  TestBoincHttpWritePattern(partial, 0, 20000, 0);
+  res = boincHttpGetFile(url, TMPFILE, 65536, hash);
+  if (!res && (stat(TMPFILE, &buffer) || (buffer.st_size != 65536)))
+    res = boincErrorCreate(kBoincError, -1, "the resumed file should be complete");
+  if (!res && !stat(partial, &buffer))
+    res = boincErrorCreate(kBoincError, -2, "the partial file should be gone");
+  remove(TMPFILE);
+
+  if (!res) {
+    TestBoincHttpWritePattern(partial, 0, 20000, 1);
+    BoincError wrong = boincHttpGetFile(url, TMPFILE, 65536, hash);
+    if (!wrong)
+      res = boincErrorCreate(kBoincError, -3, "a wrong partial file should fail the checksum");
+    else if (!stat(TMPFILE, &buffer) || !stat(partial, &buffer))
+      res = boincErrorCreate(kBoincError, -4, "a wrong download should be deleted");
+    boincErrorDestroy(wrong);
+  }
+
+  if (!res)
+    res = boincHttpGetFile(url, TMPFILE, 65536, hash);
+
+  remove(TMPFILE);
+  remove(partial);
+  remove(source);
+  return res;
+}
+
+BoincError TestBoincHttpRanges(void * data)
+{
+  /**
+   * Copy a local file in 4 ranges, and check the result against the
+   * checksum and the source
+   */
+  char source[64], url[96], srcHash[33], hash[33];
+  int done = 0;
+  BoincError res = NULL;
+
+  sprintf(source, "%s.src", TMPFILE);
+  sprintf(url, "file://%s", source);
+  TestBoincHttpWritePattern(source, 0, 300001, 0);
+  boincHashMd5File(source, srcHash);
+
+  BoincHttpTransfers * transfers = boincHttpTransfersCreate(4, 4);
+  if (!transfers)
+    return boincErrorCreate(kBoincError, -1, "cannot create the transfers");
+  boincHttpTransfersSetRanges(transfers, 4, 65536);
+
+  res = boincHttpTransfersGet(transfers, url, TMPFILE, 300001, srcHash, TestBoincHttpTransferDone, &done);
+  while (boincHttpTransfersPerform(transfers) > 0)
+    boincHttpTransfersWait(transfers, 1000);
+  if (!res && (boincHttpTransfersReceived(transfers) != 300001))
+    res = boincErrorCreate(kBoincError, -2, "the ranges should add up to the file");
+  boincHttpTransfersDestroy(transfers);
+
+  if (!res && (done != 1))
+    res = boincErrorCreate(kBoincError, -3, "the download should succeed");
+  if (!res && (boincHashMd5File(TMPFILE, hash) || strcmp(hash, srcHash)))
+    res = boincErrorCreate(kBoincError, -4, "the file should be a copy of the source");
+
+  remove(TMPFILE);
+  remove(source);
+  return res;
+}
+
+BoincError TestBoincHttpRangesResume(void * data)
+{
+  /**
+   * Lose the last of 4 ranges, then check that the next attempt only
+   * fetches the bytes that range missed
+   */
+  char source[64], url[96], srcHash[33], hash[33], part[64], spans[64];
+  struct stat buffer;
+  int done = 0;
+  BoincError res = NULL;
+
+  sprintf(source, "%s.src", TMPFILE);
+  sprintf(url, "file://%s", source);
+  sprintf(part, "%s.part", TMPFILE);
+  sprintf(spans, "%s.ranges", TMPFILE);
+  TestBoincHttpWritePattern(source, 0, 300001, 0);
+  boincHashMd5File(source, srcHash);
+
+  BoincHttpTransfers * transfers = boincHttpTransfersCreate(4, 4);
+  if (!transfers)
+    return boincErrorCreate(kBoincError, -1, "cannot create the transfers");
+  boincHttpTransfersSetRanges(transfers, 4, 65536);
+
+  // The source ends a byte into the last range, which fails
+  TestBoincHttpWritePattern(source, 0, 225001, 0);
+  res = boincHttpTransfersGet(transfers, url, TMPFILE, 300001, srcHash, TestBoincHttpTransferDone, &done);
+  while (boincHttpTransfersPerform(transfers) > 0)
+    boincHttpTransfersWait(transfers, 1000);
+  if (!res && (done != 0))
+    res = boincErrorCreate(kBoincError, -2, "the download should fail");
+  if (!res && (stat(part, &buffer) || stat(spans, &buffer)))
+    res = boincErrorCreate(kBoincError, -3, "the part and its spans should be kept");
+
+  double received = boincHttpTransfersReceived(transfers);
+  TestBoincHttpWritePattern(source, 0, 300001, 0);
+  if (!res)
+    res = boincHttpTransfersGet(transfers, url, TMPFILE, 300001, srcHash, TestBoincHttpTransferDone, &done);
+  while (boincHttpTransfersPerform(transfers) > 0)
+    boincHttpTransfersWait(transfers, 1000);
+  received = boincHttpTransfersReceived(transfers) - received;
+  boincHttpTransfersDestroy(transfers);
+
+  if (!res && (received != 300001 - 225001))
+    res = boincErrorCreatef(kBoincError, -4, "%.0f bytes fetched again instead of %d", received, 300001 - 225001);
+  if (!res && (done != 1))
+    res = boincErrorCreate(kBoincError, -5, "the resumed download should succeed");
+  if (!res && (boincHashMd5File(TMPFILE, hash) || strcmp(hash, srcHash)))
+    res = boincErrorCreate(kBoincError, -6, "the file should be a copy of the source");
+  if (!res && (!stat(part, &buffer) || !stat(spans, &buffer)))
+    res = boincErrorCreate(kBoincError, -7, "the part and its spans should be gone");
+
+  remove(TMPFILE);
+  remove(part);
+  remove(spans);
+  remove(source);
+  return res;
+}
+
+BoincError TestBoincHttpRangesSmall(void * data)
+{
+  /**
+   * A file of fewer bytes than ranges, over the smallest size split,
+   * is fetched whole rather than in empty ranges
+   */
+  char source[64], url[96], srcHash[33], hash[33];
+  int done = 0;
+  BoincError res = NULL;
+
+  sprintf(source, "%s.src", TMPFILE);
+  sprintf(url, "file://%s", source);
+  TestBoincHttpWritePattern(source, 0, 3, 0);
+  boincHashMd5File(source, srcHash);
+
+  BoincHttpTransfers * transfers = boincHttpTransfersCreate(4, 4);
+  if (!transfers)
+    return boincErrorCreate(kBoincError, -1, "cannot create the transfers");
+  boincHttpTransfersSetRanges(transfers, 4, 2);
+
+  res = boincHttpTransfersGet(transfers, url, TMPFILE, 3, srcHash, TestBoincHttpTransferDone, &done);
+  while (boincHttpTransfersPerform(transfers) > 0)
+    boincHttpTransfersWait(transfers, 1000);
+  if (!res && (boincHttpTransfersReceived(transfers) != 3))
+    res = boincErrorCreate(kBoincError, -2, "the file should be received once");
+  boincHttpTransfersDestroy(transfers);
+
+  if (!res && (done != 1))
+    res = boincErrorCreate(kBoincError, -3, "the download should succeed");
+  if (!res && (boincHashMd5File(TMPFILE, hash) || strcmp(hash, srcHash)))
+    res = boincErrorCreate(kBoincError, -4, "the file should be a copy of the source");
+
+  remove(TMPFILE);
+  remove(source);
+  return res;
+}
+
+typedef struct _TestBoincHttpStatsData {
+  BoincHttpTransfers * transfers;
+  BoincHttpStats stats;
+  int done;
+} TestBoincHttpStatsData;
+
+static void TestBoincHttpStatsDone(void * userData, BoincError err)
+{
+  TestBoincHttpStatsData * data = (TestBoincHttpStatsData *) userData;
+  boincHttpTransfersStats(data->transfers, &data->stats);
+  if (err)
+    boincErrorDestroy(err);
+  else
+    data->done++;
+}
+
+BoincError TestBoincHttpStats(void * data)
+{
+  /**
+   * The figures of a download are there when its done callback runs,
+   * or once boincHttpGetFile returns, to rank the servers
+   */
+  char source[64], url[96];
+  TestBoincHttpStatsData stats;
+  BoincError res = NULL;
+
+  sprintf(source, "%s.src", TMPFILE);
+  sprintf(url, "file://%s", source);
+  TestBoincHttpWritePattern(source, 0, 300001, 0);
+
+  memset(&stats, 0, sizeof(stats));
+  stats.transfers = boincHttpTransfersCreate(4, 4);
+  if (!stats.transfers)
+    return boincErrorCreate(kBoincError, -1, "cannot create the transfers");
+
+  res = boincHttpTransfersGet(stats.transfers, url, TMPFILE, 300001, NULL, TestBoincHttpStatsDone, &stats);
+  while (boincHttpTransfersPerform(stats.transfers) > 0)
+    boincHttpTransfersWait(stats.transfers, 1000);
+  boincHttpTransfersDestroy(stats.transfers);
+
+  if (!res && (stats.done != 1))
+    res = boincErrorCreate(kBoincError, -2, "the download should succeed");
+  if (!res && ((stats.stats.rate <= 0) || (stats.stats.latency < 0)))
+    res = boincErrorCreate(kBoincError, -3, "the download should have a rate");
+  remove(TMPFILE);
+
+  // And those of a download outside the engine
+  memset(&stats.stats, 0, sizeof(BoincHttpStats));
+  if (!res)
+    res = boincHttpGetFile(url, TMPFILE, 300001, NULL);
+  boincHttpStats(&stats.stats);
+  if (!res && ((stats.stats.rate <= 0) || (stats.stats.latency < 0)))
+    res = boincErrorCreate(kBoincError, -4, "the single download should have a rate");
+
+  remove(TMPFILE);
+  remove(source);
+  return res;
+}
+
+BoincError TestBoincHttpThrottle(void * data)
+{
+  /**
+   * Share 90000 bytes per second of download between the transfers.
+   * libcurl does not limit the file:// transfers, so only the limits
+   * given to it are checked.
+   */
+  double unknown[4] = { -1, -1, -1, -1 };
+  long none[4] = { 0, 0, 0, 0 };
+  long shares[4];
+  BoincError res = NULL;
+
+  // An even share, within the limit of a single transfer
+  boincHttpSetRateLimits(90000, 0, 30000, 0);
+  boincHttpRateShares(0, 1, unknown, none, shares);
+  if (shares[0] != 30000)
+    res = boincErrorCreatef(kBoincError, -1, "a single transfer should keep its own limit, not %ld", shares[0]);
+  boincHttpRateShares(0, 4, unknown, none, shares);
+  if (!res && (shares[0] != 22500 || shares[3] != 22500))
+    res = boincErrorCreate(kBoincError, -2, "four transfers should share the total");
+  boincHttpRateShares(1, 4, unknown, none, shares);
+  if (!res && (shares[0] != 0))
+    res = boincErrorCreate(kBoincError, -3, "the upload should not be limited");
+
+  // A transfer that used 8000 of its 30000 leaves the rest to the others
+  boincHttpSetRateLimits(90000, 0, 0, 0);
+  double held[3] = { 8000, 30000, -1 };
+  long last[3] = { 30000, 30000, 0 };
+  boincHttpRateShares(0, 3, held, last, shares);
+  if (!res && ((shares[0] != 10000) || (shares[1] != 40000) || (shares[2] != 40000)))
+    res = boincErrorCreatef(kBoincError, -4, "wrong shares %ld, %ld, %ld", shares[0], shares[1], shares[2]);
+
+  // Once it uses its margin, it gets an even share again
+  held[0] = 9500;
+  last[0] = 10000;
+  boincHttpRateShares(0, 3, held, last, shares);
+  if (!res && ((shares[0] != 30000) || (shares[1] != 30000)))
+    res = boincErrorCreatef(kBoincError, -5, "wrong shares %ld, %ld, %ld", shares[0], shares[1], shares[2]);
+
+  boincHttpSetRateLimits(3, 0, 0, 0);
+  boincHttpRateShares(0, 4, unknown, none, shares);
+  if (!res && (shares[3] != 1))
+    res = boincErrorCreate(kBoincError, -6, "a transfer should get at least a byte per second");
+  boincHttpSetRateLimits(0, 0, 0, 0);
+
+  return res;
+}
+
+BoincError TestBoincHttpSessions(void * data)
+{
+  const char * sessionFile = TMPFILE ".sessions";
+  BoincError res = NULL;
+
+  // A first run has no sessions, and a damaged file is ignored
+  unlink(sessionFile);
+  res = boincHttpLoadSessions(sessionFile);
+  if (res)
+    return res;
+  FILE * file = fopen(sessionFile, "wb");
+  if (file == NULL)
+    return boincErrorCreate(kBoincError, -1, "cannot write the session file");
+  fputs("\377\377\377\377 not a session", file);
+  fclose(file);
+  res = boincHttpLoadSessions(sessionFile);
+  if (res)
+    return res;
+
+#if LIBCURL_VERSION_NUM >= 0x080c00
+  // The sessions are secrets, that only the user may read
+  unlink(sessionFile);
+  res = boincHttpStoreSessions(sessionFile);
+  if (res)
+    return res;
+  struct stat st;
+  if (stat(sessionFile, &st) != 0)
+    return boincErrorCreate(kBoincError, -2, "the sessions were not saved");
+  if ((st.st_mode & 077) != 0)
+    return boincErrorCreatef(kBoincError, -3, "the session file is readable by others (%o)", st.st_mode & 0777);
+  res = boincHttpLoadSessions(sessionFile);
+#endif
+  unlink(sessionFile);
+
+  return res;
+}
 
 int testBoincHttp(BoincTest * test) {
   boincTestInitMajor(test, "BoincHttp");
@@ -186,6 +649,15 @@ int testBoincHttp(BoincTest * test) {
   boincTestRunMinor(test, "HTTP GET after a Post (callback revocation)", TestBoincHttpGet200, NULL);
   boincTestRunMinor(test, "HTTP GET with progress", TestBoincHttpGet200WithProgress, NULL);
   boincTestRunMinor(test, "HTTP GET without progress", TestBoincHttpGet200WithoutProgress, NULL);
+  boincTestRunMinor(test, "HTTP concurrent transfers", TestBoincHttpTransfers, NULL);
+  boincTestRunMinor(test, "HTTP requests answered in memory on the engine", TestBoincHttpTransfersMemory, NULL);
+  boincTestRunMinor(test, "HTTP GET resumes a partial file", TestBoincHttpResume, NULL);
+  boincTestRunMinor(test, "HTTP bandwidth shared between the transfers", TestBoincHttpThrottle, NULL);
+  boincTestRunMinor(test, "HTTP GET of a large file in ranges", TestBoincHttpRanges, NULL);
+  boincTestRunMinor(test, "HTTP GET in ranges resumes the spans missing", TestBoincHttpRangesResume, NULL);
+  boincTestRunMinor(test, "HTTP GET of a small file with ranges", TestBoincHttpRangesSmall, NULL);
+  boincTestRunMinor(test, "HTTP GET figures of a download", TestBoincHttpStats, NULL);
+  boincTestRunMinor(test, "HTTP TLS sessions saved for the next run", TestBoincHttpSessions, NULL);
   boincHttpCleanup();
   boincTestEndMajor(test);
   return 0;
@@ -26,6 +26,9 @@
 #include "BoincConfigurationTest.h"
 #include "BoincHashTest.h"
 #include "BoincSchedulerTest.h"
+#include "BoincTraceTest.h"
+#include "BoincSimulatorTest.h"
+#include "BoincUtilTest.h"
 #include "BoincMem.h"
 #include "BoincUtil.h"
 #include <stdlib.h>
@@ -56,6 +59,9 @@ int main(int argc, char * argv[] )
 	  testBoincConfiguration(&myTests);
 	  testBoincProxy(&myTests);
 	  testBoincScheduler(&myTests);
+	  testBoincTrace(&myTests);
+	  testBoincSimulator(&myTests);
+	  testBoincUtil(&myTests);
 	  break;
   case 1:
 	  log.userData = (void*) 0;
@@ -78,6 +84,18 @@ int main(int argc, char * argv[] )
 	  log.userData = (void*) 0;
 	  testBoincScheduler(&myTests);
 	  break;
+  case 6:
+	  log.userData = (void*) 0;
+	  testBoincTrace(&myTests);
+	  break;
+  case 7:
+	  log.userData = (void*) 0;
+	  testBoincSimulator(&myTests);
+	  break;
+  case 8:
+	  log.userData = (void*) 0;
+	  testBoincUtil(&myTests);
+	  break;
   }
 
   boincTestEnd(&myTests);
@@ -23,12 +23,18 @@
 #include "BoincProxyTest.h"
 #include "BoincWorkUnit.h"
 #include "BoincError.h"
+#include "BoincTestOSCalls.h"
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include "BoincHttp.h"
 #include "BoincMem.h"
+#include "BoincHash.h"
+#include "config.h"
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
 
 
 typedef struct _BoincProxyTest {
@@ -38,6 +44,21 @@ typedef struct _BoincProxyTest {
 } BoincProxyTest;
 
 BoincConfiguration * boincProxyGetConfiguration(BoincProxy* proxy);
+BoincError boincProxyStoreCredentials(BoincProxy * proxy);
+BoincError boincProxyCheckReply(BoincProxy * proxy, const char * data, size_t size);
+int boincProxyResumesUpload(unsigned int nBytes);
+BoincError boincProxyParseUploadOffset(const char * data, size_t size, unsigned int nBytes, unsigned int * offset);
+int boincProxyMirrorFailed(BoincProxy * proxy, const char * url);
+void boincProxyMirrorSucceeded(BoincProxy * proxy, const char * url, const BoincHttpStats * stats);
+BoincError boincProxyRankUrls(BoincProxy * proxy, BoincFileInfo * file, char *** ranked);
+int boincProxyCompressesRequests(BoincProxy * proxy);
+int boincProxyRefusesCompression(BoincProxy * proxy, BoincError err);
+#ifdef HAVE_LIBZ
+BoincError boincProxyCompressFile(const char * file, const char * compressedFile);
+#endif
+
+#define PROXY_TEST_DIR "/tmp/boincProxyTester"
+#define PROXY_TEST_URL "http://boinc.example.org/project/?a=1&b=<2>"
 
 BoincProxy * initProxy(BoincProxyTest * test) 
 {
@@ -267,6 +288,385 @@ BoincError testBoincProxyUploadFile (void * data)
   return NULL;
 }
 
+/* A proxy that never goes to the network */
+static BoincProxy * initOfflineProxy(BoincConfiguration ** conf)
+{
+  *conf = boincConfigurationCreate(PROXY_TEST_DIR);
+  if (*conf == NULL)
+    return NULL;
+  boincErrorDestroy(boincConfigurationSetString(*conf, kBoincProjectURL, PROXY_TEST_URL));
+  boincErrorDestroy(boincConfigurationSetString(*conf, kBoincUserEmail, "a&b@example.org"));
+  BoincProxy * proxy = boincProxyCreate(*conf);
+  if (proxy == NULL)
+    boincConfigurationDestroy(*conf);
+  return proxy;
+}
+
+BoincError testBoincProxyCredentials(void * data)
+{
+  /**
+   * The credentials, with the characters special to XML, are read back
+   * by the next proxy
+   */
+  BoincConfiguration * conf, * conf2;
+  char value[255];
+  BoincError err = NULL;
+
+  rmrf(PROXY_TEST_DIR);
+  mkdir(PROXY_TEST_DIR, S_IRWXU);
+
+  BoincProxy * proxy = initOfflineProxy(&conf);
+  if (proxy == NULL)
+    return boincErrorCreate(kBoincError, -1, "cannot create the proxy");
+  boincErrorDestroy(boincConfigurationSetString(conf, kBoincUserAuthenticator, "0123&4567"));
+  boincErrorDestroy(boincConfigurationSetString(conf, kBoincCGIURL, PROXY_TEST_URL "cgi"));
+  err = boincProxyStoreCredentials(proxy);
+  boincProxyDestroy(proxy);
+  boincConfigurationDestroy(conf);
+
+  BoincProxy * proxy2 = initOfflineProxy(&conf2);
+  if (proxy2 == NULL)
+    err = boincErrorCreate(kBoincError, -1, "cannot create the proxy");
+  boincConfigurationUnset(conf2, kBoincUserAuthenticator);
+  boincConfigurationUnset(conf2, kBoincCGIURL);
+  if (!err)
+    err = boincProxyLoadCredentials(proxy2);
+  if (!err && strcmp(boincConfigurationGetString(conf2, kBoincUserAuthenticator, value, 255), "0123&4567"))
+    err = boincErrorCreatef(kBoincError, 1, "wrong authenticator %s", value);
+  if (!err && strcmp(boincConfigurationGetString(conf2, kBoincCGIURL, value, 255), PROXY_TEST_URL "cgi"))
+    err = boincErrorCreatef(kBoincError, 2, "wrong scheduler URL %s", value);
+
+  if (proxy2) {
+    boincProxyDestroy(proxy2);
+    boincConfigurationDestroy(conf2);
+  }
+  rmrf(PROXY_TEST_DIR);
+  return err;
+}
+
+#define MIRROR_TEST_WU PROXY_TEST_DIR "/wu"
+#define MIRROR_TEST_MISSING "file://localhost" PROXY_TEST_DIR "/missing.dat"
+#define MIRROR_TEST_PRESENT "file://" PROXY_TEST_DIR "/present.dat"
+
+/* Download the file of the workunit, then check it against the source */
+static BoincError testBoincProxyMirrorDownload(BoincProxy * proxy, BoincWorkUnit * wu, int together, const char * srcHash)
+{
+  char hash[33];
+  BoincProxyWorkUnit pwu = {proxy, wu};
+  BoincFileInfo * fi = wu->globalFileInfo;
+
+  remove(MIRROR_TEST_WU "/in.dat");
+  BoincError err = together? boincProxyDownloadFiles(&pwu, &fi, 1, 0, 1) : boincProxyDownloadFile(&pwu, fi, 0, 1);
+  if (!err && (boincHashMd5File(MIRROR_TEST_WU "/in.dat", hash) || strcmp(hash, srcHash)))
+    err = boincErrorCreate(kBoincError, 10, "the file should have been downloaded");
+  return err;
+}
+
+BoincError testBoincProxyMirrors(void * data)
+{
+  /**
+   * A file with two mirrors, the first of them missing. The download
+   * moves on to the second, the first is then ranked last, and tried
+   * last for longer at each failure in a row.
+   */
+  char hash[33], reply[1024];
+  char ** urls = NULL;
+  BoincConfiguration * conf;
+  BoincError err = NULL;
+
+  rmrf(PROXY_TEST_DIR);
+  mkdir(PROXY_TEST_DIR, S_IRWXU);
+  mkdir(MIRROR_TEST_WU, S_IRWXU);
+
+  FILE * fh = fopen(PROXY_TEST_DIR "/present.dat", "w");
+  if (fh == NULL)
+    return boincErrorCreate(kBoincError, -1, "cannot write the file of the mirror");
+  for (int i = 0; i < 1000; i++)
+    fputc('a' + (i % 26), fh);
+  fclose(fh);
+  boincHashMd5File(PROXY_TEST_DIR "/present.dat", hash);
+
+  snprintf(reply, sizeof(reply), "<scheduler_reply><file_info><name>in.dat</name>"
+           "<url>%s</url><url>%s</url><nbytes>1000</nbytes><md5_cksum>%s</md5_cksum>"
+           "</file_info></scheduler_reply>", MIRROR_TEST_MISSING, MIRROR_TEST_PRESENT, hash);
+  fh = fopen(MIRROR_TEST_WU "/workResponse.xml", "w");
+  if (fh == NULL)
+    return boincErrorCreate(kBoincError, -2, "cannot write the reply");
+  fputs(reply, fh);
+  fclose(fh);
+
+  BoincWorkUnit * wu = boincWorkUnitCreate(MIRROR_TEST_WU);
+  BoincProxy * proxy = initOfflineProxy(&conf);
+  if ((wu == NULL) || (proxy == NULL))
+    err = boincErrorCreate(kBoincError, -3, "cannot create the workunit or the proxy");
+
+  if (!err)
+    err = boincProxyLoadWorkUnit(wu);
+  BoincFileInfo * fi = err? NULL : wu->globalFileInfo;
+  if (!err && ((fi == NULL) || (fi->nbUrls != 2)))
+    err = boincErrorCreate(kBoincError, 1, "the file should have two urls");
+  if (!err && (strcmp(fi->urls[0], MIRROR_TEST_MISSING) || strcmp(fi->urls[1], MIRROR_TEST_PRESENT)
+               || (fi->url != fi->urls[0])))
+    err = boincErrorCreate(kBoincError, 2, "the urls should keep the order of the project");
+
+  // Unknown mirrors keep the order of the project
+  if (!err)
+    err = boincProxyRankUrls(proxy, fi, &urls);
+  if (!err && strcmp(urls[0], MIRROR_TEST_MISSING))
+    err = boincErrorCreatef(kBoincError, 3, "%s should be tried first", MIRROR_TEST_MISSING);
+  boincFree(urls);
+  urls = NULL;
+
+  // The missing mirror fails, the other one sends the file
+  if (!err)
+    err = testBoincProxyMirrorDownload(proxy, wu, 1, hash);
+  if (!err)
+    err = boincProxyRankUrls(proxy, fi, &urls);
+  if (!err && strcmp(urls[0], MIRROR_TEST_PRESENT))
+    err = boincErrorCreate(kBoincError, 4, "the failed mirror should be ranked last");
+  boincFree(urls);
+  urls = NULL;
+
+  // The failed mirror is still tried, last
+  if (!err)
+    err = testBoincProxyMirrorDownload(proxy, wu, 0, hash);
+
+  // 60 seconds after the first failure, doubled up to an hour
+  int expected[] = { 120, 240, 480, 960, 1920, 3600, 3600 };
+  for (int i = 0; !err && (i < 7); i++) {
+    int delay = boincProxyMirrorFailed(proxy, MIRROR_TEST_MISSING);
+    if (delay != expected[i])
+      err = boincErrorCreatef(kBoincError, 5, "failure %d: tried last for %d seconds, not %d", i + 2, delay, expected[i]);
+  }
+
+  // A file without url is not reported as downloaded
+  if (!err) {
+    BoincProxyWorkUnit pwu = {proxy, wu};
+    int nbUrls = fi->nbUrls;
+    fi->nbUrls = 0;
+    BoincError noUrl = boincProxyDownloadFiles(&pwu, &fi, 1, 0, 1);
+    if (noUrl == NULL)
+      err = boincErrorCreate(kBoincError, 6, "a file without url should fail");
+    boincErrorDestroy(noUrl);
+    noUrl = err? NULL : boincProxyDownloadFile(&pwu, fi, 0, 1);
+    if (!err && (noUrl == NULL))
+      err = boincErrorCreate(kBoincError, 7, "a file without url should fail");
+    boincErrorDestroy(noUrl);
+    fi->nbUrls = nbUrls;
+  }
+
+  if (proxy) {
+    boincProxyDestroy(proxy);
+    boincConfigurationDestroy(conf);
+  }
+  if (wu)
+    boincWorkUnitDestroy(wu);
+  rmrf(PROXY_TEST_DIR);
+  return err;
+}
+
+BoincError testBoincProxyMirrorRanking(void * data)
+{
+  /**
+   * A mirror not measured yet goes between a fast and a slow one, at
+   * the median of their costs
+   */
+  char * mirrors[] = { "http://slow.example.org/f", "http://new.example.org/f", "http://fast.example.org/f" };
+  BoincHttpStats slow = { 0.1, 1e4 }, fast = { 0.1, 1e6 };
+  BoincFileInfo fi;
+  char ** urls = NULL;
+  BoincConfiguration * conf;
+  BoincError err = NULL;
+
+  rmrf(PROXY_TEST_DIR);
+  mkdir(PROXY_TEST_DIR, S_IRWXU);
+
+  BoincProxy * proxy = initOfflineProxy(&conf);
+  if (proxy == NULL)
+    return boincErrorCreate(kBoincError, -1, "cannot create the proxy");
+
+  memset(&fi, 0, sizeof(fi));
+  fi.urls = mirrors;
+  fi.nbUrls = 3;
+  fi.url = mirrors[0];
+  fi.nBytes = 1000000;
+  boincProxyMirrorSucceeded(proxy, mirrors[0], &slow);
+  boincProxyMirrorSucceeded(proxy, mirrors[2], &fast);
+
+  err = boincProxyRankUrls(proxy, &fi, &urls);
+  if (!err && (strcmp(urls[0], mirrors[2]) || strcmp(urls[1], mirrors[1]) || strcmp(urls[2], mirrors[0])))
+    err = boincErrorCreatef(kBoincError, 1, "wrong ranking %s, %s, %s", urls[0], urls[1], urls[2]);
+  boincFree(urls);
+
+  boincProxyDestroy(proxy);
+  boincConfigurationDestroy(conf);
+  rmrf(PROXY_TEST_DIR);
+  return err;
+}
+
+#ifdef HAVE_LIBZ
+BoincError testBoincProxyCompressRequest(void * data)
+{
+  /**
+   * A compressed request inflates back to the same bytes
+   */
+  char request[] = PROXY_TEST_DIR "/request.xml";
+  char compressed[] = PROXY_TEST_DIR "/request.xml.gz";
+  char buffer[20000];
+  BoincError err = NULL;
+
+  rmrf(PROXY_TEST_DIR);
+  mkdir(PROXY_TEST_DIR, S_IRWXU);
+
+  // Over a buffer of the compressor, with a tail that does not repeat
+  FILE * fh = fopen(request, "wb");
+  if (fh == NULL)
+    return boincErrorCreate(kBoincError, -1, "cannot write the request");
+  for (int i = 0; i < 10000; i++)
+    fputc((i < 9000)? 'a' + (i % 26) : (i * 7919) % 251, fh);
+  fclose(fh);
+
+  err = boincProxyCompressFile(request, compressed);
+  if (!err) {
+    gzFile in = gzopen(compressed, "rb");
+    int n = (in == NULL)? -1 : gzread(in, buffer, sizeof(buffer));
+    if (in != NULL)
+      gzclose(in);
+    if (n != 10000)
+      err = boincErrorCreatef(kBoincError, -2, "%d bytes inflated instead of 10000", n);
+    for (int i = 0; !err && (i < 10000); i++) {
+      if ((unsigned char) buffer[i] != (unsigned char) ((i < 9000)? 'a' + (i % 26) : (i * 7919) % 251))
+        err = boincErrorCreatef(kBoincError, -3, "byte %d differs", i);
+    }
+  }
+
+  rmrf(PROXY_TEST_DIR);
+  return err;
+}
+#endif
+
+BoincError testBoincProxyPlainRequests(void * data)
+{
+  /**
+   * The requests are compressed when asked for, until the scheduler
+   * refuses one with a 400 or a 415. Other errors keep the compression.
+   */
+  BoincConfiguration * conf;
+  BoincError err = NULL;
+
+  rmrf(PROXY_TEST_DIR);
+  mkdir(PROXY_TEST_DIR, S_IRWXU);
+
+  BoincProxy * proxy = initOfflineProxy(&conf);
+  if (proxy == NULL)
+    return boincErrorCreate(kBoincError, -1, "cannot create the proxy");
+
+  if (boincProxyCompressesRequests(proxy))
+    err = boincErrorCreate(kBoincError, -2, "the requests should be plain by default");
+  boincErrorDestroy(boincConfigurationSetNumber(conf, kBoincNetworkCompressRequests, 1));
+  if (!err && !boincProxyCompressesRequests(proxy))
+    err = boincErrorCreate(kBoincError, -3, "the requests should be compressed");
+
+  BoincError refused = boincErrorCreate(kBoincError, 500, "Internal Server Error");
+  if (!err && (boincProxyRefusesCompression(proxy, refused) || !boincProxyCompressesRequests(proxy)))
+    err = boincErrorCreate(kBoincError, -4, "a server error should keep the compression");
+  boincErrorDestroy(refused);
+  if (!err && boincProxyRefusesCompression(proxy, NULL))
+    err = boincErrorCreate(kBoincError, -5, "a success should keep the compression");
+
+  refused = boincErrorCreate(kBoincError, 415, "Unsupported Media Type");
+  if (!err && !boincProxyRefusesCompression(proxy, refused))
+    err = boincErrorCreate(kBoincError, -6, "a 415 should send the request again as is");
+  boincErrorDestroy(refused);
+  if (!err && boincProxyCompressesRequests(proxy))
+    err = boincErrorCreate(kBoincError, -7, "the next requests should be plain");
+
+  boincProxyDestroy(proxy);
+  boincConfigurationDestroy(conf);
+  rmrf(PROXY_TEST_DIR);
+  return err;
+}
+
+BoincError testBoincProxyRejectedAuthenticator(void * data)
+{
+  /**
+   * The project rejects the authenticator by a message of the
+   * scheduler or by the error number of an RPC. The authenticator is
+   * then forgotten.
+   */
+  const char * accepted = "<scheduler_reply><message priority=\"low\">Your account key is fine</message></scheduler_reply>";
+  const char * message = "<scheduler_reply><message priority=\"high\">Invalid or missing account key.  "
+    "To fix, remove and add this project.</message></scheduler_reply>";
+  const char * errorNum = "<error><error_num>-136</error_num><error_msg>Not found</error_msg></error>";
+  const char * replies[] = { accepted, message, errorNum };
+  BoincConfiguration * conf;
+  BoincError err = NULL;
+
+  rmrf(PROXY_TEST_DIR);
+  mkdir(PROXY_TEST_DIR, S_IRWXU);
+
+  BoincProxy * proxy = initOfflineProxy(&conf);
+  if (proxy == NULL)
+    return boincErrorCreate(kBoincError, -1, "cannot create the proxy");
+
+  for (int i = 0; (i < 3) && !err; i++) {
+    boincErrorDestroy(boincConfigurationSetString(conf, kBoincUserAuthenticator, "0123"));
+    BoincError res = boincProxyCheckReply(proxy, replies[i], strlen(replies[i]));
+    int rejected = (boincErrorCode(res) == kBoincAuthentication);
+    boincErrorDestroy(res);
+    if (rejected != (i > 0))
+      err = boincErrorCreatef(kBoincError, 1, "reply %d: rejected %d", i, rejected);
+    else if (boincConfigurationHasParameter(conf, kBoincUserAuthenticator) != (i == 0))
+      err = boincErrorCreatef(kBoincError, 2, "reply %d: the authenticator should be forgotten if rejected", i);
+  }
+
+  boincProxyDestroy(proxy);
+  boincConfigurationDestroy(conf);
+  rmrf(PROXY_TEST_DIR);
+  return err;
+}
+
+BoincError testBoincProxyUploadOffset(void * data)
+{
+  /**
+   * The reply of the data server to get_file_size gives the offset
+   * to resume an upload of 100000 bytes from. A size missing,
+   * garbled or larger than the file sends it all again.
+   */
+  const char * replies[] = {
+    "<data_server_reply><status>0</status><file_size>65536</file_size></data_server_reply>",
+    "<data_server_reply><status>0</status></data_server_reply>",
+    "<data_server_reply><status>0</status><file_size>12abc</file_size></data_server_reply>",
+    "<data_server_reply><status>0</status><file_size>-5</file_size></data_server_reply>",
+    "<data_server_reply><status>0</status><file_size>100001</file_size></data_server_reply>",
+    "<data_server_reply><status>0</status><file_size>100000</file_size></data_server_reply>",
+  };
+  unsigned int offsets[] = { 65536, 0, 0, 0, 0, 100000 };
+  const char * failed = "<data_server_reply><status>-1</status><message>No such file</message></data_server_reply>";
+  unsigned int offset;
+
+  for (int i = 0; i < sizeof(offsets) / sizeof(*offsets); i++) {
+    offset = 1;
+    BoincError err = boincProxyParseUploadOffset(replies[i], strlen(replies[i]), 100000, &offset);
+    if (err)
+      return err;
+    if (offset != offsets[i])
+      return boincErrorCreatef(kBoincError, 1, "reply %d: offset %u instead of %u", i, offset, offsets[i]);
+  }
+
+  BoincError err = boincProxyParseUploadOffset(failed, strlen(failed), 100000, &offset);
+  int code = boincErrorCode(err);
+  boincErrorDestroy(err);
+  if ((code != -1) || (offset != 0))
+    return boincErrorCreatef(kBoincError, 2, "the error of the data server should be returned: %d", code);
+
+  // Below 64 KiB, the server is not asked
+  if (boincProxyResumesUpload(65535) || !boincProxyResumesUpload(65536))
+    return boincErrorCreate(kBoincError, 3, "only the files of 64 KiB or more should be resumed");
+
+  return NULL;
+}
+
 BoincError testBoincProxyDestroyAll(void * data) {
   BoincProxyTest * test = (BoincProxyTest*) data;
   if (test->wu) {
@@ -288,6 +688,15 @@ int testBoincProxy(BoincTest * test)
   BoincProxyTest proxytest;
   memset(&proxytest, 0, sizeof(BoincProxyTest));
 
+  boincTestRunMinor(test, "BoincProxy credentials kept across restarts", testBoincProxyCredentials, NULL);
+  boincTestRunMinor(test, "BoincProxy rejected authenticator", testBoincProxyRejectedAuthenticator, NULL);
+  boincTestRunMinor(test, "BoincProxy upload offset", testBoincProxyUploadOffset, NULL);
+#ifdef HAVE_LIBZ
+  boincTestRunMinor(test, "BoincProxy compressed request", testBoincProxyCompressRequest, NULL);
+#endif
+  boincTestRunMinor(test, "BoincProxy plain requests", testBoincProxyPlainRequests, NULL);
+  boincTestRunMinor(test, "BoincProxy mirrors", testBoincProxyMirrors, NULL);
+  boincTestRunMinor(test, "BoincProxy mirror ranking", testBoincProxyMirrorRanking, NULL);
   boincTestRunMinor(test, "BoincProxy create&destroy", testBoincProxyCreate, &proxytest);
   proxytest.proxy = initProxy(&proxytest);
 
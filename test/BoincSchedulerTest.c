@@ -20,12 +20,15 @@
   02110-1301 USA
 
 */ 
+#define _POSIX_C_SOURCE 200809L // nanosleep
 #include "BoincSchedulerTest.h"
 #include "BoincError.h"
 #include "BoincTestOSCalls.h"
 #include "BoincMem.h"
 #include "BoincUtil.h"
 #include "BoincProxy.h"
+#include "BoincSchedulerInternal.h"
+#include "BoincTrace.h"
 //#include "BoincConfiguration.h"
 #include <stdio.h>
 #include <unistd.h>
@@ -33,6 +36,7 @@
 #include <sys/types.h>
 #include <string.h>
 #include <pthread.h>
+#include <time.h>
 
 int computetest(BoincScheduler * scheduler, BoincWorkUnit * wu, void* userData) {
   sleep(10);
@@ -95,6 +99,8 @@ struct _BoincScheduler {
   BoincQueue * queue;
 };
 
+#define SCHEDULER_TEST_TRACE PROJECT_SCHEDULER_TEST_DIR "/scheduler.trace"
+
 BoincScheduler * initScheduler(BoincComputeWorkUnitCallback callback)
 {
   mkdir(PROJECT_SCHEDULER_TEST_DIR, S_IRWXU);
@@ -115,6 +121,7 @@ BoincScheduler * initScheduler(BoincComputeWorkUnitCallback callback)
   BoincScheduler * scheduler = boincSchedulerCreate(conf, callback, NULL);
 
   scheduler->nbworkunits = 1;
+  boincErrorDestroy(boincSchedulerSetTraceFile(scheduler, SCHEDULER_TEST_TRACE));
   
   return scheduler;
 }
@@ -188,6 +195,25 @@ int testBoincSchedulerCompareFileWithStatus(BoincScheduler * scheduler, char * s
   return filestat.st_mtime - statusstat.st_mtime;
 }
 
+/* Whether the data server accepted an upload, from the trace */
+int testBoincSchedulerUploaded()
+{
+  BoincTraceRecord * records;
+  int count, uploaded = 0;
+
+  BoincError err = boincTraceRead(SCHEDULER_TEST_TRACE, &records, &count);
+  if (err) {
+    boincErrorDestroy(err);
+    return 0;
+  }
+  for (int i = 0; i < count; i++) {
+    if ((records[i].kind == 'C') && (records[i].value == kBoincTraceUpload) && (records[i].errorType == kBoincNone))
+      uploaded = 1;
+  }
+  boincFree(records);
+  return uploaded;
+}
+
 typedef struct _statusChanged {
   BoincScheduler* scheduler;
   int status;
@@ -244,8 +270,8 @@ BoincError testBoincSchedulerUpload(void * data)
   if (!err && strcmp(testBoincSchedulerReadStatus(scheduler, status), "UPLOADING"))
     err = boincErrorCreatef(kBoincError, 1, "workunit should be UPLOADING (not %s)", status);
 
-  if (!err && testBoincSchedulerCompareFileWithStatus(scheduler, "uploadResponse.xml") <= 0)
-    err = boincErrorCreate(kBoincError, 2, "workunit uploadResponse.xml should have been modified");
+  if (!err && !testBoincSchedulerUploaded())
+    err = boincErrorCreate(kBoincError, 2, "workunit should have been uploaded");
 
   if (!err && testBoincSchedulerCompareFileWithStatus(scheduler, "out.zip") > 0)
     err = boincErrorCreate(kBoincError, 3, "workunit out.zip should not have been modified");
@@ -271,8 +297,8 @@ BoincError testBoincSchedulerCompute(void * data)
   if (!err && strcmp(testBoincSchedulerReadStatus(scheduler, status), "UPLOADING"))
     err = boincErrorCreatef(kBoincError, 1, "workunit should be UPLOADING (not %s)", status);
 
-  if (!err && testBoincSchedulerCompareFileWithStatus(scheduler, "uploadResponse.xml") <= 0)
-    err = boincErrorCreate(kBoincError, 2, "workunit uploadResponse.xml should have been modified");
+  if (!err && !testBoincSchedulerUploaded())
+    err = boincErrorCreate(kBoincError, 2, "workunit should have been uploaded");
 
   if (!err && testBoincSchedulerCompareFileWithStatus(scheduler, "out.zip") < 0)
     err = boincErrorCreate(kBoincError, 3, "workunit out.zip should have been modified");
@@ -305,8 +331,8 @@ BoincError testBoincSchedulerDownload(void * data)
   if (!err && strcmp(testBoincSchedulerReadStatus(scheduler, status), "UPLOADING"))
     err = boincErrorCreatef(kBoincError, 1, "workunit should be UPLOADING (not %s)", status);
 
-  if (!err && testBoincSchedulerCompareFileWithStatus(scheduler, "uploadResponse.xml") <= 0)
-    err = boincErrorCreate(kBoincError, 2, "workunit uploadResponse.xml should have been modified");
+  if (!err && !testBoincSchedulerUploaded())
+    err = boincErrorCreate(kBoincError, 2, "workunit should have been uploaded");
 
   if (!err && testBoincSchedulerCompareFileWithStatus(scheduler, "out.zip") < 0)
     err = boincErrorCreate(kBoincError, 3, "workunit out.zip should have been modified");
@@ -336,8 +362,8 @@ BoincError testBoincSchedulerInitialize(void * data)
   if (!err && strcmp(testBoincSchedulerReadStatus(scheduler, status), "UPLOADING"))
     err = boincErrorCreatef(kBoincError, 1, "workunit should be UPLOADING (not %s)", status);
 
-  if (!err && testBoincSchedulerCompareFileWithStatus(scheduler, "uploadResponse.xml") <= 0)
-    err = boincErrorCreate(kBoincError, 2, "workunit uploadResponse.xml should have been modified");
+  if (!err && !testBoincSchedulerUploaded())
+    err = boincErrorCreate(kBoincError, 2, "workunit should have been uploaded");
 
   if (!err && testBoincSchedulerCompareFileWithStatus(scheduler, "out.zip") < 0)
     err = boincErrorCreate(kBoincError, 3, "workunit out.zip should have been modified");
@@ -368,8 +394,8 @@ BoincError testBoincSchedulerWithoutFile(void * data)
   if (!err && strcmp(testBoincSchedulerReadStatus(scheduler, status), "UPLOADING"))
     err = boincErrorCreatef(kBoincError, 1, "workunit should be UPLOADING (not %s)", status);
 
-  if (!err && testBoincSchedulerCompareFileWithStatus(scheduler, "uploadResponse.xml") <= 0)
-    err = boincErrorCreate(kBoincError, 2, "workunit uploadResponse.xml should have been modified");
+  if (!err && !testBoincSchedulerUploaded())
+    err = boincErrorCreate(kBoincError, 2, "workunit should have been uploaded");
 
   if (!err && testBoincSchedulerCompareFileWithStatus(scheduler, "out.zip") < 0)
     err = boincErrorCreate(kBoincError, 3, "workunit out.zip should have been modified");
@@ -431,6 +457,618 @@ BoincError testBoincSchedulerCleaning(void * data)
   return err;
 }
 
+/* A backend that answers at once, to check the chaining of the events */
+
+static BoincError instantInit(BoincScheduler* scheduler, void* data)
+{
+  return NULL;
+}
+
+static BoincError instantCall(BoincScheduler* scheduler, BoincWorkUnit* wu, void* data)
+{
+  return NULL;
+}
+
+static BoincError instantRequestWork(BoincScheduler* scheduler, BoincWorkUnit* wu, void* data)
+{
+  if (wu->result == NULL)
+    wu->result = boincNew(BoincResult);
+  return NULL;
+}
+
+static BoincError instantCompute(BoincScheduler* scheduler, BoincWorkUnit* wu, void* data)
+{
+  *((int*) data) = 1;
+  return NULL;
+}
+
+static BoincError instantReport(BoincScheduler* scheduler, BoincWorkUnit* wu, unsigned int failed, void* data)
+{
+  return NULL;
+}
+
+static BoincSchedulerBackend instantBackend = {
+  instantInit, instantCall, instantRequestWork, instantCall, instantCompute, instantCall, instantReport
+};
+
+BoincError testBoincSchedulerRunChain(void * data)
+{
+  BoincError err = NULL;
+  int computing = 0;
+
+  rmrf(PROJECT_SCHEDULER_TEST_DIR);
+  BoincScheduler * scheduler = initScheduler(computetest);
+  boincSchedulerSetBackend(scheduler, &instantBackend, &computing);
+
+  // Load, Created, Initializing, Downloading, Waiting, Computing
+  err = boincSchedulerRun(scheduler, 1);
+
+  if (!err && !computing)
+    err = boincErrorCreate(kBoincError, 1, "the workunit should compute after a single run");
+
+  BoincWorkUnitStatus status;
+  boincSchedulerGetWorkUnitStatus(scheduler, &status, 0);
+  if (!err && (status.status != kBoincWorkUnitComputing))
+    err = boincErrorCreatef(kBoincError, 2, "wrong status %d", status.status);
+
+  cleanupScheduler(scheduler);
+  rmrf(PROJECT_SCHEDULER_TEST_DIR);
+
+  return err;
+}
+
+/* Several threads handling the events of many slots */
+
+#define CONCURRENT_SLOTS 64
+#define CONCURRENT_CORES 4
+#define CONCURRENT_THREADS 4
+#define CONCURRENT_TARGET 500
+
+typedef struct _ConcurrentRun {
+  BoincScheduler * scheduler;
+  pthread_mutex_t mutex;
+  int completed;
+  int violations;
+} ConcurrentRun;
+
+static int concurrentCount(BoincScheduler* scheduler, int status)
+{
+  int count = 0;
+  for (int i = 0; i < CONCURRENT_SLOTS; i++) {
+    BoincWorkUnitStatus s;
+    boincSchedulerGetWorkUnitStatus(scheduler, &s, i);
+    if (s.status == status)
+      count++;
+  }
+  return count;
+}
+
+static void concurrentViolation(ConcurrentRun* run, int violated)
+{
+  if (violated) {
+    pthread_mutex_lock(&run->mutex);
+    run->violations++;
+    pthread_mutex_unlock(&run->mutex);
+  }
+}
+
+static BoincError concurrentCompute(BoincScheduler* scheduler, BoincWorkUnit* wu, void* data)
+{
+  ConcurrentRun * run = (ConcurrentRun*) data;
+  concurrentViolation(run, concurrentCount(scheduler, kBoincWorkUnitComputing) > CONCURRENT_CORES);
+  // The application is done at once
+  return boincSchedulerChangeWorkUnitStatus(scheduler, wu, kBoincWorkUnitFinished);
+}
+
+static BoincError concurrentUpload(BoincScheduler* scheduler, BoincWorkUnit* wu, void* data)
+{
+  ConcurrentRun * run = (ConcurrentRun*) data;
+  concurrentViolation(run, concurrentCount(scheduler, kBoincWorkUnitUploading) > 1);
+  return NULL;
+}
+
+static BoincError concurrentReport(BoincScheduler* scheduler, BoincWorkUnit* wu, unsigned int failed, void* data)
+{
+  ConcurrentRun * run = (ConcurrentRun*) data;
+  pthread_mutex_lock(&run->mutex);
+  run->completed++;
+  pthread_mutex_unlock(&run->mutex);
+  return NULL;
+}
+
+static BoincSchedulerBackend concurrentBackend = {
+  instantInit, instantCall, instantRequestWork, instantCall, concurrentCompute, concurrentUpload, concurrentReport
+};
+
+static void* concurrentHandler(void* data)
+{
+  ConcurrentRun * run = (ConcurrentRun*) data;
+  time_t end = time(NULL) + 60;
+
+  while (time(NULL) < end) {
+    pthread_mutex_lock(&run->mutex);
+    int done = (run->completed >= CONCURRENT_TARGET);
+    pthread_mutex_unlock(&run->mutex);
+    if (done)
+      break;
+    boincErrorDestroy(boincSchedulerRun(run->scheduler, 1));
+  }
+  return NULL;
+}
+
+BoincError testBoincSchedulerConcurrent(void * data)
+{
+  BoincError err = NULL;
+  ConcurrentRun run;
+  pthread_t threads[CONCURRENT_THREADS];
+
+  rmrf(PROJECT_SCHEDULER_TEST_DIR);
+  mkdir(PROJECT_SCHEDULER_TEST_DIR, S_IRWXU);
+
+  BoincConfiguration * conf = boincConfigurationCreate(PROJECT_SCHEDULER_TEST_DIR);
+  boincConfigurationSetNumber(conf, kBoincSchedulerSlots, CONCURRENT_SLOTS);
+  boincConfigurationSetNumber(conf, kBoincSchedulerComputeSlots, CONCURRENT_CORES);
+
+  memset(&run, 0, sizeof(ConcurrentRun));
+  pthread_mutex_init(&run.mutex, NULL);
+  run.scheduler = boincSchedulerCreate(conf, computetest, NULL);
+  boincSchedulerSetBackend(run.scheduler, &concurrentBackend, &run);
+
+  for (int i = 0; i < CONCURRENT_THREADS; i++)
+    pthread_create(&threads[i], NULL, concurrentHandler, &run);
+  for (int i = 0; i < CONCURRENT_THREADS; i++)
+    pthread_join(threads[i], NULL);
+
+  boincDebugf("completed %d, violations %d", run.completed, run.violations);
+
+  if (run.completed < CONCURRENT_TARGET)
+    err = boincErrorCreatef(kBoincError, 1, "the slots should keep completing: %d", run.completed);
+  else if (run.violations != 0)
+    err = boincErrorCreatef(kBoincError, 2, "more workunits admitted than allowed: %d", run.violations);
+
+  cleanupScheduler(run.scheduler);
+  pthread_mutex_destroy(&run.mutex);
+  rmrf(PROJECT_SCHEDULER_TEST_DIR);
+
+  return err;
+}
+
+/* The transfers handed to the network thread */
+
+#define POOL_SLOTS 4
+#define POOL_TARGET 8
+
+typedef struct _PoolRun {
+  pthread_mutex_t mutex;
+  pthread_t main;
+  int onMain;                   // transfers made by the thread handling the events
+  pthread_t network;
+  int nbnetwork;                // threads that made the transfers
+  int reports;
+} PoolRun;
+
+static void poolTransfer(PoolRun * run)
+{
+  pthread_mutex_lock(&run->mutex);
+  if (pthread_equal(pthread_self(), run->main))
+    run->onMain++;
+  else if (run->nbnetwork == 0) {
+    run->network = pthread_self();
+    run->nbnetwork = 1;
+  } else if (!pthread_equal(pthread_self(), run->network))
+    run->nbnetwork++;
+  pthread_mutex_unlock(&run->mutex);
+}
+
+static BoincError poolRequestWork(BoincScheduler* scheduler, BoincWorkUnit* wu, void* data)
+{
+  poolTransfer((PoolRun*) data);
+  return instantRequestWork(scheduler, wu, data);
+}
+
+static BoincError poolCall(BoincScheduler* scheduler, BoincWorkUnit* wu, void* data)
+{
+  poolTransfer((PoolRun*) data);
+  return NULL;
+}
+
+static BoincError poolCompute(BoincScheduler* scheduler, BoincWorkUnit* wu, void* data)
+{
+  return boincSchedulerChangeWorkUnitStatus(scheduler, wu, kBoincWorkUnitFinished);
+}
+
+static BoincError poolReport(BoincScheduler* scheduler, BoincWorkUnit* wu, unsigned int failed, void* data)
+{
+  PoolRun * run = (PoolRun*) data;
+  poolTransfer(run);
+  pthread_mutex_lock(&run->mutex);
+  run->reports++;
+  pthread_mutex_unlock(&run->mutex);
+  return NULL;
+}
+
+static BoincSchedulerBackend poolBackend = {
+  instantInit, instantCall, poolRequestWork, poolCall, poolCompute, poolCall, poolReport
+};
+
+BoincError testBoincSchedulerPools(void * data)
+{
+  BoincError err = NULL;
+  PoolRun run;
+
+  rmrf(PROJECT_SCHEDULER_TEST_DIR);
+  mkdir(PROJECT_SCHEDULER_TEST_DIR, S_IRWXU);
+
+  BoincConfiguration * conf = boincConfigurationCreate(PROJECT_SCHEDULER_TEST_DIR);
+  boincConfigurationSetNumber(conf, kBoincSchedulerSlots, POOL_SLOTS);
+  boincConfigurationSetNumber(conf, kBoincSchedulerComputeSlots, POOL_SLOTS);
+
+  memset(&run, 0, sizeof(PoolRun));
+  pthread_mutex_init(&run.mutex, NULL);
+  run.main = pthread_self();
+  BoincScheduler * scheduler = boincSchedulerCreate(conf, computetest, NULL);
+  boincSchedulerSetBackend(scheduler, &poolBackend, &run);
+  boincSchedulerSetIOThreads(scheduler, 1);
+
+  // The follow-up events of the network thread keep the slots going
+  time_t end = time(NULL) + 30;
+  int reports = 0;
+  while (!err && (reports < POOL_TARGET) && (time(NULL) < end)) {
+    err = boincSchedulerRun(scheduler, 1);
+    pthread_mutex_lock(&run.mutex);
+    reports = run.reports;
+    pthread_mutex_unlock(&run.mutex);
+  }
+
+  pthread_mutex_lock(&run.mutex);
+  if (!err && (reports < POOL_TARGET))
+    err = boincErrorCreatef(kBoincError, 1, "the slots should keep completing: %d", reports);
+  if (!err && (run.onMain != 0))
+    err = boincErrorCreatef(kBoincError, 2, "%d transfers made by the thread handling the events", run.onMain);
+  if (!err && (run.nbnetwork != 1))
+    err = boincErrorCreatef(kBoincError, 3, "the transfers should share one thread: %d", run.nbnetwork);
+  pthread_mutex_unlock(&run.mutex);
+
+  cleanupScheduler(scheduler);
+  pthread_mutex_destroy(&run.mutex);
+  rmrf(PROJECT_SCHEDULER_TEST_DIR);
+
+  return err;
+}
+
+/* The downloads of several workunits in flight on the network thread */
+
+#define ENGINE_SLOTS 4
+#define ENGINE_TARGET 8
+
+typedef struct _EngineRun {
+  pthread_mutex_t mutex;
+  BoincSchedulerDone done[ENGINE_SLOTS];
+  void * doneData[ENGINE_SLOTS];
+  int pending;
+  int maxPending;
+  int polls;
+  int reports;
+} EngineRun;
+
+static BoincError engineDownloadStart(BoincScheduler* scheduler, BoincWorkUnit* wu, 
+                                      BoincSchedulerDone done, void* doneData, void* data)
+{
+  EngineRun * run = (EngineRun*) data;
+  if (run->pending == ENGINE_SLOTS)
+    return boincErrorCreate(kBoincError, 1, "too many downloads");
+  run->done[run->pending] = done;
+  run->doneData[run->pending] = doneData;
+  run->pending++;
+  if (run->pending > run->maxPending)
+    run->maxPending = run->pending;
+  return NULL;
+}
+
+static void engineComplete(EngineRun * run, BoincError err)
+{
+  // The callbacks queue the next events, not more downloads
+  int pending = run->pending;
+  run->pending = 0;
+  run->polls = 0;
+  for (int i = 0; i < pending; i++)
+    run->done[i](run->doneData[i], (err != NULL)? boincErrorCreate(kBoincError, 0, "cancelled") : NULL);
+  boincErrorDestroy(err);
+}
+
+static void enginePerform(BoincScheduler* scheduler, int timeout, void* data)
+{
+  // The transfers end together once two are in flight, or after a while
+  // if the other slots are busy elsewhere
+  EngineRun * run = (EngineRun*) data;
+  if ((run->pending >= 2) || (++run->polls >= 20))
+    engineComplete(run, NULL);
+  else {
+    struct timespec delay = { 0, timeout * 100000L };
+    nanosleep(&delay, NULL);
+  }
+}
+
+static void engineCancel(BoincScheduler* scheduler, void* data)
+{
+  engineComplete((EngineRun*) data, boincErrorCreate(kBoincError, 0, "cancel"));
+}
+
+static BoincError engineDownload(BoincScheduler* scheduler, BoincWorkUnit* wu, void* data)
+{
+  return boincErrorCreate(kBoincError, 2, "the downloads should not block the network thread");
+}
+
+static BoincError engineReport(BoincScheduler* scheduler, BoincWorkUnit* wu, unsigned int failed, void* data)
+{
+  EngineRun * run = (EngineRun*) data;
+  pthread_mutex_lock(&run->mutex);
+  run->reports++;
+  pthread_mutex_unlock(&run->mutex);
+  return NULL;
+}
+
+static BoincSchedulerBackend engineBackend = {
+  instantInit, instantCall, instantRequestWork, engineDownload, poolCompute, instantCall, engineReport, NULL,
+  engineDownloadStart, enginePerform, engineCancel
+};
+
+BoincError testBoincSchedulerDownloadsInFlight(void * data)
+{
+  BoincError err = NULL;
+  EngineRun run;
+
+  rmrf(PROJECT_SCHEDULER_TEST_DIR);
+  mkdir(PROJECT_SCHEDULER_TEST_DIR, S_IRWXU);
+
+  BoincConfiguration * conf = boincConfigurationCreate(PROJECT_SCHEDULER_TEST_DIR);
+  boincConfigurationSetNumber(conf, kBoincSchedulerSlots, ENGINE_SLOTS);
+  boincConfigurationSetNumber(conf, kBoincSchedulerComputeSlots, ENGINE_SLOTS);
+  boincConfigurationSetNumber(conf, kBoincSchedulerPrefetchMin, ENGINE_SLOTS);
+
+  memset(&run, 0, sizeof(EngineRun));
+  pthread_mutex_init(&run.mutex, NULL);
+  BoincScheduler * scheduler = boincSchedulerCreate(conf, computetest, NULL);
+  boincSchedulerSetBackend(scheduler, &engineBackend, &run);
+  boincSchedulerSetIOThreads(scheduler, 1);
+
+  time_t end = time(NULL) + 30;
+  int reports = 0;
+  while (!err && (reports < ENGINE_TARGET) && (time(NULL) < end)) {
+    err = boincSchedulerRun(scheduler, 1);
+    pthread_mutex_lock(&run.mutex);
+    reports = run.reports;
+    pthread_mutex_unlock(&run.mutex);
+  }
+
+  // Stopped first, the network thread does not touch the run anymore
+  cleanupScheduler(scheduler);
+
+  if (!err && (reports < ENGINE_TARGET))
+    err = boincErrorCreatef(kBoincError, 1, "the slots should keep completing: %d", reports);
+  if (!err && (run.maxPending < 2))
+    err = boincErrorCreatef(kBoincError, 3, "the downloads should overlap: %d at most", run.maxPending);
+  if (!err && (run.pending != 0))
+    err = boincErrorCreatef(kBoincError, 4, "%d downloads left over", run.pending);
+
+  pthread_mutex_destroy(&run.mutex);
+  rmrf(PROJECT_SCHEDULER_TEST_DIR);
+
+  return err;
+}
+
+/* The slots loaded on several threads at startup */
+
+#define LOAD_SLOTS 8
+#define LOAD_THREADS 4
+
+typedef struct _LoadRun {
+  pthread_mutex_t mutex;
+  int published[LOAD_SLOTS];
+  int total;
+  pthread_t threads[LOAD_SLOTS];
+  int nbthreads;
+} LoadRun;
+
+static void loadSleep(long ms)
+{
+  struct timespec delay = { ms / 1000, (ms % 1000) * 1000000L };
+  nanosleep(&delay, NULL);
+}
+
+static void loadStatusChanged(void* data, int index)
+{
+  LoadRun * run = (LoadRun*) data;
+  pthread_mutex_lock(&run->mutex);
+  if ((index >= 0) && (index < LOAD_SLOTS))
+    run->published[index]++;
+  run->total++;
+  pthread_mutex_unlock(&run->mutex);
+}
+
+static BoincError loadWorkUnit(BoincScheduler* scheduler, BoincWorkUnit* wu, void* data)
+{
+  LoadRun * run = (LoadRun*) data;
+  int i;
+
+  // Long enough for the other loaders to take the next slots
+  loadSleep(100);
+
+  pthread_mutex_lock(&run->mutex);
+  for (i = 0; (i < run->nbthreads) && !pthread_equal(run->threads[i], pthread_self()); i++)
+    ;
+  if ((i == run->nbthreads) && (i < LOAD_SLOTS))
+    run->threads[run->nbthreads++] = pthread_self();
+  pthread_mutex_unlock(&run->mutex);
+  return NULL;
+}
+
+static BoincSchedulerBackend loadBackend = {
+  instantInit, loadWorkUnit, instantRequestWork, instantCall, instantCompute, instantCall, instantReport
+};
+
+BoincError testBoincSchedulerLoadSlots(void * data)
+{
+  BoincError err = NULL;
+  LoadRun run;
+
+  rmrf(PROJECT_SCHEDULER_TEST_DIR);
+  mkdir(PROJECT_SCHEDULER_TEST_DIR, S_IRWXU);
+
+  BoincConfiguration * conf = boincConfigurationCreate(PROJECT_SCHEDULER_TEST_DIR);
+  boincConfigurationSetNumber(conf, kBoincSchedulerSlots, LOAD_SLOTS);
+  boincConfigurationSetNumber(conf, kBoincSchedulerLoadThreads, LOAD_THREADS);
+
+  memset(&run, 0, sizeof(LoadRun));
+  pthread_mutex_init(&run.mutex, NULL);
+  BoincScheduler * scheduler = boincSchedulerCreate(conf, computetest, NULL);
+  boincSchedulerSetBackend(scheduler, &loadBackend, &run);
+  boincSchedulerSetStatusChangedCallback(scheduler, loadStatusChanged, &run);
+
+  // The load event only: the events of the slots stay in the queue
+  err = boincSchedulerHandleEvents(scheduler);
+
+  time_t end = time(NULL) + 10;
+  int total = 0;
+  while (!err && (total < LOAD_SLOTS) && (time(NULL) < end)) {
+    loadSleep(10);
+    pthread_mutex_lock(&run.mutex);
+    total = run.total;
+    pthread_mutex_unlock(&run.mutex);
+  }
+  loadSleep(200);
+
+  pthread_mutex_lock(&run.mutex);
+  for (int i = 0; !err && (i < LOAD_SLOTS); i++) {
+    if (run.published[i] != 1)
+      err = boincErrorCreatef(kBoincError, 1, "slot %d published %d times", i, run.published[i]);
+  }
+  if (!err && (run.nbthreads < 2))
+    err = boincErrorCreatef(kBoincError, 2, "the slots should load on several threads: %d", run.nbthreads);
+  pthread_mutex_unlock(&run.mutex);
+
+  cleanupScheduler(scheduler);
+  pthread_mutex_destroy(&run.mutex);
+  rmrf(PROJECT_SCHEDULER_TEST_DIR);
+
+  return err;
+}
+
+/* The startup from the project configuration of the last run */
+
+static BoincError cachedInit(BoincScheduler* scheduler, void* data)
+{
+  (*((int*) data))++;
+  return NULL;
+}
+
+static BoincSchedulerBackend cachedBackend = {
+  cachedInit, instantCall, instantRequestWork, instantCall, instantCall, instantCall, instantReport
+};
+
+static BoincError cachedStart(const char* projectFile, int corrupt, int* inits)
+{
+  FILE * fh = fopen(projectFile, "w");
+  if (fh == NULL)
+    return boincErrorCreatef(kBoincError, 1, "cannot write %s", projectFile);
+  fprintf(fh, "%s", corrupt? "<project_config><name>Test" : "<project_config><name>Test</name></project_config>\n");
+  fclose(fh);
+  *inits = 0;
+
+  BoincConfiguration * conf = boincConfigurationCreate(PROJECT_SCHEDULER_TEST_DIR);
+  BoincScheduler * scheduler = boincSchedulerCreate(conf, computetest, NULL);
+  boincSchedulerSetBackend(scheduler, &cachedBackend, inits);
+
+  // The load event, with the project configuration of the last run
+  BoincError err = boincSchedulerHandleEvents(scheduler);
+  cleanupScheduler(scheduler);
+  return err;
+}
+
+BoincError testBoincSchedulerCachedStartup(void * data)
+{
+  char projectFile[255];
+  int inits = 0;
+
+  rmrf(PROJECT_SCHEDULER_TEST_DIR);
+  mkdir(PROJECT_SCHEDULER_TEST_DIR, S_IRWXU);
+  sprintf(projectFile, "%s/project.xml", PROJECT_SCHEDULER_TEST_DIR);
+
+  BoincError err = cachedStart(projectFile, 0, &inits);
+  if (!err && (inits != 0))
+    err = boincErrorCreate(kBoincError, 2, "the cached configuration should spare the server");
+
+  // A corrupt configuration is fetched again
+  if (!err)
+    err = cachedStart(projectFile, 1, &inits);
+  if (!err && (inits != 1))
+    err = boincErrorCreatef(kBoincError, 3, "a corrupt configuration should be fetched again: %d", inits);
+
+  rmrf(PROJECT_SCHEDULER_TEST_DIR);
+
+  return err;
+}
+
+/* The startup from the credentials of the last run too */
+
+static int cachedRun(int withCredentials, int * initsAtStart)
+{
+  char file[255];
+  int inits = 0;
+
+  rmrf(PROJECT_SCHEDULER_TEST_DIR);
+  mkdir(PROJECT_SCHEDULER_TEST_DIR, S_IRWXU);
+
+  sprintf(file, "%s/project.xml", PROJECT_SCHEDULER_TEST_DIR);
+  FILE * fh = fopen(file, "w");
+  fprintf(fh, "<project_config><name>Test</name></project_config>\n");
+  fclose(fh);
+  if (withCredentials) {
+    sprintf(file, "%s/credentials.xml", PROJECT_SCHEDULER_TEST_DIR);
+    fh = fopen(file, "w");
+    fprintf(fh, "<credentials>\n<project_url>http://example.org/?a=1&amp;b=2</project_url>\n"
+            "<email>test@example.org</email>\n<authenticator>0123</authenticator>\n"
+            "<scheduler>http://example.org/cgi?a=1&amp;b=2</scheduler>\n</credentials>\n");
+    fclose(fh);
+  }
+
+  BoincConfiguration * conf = boincConfigurationCreate(PROJECT_SCHEDULER_TEST_DIR);
+  boincConfigurationSetString(conf, kBoincProjectURL, "http://example.org/?a=1&b=2");
+  boincConfigurationSetString(conf, kBoincUserEmail, "test@example.org");
+  boincConfigurationSetNumber(conf, kBoincSchedulerTimerSlack, 0);
+  BoincScheduler * scheduler = boincSchedulerCreate(conf, computetest, NULL);
+  boincSchedulerSetBackend(scheduler, &cachedBackend, &inits);
+
+  // The load event, which does not wait for the server
+  boincErrorDestroy(boincSchedulerHandleEvents(scheduler));
+  *initsAtStart = inits;
+
+  // Long enough for the refresh of the configuration
+  time_t end = time(NULL) + 3;
+  while (time(NULL) < end)
+    boincErrorDestroy(boincSchedulerRun(scheduler, 1));
+
+  cleanupScheduler(scheduler);
+  rmrf(PROJECT_SCHEDULER_TEST_DIR);
+  return inits;
+}
+
+BoincError testBoincSchedulerCachedCredentials(void * data)
+{
+  // With or without them, the slots start at once and the
+  // configuration is refreshed in the background
+  for (int withCredentials = 1; withCredentials >= 0; withCredentials--) {
+    int initsAtStart;
+    int inits = cachedRun(withCredentials, &initsAtStart);
+    if (initsAtStart != 0)
+      return boincErrorCreatef(kBoincError, 1, "the cache should spare the server at startup: %d", initsAtStart);
+    if (inits != 1)
+      return boincErrorCreatef(kBoincError, 2, "the configuration should be refreshed once: %d", inits);
+  }
+
+  return NULL;
+}
+
 int testBoincScheduler(BoincTest * test) 
 {
   boincTestInitMajor(test, "BoincScheduler");
@@ -443,6 +1081,13 @@ int testBoincScheduler(BoincTest * test)
   rmrf(PROJECT_SCHEDULER_TEST_DIR);
   boincTestRunMinor(test, "BoincScheduler async run complete", testBoincSchedulerCompleteAsync, NULL);
   boincTestRunMinor(test, "BoincScheduler cleaning", testBoincSchedulerCleaning, NULL);
+  boincTestRunMinor(test, "BoincScheduler run chains transitions", testBoincSchedulerRunChain, NULL);
+  boincTestRunMinor(test, "BoincScheduler concurrent handlers", testBoincSchedulerConcurrent, NULL);
+  boincTestRunMinor(test, "BoincScheduler hands the transfers to the network thread", testBoincSchedulerPools, NULL);
+  boincTestRunMinor(test, "BoincScheduler keeps several downloads in flight", testBoincSchedulerDownloadsInFlight, NULL);
+  boincTestRunMinor(test, "BoincScheduler loads the slots on several threads", testBoincSchedulerLoadSlots, NULL);
+  boincTestRunMinor(test, "BoincScheduler starts from the cached configuration", testBoincSchedulerCachedStartup, NULL);
+  boincTestRunMinor(test, "BoincScheduler starts from the cached credentials", testBoincSchedulerCachedCredentials, NULL);
   boincTestEndMajor(test);
   return 0;
 }
@@ -0,0 +1,316 @@
+/*
+  BoincLite, a light-weight library for BOINC clients.
+
+  Copyright (C) 2008 Sony Computer Science Laboratory Paris 
+  Authors: Peter Hanappe, Anthony Beurive, Tangui Morlier
+
+  This library is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation; version 2.1 of the
+  License.
+
+  This library is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+  02110-1301 USA
+
+*/ 
+#include "BoincSimulatorTest.h"
+#include "BoincTestOSCalls.h"
+#include "BoincMem.h"
+#include "BoincTuner.h"
+#include <string.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define SIMULATOR_DIR TMPDIR "boincSimulatorTester/"
+
+static int computeNothing(BoincScheduler * scheduler, BoincWorkUnit * wu, void* userData)
+{
+  return 0;
+}
+
+// A negative slack keeps the default timer slack
+static BoincError runSimulationWithSlack(BoincSimulationParameters * parameters, int computeSlots, 
+                                         int slack, BoincSimulationReport * report)
+{
+  rmrf(SIMULATOR_DIR);
+  mkdir(SIMULATOR_DIR, S_IRWXU);
+
+  BoincConfiguration * conf = boincConfigurationCreate(SIMULATOR_DIR);
+  BoincError err = boincConfigurationSetNumber(conf, kBoincSchedulerSlots, computeSlots + 1);
+  if (err == NULL)
+    err = boincConfigurationSetNumber(conf, kBoincSchedulerComputeSlots, computeSlots);
+  if ((err == NULL) && (slack >= 0))
+    err = boincConfigurationSetNumber(conf, kBoincSchedulerTimerSlack, slack);
+  if (err != NULL) {
+    boincConfigurationDestroy(conf);
+    return err;
+  }
+
+  BoincScheduler * scheduler = boincSchedulerCreate(conf, computeNothing, NULL);
+  err = boincSchedulerSimulate(scheduler, parameters, report);
+  boincSchedulerDestroy(scheduler);
+  boincConfigurationDestroy(conf);
+
+  rmrf(SIMULATOR_DIR);
+
+  return err;
+}
+
+static BoincError runSimulation(BoincSimulationParameters * parameters, int computeSlots, 
+                                BoincSimulationReport * report)
+{
+  return runSimulationWithSlack(parameters, computeSlots, -1, report);
+}
+
+static void defaultParameters(BoincSimulationParameters * parameters)
+{
+  memset(parameters, 0, sizeof(BoincSimulationParameters));
+  parameters->duration = 36000;
+  parameters->seed = 1;
+  parameters->computeTime = 600;
+  parameters->deadline = 7200;
+  parameters->latency = 2;
+  parameters->downloadBytes = 1000000;
+  parameters->uploadBytes = 100000;
+  parameters->downBandwidth = 100000;
+  parameters->upBandwidth = 50000;
+}
+
+BoincError testBoincSimulatorThroughput(void* data)
+{
+  BoincSimulationParameters parameters;
+  BoincSimulationReport report;
+
+  defaultParameters(&parameters);
+
+  BoincError err = runSimulation(&parameters, 1, &report);
+  if (err)
+    return err;
+
+  boincDebugf("completed %d, idle %f, events %d", report.completed, report.idleCoreRatio, report.events);
+
+  if (report.virtualTime < parameters.duration)
+    return boincErrorCreatef(kBoincError, 1, "simulation stopped at %u", report.virtualTime);
+  // At most one workunit of 600 s every 600 s
+  if ((report.completed < 50) || (report.completed > 60))
+    return boincErrorCreatef(kBoincError, 2, "wrong number of completed workunits: %d", report.completed);
+  if (report.deadlineMisses != 0)
+    return boincErrorCreatef(kBoincError, 3, "no deadline should be missed: %d", report.deadlineMisses);
+  if (report.idleCoreRatio > 0.1)
+    return boincErrorCreatef(kBoincError, 4, "the core is idle too often: %f", report.idleCoreRatio);
+  // Blocked workunits wait on their wait list instead of polling
+  if (report.events > 20 * report.completed)
+    return boincErrorCreatef(kBoincError, 6, "too many events: %d", report.events);
+
+  // Two cores, twice the work
+  BoincSimulationReport report2;
+  err = runSimulation(&parameters, 2, &report2);
+  if (err)
+    return err;
+  if (report2.completed < 2 * report.completed - 5)
+    return boincErrorCreatef(kBoincError, 5, "two cores should double the throughput: %d", report2.completed);
+
+  return NULL;
+}
+
+BoincError testBoincSimulatorDeterminism(void* data)
+{
+  BoincSimulationParameters parameters;
+  BoincSimulationReport report1;
+  BoincSimulationReport report2;
+
+  defaultParameters(&parameters);
+  parameters.computeSpread = 0.5;
+  parameters.requestFailureRate = 0.1;
+  parameters.downloadFailureRate = 0.2;
+  parameters.uploadFailureRate = 0.2;
+
+  BoincError err = runSimulation(&parameters, 1, &report1);
+  if (err == NULL)
+    err = runSimulation(&parameters, 1, &report2);
+  if (err)
+    return err;
+
+  if (report1.failures == 0)
+    return boincErrorCreate(kBoincError, 1, "some requests should fail");
+  if ((report1.completed != report2.completed) || (report1.events != report2.events)
+      || (report1.idleCoreTime != report2.idleCoreTime) || (report1.failures != report2.failures))
+    return boincErrorCreate(kBoincError, 2, "two runs with the same seed differ");
+
+  return NULL;
+}
+
+BoincError testBoincSimulatorDeadline(void* data)
+{
+  BoincSimulationParameters parameters;
+  BoincSimulationReport report;
+
+  defaultParameters(&parameters);
+  parameters.deadline = 300;
+
+  BoincError err = runSimulation(&parameters, 1, &report);
+  if (err)
+    return err;
+
+  if ((report.completed == 0) || (report.deadlineMisses != report.completed))
+    return boincErrorCreatef(kBoincError, 1, "every workunit should miss its deadline: %d/%d", 
+                             report.deadlineMisses, report.completed);
+
+  return NULL;
+}
+
+BoincError testBoincSimulatorAbort(void* data)
+{
+  BoincSimulationParameters parameters;
+  BoincSimulationReport report;
+
+  // The prefetched workunit waits a whole computation for the core,
+  // which leaves it too little time to compute
+  defaultParameters(&parameters);
+  parameters.deadline = 900;
+
+  BoincError err = runSimulation(&parameters, 1, &report);
+  if (err)
+    return err;
+
+  if (report.aborted == 0)
+    return boincErrorCreate(kBoincError, 1, "the late workunits should be aborted");
+  if (report.deadlineMisses != 0)
+    return boincErrorCreatef(kBoincError, 2, "no late workunit should be computed: %d", report.deadlineMisses);
+  if (report.completed < 50)
+    return boincErrorCreatef(kBoincError, 3, "the core should compute fresh work: %d", report.completed);
+
+  return NULL;
+}
+
+BoincError testBoincSimulatorCancel(void* data)
+{
+  BoincSimulationParameters parameters;
+  BoincSimulationReport report;
+  BoincSimulationReport cancelled;
+
+  defaultParameters(&parameters);
+
+  BoincError err = runSimulation(&parameters, 1, &report);
+  if (err)
+    return err;
+
+  // The server gives up a third of the results before their end
+  parameters.cancelRate = 0.3;
+  err = runSimulation(&parameters, 1, &cancelled);
+  if (err)
+    return err;
+
+  boincDebugf("completed %d, cancelled %d", cancelled.completed, cancelled.cancelled);
+
+  if (cancelled.cancelled == 0)
+    return boincErrorCreate(kBoincError, 1, "some results should be aborted by the server");
+  if (cancelled.aborted != 0)
+    return boincErrorCreatef(kBoincError, 2, "no result should miss its deadline: %d", cancelled.aborted);
+  // The core does not keep computing what the server gave up
+  if (cancelled.completed + cancelled.cancelled <= report.completed)
+    return boincErrorCreatef(kBoincError, 3, "the aborted results should free the core: %d + %d", 
+                             cancelled.completed, cancelled.cancelled);
+
+  return NULL;
+}
+
+BoincError testBoincSimulatorCoalescing(void* data)
+{
+  BoincSimulationParameters parameters;
+  BoincSimulationReport exact;
+  BoincSimulationReport coalesced;
+
+  defaultParameters(&parameters);
+  parameters.requestFailureRate = 0.5;
+  parameters.downloadFailureRate = 0.5;
+  parameters.uploadFailureRate = 0.5;
+
+  BoincError err = runSimulationWithSlack(&parameters, 4, 0, &exact);
+  if (err == NULL)
+    err = runSimulationWithSlack(&parameters, 4, 10, &coalesced);
+  if (err)
+    return err;
+
+  boincDebugf("wakeups %d -> %d, completed %d -> %d", exact.wakeups, coalesced.wakeups,
+              exact.completed, coalesced.completed);
+
+  // The retries of the slots share their wakeups
+  if (coalesced.wakeups >= exact.wakeups)
+    return boincErrorCreatef(kBoincError, 1, "the timers should be coalesced: %d >= %d", 
+                             coalesced.wakeups, exact.wakeups);
+  // A few seconds late on a retry barely shows on the throughput
+  if (coalesced.completed < exact.completed * 9 / 10)
+    return boincErrorCreatef(kBoincError, 2, "the slack costs too much work: %d < %d", 
+                             coalesced.completed, exact.completed);
+
+  return NULL;
+}
+
+BoincError testBoincSimulatorTuner(void* data)
+{
+  BoincTuner tuner;
+
+  boincTunerInit(&tuner, 1, 4);
+  if (boincTunerWorkRequestSeconds(&tuner, 2) != 1.0)
+    return boincErrorCreate(kBoincError, 1, "an untrained tuner should ask for the minimal work");
+
+  // Fetching takes two thirds of a computation: two cores need two
+  // workunits in flight
+  for (int i = 0; i < 8; i++) {
+    boincTunerStatusLeft(&tuner, kBoincWorkUnitInitializing, 10);
+    boincTunerStatusLeft(&tuner, kBoincWorkUnitDownloading, 390);
+    boincTunerStatusLeft(&tuner, kBoincWorkUnitComputing, 600);
+    boincTunerCoreIdle(&tuner, 0);
+    boincTunerUpdate(&tuner, 2);
+  }
+  if (tuner.depth != 2)
+    return boincErrorCreatef(kBoincError, 2, "wrong prefetch depth: %d", tuner.depth);
+  if (boincTunerWorkRequestSeconds(&tuner, 2) != 600.0)
+    return boincErrorCreatef(kBoincError, 3, "wrong work request: %f", boincTunerWorkRequestSeconds(&tuner, 2));
+
+  // The cores still starve: grow up to the limit
+  for (int i = 0; i < 8; i++) {
+    boincTunerCoreIdle(&tuner, 120);
+    boincTunerUpdate(&tuner, 2);
+  }
+  if (tuner.depth != 4)
+    return boincErrorCreatef(kBoincError, 4, "the depth should reach its limit: %d", tuner.depth);
+
+  // Fast downloads again: shrink one step at a time
+  for (int i = 0; i < 24; i++) {
+    boincTunerStatusLeft(&tuner, kBoincWorkUnitDownloading, 10);
+    boincTunerCoreIdle(&tuner, 0);
+  }
+  boincTunerUpdate(&tuner, 2);
+  if (tuner.depth != 3)
+    return boincErrorCreatef(kBoincError, 5, "the depth should shrink by one: %d", tuner.depth);
+  for (int i = 0; i < 4; i++)
+    boincTunerUpdate(&tuner, 2);
+  if (tuner.depth != 1)
+    return boincErrorCreatef(kBoincError, 6, "the depth should shrink to its minimum: %d", tuner.depth);
+
+  return NULL;
+}
+
+int testBoincSimulator(BoincTest * test)
+{
+  boincTestInitMajor(test, "BoincSimulator");
+  boincTestRunMinor(test, "BoincSimulator throughput", testBoincSimulatorThroughput, NULL);
+  boincTestRunMinor(test, "BoincSimulator determinism", testBoincSimulatorDeterminism, NULL);
+  boincTestRunMinor(test, "BoincSimulator deadline", testBoincSimulatorDeadline, NULL);
+  boincTestRunMinor(test, "BoincSimulator abort", testBoincSimulatorAbort, NULL);
+  boincTestRunMinor(test, "BoincSimulator cancel", testBoincSimulatorCancel, NULL);
+  boincTestRunMinor(test, "BoincSimulator coalescing", testBoincSimulatorCoalescing, NULL);
+  boincTestRunMinor(test, "BoincSimulator tuner", testBoincSimulatorTuner, NULL);
+  boincTestEndMajor(test);
+  return 0;
+}
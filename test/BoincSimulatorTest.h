@@ -0,0 +1,42 @@
+/*
+  BoincLite, a light-weight library for BOINC clients.
+
+  Copyright (C) 2008 Sony Computer Science Laboratory Paris 
+  Authors: Peter Hanappe, Anthony Beurive, Tangui Morlier
+
+  This library is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation; version 2.1 of the
+  License.
+
+  This library is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+  02110-1301 USA
+
+*/ 
+ 
+#include "BoincTest.h"
+#include "BoincLite.h"
+
+#ifndef __BoincSimulatorTest_H__
+#define __BoincSimulatorTest_H__
+
+
+#ifdef __cplusplus
+#extern "C" {
+#endif
+
+
+int testBoincSimulator(BoincTest * test) ;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __BoincSimulatorTest_H__
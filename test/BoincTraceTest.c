@@ -0,0 +1,157 @@
+/*
+  BoincLite, a light-weight library for BOINC clients.
+
+  Copyright (C) 2008 Sony Computer Science Laboratory Paris 
+  Authors: Peter Hanappe, Anthony Beurive, Tangui Morlier
+
+  This library is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation; version 2.1 of the
+  License.
+
+  This library is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+  02110-1301 USA
+
+*/ 
+#include "BoincTraceTest.h"
+#include "BoincTestOSCalls.h"
+#include "BoincMem.h"
+#include "BoincUtil.h"
+#include <string.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define REPLAY_DIR TMPDIR "boincReplayTester/"
+#define REPLAY_INPUT TMPDIR "boincReplayInput.trace"
+#define REPLAY_OUTPUT TMPDIR "boincReplayOutput.trace"
+
+// Two slots. Slot 0 goes through a whole cycle, the first request of
+// slot 1 fails with a network error.
+static const char * replayTrace =
+  "# handwritten trace\n"
+  "E 1000 -1 -1 0\n"
+  "C 1000 -1 0 0 0 0 0 \n"
+  "C 1000 0 1 0 0 0 0 \n"
+  "L 1000 0 0\n"
+  "C 1000 1 1 0 0 0 0 \n"
+  "L 1000 1 0\n"
+  "C 1000 0 2 3 0 0 0 \n"
+  "C 1003 0 3 5 0 0 0 \n"
+  "C 1008 1 2 1 4 4 0 Network down\n"
+  "S 1020 0 6\n"
+  "C 1020 0 4 2 0 0 0 \n"
+  "C 1022 0 5 1 0 0 0 \n";
+
+BoincError testBoincTraceRead(void* data)
+{
+  FILE * fh = fopen(REPLAY_INPUT, "w+");
+  fprintf(fh, "%s", replayTrace);
+  fclose(fh);
+
+  BoincTraceRecord * records;
+  int count;
+  BoincError err = boincTraceRead(REPLAY_INPUT, &records, &count);
+  if (err)
+    return err;
+
+  if (count != 12) {
+    err = boincErrorCreatef(kBoincError, 1, "wrong number of records: %d", count);
+  } else if ((records[8].kind != 'C') || (records[8].errorType != kBoincError) 
+             || (records[8].errorCode != kBoincNetwork) || strcmp(records[8].message, "Network down")) {
+    err = boincErrorCreate(kBoincError, 2, "wrong error record");
+  } else if ((records[9].kind != 'S') || (records[9].value != kBoincWorkUnitFinished)) {
+    err = boincErrorCreate(kBoincError, 3, "wrong status record");
+  }
+
+  boincFree(records);
+  return err;
+}
+
+static int computeNothing(BoincScheduler * scheduler, BoincWorkUnit * wu, void* userData)
+{
+  return 0;
+}
+
+BoincError testBoincTraceReplay(void* data)
+{
+  rmrf(REPLAY_DIR);
+  mkdir(REPLAY_DIR, S_IRWXU);
+
+  BoincConfiguration * conf = boincConfigurationCreate(REPLAY_DIR);
+  BoincScheduler * scheduler = boincSchedulerCreate(conf, computeNothing, NULL);
+
+  BoincError err = boincSchedulerSetTraceFile(scheduler, REPLAY_OUTPUT);
+  if (err == NULL) {
+    err = boincSchedulerReplay(scheduler, REPLAY_INPUT);
+  }
+  if (err == NULL) {
+    // Closes the output trace
+    err = boincSchedulerSetTraceFile(scheduler, NULL);
+  }
+
+  if ((err == NULL) && (boincConfigurationGetNumber(conf, kBoincUserTotalWorkunits) != 1)) {
+    err = boincErrorCreatef(kBoincError, 1, "one workunit should be completed, not %d", 
+                            boincConfigurationGetNumber(conf, kBoincUserTotalWorkunits));
+  }
+
+  boincSchedulerDestroy(scheduler);
+  boincConfigurationDestroy(conf);
+
+  if (err)
+    return err;
+
+  // The replayed run must make the same calls at the same times
+  BoincTraceRecord * in;
+  BoincTraceRecord * out;
+  int nin, nout;
+
+  if ((err = boincTraceRead(REPLAY_INPUT, &in, &nin)) != NULL)
+    return err;
+  if ((err = boincTraceRead(REPLAY_OUTPUT, &out, &nout)) != NULL) {
+    boincFree(in);
+    return err;
+  }
+
+  int i = 0, j = 0;
+  while ((err == NULL) && (i < nin)) {
+    if (in[i].kind != 'C') {
+      i++;
+      continue;
+    }
+    while ((j < nout) && (out[j].kind != 'C'))
+      j++;
+    if (j == nout) {
+      err = boincErrorCreatef(kBoincError, 2, "call at line %d not replayed", i + 2);
+    } else if ((in[i].time != out[j].time) || (in[i].index != out[j].index) 
+               || (in[i].value != out[j].value) || (in[i].duration != out[j].duration)
+               || (in[i].errorType != out[j].errorType)) {
+      err = boincErrorCreatef(kBoincError, 3, "call at line %d replayed differently", i + 2);
+    }
+    i++;
+    j++;
+  }
+
+  boincFree(in);
+  boincFree(out);
+
+  rmrf(REPLAY_DIR);
+
+  return err;
+}
+
+int testBoincTrace(BoincTest * test)
+{
+  boincTestInitMajor(test, "BoincTrace");
+  boincTestRunMinor(test, "BoincTrace read", testBoincTraceRead, NULL);
+  boincTestRunMinor(test, "BoincTrace replay", testBoincTraceReplay, NULL);
+  boincTestEndMajor(test);
+  return 0;
+}
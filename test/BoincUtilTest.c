@@ -0,0 +1,320 @@
+/*
+  BoincLite, a light-weight library for BOINC clients.
+
+  Copyright (C) 2008 Sony Computer Science Laboratory Paris 
+  Authors: Peter Hanappe, Anthony Beurive, Tangui Morlier
+
+  This library is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation; version 2.1 of the
+  License.
+
+  This library is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+  02110-1301 USA
+
+*/ 
+#include "BoincUtilTest.h"
+#include "BoincUtil.h"
+#include "BoincMutex.h"
+#include "BoincMem.h"
+
+/* The queue */
+
+BoincError testBoincQueueWakeups(void * data)
+{
+  BoincError err = NULL;
+  int event = 0;
+
+  BoincQueue * queue = boincQueueCreate();
+
+  // An event due ends the wait: one wakeup
+  boincQueuePut(queue, boincQueueNow(), &event);
+  boincQueuePut(queue, boincQueueNow(), &event);
+  if (!boincQueueWait(queue, 1) || (boincQueueGet(queue) != &event))
+    err = boincErrorCreate(kBoincError, 1, "the event should be due");
+  if (!err && (boincQueueCountWakeups(queue) != 1))
+    err = boincErrorCreatef(kBoincError, 2, "one wakeup expected: %d", boincQueueCountWakeups(queue));
+
+  // The events taken in the same round share it
+  if (!err && (boincQueueGet(queue) != &event))
+    err = boincErrorCreate(kBoincError, 3, "the second event should be due");
+  if (!err && (boincQueueCountWakeups(queue) != 1))
+    err = boincErrorCreatef(kBoincError, 4, "the second event should not wake up: %d", boincQueueCountWakeups(queue));
+
+  // Neither a wake with nothing to do nor a wait that times out counts
+  boincQueueWake(queue);
+  if (!err && (!boincQueueWait(queue, 1) || (boincQueueGet(queue) != NULL)))
+    err = boincErrorCreate(kBoincError, 5, "the wake should end the wait with no event");
+  if (!err && boincQueueWait(queue, 0))
+    err = boincErrorCreate(kBoincError, 6, "the wait should time out");
+  if (!err && (boincQueueCountWakeups(queue) != 1))
+    err = boincErrorCreatef(kBoincError, 7, "empty wakeups should not count: %d", boincQueueCountWakeups(queue));
+
+  boincQueueDestroy(queue);
+
+  return err;
+}
+
+/* A virtual clock only moves the queue it is given */
+
+static unsigned int virtualClock(void* data)
+{
+  return *((unsigned int*) data);
+}
+
+BoincError testBoincQueueClocks(void * data)
+{
+  BoincError err = NULL;
+  int event = 0;
+  unsigned int virtualNow = 1000;
+
+  BoincQueue * replayed = boincQueueCreate();
+  BoincQueue * real = boincQueueCreate();
+  boincQueueSetClock(replayed, virtualClock, &virtualNow);
+
+  if (boincQueueTime(replayed) != 1000)
+    err = boincErrorCreate(kBoincError, 1, "the queue should follow its virtual clock");
+  if (!err && (boincQueueTime(real) < boincQueueNow()))
+    err = boincErrorCreate(kBoincError, 2, "the other queue should keep the real time");
+
+  // The event due in the virtual future does not block the wait
+  boincQueuePut(replayed, 1010, &event);
+  if (!err && boincQueueWait(replayed, 60))
+    err = boincErrorCreate(kBoincError, 3, "the event should not be due yet");
+  virtualNow = 1010;
+  if (!err && (boincQueueGet(replayed) != &event))
+    err = boincErrorCreate(kBoincError, 4, "the event should be due on the virtual clock");
+
+  // while the real queue still waits on the real time
+  boincQueuePut(real, boincQueueNow() + 3600, &event);
+  if (!err && (boincQueueGet(real) != NULL))
+    err = boincErrorCreate(kBoincError, 5, "the event should not be due on the real clock");
+
+  boincQueueDestroy(real);
+  boincQueueDestroy(replayed);
+
+  return err;
+}
+
+/* The classes of the events */
+
+static unsigned int priorityNow;
+
+static unsigned int priorityClock(void* data)
+{
+  return priorityNow;
+}
+
+static int priorityOf(void* data)
+{
+  return *((int*) data);
+}
+
+BoincError testBoincQueuePriorities(void * data)
+{
+  BoincError err = NULL;
+  int stateChange = 0, retry = 2;
+
+  BoincQueue * queue = boincQueueCreate();
+  boincQueueSetPriority(queue, priorityOf, 10);
+  boincQueueSetClock(queue, priorityClock, NULL);
+
+  // A retry due before a state change waits behind it
+  priorityNow = 110;
+  boincQueuePut(queue, 100, &retry);
+  boincQueuePut(queue, 105, &stateChange);
+  if (boincQueueGet(queue) != &stateChange)
+    err = boincErrorCreate(kBoincError, 1, "the state change should come before the retry");
+  boincQueueGet(queue);
+
+  // but not forever
+  priorityNow = 125;
+  boincQueuePut(queue, 100, &retry);
+  boincQueuePut(queue, 120, &stateChange);
+  if (!err && (boincQueueGet(queue) != &retry))
+    err = boincErrorCreate(kBoincError, 2, "the retry due for 25 seconds should move up");
+  if (!err && (boincQueueGet(queue) != &stateChange))
+    err = boincErrorCreate(kBoincError, 3, "the state change should follow");
+  if (!err && (boincQueueGet(queue) != NULL))
+    err = boincErrorCreate(kBoincError, 4, "the queue should be empty");
+
+  boincQueueDestroy(queue);
+
+  return err;
+}
+
+BoincError testBoincQueuePoolJobs(void * data)
+{
+  BoincError err = NULL;
+  int retries[4] = {2, 2, 2, 2}, completion = 0;
+
+  BoincQueue * queue = boincQueueCreate();
+  boincQueueSetPriority(queue, priorityOf, 30);
+  boincQueueSetClock(queue, priorityClock, NULL);
+
+  // A burst of retries handed to the busy network thread, then a
+  // completion, each due when it is handed over
+  priorityNow = 1000000;
+  for (int i = 0; i < 4; i++)
+    boincQueuePut(queue, boincQueueTime(queue), &retries[i]);
+  priorityNow += 5;
+  boincQueuePut(queue, boincQueueTime(queue), &completion);
+
+  if (boincQueueGet(queue) != &completion)
+    err = boincErrorCreate(kBoincError, 1, "the completion should overtake the retries");
+  for (int i = 0; !err && (i < 4); i++) {
+    if (boincQueueGet(queue) != &retries[i])
+      err = boincErrorCreatef(kBoincError, 2, "retry %d should follow in order", i);
+  }
+
+  boincQueueDestroy(queue);
+
+  return err;
+}
+
+/* The inbox */
+
+BoincError testBoincInboxFull(void * data)
+{
+  BoincError err = NULL;
+  BoincInboxMessage message = {0, 0, 0};
+
+  // Rounded up to 4 slots
+  BoincInbox * inbox = boincInboxCreate(3);
+  if (inbox == NULL)
+    return boincErrorCreate(kBoincFatal, kBoincSystem, "Out of memory");
+
+  // Several rounds, so the positions wrap around the ring
+  for (int round = 0; !err && (round < 5); round++) {
+    for (int i = 0; !err && (i < 4); i++) {
+      message.index = 4 * round + i;
+      int posted = boincInboxPut(inbox, &message);
+      if (posted != (i == 0))
+        err = boincErrorCreatef(kBoincError, 1, "only the first message should wake up the reader: %d", posted);
+    }
+    if (!err && (boincInboxPut(inbox, &message) != -1))
+      err = boincErrorCreate(kBoincError, 2, "the inbox should be full");
+    for (int i = 0; !err && (i < 4); i++) {
+      if (!boincInboxGet(inbox, &message) || (message.index != 4 * round + i))
+        err = boincErrorCreatef(kBoincError, 3, "message %d should come out in order", 4 * round + i);
+    }
+    if (!err && boincInboxGet(inbox, &message))
+      err = boincErrorCreate(kBoincError, 4, "the inbox should be empty");
+  }
+
+  boincInboxDestroy(inbox);
+
+  return err;
+}
+
+// The producers spin on a full inbox: they need threads of their own
+#if !defined(BOINCLITE_SINGLE_THREADED)
+
+#define INBOX_PRODUCERS 4
+#define INBOX_MESSAGES 20000
+
+typedef struct _InboxProducer {
+  BoincInbox * inbox;
+  int id;
+  volatile unsigned int full;       // times the producer found the inbox full
+} InboxProducer;
+
+static void inboxProduce(void * data)
+{
+  InboxProducer * producer = (InboxProducer *) data;
+  BoincInboxMessage message = {producer->id, 0, 0};
+
+  for (int i = 0; i < INBOX_MESSAGES; i++) {
+    message.index = i;
+    while (boincInboxPut(producer->inbox, &message) < 0) {
+      producer->full++;
+      boincThreadYield();
+    }
+  }
+}
+
+BoincError testBoincInboxProducers(void * data)
+{
+  BoincError err = NULL;
+  InboxProducer producers[INBOX_PRODUCERS];
+  BoincThread threads[INBOX_PRODUCERS];
+  int next[INBOX_PRODUCERS];
+  BoincInboxMessage message;
+
+  // Small enough to wrap around and fill up many times
+  BoincInbox * inbox = boincInboxCreate(16);
+  if (inbox == NULL)
+    return boincErrorCreate(kBoincFatal, kBoincSystem, "Out of memory");
+
+  for (int i = 0; i < INBOX_PRODUCERS; i++) {
+    producers[i].inbox = inbox;
+    producers[i].id = i;
+    producers[i].full = 0;
+    next[i] = 0;
+    threads[i] = boincThreadCreate(inboxProduce, &producers[i]);
+    if (!threads[i])
+      err = boincErrorCreate(kBoincFatal, kBoincSystem, "Could not start a producer");
+  }
+
+  // Every message once, in the order of its producer
+  int received = 0;
+  while (!err && (received < INBOX_PRODUCERS * INBOX_MESSAGES)) {
+    if (!boincInboxGet(inbox, &message)) {
+      boincThreadYield();
+      continue;
+    }
+    if ((message.kind < 0) || (message.kind >= INBOX_PRODUCERS))
+      err = boincErrorCreatef(kBoincError, 1, "unknown producer %d", message.kind);
+    else if (message.index != next[message.kind])
+      err = boincErrorCreatef(kBoincError, 2, "producer %d: message %d instead of %d", 
+                              message.kind, message.index, next[message.kind]);
+    else
+      next[message.kind]++;
+    received++;
+  }
+  // Let the producers end before the inbox goes
+  while (err && (received < INBOX_PRODUCERS * INBOX_MESSAGES)) {
+    received += boincInboxGet(inbox, &message);
+  }
+
+  for (int i = 0; i < INBOX_PRODUCERS; i++) {
+    if (threads[i])
+      boincThreadJoin(threads[i]);
+  }
+
+  if (!err && boincInboxGet(inbox, &message))
+    err = boincErrorCreate(kBoincError, 3, "a message was delivered twice");
+
+  unsigned int full = 0;
+  for (int i = 0; i < INBOX_PRODUCERS; i++)
+    full += producers[i].full;
+  boincDebugf("inbox found full %u times", full);
+
+  boincInboxDestroy(inbox);
+
+  return err;
+}
+
+#endif
+
+int testBoincUtil(BoincTest * test)
+{
+  boincTestInitMajor(test, "BoincUtil");
+  boincTestRunMinor(test, "BoincQueue wakeups", testBoincQueueWakeups, NULL);
+  boincTestRunMinor(test, "BoincQueue clock of each queue", testBoincQueueClocks, NULL);
+  boincTestRunMinor(test, "BoincQueue priorities", testBoincQueuePriorities, NULL);
+  boincTestRunMinor(test, "BoincQueue completion before the retries", testBoincQueuePoolJobs, NULL);
+  boincTestRunMinor(test, "BoincInbox full", testBoincInboxFull, NULL);
+#if !defined(BOINCLITE_SINGLE_THREADED)
+  boincTestRunMinor(test, "BoincInbox producers", testBoincInboxProducers, NULL);
+#endif
+  boincTestEndMajor(test);
+  return 0;
+}